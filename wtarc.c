@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * An archive starts with a header of 64 bit little endian integers:
+ *
+ *     0   "WTA1" and four zero bytes
+ *     8   number of snapshots
+ *     16  number of strings, offset of the strings
+ *     32  number of triples, offset of the triples
+ *     48  number of paths, offset of the paths
+ *     64  number of blocks, offset of the block index
+ *     80  smallest and largest epoch_ms
+ *
+ * Sections follow in that order, each one running up to the next. Numbers in
+ * them are unsigned LEB128 varints, signed ones zigzag encoded first.
+ *
+ * Strings are a length and that many bytes each, with ids starting at 1,
+ * and triples are the string ids of a name, class and title. A path is the
+ * number of steps and then the depth and triple id of each step. The block
+ * index has 40 bytes per block: offset, size and number of snapshots, then
+ * the smallest and largest epoch_ms in it.
+ *
+ * Blocks hold up to ARC_BLOCK_SIZE snapshots, one column after the other.
+ * The snapshot ids and times are stored as differences to the one before,
+ * starting from 0, idle times the same way but plus one to make room for
+ * null as 0. Sample times and path ids hardly ever change, so they're runs
+ * of a length and a value.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wtarc.h"
+#include "wtdb.h"
+
+
+static noreturn void arc_die(const Archive *arc, const char *fmt, ...)
+{
+    DO_LOG();
+    longjmp(*arc->env, 1);
+}
+
+static noreturn void arc_corrupt(const Archive *arc, const char *what)
+{
+    arc_die(arc, "Archive '%s' is corrupt: %s", arc->name, what);
+}
+
+bool arc_is_archive_name(const char *name)
+{
+    size_t len        = strlen(name);
+    size_t suffix_len = strlen(ARC_SUFFIX);
+    return len > suffix_len
+        && strcmp(name + len - suffix_len, ARC_SUFFIX) == 0;
+}
+
+
+size_t arc_put_uvarint(unsigned char *out, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (unsigned char) (value | 0x80);
+        value    >>= 7;
+    }
+    out[len++] = (unsigned char) value;
+    return len;
+}
+
+uint64_t arc_zigzag(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+void arc_put_u64(unsigned char *out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (unsigned char) (value >> (i * 8));
+    }
+}
+
+static uint64_t arc_get_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= (uint64_t) in[i] << (i * 8);
+    }
+    return value;
+}
+
+static uint64_t arc_get_uvarint(const Archive *arc, const unsigned char **p,
+                                const unsigned char *end)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end) {
+            arc_corrupt(arc, "truncated number");
+        }
+        unsigned char byte = *(*p)++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    arc_corrupt(arc, "overlong number");
+}
+
+static int64_t arc_get_varint(const Archive *arc, const unsigned char **p,
+                              const unsigned char *end)
+{
+    uint64_t value = arc_get_uvarint(arc, p, end);
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static uint32_t arc_get_id(const Archive *arc, const unsigned char **p,
+                           const unsigned char *end, uint64_t limit,
+                           const char *what)
+{
+    uint64_t id = arc_get_uvarint(arc, p, end);
+    if (id >= limit) {
+        arc_corrupt(arc, what);
+    }
+    return (uint32_t) id;
+}
+
+
+static const unsigned char *arc_section(const Archive *arc, uint64_t offset,
+                                        uint64_t next)
+{
+    if (offset < ARC_HEADER_SIZE || offset > next || next > arc->size) {
+        arc_corrupt(arc, "bad section offset");
+    }
+    return arc->data + offset;
+}
+
+static void *arc_calloc(const Archive *arc, uint64_t count, size_t size)
+{
+    /* Every entry takes at least a byte in the file, so more than that
+     * can't be right and shouldn't even be tried to allocate. */
+    if (count > arc->size) {
+        arc_corrupt(arc, "too many entries");
+    }
+    void *ptr = calloc((size_t) count + 1, size);
+    if (!ptr) {
+        arc_die(arc, "Can't calloc %llu entries for archive '%s'",
+                (unsigned long long) count, arc->name);
+    }
+    return ptr;
+}
+
+static void arc_read_strings(Archive *arc, const unsigned char *p,
+                             const unsigned char *end)
+{
+    arc->strings = arc_calloc(arc, arc->string_count + 1,
+                              sizeof(*arc->strings));
+    for (uint64_t i = 1; i <= arc->string_count; ++i) {
+        arc->strings[i] = p;
+        uint64_t len    = arc_get_uvarint(arc, &p, end);
+        if (len > (uint64_t) (end - p)) {
+            arc_corrupt(arc, "truncated string");
+        }
+        p += len;
+    }
+}
+
+static void arc_read_triples(Archive *arc, const unsigned char *p,
+                             const unsigned char *end)
+{
+    arc->triples = arc_calloc(arc, arc->triple_count * 3,
+                              sizeof(*arc->triples));
+    for (uint64_t i = 0; i < arc->triple_count * 3; ++i) {
+        arc->triples[i] = arc_get_id(arc, &p, end, arc->string_count + 1,
+                                     "bad string id");
+    }
+}
+
+static void arc_read_paths(Archive *arc, const unsigned char *p,
+                           const unsigned char *end)
+{
+    arc->path_starts = arc_calloc(arc, arc->path_count + 1,
+                                  sizeof(*arc->path_starts));
+
+    /* Steps take at least two bytes each, that's plenty of room. */
+    arc->steps = arc_calloc(arc, (uint64_t) (end - p) / 2,
+                            sizeof(*arc->steps));
+    uint64_t steps = 0;
+    for (uint64_t i = 0; i < arc->path_count; ++i) {
+        arc->path_starts[i] = (uint32_t) steps;
+        uint64_t count      = arc_get_uvarint(arc, &p, end);
+        if (count > (uint64_t) (end - p) / 2) {
+            arc_corrupt(arc, "truncated path");
+        }
+        for (uint64_t j = 0; j < count; ++j) {
+            ArcStep *step = &arc->steps[steps++];
+            step->depth   = (uint32_t) arc_get_uvarint(arc, &p, end);
+            step->triple  = arc_get_id(arc, &p, end, arc->triple_count,
+                                       "bad triple id");
+        }
+    }
+    arc->path_starts[arc->path_count] = (uint32_t) steps;
+}
+
+static void arc_read_header(Archive *arc)
+{
+    if (arc->size < ARC_HEADER_SIZE
+            || memcmp(arc->data, ARC_MAGIC "\0\0\0\0", 8) != 0) {
+        arc_die(arc, "'%s' is not an archive", arc->name);
+    }
+
+    const unsigned char *h = arc->data;
+    arc->snapshot_count    = arc_get_u64(h + 8);
+    arc->string_count      = arc_get_u64(h + 16);
+    arc->triple_count      = arc_get_u64(h + 32);
+    arc->path_count        = arc_get_u64(h + 48);
+    arc->block_count       = arc_get_u64(h + 64);
+    arc->min_epoch_ms      = (int64_t) arc_get_u64(h + 80);
+    arc->max_epoch_ms      = (int64_t) arc_get_u64(h + 88);
+
+    uint64_t strings = arc_get_u64(h + 24);
+    uint64_t triples = arc_get_u64(h + 40);
+    uint64_t paths   = arc_get_u64(h + 56);
+    uint64_t index   = arc_get_u64(h + 72);
+    if (arc->string_count > arc->size || arc->triple_count > arc->size
+            || arc->path_count == 0 || arc->path_count > arc->size
+            || arc->block_count > arc->size / ARC_INDEX_SIZE
+            || index + arc->block_count * ARC_INDEX_SIZE > arc->size) {
+        arc_corrupt(arc, "bad header");
+    }
+
+    const unsigned char *s = arc_section(arc, strings, triples);
+    const unsigned char *t = arc_section(arc, triples, paths);
+    const unsigned char *p = arc_section(arc, paths, index);
+    arc_read_strings(arc, s, t);
+    arc_read_triples(arc, t, p);
+    arc_read_paths(arc, p, arc->data + index);
+    arc->index = arc->data + index;
+}
+
+void arc_open(Archive *arc, const char *name)
+{
+    debug("Opening archive '%s'", name);
+    arc->name = name;
+
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        arc_die(arc, "Can't open archive '%s': %s", name, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        close(fd);
+        arc_die(arc, "Can't stat archive '%s': %s", name, strerror(error));
+    }
+
+    arc->size = (size_t) st.st_size;
+    void *data = arc->size ? mmap(NULL, arc->size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0)
+                           : MAP_FAILED;
+    int error  = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        arc->size = 0;
+        arc_die(arc, "Can't map archive '%s': %s", name,
+                st.st_size ? strerror(error) : "empty file");
+    }
+
+    /* Blocks are read once from front to back. */
+    arc->data = data;
+    madvise(data, arc->size, MADV_SEQUENTIAL);
+    arc_read_header(arc);
+}
+
+void arc_close(Archive *arc)
+{
+    if (arc->data) {
+        munmap((void *) arc->data, arc->size);
+    }
+    free(arc->strings);
+    free(arc->triples);
+    free(arc->path_starts);
+    free(arc->steps);
+    *arc = (Archive) {.env = arc->env};
+}
+
+
+bool arc_string(const Archive *arc, uint32_t id, const char **out,
+                size_t *len)
+{
+    if (id == ARC_NULL) {
+        return false;
+    }
+    /* Already checked when opening, so this can't fail. */
+    const unsigned char *p = arc->strings[id];
+    *len = (size_t) arc_get_uvarint(arc, &p, arc->data + arc->size);
+    *out = (const char *) p;
+    return true;
+}
+
+const uint32_t *arc_triple(const Archive *arc, uint32_t id)
+{
+    return arc->triples + (size_t) id * 3;
+}
+
+const ArcStep *arc_path(const Archive *arc, uint32_t id, size_t *count)
+{
+    *count = arc->path_starts[id + 1] - arc->path_starts[id];
+    return arc->steps + arc->path_starts[id];
+}
+
+
+bool arc_block_overlaps(const Archive *arc, uint64_t block,
+                        int64_t from_ms, int64_t until_ms)
+{
+    const unsigned char *entry = arc->index + block * ARC_INDEX_SIZE;
+    int64_t             min    = (int64_t) arc_get_u64(entry + 24);
+    int64_t             max    = (int64_t) arc_get_u64(entry + 32);
+    return max >= from_ms && min <= until_ms;
+}
+
+static void arc_read_deltas(const Archive *arc, const unsigned char **p,
+                            const unsigned char *end, int64_t *out,
+                            size_t count)
+{
+    int64_t value = 0;
+    for (size_t i = 0; i < count; ++i) {
+        value += arc_get_varint(arc, p, end);
+        out[i] = value;
+    }
+}
+
+static void arc_read_runs(const Archive *arc, const unsigned char **p,
+                          const unsigned char *end, int64_t *out,
+                          uint32_t *ids, size_t count)
+{
+    for (size_t i = 0; i < count;) {
+        uint64_t run   = arc_get_uvarint(arc, p, end);
+        uint64_t value = ids ? arc_get_id(arc, p, end, arc->path_count,
+                                          "bad path id")
+                             : arc_get_uvarint(arc, p, end);
+        if (run == 0 || run > count - i) {
+            arc_corrupt(arc, "bad run length");
+        }
+        for (uint64_t j = 0; j < run; ++j, ++i) {
+            if (ids) {
+                ids[i] = (uint32_t) value;
+            }
+            else {
+                out[i] = (int64_t) value;
+            }
+        }
+    }
+}
+
+void arc_read_block(const Archive *arc, uint64_t block, ArcRows *rows)
+{
+    const unsigned char *entry  = arc->index + block * ARC_INDEX_SIZE;
+    uint64_t            offset  = arc_get_u64(entry);
+    uint64_t            size    = arc_get_u64(entry + 8);
+    uint64_t            count   = arc_get_u64(entry + 16);
+    if (offset > arc->size || size > arc->size - offset
+            || count > ARC_BLOCK_SIZE) {
+        arc_corrupt(arc, "bad block");
+    }
+
+    const unsigned char *p   = arc->data + offset;
+    const unsigned char *end = p + size;
+    rows->count = (size_t) count;
+    arc_read_deltas(arc, &p, end, rows->snapshot_id, rows->count);
+    arc_read_deltas(arc, &p, end, rows->epoch_ms, rows->count);
+    arc_read_deltas(arc, &p, end, rows->idle_time, rows->count);
+    for (size_t i = 0; i < rows->count; ++i) {
+        rows->idle_time[i] -= 1;
+    }
+    arc_read_runs(arc, &p, end, rows->sample_time, NULL, rows->count);
+    arc_read_runs(arc, &p, end, NULL, rows->path, rows->count);
+}
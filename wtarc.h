@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef WTARC_H
+#define WTARC_H
+
+/*
+ * Columnar snapshot archives, written by wtarchive and scanned by wtstats.
+ * They only keep what reports need: the time, idle time and sample time of
+ * every snapshot and its focus path, which is the focused windows below the
+ * root from the top down. See wtarc.c for the layout. Errors are fatal and
+ * jump to the jmp_buf the Archive points to, after logging a message.
+ */
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Archives are named after their database with this appended. */
+#define ARC_SUFFIX ".wta"
+
+#define ARC_MAGIC       "WTA1"
+#define ARC_HEADER_SIZE 96
+#define ARC_INDEX_SIZE  40
+#define ARC_BLOCK_SIZE  4096
+
+/* Strings and triples use id 0 for null, paths for the empty path. */
+#define ARC_NULL 0
+
+
+typedef struct {
+    uint32_t depth;
+    uint32_t triple;
+} ArcStep;
+
+/* One block of snapshots, decoded into a column each. Idle time is -1 for
+ * snapshots that don't have one. */
+typedef struct {
+    size_t   count;
+    int64_t  snapshot_id[ARC_BLOCK_SIZE];
+    int64_t  epoch_ms[ARC_BLOCK_SIZE];
+    int64_t  idle_time[ARC_BLOCK_SIZE];
+    int64_t  sample_time[ARC_BLOCK_SIZE];
+    uint32_t path[ARC_BLOCK_SIZE];
+} ArcRows;
+
+typedef struct {
+    jmp_buf             *env;
+    const char          *name;
+    const unsigned char *data;
+    size_t              size;
+    uint64_t            snapshot_count;
+    uint64_t            string_count;
+    uint64_t            triple_count;
+    uint64_t            path_count;
+    uint64_t            block_count;
+    int64_t             min_epoch_ms;
+    int64_t             max_epoch_ms;
+    const unsigned char **strings;
+    uint32_t            *triples;
+    uint32_t            *path_starts;
+    ArcStep             *steps;
+    const unsigned char *index;
+} Archive;
+
+
+bool arc_is_archive_name(const char *name);
+
+/* Stores an unsigned LEB128 varint in out, which needs 10 bytes of space, and
+ * returns how many it took. Signed values get zigzag encoded first. */
+size_t arc_put_uvarint(unsigned char *out, uint64_t value);
+
+uint64_t arc_zigzag(int64_t value);
+
+void arc_put_u64(unsigned char *out, uint64_t value);
+
+/* Maps the archive into memory and reads its dictionaries. */
+void arc_open(Archive *arc, const char *name);
+
+void arc_close(Archive *arc);
+
+/* Gives the string with the given id and its length, false for null. */
+bool arc_string(const Archive *arc, uint32_t id, const char **out,
+                size_t *len);
+
+/* The name, class and title string ids of a triple. */
+const uint32_t *arc_triple(const Archive *arc, uint32_t id);
+
+/* The steps of a path, from the top down. */
+const ArcStep *arc_path(const Archive *arc, uint32_t id, size_t *count);
+
+/* Whether a block may have snapshots between from_ms and until_ms, both
+ * inclusive, going by the range of times it was written with. */
+bool arc_block_overlaps(const Archive *arc, uint64_t block,
+                        int64_t from_ms, int64_t until_ms);
+
+void arc_read_block(const Archive *arc, uint64_t block, ArcRows *rows);
+
+#endif
@@ -0,0 +1,672 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "wtarc.h"
+#include "wtdb.h"
+
+
+#define ARGS_ERROR     (1 << 0)
+#define ARGS_WANT_HELP (1 << 1)
+
+static const char *args_help =
+    "\n"
+    "wtarchive - converts snapshot databases into compact archives that\n"
+    "wtstats can read a lot faster. Archives only keep the time, idle\n"
+    "time and focused windows of every snapshot, so they can't be\n"
+    "queried with SQL or with the -w option of wtstats anymore.\n"
+    "\n"
+    "Usage: %s [OPTIONS] DATABASE_FILE...\n"
+    "\n"
+    "Every DATABASE_FILE is written to DATABASE_FILE" ARC_SUFFIX ". wtstats\n"
+    "only uses an archive once its database is gone, so only archive\n"
+    "partitions that wtsnap -P is done writing to.\n"
+    "\n"
+    "Available options:\n"
+    "\n"
+    "    -r\n"
+    "        Remove each database after its archive has been written.\n"
+    "        Default is to keep them.\n"
+    "\n"
+    "    -h\n"
+    "        Shows this help.\n"
+    "\n";
+
+
+typedef struct Bytes {
+    unsigned char *data;
+    size_t        size;
+    size_t        capacity;
+} Bytes;
+
+/*
+ * Gives every distinct key an id, counting up from 0 in the order they're
+ * first seen. The keys are already encoded the way they go into the archive
+ * and kept back to back, so the whole section is just the key buffer.
+ */
+typedef struct Dict {
+    Bytes              keys;
+    size_t             *offsets;
+    unsigned long long *hashes;
+    uint32_t           *slots;
+    size_t             count;
+    size_t             capacity;
+} Dict;
+
+/* Idle times are stored plus one, with 0 for null, like in the archive. */
+typedef struct Row {
+    int64_t  snapshot_id;
+    int64_t  epoch_ms;
+    int64_t  idle_time;
+    int64_t  sample_time;
+    uint32_t path;
+} Row;
+
+typedef struct Context {
+    bool          remove;
+    const char    *db_name;
+    char          *out_name;
+    char          *tmp_name;
+    FILE          *out;
+    jmp_buf       env;
+    Db            db;
+    sqlite3_stmt  *stmt;
+    Dict          strings;
+    Dict          triples;
+    Dict          paths;
+    Bytes         path;
+    Bytes         blocks;
+    Bytes         index;
+    Row           *rows;
+    size_t        row_count;
+    size_t        row_capacity;
+    bool          have_row;
+} Context;
+
+
+static noreturn void die(Context *ctx, const char *fmt, ...)
+{
+    DO_LOG();
+    longjmp(ctx->env, 1);
+}
+
+
+static void bytes_reserve(Context *ctx, Bytes *b, size_t len)
+{
+    if (b->size + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (b->size + len > capacity) {
+            capacity *= 2;
+        }
+        unsigned char *data = realloc(b->data, capacity);
+        if (!data) {
+            die(ctx, "Can't realloc %zu bytes", capacity);
+        }
+        b->data     = data;
+        b->capacity = capacity;
+    }
+}
+
+static void bytes_put(Context *ctx, Bytes *b, const void *data, size_t len)
+{
+    bytes_reserve(ctx, b, len);
+    memcpy(b->data + b->size, data, len);
+    b->size += len;
+}
+
+static void bytes_put_uvarint(Context *ctx, Bytes *b, uint64_t value)
+{
+    bytes_reserve(ctx, b, 10);
+    b->size += arc_put_uvarint(b->data + b->size, value);
+}
+
+static void bytes_put_u64(Context *ctx, Bytes *b, uint64_t value)
+{
+    bytes_reserve(ctx, b, 8);
+    arc_put_u64(b->data + b->size, value);
+    b->size += 8;
+}
+
+static void bytes_free(Bytes *b)
+{
+    free(b->data);
+    *b = (Bytes) {0};
+}
+
+
+static unsigned long long dict_hash(const unsigned char *key, size_t len)
+{
+    /* 64 bit FNV-1a */
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Slots hold the id plus one, so that zero means empty. */
+static uint32_t *dict_find_slot(const Dict *dict, uint32_t *slots,
+                                size_t capacity, unsigned long long hash,
+                                const unsigned char *key, size_t len)
+{
+    size_t i = (size_t) hash & (capacity - 1);
+    while (slots[i]) {
+        size_t id    = slots[i] - 1;
+        size_t start = dict->offsets[id];
+        if (dict->hashes[id] == hash
+                && dict->offsets[id + 1] - start == len
+                && memcmp(dict->keys.data + start, key, len) == 0) {
+            break;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static void dict_grow(Context *ctx, Dict *dict)
+{
+    size_t   capacity = dict->capacity ? dict->capacity * 2 : 1024;
+    uint32_t *slots   = calloc(capacity, sizeof(*slots));
+    size_t   *offsets = realloc(dict->offsets,
+                                (capacity / 2 + 1) * sizeof(*offsets));
+    if (offsets) {
+        dict->offsets = offsets;
+    }
+    unsigned long long *hashes = realloc(dict->hashes,
+                                         capacity / 2 * sizeof(*hashes));
+    if (hashes) {
+        dict->hashes = hashes;
+    }
+    if (!slots || !offsets || !hashes) {
+        free(slots);
+        die(ctx, "Can't allocate %zu dictionary entries", capacity);
+    }
+
+    for (size_t id = 0; id < dict->count; ++id) {
+        size_t start = dict->offsets[id];
+        size_t len   = dict->offsets[id + 1] - start;
+        *dict_find_slot(dict, slots, capacity, dict->hashes[id],
+                        dict->keys.data + start, len) = (uint32_t) id + 1;
+    }
+
+    free(dict->slots);
+    dict->slots    = slots;
+    dict->capacity = capacity;
+}
+
+static uint32_t dict_add(Context *ctx, Dict *dict, const void *key, size_t len)
+{
+    if ((dict->count + 1) * 2 > dict->capacity) {
+        dict_grow(ctx, dict);
+    }
+    if (dict->count == 0) {
+        dict->offsets[0] = 0;
+    }
+
+    unsigned long long hash = dict_hash(key, len);
+    uint32_t           *slot = dict_find_slot(dict, dict->slots,
+                                              dict->capacity, hash, key, len);
+    if (!*slot) {
+        if (dict->count >= UINT32_MAX - 1) {
+            die(ctx, "Too many distinct entries in '%s'", ctx->db_name);
+        }
+        bytes_put(ctx, &dict->keys, key, len);
+        dict->hashes[dict->count]      = hash;
+        dict->offsets[dict->count + 1] = dict->keys.size;
+        *slot = (uint32_t) ++dict->count;
+    }
+    return *slot - 1;
+}
+
+static void dict_free(Dict *dict)
+{
+    bytes_free(&dict->keys);
+    free(dict->offsets);
+    free(dict->hashes);
+    free(dict->slots);
+    *dict = (Dict) {0};
+}
+
+
+/* String ids start at 1, leaving 0 for null. */
+static uint32_t archive_string(Context *ctx, sqlite3_stmt *stmt, int column)
+{
+    const unsigned char *text = sqlite3_column_text(stmt, column);
+    if (!text) {
+        return ARC_NULL;
+    }
+    size_t        len = (size_t) sqlite3_column_bytes(stmt, column);
+    unsigned char key[10];
+    Bytes         *b  = &ctx->path;
+    size_t        at  = b->size;
+    bytes_put(ctx, b, key, arc_put_uvarint(key, len));
+    bytes_put(ctx, b, text, len);
+    uint32_t id = dict_add(ctx, &ctx->strings, b->data + at, b->size - at);
+    b->size = at;
+    return id + 1;
+}
+
+static uint32_t archive_triple(Context *ctx, sqlite3_stmt *stmt)
+{
+    uint32_t      ids[3];
+    unsigned char key[30];
+    size_t        len = 0;
+    for (int i = 0; i < 3; ++i) {
+        ids[i] = archive_string(ctx, stmt, 5 + i);
+    }
+    for (int i = 0; i < 3; ++i) {
+        len += arc_put_uvarint(key + len, ids[i]);
+    }
+    return dict_add(ctx, &ctx->triples, key, len);
+}
+
+/* The path buffer holds the steps so far, after room for their count. */
+static void archive_finish_snapshot(Context *ctx)
+{
+    if (!ctx->have_row) {
+        return;
+    }
+
+    Bytes         *b = &ctx->path;
+    unsigned char count[10];
+    size_t        count_len = arc_put_uvarint(count, b->data[0]);
+    size_t        start     = 10 - count_len;
+    memcpy(b->data + start, count, count_len);
+
+    Row *row  = &ctx->rows[ctx->row_count - 1];
+    row->path = dict_add(ctx, &ctx->paths, b->data + start, b->size - start);
+    ctx->have_row = false;
+}
+
+static void archive_add_row(void *data, sqlite3_stmt *stmt)
+{
+    Context *ctx         = data;
+    int64_t snapshot_id  = sqlite3_column_int64(stmt, 0);
+    Bytes   *b           = &ctx->path;
+
+    if (!ctx->have_row || ctx->rows[ctx->row_count - 1].snapshot_id
+                              != snapshot_id) {
+        archive_finish_snapshot(ctx);
+
+        if (ctx->row_count == ctx->row_capacity) {
+            size_t capacity = ctx->row_capacity ? ctx->row_capacity * 2
+                                                : 4096;
+            Row    *rows    = realloc(ctx->rows, capacity * sizeof(*rows));
+            if (!rows) {
+                die(ctx, "Can't realloc %zu snapshots", capacity);
+            }
+            ctx->rows         = rows;
+            ctx->row_capacity = capacity;
+        }
+
+        Row *row = &ctx->rows[ctx->row_count++];
+        row->snapshot_id = snapshot_id;
+        row->epoch_ms    = sqlite3_column_int64(stmt, 1);
+        row->idle_time   = sqlite3_column_type(stmt, 2) == SQLITE_NULL
+                         ? 0 : sqlite3_column_int64(stmt, 2) + 1;
+        row->sample_time = sqlite3_column_int64(stmt, 3);
+        ctx->have_row    = true;
+
+        /* The step count goes in front once it's known, the first byte
+         * keeps it until then. Focus paths are never longer than 255. */
+        b->size = 0;
+        bytes_reserve(ctx, b, 10);
+        b->data[0] = 0;
+        b->size    = 10;
+    }
+
+    if (sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+        if (b->data[0] == UINT8_MAX) {
+            die(ctx, "Snapshot %lld in '%s' has too many focused windows",
+                (long long) snapshot_id, ctx->db_name);
+        }
+        uint32_t triple = archive_triple(ctx, stmt);
+        ++b->data[0];
+        bytes_put_uvarint(ctx, b, (uint64_t) sqlite3_column_int64(stmt, 4));
+        bytes_put_uvarint(ctx, b, triple);
+    }
+}
+
+
+/*
+ * Windows without a parent are the root, which wtstats never looks at. The
+ * order is the one reports go through snapshots in and makes focus paths
+ * come out from the top down.
+ */
+static const char *archive_select_sql =
+    "select\n"
+    "    s.snapshot_id, s.epoch_ms, s.idle_time, s.sample_time,\n"
+    "    w.depth, w.name, w.class, w.title\n"
+    "from snapshot s\n"
+    "left join window w\n"
+    "    on  w.snapshot_id = s.snapshot_id\n"
+    "    and w.focused <> 0\n"
+    "    and w.parent_id is not null\n"
+    "order by s.epoch_ms, s.snapshot_id, w.depth";
+
+static void archive_read(Context *ctx)
+{
+    db_open(&ctx->db, ctx->db_name, SQLITE_OPEN_READONLY);
+    sqlite3_busy_timeout(ctx->db.handle, 5000);
+
+    sqlite3_stmt *check;
+    if (sqlite3_prepare_v2(ctx->db.handle,
+                           "select epoch_ms from snapshot limit 0", -1,
+                           &check, NULL) != SQLITE_OK) {
+        die(ctx, "Database '%s' has no epoch_ms column, "
+                 "run wtsnap once to update it", ctx->db_name);
+    }
+    sqlite3_finalize(check);
+
+    /* The empty path is always there as id 0. */
+    unsigned char empty = 0;
+    dict_add(ctx, &ctx->paths, &empty, 1);
+
+    ctx->stmt = db_prepare(&ctx->db, archive_select_sql);
+    db_exec_stmt(&ctx->db, ctx->stmt, archive_add_row, ctx);
+    archive_finish_snapshot(ctx);
+    ctx->stmt = db_close_stmt(ctx->stmt);
+}
+
+
+static void archive_encode_deltas(Context *ctx, const Row *rows, size_t count,
+                                  size_t field)
+{
+    int64_t prev = 0;
+    for (size_t i = 0; i < count; ++i) {
+        int64_t value;
+        memcpy(&value, (const char *) &rows[i] + field, sizeof(value));
+        bytes_put_uvarint(ctx, &ctx->blocks, arc_zigzag(value - prev));
+        prev = value;
+    }
+}
+
+static void archive_encode_runs(Context *ctx, const Row *rows, size_t count,
+                                bool paths)
+{
+    for (size_t i = 0; i < count;) {
+        uint64_t value = paths ? rows[i].path : (uint64_t) rows[i].sample_time;
+        size_t   run   = 1;
+        while (i + run < count
+                && (paths ? rows[i + run].path
+                          : (uint64_t) rows[i + run].sample_time) == value) {
+            ++run;
+        }
+        bytes_put_uvarint(ctx, &ctx->blocks, run);
+        bytes_put_uvarint(ctx, &ctx->blocks, value);
+        i += run;
+    }
+}
+
+static void archive_encode_blocks(Context *ctx)
+{
+    for (size_t first = 0; first < ctx->row_count; first += ARC_BLOCK_SIZE) {
+        size_t    count = ctx->row_count - first < ARC_BLOCK_SIZE
+                        ? ctx->row_count - first : ARC_BLOCK_SIZE;
+        const Row *rows = ctx->rows + first;
+        size_t    start = ctx->blocks.size;
+
+        int64_t min = rows[0].epoch_ms;
+        int64_t max = rows[0].epoch_ms;
+        for (size_t i = 1; i < count; ++i) {
+            min = rows[i].epoch_ms < min ? rows[i].epoch_ms : min;
+            max = rows[i].epoch_ms > max ? rows[i].epoch_ms : max;
+        }
+
+        archive_encode_deltas(ctx, rows, count, offsetof(Row, snapshot_id));
+        archive_encode_deltas(ctx, rows, count, offsetof(Row, epoch_ms));
+        archive_encode_deltas(ctx, rows, count, offsetof(Row, idle_time));
+        archive_encode_runs(ctx, rows, count, false);
+        archive_encode_runs(ctx, rows, count, true);
+
+        /* Offsets are relative to the blocks for now. */
+        bytes_put_u64(ctx, &ctx->index, start);
+        bytes_put_u64(ctx, &ctx->index, ctx->blocks.size - start);
+        bytes_put_u64(ctx, &ctx->index, count);
+        bytes_put_u64(ctx, &ctx->index, (uint64_t) min);
+        bytes_put_u64(ctx, &ctx->index, (uint64_t) max);
+    }
+}
+
+static void archive_write_bytes(Context *ctx, const void *data, size_t len)
+{
+    if (len && fwrite(data, 1, len, ctx->out) != len) {
+        die(ctx, "Can't write to '%s': %s", ctx->tmp_name, strerror(errno));
+    }
+}
+
+static void archive_write(Context *ctx)
+{
+    archive_encode_blocks(ctx);
+
+    uint64_t strings = ARC_HEADER_SIZE;
+    uint64_t triples = strings + ctx->strings.keys.size;
+    uint64_t paths   = triples + ctx->triples.keys.size;
+    uint64_t index   = paths + ctx->paths.keys.size;
+    uint64_t blocks  = index + ctx->index.size;
+
+    for (size_t i = 0; i < ctx->index.size; i += ARC_INDEX_SIZE) {
+        uint64_t offset = 0;
+        for (int j = 0; j < 8; ++j) {
+            offset |= (uint64_t) ctx->index.data[i + j] << (j * 8);
+        }
+        arc_put_u64(ctx->index.data + i, blocks + offset);
+    }
+
+    int64_t min = ctx->row_count ? ctx->rows[0].epoch_ms : 0;
+    int64_t max = ctx->row_count ? ctx->rows[ctx->row_count - 1].epoch_ms : 0;
+    Bytes   header = {0};
+    bytes_put(ctx, &header, ARC_MAGIC "\0\0\0\0", 8);
+    bytes_put_u64(ctx, &header, ctx->row_count);
+    bytes_put_u64(ctx, &header, ctx->strings.count);
+    bytes_put_u64(ctx, &header, strings);
+    bytes_put_u64(ctx, &header, ctx->triples.count);
+    bytes_put_u64(ctx, &header, triples);
+    bytes_put_u64(ctx, &header, ctx->paths.count);
+    bytes_put_u64(ctx, &header, paths);
+    bytes_put_u64(ctx, &header, ctx->index.size / ARC_INDEX_SIZE);
+    bytes_put_u64(ctx, &header, index);
+    bytes_put_u64(ctx, &header, (uint64_t) min);
+    bytes_put_u64(ctx, &header, (uint64_t) max);
+    archive_write_bytes(ctx, header.data, header.size);
+    bytes_free(&header);
+
+    archive_write_bytes(ctx, ctx->strings.keys.data, ctx->strings.keys.size);
+    archive_write_bytes(ctx, ctx->triples.keys.data, ctx->triples.keys.size);
+    archive_write_bytes(ctx, ctx->paths.keys.data, ctx->paths.keys.size);
+    archive_write_bytes(ctx, ctx->index.data, ctx->index.size);
+    archive_write_bytes(ctx, ctx->blocks.data, ctx->blocks.size);
+}
+
+
+static char *archive_name(Context *ctx, const char *suffix)
+{
+    size_t len  = strlen(ctx->db_name) + strlen(suffix) + 1;
+    char   *name = malloc(len);
+    if (!name) {
+        die(ctx, "Can't malloc %zu bytes for archive name", len);
+    }
+    snprintf(name, len, "%s%s", ctx->db_name, suffix);
+    return name;
+}
+
+/*
+ * The archive is written to a temporary file and renamed into place once
+ * it's safely on disk, so wtstats never sees half of one.
+ */
+static void archive_create(Context *ctx)
+{
+    ctx->out_name = archive_name(ctx, ARC_SUFFIX);
+    ctx->tmp_name = archive_name(ctx, ARC_SUFFIX ".tmp");
+    ctx->out      = fopen(ctx->tmp_name, "wb");
+    if (!ctx->out) {
+        die(ctx, "Can't open '%s': %s", ctx->tmp_name, strerror(errno));
+    }
+
+    archive_write(ctx);
+
+    FILE *out = ctx->out;
+    ctx->out  = NULL;
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        int error = errno;
+        fclose(out);
+        die(ctx, "Can't write to '%s': %s", ctx->tmp_name, strerror(error));
+    }
+    if (fclose(out) != 0) {
+        die(ctx, "Can't close '%s': %s", ctx->tmp_name, strerror(errno));
+    }
+    if (rename(ctx->tmp_name, ctx->out_name) != 0) {
+        die(ctx, "Can't rename '%s' to '%s': %s", ctx->tmp_name,
+            ctx->out_name, strerror(errno));
+    }
+    free(ctx->tmp_name);
+    ctx->tmp_name = NULL;
+}
+
+static void archive_remove_database(Context *ctx)
+{
+    static const char *suffixes[] = {"-wal", "-shm", "-journal", NULL};
+    if (unlink(ctx->db_name) != 0) {
+        die(ctx, "Can't remove '%s': %s", ctx->db_name, strerror(errno));
+    }
+    for (const char **suffix = suffixes; *suffix; ++suffix) {
+        char *name = archive_name(ctx, *suffix);
+        if (unlink(name) != 0 && errno != ENOENT) {
+            warn("Can't remove '%s': %s", name, strerror(errno));
+        }
+        free(name);
+    }
+}
+
+static void cleanup(Context *ctx)
+{
+    debug("Cleaning up");
+    ctx->stmt      = db_close_stmt(ctx->stmt);
+    ctx->db.handle = db_close(ctx->db.handle);
+    if (ctx->out) {
+        fclose(ctx->out);
+        ctx->out = NULL;
+    }
+    if (ctx->tmp_name) {
+        unlink(ctx->tmp_name);
+        free(ctx->tmp_name);
+        ctx->tmp_name = NULL;
+    }
+    free(ctx->out_name);
+    ctx->out_name = NULL;
+    dict_free(&ctx->strings);
+    dict_free(&ctx->triples);
+    dict_free(&ctx->paths);
+    bytes_free(&ctx->path);
+    bytes_free(&ctx->blocks);
+    bytes_free(&ctx->index);
+    free(ctx->rows);
+    ctx->rows         = NULL;
+    ctx->row_count    = 0;
+    ctx->row_capacity = 0;
+    ctx->have_row     = false;
+}
+
+static bool run_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        debug("Archiving '%s'", ctx->db_name);
+        archive_read(ctx);
+        ctx->db.handle = db_close(ctx->db.handle);
+        archive_create(ctx);
+        debug("Wrote %zu snapshots to '%s'", ctx->row_count, ctx->out_name);
+        if (ctx->remove) {
+            archive_remove_database(ctx);
+        }
+        return true;
+    }
+    else {
+        debug("Caught longjmp");
+        return false;
+    }
+}
+
+
+static int args_parse(Context *ctx, int argc, char **argv)
+{
+    int opt;
+    int ret = 0;
+
+    while ((opt = getopt(argc, argv, "hr")) != -1) {
+        switch (opt) {
+            case 'h':
+                ret |= ARGS_WANT_HELP;
+                break;
+            case 'r':
+                ctx->remove = true;
+                debug("remove set to true");
+                break;
+            default:
+                ret |= ARGS_ERROR;
+                break;
+        }
+    }
+
+    if (optind == argc && !(ret & ARGS_WANT_HELP)) {
+        warn("%s: no databases given", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ret & ARGS_WANT_HELP) {
+        fprintf(stdout, args_help, argv[0]);
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    Context ctx = {0};
+    ctx.db.env  = &ctx.env;
+
+    int arg_ret = args_parse(&ctx, argc, argv);
+    if (arg_ret & ARGS_ERROR) {
+        return 2;
+    }
+    else if (arg_ret & ARGS_WANT_HELP) {
+        return 0;
+    }
+
+    bool ok = true;
+    for (int i = optind; i < argc; ++i) {
+        ctx.db_name = argv[i];
+        ok          = run_with_jmp_buf(&ctx) && ok;
+        cleanup(&ctx);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
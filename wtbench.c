@@ -0,0 +1,699 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include "wtdb.h"
+
+
+#define ARGS_ERROR     (1 << 0)
+#define ARGS_WANT_HELP (1 << 1)
+
+static const char *args_help =
+    "\n"
+    "wtbench - builds a synthetic window tree on an X display and takes\n"
+    "snapshots of it with wtsnap, to see how long capturing takes and\n"
+    "how that scales. Best run on a display of its own, like with\n"
+    "`make bench`, which starts Xvfb for it.\n"
+    "\n"
+    "Usage: %s [OPTIONS] [-- WTSNAP_OPTIONS...]\n"
+    "\n"
+    "WTSNAP_OPTIONS are passed on to every run of wtsnap, along with\n"
+    "-v and the -d and -f options wtbench picks.\n"
+    "\n"
+    "Available options:\n"
+    "\n"
+    "    -c COUNT\n"
+    "        Change the titles of COUNT windows before every\n"
+    "        snapshot, so that caches have something to do.\n"
+    "        Default is 0, leaving everything alone.\n"
+    "\n"
+    "    -D\n"
+    "        Run a single wtsnap daemon with -D -s 1 instead of one\n"
+    "        wtsnap process for each snapshot. Takes a second per\n"
+    "        snapshot, but measures a warmed up daemon, which is the\n"
+    "        only way to see what -E and -R do.\n"
+    "        Default is one process for each snapshot.\n"
+    "\n"
+    "    -d DISPLAY\n"
+    "        Name of the X display to build the tree on. It's retried\n"
+    "        for a few seconds, to give a server that was just started\n"
+    "        some time to come up.\n"
+    "        Default is '', the default display.\n"
+    "\n"
+    "    -e\n"
+    "        Publish the top-level windows in _NET_CLIENT_LIST and the\n"
+    "        one with the focus in _NET_ACTIVE_WINDOW, like an EWMH\n"
+    "        window manager does, for trying out wtsnap -C.\n"
+    "        Default is to not set them.\n"
+    "\n"
+    "    -f DATABASE_FILE\n"
+    "        Database for wtsnap to write to. It's left behind, and if\n"
+    "        it already exists, only its growth counts.\n"
+    "        Default is a temporary file that's removed afterwards.\n"
+    "\n"
+    "    -l LEVELS\n"
+    "        How many levels of windows there are below the root.\n"
+    "        Default is 3.\n"
+    "\n"
+    "    -n SNAPSHOTS\n"
+    "        How many snapshots to take.\n"
+    "        Default is 100.\n"
+    "\n"
+    "    -s WTSNAP\n"
+    "        Path to the wtsnap program to run.\n"
+    "        Default is ./wtsnap\n"
+    "\n"
+    "    -t TITLE_LENGTH\n"
+    "        How many bytes long the title of every window is.\n"
+    "        Default is 40.\n"
+    "\n"
+    "    -w WIDTH\n"
+    "        How many children every window above the last level\n"
+    "        has, so there's WIDTH + WIDTH^2 + ... + WIDTH^LEVELS\n"
+    "        windows in total.\n"
+    "        Default is 4.\n"
+    "\n"
+    "    -h\n"
+    "        Shows this help.\n"
+    "\n";
+
+
+/* What wtsnap -v reports about every snapshot. */
+typedef struct Sample {
+    double process_ms;
+    double total_ms;
+    double db_ms;
+    int    round_trips;
+    int    rows;
+} Sample;
+
+typedef struct Context {
+    const char *dpy_name;
+    const char *db_name;
+    const char *wtsnap;
+    char       *tmp_name;
+    int        width;
+    int        levels;
+    int        title_length;
+    int        snapshots;
+    int        changes;
+    bool       daemon;
+    bool       ewmh;
+    char       **snap_argv;
+    int        snap_argc;
+    jmp_buf    env;
+    Display    *dpy;
+    Window     root;
+    Atom       net_wm_name;
+    Atom       utf8_string;
+    Window     *windows;
+    size_t     window_count;
+    size_t     top_level_count;
+    Window     focus;
+    char       *title;
+    size_t     change_cursor;
+    int        change_round;
+    Sample     *samples;
+    int        sample_count;
+    pid_t      pid;
+    FILE       *output;
+} Context;
+
+
+static noreturn void die(Context *ctx, const char *fmt, ...)
+{
+    DO_LOG();
+    longjmp(ctx->env, 1);
+}
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        /* keep sleeping */
+    }
+}
+
+
+static void x_open_display(Context *ctx)
+{
+    for (int tries = 0; tries < 50 && !ctx->dpy; ++tries) {
+        if (tries > 0) {
+            sleep_ms(100);
+        }
+        ctx->dpy = XOpenDisplay(ctx->dpy_name);
+    }
+    if (!ctx->dpy) {
+        die(ctx, "Can't open display '%s'", ctx->dpy_name);
+    }
+    ctx->root        = XDefaultRootWindow(ctx->dpy);
+    ctx->net_wm_name = XInternAtom(ctx->dpy, "_NET_WM_NAME", false);
+    ctx->utf8_string = XInternAtom(ctx->dpy, "UTF8_STRING", false);
+}
+
+/* Pads the title out to its length, varying with the window and round. */
+static void x_set_title(Context *ctx, Window window, size_t index)
+{
+    size_t len  = (size_t) ctx->title_length;
+    int    head = snprintf(ctx->title, len + 1, "window %zu round %d ",
+                           index, ctx->change_round);
+    for (size_t i = head < 0 ? 0 : (size_t) head; i < len; ++i) {
+        ctx->title[i] = (char) ('a' + (i + index) % 26);
+    }
+    ctx->title[len] = '\0';
+
+    XChangeProperty(ctx->dpy, window, ctx->net_wm_name, ctx->utf8_string, 8,
+                    PropModeReplace, (unsigned char *) ctx->title, (int) len);
+    XStoreName(ctx->dpy, window, ctx->title);
+}
+
+static void x_create_window(Context *ctx, Window parent, int level)
+{
+    Window window = XCreateSimpleWindow(ctx->dpy, parent, 0, 0, 64, 64, 0,
+                                        0, 0);
+    size_t index  = ctx->window_count;
+    ctx->windows[ctx->window_count++] = window;
+    if (level == 1) {
+        ++ctx->top_level_count;
+    }
+
+    char       name[32], class[32];
+    XClassHint hint = {name, class};
+    snprintf(name, sizeof(name), "wtbench");
+    snprintf(class, sizeof(class), "Wtbench%zu", index % 16);
+    XSetClassHint(ctx->dpy, window, &hint);
+    x_set_title(ctx, window, index);
+    XMapWindow(ctx->dpy, window);
+
+    ctx->focus = window;
+    if (level < ctx->levels) {
+        for (int i = 0; i < ctx->width; ++i) {
+            x_create_window(ctx, window, level + 1);
+        }
+    }
+}
+
+static void x_publish_clients(Context *ctx)
+{
+    Atom client_list = XInternAtom(ctx->dpy, "_NET_CLIENT_LIST", false);
+    Atom active      = XInternAtom(ctx->dpy, "_NET_ACTIVE_WINDOW", false);
+
+    /* Xlib wants 32 bit properties as longs, which Window already is. */
+    Window *clients = malloc(ctx->top_level_count * sizeof(*clients));
+    if (!clients) {
+        die(ctx, "Can't malloc %zu clients", ctx->top_level_count);
+    }
+    size_t count = 0;
+    Window client = None;
+    for (size_t i = 0; i < ctx->window_count; ++i) {
+        Window       root, parent, *children = NULL;
+        unsigned int nchildren;
+        if (XQueryTree(ctx->dpy, ctx->windows[i], &root, &parent,
+                       &children, &nchildren) && parent == ctx->root) {
+            clients[count++] = ctx->windows[i];
+            client           = ctx->windows[i];
+        }
+        if (children) {
+            XFree(children);
+        }
+    }
+
+    XChangeProperty(ctx->dpy, ctx->root, client_list, XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *) clients, (int) count);
+    XChangeProperty(ctx->dpy, ctx->root, active, XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *) &client, 1);
+    free(clients);
+}
+
+static void x_build_tree(Context *ctx)
+{
+    size_t total = 0, level_count = 1;
+    for (int level = 1; level <= ctx->levels; ++level) {
+        level_count *= (size_t) ctx->width;
+        total       += level_count;
+    }
+
+    ctx->windows = malloc(total * sizeof(*ctx->windows));
+    ctx->title   = malloc((size_t) ctx->title_length + 1);
+    if (!ctx->windows || !ctx->title) {
+        die(ctx, "Can't malloc space for %zu windows", total);
+    }
+
+    debug("Creating %zu windows", total);
+    for (int i = 0; i < ctx->width; ++i) {
+        x_create_window(ctx, ctx->root, 1);
+    }
+    XSync(ctx->dpy, false);
+
+    /* The last window is a leaf, so it's as deep down as it gets. */
+    if (ctx->focus != None) {
+        XSetInputFocus(ctx->dpy, ctx->focus, RevertToParent, CurrentTime);
+    }
+    if (ctx->ewmh) {
+        x_publish_clients(ctx);
+    }
+    XSync(ctx->dpy, false);
+}
+
+/* Goes round all windows, so every change is one no cache has seen yet. */
+static void x_change_titles(Context *ctx)
+{
+    if (ctx->changes <= 0 || ctx->window_count == 0) {
+        return;
+    }
+    for (int i = 0; i < ctx->changes; ++i) {
+        if (ctx->change_cursor == 0) {
+            ++ctx->change_round;
+        }
+        x_set_title(ctx, ctx->windows[ctx->change_cursor],
+                    ctx->change_cursor);
+        ctx->change_cursor = (ctx->change_cursor + 1) % ctx->window_count;
+    }
+    XSync(ctx->dpy, false);
+}
+
+
+static void bench_build_argv(Context *ctx, char **extra, int extra_count)
+{
+    const char *fixed[] = {
+        ctx->wtsnap, "-v", "-d", ctx->dpy_name, "-f", ctx->db_name,
+    };
+    int fixed_count = (int) (sizeof(fixed) / sizeof(fixed[0]));
+    int count       = fixed_count + (ctx->daemon ? 3 : 0) + extra_count;
+
+    ctx->snap_argv = calloc((size_t) count + 1, sizeof(*ctx->snap_argv));
+    if (!ctx->snap_argv) {
+        die(ctx, "Can't calloc %d arguments", count + 1);
+    }
+    for (int i = 0; i < fixed_count; ++i) {
+        ctx->snap_argv[ctx->snap_argc++] = (char *) fixed[i];
+    }
+    if (ctx->daemon) {
+        ctx->snap_argv[ctx->snap_argc++] = "-D";
+        ctx->snap_argv[ctx->snap_argc++] = "-s";
+        ctx->snap_argv[ctx->snap_argc++] = "1";
+    }
+    for (int i = 0; i < extra_count; ++i) {
+        ctx->snap_argv[ctx->snap_argc++] = extra[i];
+    }
+}
+
+static void bench_make_db_name(Context *ctx)
+{
+    if (ctx->db_name) {
+        return;
+    }
+    const char *dir  = getenv("TMPDIR");
+    size_t     size  = strlen(dir ? dir : "/tmp") + 32;
+    ctx->tmp_name    = malloc(size);
+    if (!ctx->tmp_name) {
+        die(ctx, "Can't malloc %zu bytes for database name", size);
+    }
+    snprintf(ctx->tmp_name, size, "%s/wtbench-XXXXXX", dir ? dir : "/tmp");
+
+    /* SQLite takes an empty file as an empty database. */
+    int fd = mkstemp(ctx->tmp_name);
+    if (fd < 0) {
+        die(ctx, "Can't create '%s': %s", ctx->tmp_name, strerror(errno));
+    }
+    close(fd);
+    ctx->db_name = ctx->tmp_name;
+}
+
+/* The write-ahead log counts too, it's just not checkpointed yet. */
+static long long bench_db_size(const Context *ctx)
+{
+    long long   total = 0;
+    const char  *suffixes[] = {"", "-wal"};
+    char        name[4096];
+    struct stat st;
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        snprintf(name, sizeof(name), "%s%s", ctx->db_name, suffixes[i]);
+        if (stat(name, &st) == 0) {
+            total += (long long) st.st_size;
+        }
+    }
+    return total;
+}
+
+static void bench_start(Context *ctx)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        die(ctx, "Can't create pipe: %s", strerror(errno));
+    }
+
+    fflush(stdout);
+    ctx->pid = fork();
+    if (ctx->pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        die(ctx, "Can't fork: %s", strerror(errno));
+    }
+    else if (ctx->pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(ctx->wtsnap, ctx->snap_argv);
+        warn("Can't run '%s': %s", ctx->wtsnap, strerror(errno));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    ctx->output = fdopen(fds[0], "r");
+    if (!ctx->output) {
+        close(fds[0]);
+        die(ctx, "Can't read from wtsnap: %s", strerror(errno));
+    }
+}
+
+static bool bench_stop(Context *ctx)
+{
+    if (ctx->output) {
+        fclose(ctx->output);
+        ctx->output = NULL;
+    }
+    if (ctx->pid <= 0) {
+        return true;
+    }
+
+    int   status;
+    pid_t pid = ctx->pid;
+    ctx->pid  = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        warn("Can't wait for wtsnap: %s", strerror(errno));
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool bench_read_sample(Context *ctx, Sample *sample)
+{
+    char line[1024];
+    while (fgets(line, sizeof(line), ctx->output)) {
+        int id;
+        if (sscanf(line, "Snapshot %d: %lf ms, %lf ms in the database, "
+                         "%d round trips, %d rows", &id, &sample->total_ms,
+                   &sample->db_ms, &sample->round_trips, &sample->rows) == 5) {
+            return true;
+        }
+        fputs(line, stdout);
+    }
+    return false;
+}
+
+static void bench_run_processes(Context *ctx)
+{
+    for (int i = 0; i < ctx->snapshots; ++i) {
+        x_change_titles(ctx);
+        Sample    *sample  = &ctx->samples[ctx->sample_count];
+        long long start_ns = monotonic_ns();
+        bench_start(ctx);
+        bool got = bench_read_sample(ctx, sample);
+        bool ok  = bench_stop(ctx);
+        if (!got || !ok) {
+            die(ctx, "wtsnap failed on snapshot %d", i + 1);
+        }
+        sample->process_ms = (double) (monotonic_ns() - start_ns) / 1e6;
+        ++ctx->sample_count;
+    }
+}
+
+/* Titles are changed right after a snapshot, so they're in before the next. */
+static void bench_run_daemon(Context *ctx)
+{
+    bench_start(ctx);
+    while (ctx->sample_count < ctx->snapshots) {
+        Sample *sample = &ctx->samples[ctx->sample_count];
+        if (!bench_read_sample(ctx, sample)) {
+            break;
+        }
+        sample->process_ms = 0.0;
+        ++ctx->sample_count;
+        debug("Got snapshot %d of %d", ctx->sample_count, ctx->snapshots);
+        x_change_titles(ctx);
+    }
+    kill(ctx->pid, SIGTERM);
+    bench_stop(ctx);
+    if (ctx->sample_count < ctx->snapshots) {
+        die(ctx, "wtsnap stopped after %d of %d snapshots",
+            ctx->sample_count, ctx->snapshots);
+    }
+}
+
+
+static int bench_compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank, so the p99 of less than 100 samples is the slowest one. */
+static double bench_percentile(Context *ctx, size_t offset, double p)
+{
+    int    n      = ctx->sample_count;
+    double *value = malloc((size_t) n * sizeof(*value));
+    if (!value) {
+        die(ctx, "Can't malloc %d values", n);
+    }
+    for (int i = 0; i < n; ++i) {
+        value[i] = *(const double *) ((const char *) &ctx->samples[i] + offset);
+    }
+    qsort(value, (size_t) n, sizeof(*value), bench_compare_doubles);
+
+    int rank = (int) (p / 100.0 * n + 0.999999);
+    rank     = rank < 1 ? 1 : rank > n ? n : rank;
+    double result = value[rank - 1];
+    free(value);
+    return result;
+}
+
+static void bench_report_latency(Context *ctx, const char *label,
+                                 size_t offset)
+{
+    printf("%-22s p50 %9.3f ms   p99 %9.3f ms\n", label,
+           bench_percentile(ctx, offset, 50.0),
+           bench_percentile(ctx, offset, 99.0));
+}
+
+static void bench_report(Context *ctx, long long db_bytes)
+{
+    int    n           = ctx->sample_count;
+    double round_trips = 0.0, rows = 0.0;
+    for (int i = 0; i < n; ++i) {
+        round_trips += ctx->samples[i].round_trips;
+        rows        += ctx->samples[i].rows;
+    }
+
+    printf("%-22s %zu (width %d, %d levels, %d byte titles)\n", "Windows:",
+           ctx->window_count, ctx->width, ctx->levels, ctx->title_length);
+    printf("%-22s %d%s\n", "Snapshots:", n,
+           ctx->daemon ? " from one daemon" : ", one process each");
+    bench_report_latency(ctx, "Snapshot:", offsetof(Sample, total_ms));
+    bench_report_latency(ctx, "Database:", offsetof(Sample, db_ms));
+    if (!ctx->daemon) {
+        bench_report_latency(ctx, "Process:", offsetof(Sample, process_ms));
+    }
+    printf("%-22s %.1f per snapshot\n", "Round trips:", round_trips / n);
+    printf("%-22s %.1f per snapshot\n", "Rows:", rows / n);
+    printf("%-22s %.1f per snapshot\n", "Database bytes:",
+           (double) db_bytes / n);
+}
+
+
+static void cleanup(Context *ctx)
+{
+    debug("Cleaning up");
+    if (ctx->pid > 0) {
+        kill(ctx->pid, SIGTERM);
+    }
+    bench_stop(ctx);
+    if (ctx->dpy) {
+        XCloseDisplay(ctx->dpy);
+        ctx->dpy = NULL;
+    }
+    if (ctx->tmp_name) {
+        const char *suffixes[] = {"", "-journal", "-wal", "-shm"};
+        char       name[4096];
+        for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+            snprintf(name, sizeof(name), "%s%s", ctx->tmp_name, suffixes[i]);
+            unlink(name);
+        }
+        free(ctx->tmp_name);
+        ctx->tmp_name = NULL;
+    }
+    free(ctx->windows);
+    free(ctx->title);
+    free(ctx->samples);
+    free(ctx->snap_argv);
+}
+
+static bool run_with_jmp_buf(Context *ctx, char **extra, int extra_count)
+{
+    if (setjmp(ctx->env) == 0) {
+        bench_make_db_name(ctx);
+        bench_build_argv(ctx, extra, extra_count);
+        ctx->samples = calloc((size_t) ctx->snapshots, sizeof(*ctx->samples));
+        if (!ctx->samples) {
+            die(ctx, "Can't calloc %d samples", ctx->snapshots);
+        }
+
+        x_open_display(ctx);
+        x_build_tree(ctx);
+
+        long long db_start = bench_db_size(ctx);
+        if (ctx->daemon) {
+            bench_run_daemon(ctx);
+        }
+        else {
+            bench_run_processes(ctx);
+        }
+        bench_report(ctx, bench_db_size(ctx) - db_start);
+        return true;
+    }
+    else {
+        debug("Caught longjmp");
+        return false;
+    }
+}
+
+
+static int args_positive(const char *prog, int opt, const char *arg, int min,
+                         int *out)
+{
+    *out = atoi(arg);
+    debug("-%c set to %d from '%s'", opt, *out, arg);
+    if (*out >= min) {
+        return 0;
+    }
+    else {
+        warn("%s: invalid argument to -%c -- '%s'", prog, opt, arg);
+        return ARGS_ERROR;
+    }
+}
+
+static int args_parse(Context *ctx, int argc, char **argv)
+{
+    int opt;
+    int ret = 0;
+
+    while ((opt = getopt(argc, argv, "c:Dd:ef:hl:n:s:t:w:")) != -1) {
+        switch (opt) {
+            case 'c':
+                ret |= args_positive(argv[0], opt, optarg, 0, &ctx->changes);
+                break;
+            case 'D':
+                ctx->daemon = true;
+                debug("daemon set to true");
+                break;
+            case 'd':
+                ctx->dpy_name = optarg;
+                debug("dpy_name set to '%s'", ctx->dpy_name);
+                break;
+            case 'e':
+                ctx->ewmh = true;
+                debug("ewmh set to true");
+                break;
+            case 'f':
+                ctx->db_name = optarg;
+                debug("db_name set to '%s'", ctx->db_name);
+                break;
+            case 'h':
+                ret |= ARGS_WANT_HELP;
+                break;
+            case 'l':
+                ret |= args_positive(argv[0], opt, optarg, 1, &ctx->levels);
+                break;
+            case 'n':
+                ret |= args_positive(argv[0], opt, optarg, 1,
+                                     &ctx->snapshots);
+                break;
+            case 's':
+                ctx->wtsnap = optarg;
+                debug("wtsnap set to '%s'", ctx->wtsnap);
+                break;
+            case 't':
+                ret |= args_positive(argv[0], opt, optarg, 1,
+                                     &ctx->title_length);
+                break;
+            case 'w':
+                ret |= args_positive(argv[0], opt, optarg, 1, &ctx->width);
+                break;
+            default:
+                ret |= ARGS_ERROR;
+                break;
+        }
+    }
+
+    if (ret & ARGS_WANT_HELP) {
+        fprintf(stdout, args_help, argv[0]);
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    Context ctx      = {0};
+    ctx.dpy_name     = "";
+    ctx.wtsnap       = "./wtsnap";
+    ctx.width        = 4;
+    ctx.levels       = 3;
+    ctx.title_length = 40;
+    ctx.snapshots    = 100;
+
+    int arg_ret = args_parse(&ctx, argc, argv);
+    if (arg_ret & ARGS_ERROR) {
+        return 2;
+    }
+    else if (arg_ret & ARGS_WANT_HELP) {
+        return 0;
+    }
+
+    bool ok = run_with_jmp_buf(&ctx, argv + optind, argc - optind);
+    cleanup(&ctx);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
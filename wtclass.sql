@@ -1,7 +1,7 @@
 -- This is an example classification file.
 -- The content here is plugged directly into an SQLite CASE statement.
 -- You'll probably want to look at the name, class and title columns.
--- Have a look at the wtstats script for details on how this works.
+-- Have a look at wtstats.c for details on how this works.
 -- By default, the classfication file lives at ~/.wtclass.sql.
 
 -- Classification for a work task.
@@ -0,0 +1,1221 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * wtclassify - an SQLite extension that compiles the contents of a wtstats
+ * classification file into something faster than the CASE statement it is
+ * written as. Every distinct like '%...%' literal on a column goes into one
+ * Aho-Corasick automaton for that column, so each name, class and title is
+ * scanned only once per row, no matter how many rules look at it. The rules
+ * are then evaluated in order with SQL's three-valued logic, so the first
+ * matching rule wins just like in the CASE.
+ *
+ * Only a subset of SQL is understood: when/then/else, and, or, not,
+ * parentheses, = and <> against a string, [not] like, [not] in, is [not] null
+ * and show_uncategorized as conditions, string literals, columns, null and ||
+ * as results. Anything else is an error, which is wtstats' cue to fall back
+ * to the plain CASE statement.
+ */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <strings.h>
+#include <sqlite3ext.h>
+#include "wtclassify.h"
+
+SQLITE_EXTENSION_INIT1
+
+
+#define COLUMN_COUNT 3
+
+static const char *column_names[COLUMN_COUNT] = {"name", "class", "title"};
+
+typedef enum {
+    TOKEN_EOF,
+    TOKEN_WORD,
+    TOKEN_STRING,
+    TOKEN_LPAREN,
+    TOKEN_RPAREN,
+    TOKEN_COMMA,
+    TOKEN_DOT,
+    TOKEN_EQ,
+    TOKEN_NE,
+    TOKEN_CONCAT,
+} TokenType;
+
+typedef struct {
+    TokenType  type;
+    const char *start;
+    int        len;
+    char       *string;
+} Token;
+
+typedef enum {
+    EXPR_AND,
+    EXPR_OR,
+    EXPR_NOT,
+    EXPR_SHOW,
+    EXPR_IS_NULL,
+    EXPR_EQ,
+    EXPR_IN,
+    EXPR_CONTAINS,
+    EXPR_LIKE,
+} ExprType;
+
+typedef struct {
+    ExprType   type;
+    int        column;
+    int        lhs, rhs;
+    int        first, count;
+    const char *text;
+    int        len;
+} Expr;
+
+/* A column of -1 is a string literal, a null text means null. */
+typedef struct {
+    int        column;
+    const char *text;
+    int        len;
+} Term;
+
+/* A condition of -1 is the else branch. */
+typedef struct {
+    int cond;
+    int first, count;
+} Rule;
+
+typedef struct {
+    unsigned char classes[256];
+    int           nclasses;
+    int           *next;
+    int           *pattern;
+    int           *link;
+    int           nstates, capacity;
+    int           first_pattern, npatterns;
+} Matcher;
+
+typedef enum {
+    TRI_FALSE,
+    TRI_TRUE,
+    TRI_NULL,
+} Tri;
+
+typedef struct {
+    Expr       *exprs;
+    int        nexprs, cexprs;
+    Term       *terms;
+    int        nterms, cterms;
+    Rule       *rules;
+    int        nrules, crules;
+    const char **items;
+    int        nitems, citems;
+    char       **strings;
+    int        nstrings, cstrings;
+    char       **patterns[COLUMN_COUNT];
+    int        npatterns[COLUMN_COUNT], cpatterns[COLUMN_COUNT];
+    Matcher    matchers[COLUMN_COUNT];
+    int        total_patterns;
+    uint64_t   *found;
+    int        nfound;
+    int        *trigger_start;
+    int        *trigger_rules;
+    uint64_t   *untriggered;
+    uint64_t   *candidates;
+    int        ncandidates;
+    const char *values[COLUMN_COUNT];
+    int        lengths[COLUMN_COUNT];
+    int        show;
+} Rules;
+
+typedef struct {
+    jmp_buf    env;
+    char       *error;
+    Rules      *rules;
+    int        *scratch;
+    const char *src;
+    const char *pos;
+    int        line;
+    Token      tok;
+} Compiler;
+
+
+static noreturn void fail(Compiler *c, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char *msg = sqlite3_vmprintf(fmt, ap);
+    va_end(ap);
+    c->error = sqlite3_mprintf("line %d: %s", c->line, msg ? msg : fmt);
+    sqlite3_free(msg);
+    longjmp(c->env, 1);
+}
+
+/*
+ * Grows the array at *ptr so that it can hold at least one more element,
+ * dying if that's not possible.
+ */
+static void grow(Compiler *c, void *ptr, int count, int *capacity,
+                 size_t size)
+{
+    if (count < *capacity) {
+        return;
+    }
+    int new_capacity = *capacity ? *capacity * 2 : 16;
+    void **array = ptr;
+    void *grown = sqlite3_realloc64(*array, (sqlite3_uint64) new_capacity
+                                          * size);
+    if (!grown) {
+        fail(c, "out of memory");
+    }
+    *array = grown;
+    *capacity = new_capacity;
+}
+
+static unsigned char ascii_lower(unsigned char ch)
+{
+    return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+}
+
+
+static void rules_free(Rules *r)
+{
+    if (r) {
+        for (int i = 0; i < r->nstrings; ++i) {
+            sqlite3_free(r->strings[i]);
+        }
+        for (int i = 0; i < COLUMN_COUNT; ++i) {
+            sqlite3_free(r->patterns[i]);
+            sqlite3_free(r->matchers[i].next);
+            sqlite3_free(r->matchers[i].pattern);
+            sqlite3_free(r->matchers[i].link);
+        }
+        sqlite3_free(r->exprs);
+        sqlite3_free(r->terms);
+        sqlite3_free(r->rules);
+        sqlite3_free(r->items);
+        sqlite3_free(r->strings);
+        sqlite3_free(r->found);
+        sqlite3_free(r->trigger_start);
+        sqlite3_free(r->trigger_rules);
+        sqlite3_free(r->untriggered);
+        sqlite3_free(r->candidates);
+        sqlite3_free(r);
+    }
+}
+
+static void rules_destroy(void *r)
+{
+    rules_free(r);
+}
+
+static char *rules_add_string(Compiler *c, const char *start, int len)
+{
+    Rules *r = c->rules;
+    grow(c, &r->strings, r->nstrings, &r->cstrings, sizeof(*r->strings));
+    char *s = sqlite3_malloc(len + 1);
+    if (!s) {
+        fail(c, "out of memory");
+    }
+    memcpy(s, start, (size_t) len);
+    s[len] = '\0';
+    r->strings[r->nstrings++] = s;
+    return s;
+}
+
+static int rules_add_expr(Compiler *c, const Expr *expr)
+{
+    Rules *r = c->rules;
+    grow(c, &r->exprs, r->nexprs, &r->cexprs, sizeof(*r->exprs));
+    r->exprs[r->nexprs] = *expr;
+    return r->nexprs++;
+}
+
+/*
+ * Patterns are deduplicated per column, so a literal that many rules look
+ * for is still only one bit in the found set.
+ */
+static int rules_add_pattern(Compiler *c, int column, const char *text,
+                             int len)
+{
+    Rules *r = c->rules;
+    char *lower = rules_add_string(c, text, len);
+    for (int i = 0; i < len; ++i) {
+        lower[i] = (char) ascii_lower((unsigned char) lower[i]);
+    }
+    for (int i = 0; i < r->npatterns[column]; ++i) {
+        if (strcmp(r->patterns[column][i], lower) == 0) {
+            return i;
+        }
+    }
+
+    grow(c, &r->patterns[column], r->npatterns[column],
+         &r->cpatterns[column], sizeof(*r->patterns[column]));
+    r->patterns[column][r->npatterns[column]] = lower;
+    return r->npatterns[column]++;
+}
+
+
+static bool is_word_char(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+        || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+static void lex_skip_space(Compiler *c)
+{
+    for (;;) {
+        char ch = *c->pos;
+        if (ch == '\n') {
+            ++c->line;
+            ++c->pos;
+        }
+        else if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f'
+                || ch == '\v') {
+            ++c->pos;
+        }
+        else if (ch == '-' && c->pos[1] == '-') {
+            while (*c->pos && *c->pos != '\n') {
+                ++c->pos;
+            }
+        }
+        else if (ch == '/' && c->pos[1] == '*') {
+            c->pos += 2;
+            while (*c->pos && !(c->pos[0] == '*' && c->pos[1] == '/')) {
+                if (*c->pos++ == '\n') {
+                    ++c->line;
+                }
+            }
+            if (!*c->pos) {
+                fail(c, "unterminated comment");
+            }
+            c->pos += 2;
+        }
+        else {
+            break;
+        }
+    }
+}
+
+static void lex_string(Compiler *c)
+{
+    const char *start = ++c->pos;
+    int        len    = 0;
+    for (const char *p = start; ; ++p) {
+        if (!*p) {
+            fail(c, "unterminated string");
+        }
+        else if (*p == '\'') {
+            if (p[1] != '\'') {
+                break;
+            }
+            ++p;
+        }
+        ++len;
+    }
+
+    char *s = rules_add_string(c, start, len);
+    for (int i = 0; i < len; ++i) {
+        if (*c->pos == '\n') {
+            ++c->line;
+        }
+        s[i] = *c->pos;
+        c->pos += *c->pos == '\'' ? 2 : 1;
+    }
+    ++c->pos;
+
+    c->tok.type   = TOKEN_STRING;
+    c->tok.string = s;
+    c->tok.len    = len;
+}
+
+static void lex(Compiler *c)
+{
+    lex_skip_space(c);
+    c->tok.start  = c->pos;
+    c->tok.string = NULL;
+
+    char ch = *c->pos;
+    if (!ch) {
+        c->tok.type = TOKEN_EOF;
+        c->tok.len  = 0;
+    }
+    else if (ch == '\'') {
+        lex_string(c);
+    }
+    else if (is_word_char(ch) && !(ch >= '0' && ch <= '9')) {
+        while (is_word_char(*c->pos)) {
+            ++c->pos;
+        }
+        c->tok.type = TOKEN_WORD;
+        c->tok.len  = (int) (c->pos - c->tok.start);
+    }
+    else {
+        static const struct {
+            const char *text;
+            TokenType  type;
+        } symbols[] = {
+            {"||", TOKEN_CONCAT}, {"==", TOKEN_EQ}, {"<>", TOKEN_NE},
+            {"!=", TOKEN_NE},     {"=",  TOKEN_EQ}, {"(",  TOKEN_LPAREN},
+            {")",  TOKEN_RPAREN}, {",",  TOKEN_COMMA}, {".", TOKEN_DOT},
+        };
+        for (size_t i = 0; i < sizeof(symbols) / sizeof(*symbols); ++i) {
+            size_t len = strlen(symbols[i].text);
+            if (strncmp(c->pos, symbols[i].text, len) == 0) {
+                c->pos      += len;
+                c->tok.type  = symbols[i].type;
+                c->tok.len   = (int) len;
+                return;
+            }
+        }
+        fail(c, "unsupported syntax near '%.16s'", c->pos);
+    }
+}
+
+static bool is_keyword(Compiler *c, const char *word)
+{
+    return c->tok.type == TOKEN_WORD && (int) strlen(word) == c->tok.len
+        && strncasecmp(c->tok.start, word, (size_t) c->tok.len) == 0;
+}
+
+static bool accept_keyword(Compiler *c, const char *word)
+{
+    if (is_keyword(c, word)) {
+        lex(c);
+        return true;
+    }
+    return false;
+}
+
+static void expect_keyword(Compiler *c, const char *word)
+{
+    if (!accept_keyword(c, word)) {
+        fail(c, "expected '%s' near '%.16s'", word, c->tok.start);
+    }
+}
+
+static bool accept(Compiler *c, TokenType type)
+{
+    if (c->tok.type == type) {
+        lex(c);
+        return true;
+    }
+    return false;
+}
+
+static void expect(Compiler *c, TokenType type, const char *what)
+{
+    if (!accept(c, type)) {
+        fail(c, "expected %s near '%.16s'", what, c->tok.start);
+    }
+}
+
+static const char *expect_string(Compiler *c, int *len)
+{
+    if (c->tok.type != TOKEN_STRING) {
+        fail(c, "expected a string near '%.16s'", c->tok.start);
+    }
+    const char *s = c->tok.string;
+    *len = c->tok.len;
+    lex(c);
+    return s;
+}
+
+/*
+ * Returns the index of the column the current word refers to, optionally
+ * qualified with the w alias that wtstats gives the window view, or -1 if
+ * it's not a column.
+ */
+static int accept_column(Compiler *c)
+{
+    const char *save_pos  = c->pos;
+    int        save_line  = c->line;
+    Token      save_tok   = c->tok;
+
+    if (is_keyword(c, "w")) {
+        lex(c);
+        if (!accept(c, TOKEN_DOT)) {
+            c->pos  = save_pos;
+            c->line = save_line;
+            c->tok  = save_tok;
+            return -1;
+        }
+        for (int i = 0; i < COLUMN_COUNT; ++i) {
+            if (accept_keyword(c, column_names[i])) {
+                return i;
+            }
+        }
+        fail(c, "unsupported column near '%.16s'", c->tok.start);
+    }
+
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        if (accept_keyword(c, column_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Only %literal% goes into the automaton, everything else is matched slowly. */
+static bool is_contains_pattern(const char *pattern, int len)
+{
+    if (len < 3 || pattern[0] != '%' || pattern[len - 1] != '%') {
+        return false;
+    }
+    for (int i = 1; i < len - 1; ++i) {
+        if (pattern[i] == '%' || pattern[i] == '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int parse_expr(Compiler *c);
+
+static int parse_in(Compiler *c, int column)
+{
+    Rules *r = c->rules;
+    Expr  expr = {.type = EXPR_IN, .column = column, .first = r->nitems};
+    expect(c, TOKEN_LPAREN, "'('");
+    do {
+        int len;
+        const char *s = expect_string(c, &len);
+        grow(c, &r->items, r->nitems, &r->citems, sizeof(*r->items));
+        r->items[r->nitems++] = s;
+        ++expr.count;
+    } while (accept(c, TOKEN_COMMA));
+    expect(c, TOKEN_RPAREN, "')'");
+    return rules_add_expr(c, &expr);
+}
+
+static int parse_like(Compiler *c, int column)
+{
+    Expr expr = {.column = column};
+    expr.text = expect_string(c, &expr.len);
+    if (is_contains_pattern(expr.text, expr.len)) {
+        expr.type  = EXPR_CONTAINS;
+        expr.first = rules_add_pattern(c, column, expr.text + 1, expr.len - 2);
+    }
+    else {
+        expr.type = EXPR_LIKE;
+    }
+    return rules_add_expr(c, &expr);
+}
+
+static int negate(Compiler *c, int index)
+{
+    Expr expr = {.type = EXPR_NOT, .lhs = index};
+    return rules_add_expr(c, &expr);
+}
+
+static int parse_predicate(Compiler *c)
+{
+    if (accept(c, TOKEN_LPAREN)) {
+        int index = parse_expr(c);
+        expect(c, TOKEN_RPAREN, "')'");
+        return index;
+    }
+
+    if (accept_keyword(c, "show_uncategorized")) {
+        Expr expr = {.type = EXPR_SHOW};
+        return rules_add_expr(c, &expr);
+    }
+
+    int column = accept_column(c);
+    if (column < 0) {
+        fail(c, "unsupported condition near '%.16s'", c->tok.start);
+    }
+
+    if (accept(c, TOKEN_EQ) || c->tok.type == TOKEN_NE) {
+        bool ne = accept(c, TOKEN_NE);
+        Expr expr = {.type = EXPR_EQ, .column = column};
+        expr.text = expect_string(c, &expr.len);
+        int index = rules_add_expr(c, &expr);
+        return ne ? negate(c, index) : index;
+    }
+    else if (accept_keyword(c, "is")) {
+        bool not = accept_keyword(c, "not");
+        expect_keyword(c, "null");
+        Expr expr  = {.type = EXPR_IS_NULL, .column = column};
+        int  index = rules_add_expr(c, &expr);
+        return not ? negate(c, index) : index;
+    }
+
+    bool not = accept_keyword(c, "not");
+    if (accept_keyword(c, "like")) {
+        int index = parse_like(c, column);
+        return not ? negate(c, index) : index;
+    }
+    else if (accept_keyword(c, "in")) {
+        int index = parse_in(c, column);
+        return not ? negate(c, index) : index;
+    }
+    fail(c, "unsupported comparison near '%.16s'", c->tok.start);
+}
+
+static int parse_not(Compiler *c)
+{
+    if (accept_keyword(c, "not")) {
+        return negate(c, parse_not(c));
+    }
+    return parse_predicate(c);
+}
+
+static int parse_and(Compiler *c)
+{
+    int lhs = parse_not(c);
+    while (accept_keyword(c, "and")) {
+        Expr expr = {.type = EXPR_AND, .lhs = lhs};
+        expr.rhs  = parse_not(c);
+        lhs       = rules_add_expr(c, &expr);
+    }
+    return lhs;
+}
+
+static int parse_expr(Compiler *c)
+{
+    int lhs = parse_and(c);
+    while (accept_keyword(c, "or")) {
+        Expr expr = {.type = EXPR_OR, .lhs = lhs};
+        expr.rhs  = parse_and(c);
+        lhs       = rules_add_expr(c, &expr);
+    }
+    return lhs;
+}
+
+static void parse_result(Compiler *c, Rule *rule)
+{
+    Rules *r = c->rules;
+    rule->first = r->nterms;
+    do {
+        Term term = {.column = accept_column(c)};
+        if (term.column < 0) {
+            if (c->tok.type == TOKEN_STRING) {
+                term.text = expect_string(c, &term.len);
+            }
+            else if (!accept_keyword(c, "null")) {
+                fail(c, "unsupported result near '%.16s'", c->tok.start);
+            }
+        }
+        grow(c, &r->terms, r->nterms, &r->cterms, sizeof(*r->terms));
+        r->terms[r->nterms++] = term;
+        ++rule->count;
+    } while (accept(c, TOKEN_CONCAT));
+}
+
+static void parse_rules(Compiler *c)
+{
+    Rules *r = c->rules;
+    lex(c);
+    for (;;) {
+        Rule rule = {0};
+        if (accept_keyword(c, "when")) {
+            rule.cond = parse_expr(c);
+            expect_keyword(c, "then");
+        }
+        else if (accept_keyword(c, "else")) {
+            rule.cond = -1;
+        }
+        else {
+            break;
+        }
+        parse_result(c, &rule);
+
+        grow(c, &r->rules, r->nrules, &r->crules, sizeof(*r->rules));
+        r->rules[r->nrules++] = rule;
+        if (rule.cond < 0) {
+            break;
+        }
+    }
+
+    if (c->tok.type != TOKEN_EOF) {
+        fail(c, "unsupported syntax near '%.16s'", c->tok.start);
+    }
+    else if (r->nrules == 0) {
+        fail(c, "no rules");
+    }
+}
+
+
+/*
+ * Every byte that appears in a pattern gets its own class, together with
+ * its upper case variant, everything else shares class 0. That keeps the
+ * transition table small and makes the matching case-insensitive for free.
+ */
+static void matcher_build_classes(Matcher *m, char **patterns, int count)
+{
+    memset(m->classes, 0, sizeof(m->classes));
+    m->nclasses = 1;
+    for (int i = 0; i < count; ++i) {
+        for (const unsigned char *p = (const unsigned char *) patterns[i];
+             *p; ++p) {
+            if (m->classes[*p] == 0) {
+                m->classes[*p] = (unsigned char) m->nclasses++;
+                if (*p >= 'a' && *p <= 'z') {
+                    m->classes[*p - 'a' + 'A'] = m->classes[*p];
+                }
+            }
+        }
+    }
+}
+
+static int matcher_add_state(Compiler *c, Matcher *m)
+{
+    if (m->nstates == m->capacity) {
+        int capacity = m->capacity ? m->capacity * 2 : 64;
+        int *next    = sqlite3_realloc64(m->next, (sqlite3_uint64) capacity
+                                                * m->nclasses * sizeof(int));
+        if (next) {
+            m->next = next;
+        }
+        int *pattern = sqlite3_realloc64(m->pattern, (sqlite3_uint64)
+                                         capacity * sizeof(int));
+        if (pattern) {
+            m->pattern = pattern;
+        }
+        int *link = sqlite3_realloc64(m->link, (sqlite3_uint64) capacity
+                                             * sizeof(int));
+        if (link) {
+            m->link = link;
+        }
+        if (!next || !pattern || !link) {
+            fail(c, "out of memory");
+        }
+        m->capacity = capacity;
+    }
+
+    int state = m->nstates++;
+    for (int i = 0; i < m->nclasses; ++i) {
+        m->next[state * m->nclasses + i] = -1;
+    }
+    m->pattern[state] = -1;
+    m->link[state]    = -1;
+    return state;
+}
+
+/*
+ * Builds the trie of all patterns and then turns it into a full DFA in
+ * breadth-first order, so following the failure links is never necessary
+ * while scanning. The link of a state points to the nearest state along
+ * its failure chain that ends a pattern, which is all a scan needs.
+ */
+static void matcher_build(Compiler *c, Matcher *m, char **patterns, int count,
+                          int first_pattern)
+{
+    m->first_pattern = first_pattern;
+    m->npatterns     = count;
+    if (count == 0) {
+        return;
+    }
+
+    matcher_build_classes(m, patterns, count);
+    matcher_add_state(c, m);
+
+    for (int i = 0; i < count; ++i) {
+        int state = 0;
+        for (const unsigned char *p = (const unsigned char *) patterns[i];
+             *p; ++p) {
+            int *next = &m->next[state * m->nclasses + m->classes[*p]];
+            if (*next < 0) {
+                int added = matcher_add_state(c, m);
+                next  = &m->next[state * m->nclasses + m->classes[*p]];
+                *next = added;
+            }
+            state = *next;
+        }
+        m->pattern[state] = first_pattern + i;
+    }
+
+    int *queue = sqlite3_malloc64((sqlite3_uint64) m->nstates * sizeof(int));
+    int *fail_state = sqlite3_malloc64((sqlite3_uint64) m->nstates
+                                       * sizeof(int));
+    if (!queue || !fail_state) {
+        sqlite3_free(queue);
+        sqlite3_free(fail_state);
+        fail(c, "out of memory");
+    }
+
+    int head = 0, tail = 0;
+    for (int i = 0; i < m->nclasses; ++i) {
+        int *next = &m->next[i];
+        if (*next < 0) {
+            *next = 0;
+        }
+        else {
+            fail_state[*next] = 0;
+            queue[tail++]     = *next;
+        }
+    }
+
+    while (head < tail) {
+        int state = queue[head++];
+        int f     = fail_state[state];
+        m->link[state] = m->pattern[f] >= 0 ? f : m->link[f];
+        for (int i = 0; i < m->nclasses; ++i) {
+            int *next = &m->next[state * m->nclasses + i];
+            int fnext = m->next[f * m->nclasses + i];
+            if (*next < 0) {
+                *next = fnext;
+            }
+            else {
+                fail_state[*next] = fnext;
+                queue[tail++]     = *next;
+            }
+        }
+    }
+
+    sqlite3_free(queue);
+    sqlite3_free(fail_state);
+}
+
+static void matcher_scan(const Matcher *m, const char *value, uint64_t *found)
+{
+    int state = 0;
+    for (const unsigned char *p = (const unsigned char *) value; *p; ++p) {
+        state = m->next[state * m->nclasses + m->classes[*p]];
+        for (int s = m->pattern[state] >= 0 ? state : m->link[state];
+             s >= 0; s = m->link[s]) {
+            int bit = m->pattern[s];
+            found[bit / 64] |= UINT64_C(1) << (bit % 64);
+        }
+    }
+}
+
+
+/*
+ * Collects patterns of which at least one must be found for the expression
+ * to be true. Returns false if there's no such set, like for a negation.
+ */
+static bool rules_collect_triggers(Rules *r, int index, int *out, int *count)
+{
+    const Expr *expr = &r->exprs[index];
+    switch (expr->type) {
+        case EXPR_CONTAINS:
+            out[(*count)++] = expr->first;
+            return true;
+        case EXPR_AND: {
+            int saved = *count;
+            if (rules_collect_triggers(r, expr->lhs, out, count)) {
+                return true;
+            }
+            *count = saved;
+            return rules_collect_triggers(r, expr->rhs, out, count);
+        }
+        case EXPR_OR:
+            return rules_collect_triggers(r, expr->lhs, out, count)
+                && rules_collect_triggers(r, expr->rhs, out, count);
+        default:
+            return false;
+    }
+}
+
+static void *rules_alloc(Compiler *c, int count, size_t size)
+{
+    void *p = sqlite3_malloc64((sqlite3_uint64) (count > 0 ? count : 1)
+                               * size);
+    if (!p) {
+        fail(c, "out of memory");
+    }
+    memset(p, 0, (size_t) (count > 0 ? count : 1) * size);
+    return p;
+}
+
+/*
+ * Lists the rules each pattern triggers, so that after scanning a row only
+ * those rules and the ones without any triggers need to be tried. With a
+ * few hundred rules of which only a handful can possibly match, that's the
+ * difference between evaluating a few hundred conditions and a few.
+ */
+static void rules_build_triggers(Compiler *c)
+{
+    Rules *r = c->rules;
+    c->scratch = rules_alloc(c, r->nexprs + r->total_patterns, sizeof(int));
+    int *out  = c->scratch;
+    int *fill = c->scratch + r->nexprs;
+    r->ncandidates   = (r->nrules + 63) / 64;
+    r->untriggered   = rules_alloc(c, r->ncandidates, sizeof(uint64_t));
+    r->candidates    = rules_alloc(c, r->ncandidates, sizeof(uint64_t));
+    r->trigger_start = rules_alloc(c, r->total_patterns + 1, sizeof(int));
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < r->nrules; ++i) {
+            int count = 0;
+            int cond  = r->rules[i].cond;
+            if (cond < 0 || !rules_collect_triggers(r, cond, out, &count)) {
+                r->untriggered[i / 64] |= UINT64_C(1) << (i % 64);
+                continue;
+            }
+            for (int j = 0; j < count; ++j) {
+                if (pass) {
+                    int p = out[j];
+                    r->trigger_rules[r->trigger_start[p] + fill[p]++] = i;
+                }
+                else {
+                    ++r->trigger_start[out[j] + 1];
+                }
+            }
+        }
+
+        if (!pass) {
+            for (int p = 0; p < r->total_patterns; ++p) {
+                r->trigger_start[p + 1] += r->trigger_start[p];
+            }
+            r->trigger_rules = rules_alloc(c, r->trigger_start[
+                                           r->total_patterns], sizeof(int));
+            memset(r->untriggered, 0, (size_t) r->ncandidates
+                                      * sizeof(uint64_t));
+        }
+    }
+}
+
+static Rules *rules_compile(const char *src, char **error)
+{
+    Compiler c = {.src = src, .pos = src, .line = 1};
+    c.rules = sqlite3_malloc(sizeof(*c.rules));
+    if (!c.rules) {
+        *error = sqlite3_mprintf("out of memory");
+        return NULL;
+    }
+    memset(c.rules, 0, sizeof(*c.rules));
+
+    if (setjmp(c.env)) {
+        sqlite3_free(c.scratch);
+        rules_free(c.rules);
+        *error = c.error;
+        return NULL;
+    }
+
+    parse_rules(&c);
+
+    Rules *r = c.rules;
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        matcher_build(&c, &r->matchers[i], r->patterns[i], r->npatterns[i],
+                      r->total_patterns);
+        r->total_patterns += r->npatterns[i];
+    }
+
+    for (int i = 0; i < r->nexprs; ++i) {
+        Expr *expr = &r->exprs[i];
+        if (expr->type == EXPR_CONTAINS) {
+            expr->first += r->matchers[expr->column].first_pattern;
+        }
+    }
+
+    r->nfound = (r->total_patterns + 63) / 64;
+    r->found  = rules_alloc(&c, r->nfound, sizeof(*r->found));
+    rules_build_triggers(&c);
+    sqlite3_free(c.scratch);
+
+    return r;
+}
+
+
+static const unsigned char *utf8_next(const unsigned char *s)
+{
+    ++s;
+    while ((*s & 0xC0) == 0x80) {
+        ++s;
+    }
+    return s;
+}
+
+/* Same as SQLite's default like: no escapes, case-insensitive for ASCII. */
+static bool like_match(const unsigned char *p, const unsigned char *s)
+{
+    while (*p) {
+        if (*p == '%') {
+            while (*p == '%' || *p == '_') {
+                if (*p++ == '_') {
+                    if (!*s) {
+                        return false;
+                    }
+                    s = utf8_next(s);
+                }
+            }
+            if (!*p) {
+                return true;
+            }
+            for (;;) {
+                if (like_match(p, s)) {
+                    return true;
+                }
+                else if (!*s) {
+                    return false;
+                }
+                s = utf8_next(s);
+            }
+        }
+        else if (!*s) {
+            return false;
+        }
+        else if (*p == '_') {
+            s = utf8_next(s);
+            ++p;
+        }
+        else if (ascii_lower(*p) == ascii_lower(*s)) {
+            ++p;
+            ++s;
+        }
+        else {
+            return false;
+        }
+    }
+    return !*s;
+}
+
+static bool rules_contains(Rules *r, const Expr *expr)
+{
+    int bit = expr->first;
+    return r->found[bit / 64] & (UINT64_C(1) << (bit % 64));
+}
+
+static Tri rules_eval(Rules *r, int index)
+{
+    const Expr *expr  = &r->exprs[index];
+    const char *value = r->values[expr->column];
+    switch (expr->type) {
+        case EXPR_AND: {
+            Tri lhs = rules_eval(r, expr->lhs);
+            if (lhs == TRI_FALSE) {
+                return TRI_FALSE;
+            }
+            Tri rhs = rules_eval(r, expr->rhs);
+            return rhs == TRI_FALSE ? TRI_FALSE
+                 : lhs == TRI_NULL || rhs == TRI_NULL ? TRI_NULL : TRI_TRUE;
+        }
+        case EXPR_OR: {
+            Tri lhs = rules_eval(r, expr->lhs);
+            if (lhs == TRI_TRUE) {
+                return TRI_TRUE;
+            }
+            Tri rhs = rules_eval(r, expr->rhs);
+            return rhs == TRI_TRUE ? TRI_TRUE
+                 : lhs == TRI_NULL || rhs == TRI_NULL ? TRI_NULL : TRI_FALSE;
+        }
+        case EXPR_NOT: {
+            Tri lhs = rules_eval(r, expr->lhs);
+            return lhs == TRI_NULL ? TRI_NULL
+                 : lhs == TRI_TRUE ? TRI_FALSE : TRI_TRUE;
+        }
+        case EXPR_SHOW:
+            return r->show ? TRI_TRUE : TRI_FALSE;
+        case EXPR_IS_NULL:
+            return value ? TRI_FALSE : TRI_TRUE;
+        default:
+            break;
+    }
+
+    if (!value) {
+        return TRI_NULL;
+    }
+
+    int len = r->lengths[expr->column];
+    switch (expr->type) {
+        case EXPR_EQ:
+            return len == expr->len
+                && memcmp(value, expr->text, (size_t) len) == 0
+                 ? TRI_TRUE : TRI_FALSE;
+        case EXPR_IN:
+            for (int i = 0; i < expr->count; ++i) {
+                if (strcmp(value, r->items[expr->first + i]) == 0) {
+                    return TRI_TRUE;
+                }
+            }
+            return TRI_FALSE;
+        case EXPR_CONTAINS:
+            return rules_contains(r, expr) ? TRI_TRUE : TRI_FALSE;
+        case EXPR_LIKE:
+            return like_match((const unsigned char *) expr->text,
+                              (const unsigned char *) value)
+                 ? TRI_TRUE : TRI_FALSE;
+        default:
+            return TRI_NULL;
+    }
+}
+
+static void rules_result(Rules *r, const Rule *rule, sqlite3_context *ctx)
+{
+    const Term *terms = &r->terms[rule->first];
+    const char *texts[rule->count];
+    int        lengths[rule->count];
+    size_t     total = 0;
+
+    for (int i = 0; i < rule->count; ++i) {
+        if (terms[i].column < 0) {
+            texts[i]   = terms[i].text;
+            lengths[i] = terms[i].len;
+        }
+        else {
+            texts[i]   = r->values[terms[i].column];
+            lengths[i] = r->lengths[terms[i].column];
+        }
+        if (!texts[i]) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        total += (size_t) lengths[i];
+    }
+
+    if (rule->count == 1) {
+        sqlite3_result_text(ctx, texts[0], lengths[0], SQLITE_TRANSIENT);
+        return;
+    }
+
+    char *buf = sqlite3_malloc64(total + 1);
+    if (!buf) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < rule->count; ++i) {
+        memcpy(buf + pos, texts[i], (size_t) lengths[i]);
+        pos += (size_t) lengths[i];
+    }
+    buf[pos] = '\0';
+    sqlite3_result_text64(ctx, buf, pos, sqlite3_free, SQLITE_UTF8);
+}
+
+static void rules_classify(Rules *r, sqlite3_context *ctx,
+                           sqlite3_value **argv)
+{
+    r->show = sqlite3_value_int(argv[1]);
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        r->values[i]  = (const char *) sqlite3_value_text(argv[2 + i]);
+        r->lengths[i] = sqlite3_value_bytes(argv[2 + i]);
+    }
+
+    memset(r->found, 0, (size_t) r->nfound * sizeof(*r->found));
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        if (r->values[i] && r->matchers[i].npatterns > 0) {
+            matcher_scan(&r->matchers[i], r->values[i], r->found);
+        }
+    }
+
+    memcpy(r->candidates, r->untriggered,
+           (size_t) r->ncandidates * sizeof(*r->candidates));
+    for (int w = 0; w < r->nfound; ++w) {
+        for (uint64_t bits = r->found[w]; bits; bits &= bits - 1) {
+            int p = w * 64 + __builtin_ctzll(bits);
+            for (int j = r->trigger_start[p]; j < r->trigger_start[p + 1];
+                 ++j) {
+                int i = r->trigger_rules[j];
+                r->candidates[i / 64] |= UINT64_C(1) << (i % 64);
+            }
+        }
+    }
+
+    for (int w = 0; w < r->ncandidates; ++w) {
+        for (uint64_t bits = r->candidates[w]; bits; bits &= bits - 1) {
+            const Rule *rule = &r->rules[w * 64 + __builtin_ctzll(bits)];
+            if (rule->cond < 0 || rules_eval(r, rule->cond) == TRI_TRUE) {
+                rules_result(r, rule, ctx);
+                return;
+            }
+        }
+    }
+    sqlite3_result_null(ctx);
+}
+
+
+/*
+ * Compiled rules are kept as auxiliary data on the first argument, so they
+ * are only compiled once per statement as long as the rules are a constant.
+ * SQLite may free the auxiliary data as soon as it's set, so it's only set
+ * after the rules are done being used.
+ */
+static Rules *get_rules(sqlite3_context *ctx, sqlite3_value *arg,
+                        bool *compiled)
+{
+    Rules *r = sqlite3_get_auxdata(ctx, 0);
+    *compiled = false;
+    if (!r) {
+        const char *src = (const char *) sqlite3_value_text(arg);
+        char *error = NULL;
+        r = rules_compile(src ? src : "", &error);
+        if (!r) {
+            char *msg = sqlite3_mprintf("wtclassify: %s",
+                                        error ? error : "out of memory");
+            sqlite3_result_error(ctx, msg ? msg : "wtclassify: error", -1);
+            sqlite3_free(msg);
+            sqlite3_free(error);
+            return NULL;
+        }
+        *compiled = true;
+    }
+    return r;
+}
+
+static void wtclassify_func(sqlite3_context *ctx, int argc,
+                            sqlite3_value **argv)
+{
+    (void) argc;
+    bool  compiled;
+    Rules *r = get_rules(ctx, argv[0], &compiled);
+    if (r) {
+        rules_classify(r, ctx, argv);
+        if (compiled) {
+            sqlite3_set_auxdata(ctx, 0, r, rules_destroy);
+        }
+    }
+}
+
+/* Compiles the rules and returns how many there are, or raises an error. */
+static void wtclassify_check_func(sqlite3_context *ctx, int argc,
+                                  sqlite3_value **argv)
+{
+    (void) argc;
+    bool  compiled;
+    Rules *r = get_rules(ctx, argv[0], &compiled);
+    if (r) {
+        sqlite3_result_int(ctx, r->nrules);
+        if (compiled) {
+            sqlite3_set_auxdata(ctx, 0, r, rules_destroy);
+        }
+    }
+}
+
+
+int wtclassify_register(sqlite3 *db)
+{
+    int flags  = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int result = sqlite3_create_function(db, "wtclassify", 5, flags, NULL,
+                                         wtclassify_func, NULL, NULL);
+    if (result == SQLITE_OK) {
+        result = sqlite3_create_function(db, "wtclassify_check", 1, flags,
+                                         NULL, wtclassify_check_func, NULL,
+                                         NULL);
+    }
+    return result;
+}
+
+#ifndef SQLITE_CORE
+int sqlite3_wtclassify_init(sqlite3 *db, char **error,
+                            const sqlite3_api_routines *api)
+{
+    SQLITE_EXTENSION_INIT2(api);
+    (void) error;
+    return wtclassify_register(db);
+}
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "wtdb.h"
+
+
+void warn(const char *fmt, ...)
+{
+    DO_LOG();
+}
+
+#ifndef NDEBUG
+void debug(const char *fmt, ...)
+{
+    fputs("[DEBUG]\n", stderr);
+    DO_LOG();
+    fputs("\n", stderr);
+}
+#endif
+
+
+noreturn void db_die(Db *db, const char *fmt, ...)
+{
+    DO_LOG();
+    longjmp(*db->env, 1);
+}
+
+char *db_default_name(Db *db)
+{
+    debug("Constructing default db name");
+    const char *home = getenv("HOME");
+    if (!home) {
+        db_die(db, "HOME not set, use -f to specify a database file");
+    }
+
+    const char *suffix    = "/.wtsnap.db";
+    size_t     home_len   = strlen(home);
+    size_t     suffix_len = strlen(suffix);
+
+    size_t size = home_len + suffix_len + 1;
+    char   *buf = malloc(size);
+    if (!buf) {
+        db_die(db, "Can't malloc %zu bytes for database path", size);
+    }
+
+    memcpy(buf, home, home_len);
+    memcpy(buf + home_len, suffix, suffix_len + 1);
+    return buf;
+}
+
+void db_open(Db *db, const char *name, int flags)
+{
+    debug("Opening db '%s'", name);
+    int result = sqlite3_open_v2(name, &db->handle, flags, NULL);
+    if (result != SQLITE_OK) {
+        db_die(db, "Can't open database '%s': %s", name,
+               sqlite3_errmsg(db->handle));
+    }
+}
+
+sqlite3 *db_close(sqlite3 *db)
+{
+    if (db) {
+        debug("Closing database");
+        int result = sqlite3_close(db);
+        if (result != SQLITE_OK) {
+            warn("Can't close database: %s", sqlite3_errmsg(db));
+        }
+    }
+    return NULL;
+}
+
+void db_set_pragma(Db *db, const char *name, const char *value)
+{
+    char sql[128];
+    snprintf(sql, sizeof(sql), "pragma %s = %s", name, value);
+    debug("Executing %s", sql);
+
+    sqlite3_stmt *stmt;
+    int result = sqlite3_prepare_v2(db->handle, sql, -1, &stmt, NULL);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to prepare statement '%s': %s",
+               sql, sqlite3_errmsg(db->handle));
+    }
+
+    /* Some pragmas return the value that actually got set. */
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *actual = (const char *) sqlite3_column_text(stmt, 0);
+        if (actual && strcasecmp(actual, value) != 0) {
+            warn("Wanted %s %s, but got %s", name, value, actual);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (result != SQLITE_DONE) {
+        db_die(db, "Failed to execute statement '%s': %s",
+               sql, sqlite3_errmsg(db->handle));
+    }
+}
+
+void db_exec(Db *db, const char *sql)
+{
+    debug("Executing %s", sql);
+    int result = sqlite3_exec(db->handle, sql, NULL, NULL, NULL);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to execute statement '%s': %s",
+               sql, sqlite3_errmsg(db->handle));
+    }
+}
+
+sqlite3_stmt *db_prepare(Db *db, const char *sql)
+{
+    debug("Preparing %s", sql);
+    sqlite3_stmt *stmt;
+    int result = sqlite3_prepare_v3(db->handle, sql, -1,
+                                    SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to prepare statement '%s': %s",
+               sql, sqlite3_errmsg(db->handle));
+    }
+    return stmt;
+}
+
+void db_bind_int(Db *db, sqlite3_stmt *stmt, int index, int value)
+{
+    debug("Binding int value %d to parameter %d in %s",
+          value, index, sqlite3_sql(stmt));
+    int result = sqlite3_bind_int(stmt, index, value);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to bind int value %d to parameter %d: %s",
+               value, index, sqlite3_errmsg(db->handle));
+    }
+}
+
+void db_bind_int64(Db *db, sqlite3_stmt *stmt, int index, sqlite3_int64 value)
+{
+    debug("Binding int64 value %lld to parameter %d in %s",
+          (long long) value, index, sqlite3_sql(stmt));
+    int result = sqlite3_bind_int64(stmt, index, value);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to bind int64 value %lld to parameter %d: %s",
+               (long long) value, index, sqlite3_errmsg(db->handle));
+    }
+}
+
+void db_bind_string(Db *db, sqlite3_stmt *stmt, int index, const char *value)
+{
+    debug("Binding string value '%s' to parameter %d in %s",
+          value, index, sqlite3_sql(stmt));
+    int result = sqlite3_bind_text(stmt, index, value, -1, SQLITE_TRANSIENT);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to bind string value '%s' to parameter %d: %s",
+               value, index, sqlite3_errmsg(db->handle));
+    }
+}
+
+void db_bind_static_string(Db *db, sqlite3_stmt *stmt, int index,
+                           const char *value)
+{
+    debug("Binding static string value '%s' to parameter %d in %s",
+          value, index, sqlite3_sql(stmt));
+    int result = sqlite3_bind_text(stmt, index, value, -1, SQLITE_STATIC);
+    if (result != SQLITE_OK) {
+        db_die(db, "Failed to bind string value '%s' to parameter %d: %s",
+               value, index, sqlite3_errmsg(db->handle));
+    }
+}
+
+int db_exec_stmt(Db *db, sqlite3_stmt *stmt,
+                 void (*callback)(void *data, sqlite3_stmt *stmt), void *data)
+{
+    debug("Executing prepared statement %s", sqlite3_sql(stmt));
+
+    int rows = 0;
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        ++rows;
+        debug("Got row %d", rows);
+        if (callback) {
+            callback(data, stmt);
+        }
+    }
+
+    if (result != SQLITE_DONE) {
+        db_die(db, "Failed to execute prepared statement: %s",
+               sqlite3_errmsg(db->handle));
+    }
+
+    return rows;
+}
+
+bool db_select_int64s(Db *db, sqlite3_stmt *stmt, sqlite3_int64 *out,
+                      int count)
+{
+    debug("Selecting %d values with %s", count, sqlite3_sql(stmt));
+    bool found = false;
+    int  result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (!found) {
+            for (int i = 0; i < count; ++i) {
+                out[i] = sqlite3_column_int64(stmt, i);
+            }
+            found = true;
+        }
+    }
+
+    if (result != SQLITE_DONE) {
+        db_die(db, "Failed to execute prepared statement: %s",
+               sqlite3_errmsg(db->handle));
+    }
+
+    return found;
+}
+
+void db_reset_stmt(sqlite3_stmt *stmt)
+{
+    debug("Resetting statement %s", sqlite3_sql(stmt));
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+sqlite3_stmt *db_close_stmt(sqlite3_stmt *stmt)
+{
+    if (stmt) {
+        debug("Finalizing statment %s", sqlite3_sql(stmt));
+        sqlite3_finalize(stmt); /* Never fails. */
+    }
+    return NULL;
+}
+
+bool db_rollback(sqlite3 *db, bool tx)
+{
+    if (tx) {
+        debug("Executing rollback");
+        int result = sqlite3_exec(db, "rollback", NULL, NULL, NULL);
+        if (result != SQLITE_OK) {
+            warn("Failed to execute statement 'rollback': %s",
+                 sqlite3_errmsg(db));
+        }
+    }
+    return false;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef WTDB_H
+#define WTDB_H
+
+/*
+ * Database and logging helpers shared by wtsnap and wtstats. Errors are fatal
+ * and jump to the jmp_buf the Db points to, after logging a message.
+ */
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdnoreturn.h>
+#include <sqlite3.h>
+
+
+typedef struct {
+    jmp_buf *env;
+    sqlite3 *handle;
+} Db;
+
+
+#define DO_LOG() do { \
+        va_list ap; \
+        va_start(ap, fmt); \
+        vfprintf(stderr, fmt, ap); \
+        va_end(ap); \
+        fputs("\n", stderr); \
+    } while (0)
+
+void warn(const char *fmt, ...);
+
+#ifdef NDEBUG
+#   define debug(...) do { /* nothing */ } while (0)
+#else
+void debug(const char *fmt, ...);
+#endif
+
+
+noreturn void db_die(Db *db, const char *fmt, ...);
+
+/* Returns $HOME/.wtsnap.db in a buffer that the caller needs to free. */
+char *db_default_name(Db *db);
+
+void db_open(Db *db, const char *name, int flags);
+
+sqlite3 *db_close(sqlite3 *db);
+
+void db_set_pragma(Db *db, const char *name, const char *value);
+
+void db_exec(Db *db, const char *sql);
+
+sqlite3_stmt *db_prepare(Db *db, const char *sql);
+
+void db_bind_int(Db *db, sqlite3_stmt *stmt, int index, int value);
+
+void db_bind_int64(Db *db, sqlite3_stmt *stmt, int index,
+                   sqlite3_int64 value);
+
+void db_bind_string(Db *db, sqlite3_stmt *stmt, int index, const char *value);
+
+/* Doesn't copy the value, so it has to stay around until the parameter is
+ * bound again or the statement is finalized. */
+void db_bind_static_string(Db *db, sqlite3_stmt *stmt, int index,
+                           const char *value);
+
+int db_exec_stmt(Db *db, sqlite3_stmt *stmt,
+                 void (*callback)(void *data, sqlite3_stmt *stmt), void *data);
+
+bool db_select_int64s(Db *db, sqlite3_stmt *stmt, sqlite3_int64 *out,
+                      int count);
+
+void db_reset_stmt(sqlite3_stmt *stmt);
+
+sqlite3_stmt *db_close_stmt(sqlite3_stmt *stmt);
+
+bool db_rollback(sqlite3 *db, bool tx);
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "wtdb.h"
+#include "wtschema.h"
+
+
+#define ARGS_ERROR     (1 << 0)
+#define ARGS_WANT_HELP (1 << 1)
+
+#define GEN_DAY_SECONDS    86400LL
+
+static const char *args_help =
+    "\n"
+    "wtgen - writes months of made up snapshots into a new database, for\n"
+    "measuring how wtstats copes with a lot of history. It's the same\n"
+    "history every time for the same options, so numbers taken on it\n"
+    "can be compared. `make bench-stats` runs wtstats over it.\n"
+    "\n"
+    "Usage: %s [OPTIONS]\n"
+    "\n"
+    "Snapshots are taken during working hours on weekdays and now and\n"
+    "then on weekends, with a lunch break and other idle stretches. The\n"
+    "focus mostly stays with one application, and titles change to\n"
+    "documents that were used recently more often than to old ones, with\n"
+    "new ones turning up all the time.\n"
+    "\n"
+    "Available options:\n"
+    "\n"
+    "    -a APPLICATIONS\n"
+    "        How many applications have a window open, each of which\n"
+    "        is a frame and a client window below the root window.\n"
+    "        At most 10.\n"
+    "        Default is 10.\n"
+    "\n"
+    "    -c RULES\n"
+    "        Instead of writing a database, print a classification\n"
+    "        file with RULES rules for the applications and titles\n"
+    "        that the database would have, for use with wtstats -c.\n"
+    "\n"
+    "    -d DATE\n"
+    "        The day the history starts on, like 2021-01-04.\n"
+    "        Default is 2021-01-04, a Monday.\n"
+    "\n"
+    "    -f DATABASE_FILE\n"
+    "        The database to write. It mustn't have any tables in it\n"
+    "        yet, wtgen only makes new ones.\n"
+    "        Default is wtgen.db\n"
+    "\n"
+    "    -m MONTHS\n"
+    "        How many months of history to write, 30 days each.\n"
+    "        Default is 1.\n"
+    "\n"
+    "    -N\n"
+    "        Use the normalized layout, like wtsnap -N.\n"
+    "        Default is the plain layout.\n"
+    "\n"
+    "    -r SEED\n"
+    "        Seed for the random numbers, to get a different history.\n"
+    "        Default is 1.\n"
+    "\n"
+    "    -s SAMPLE_TIME\n"
+    "        Seconds between snapshots, like wtsnap -s.\n"
+    "        Default is 60.\n"
+    "\n"
+    "    -h\n"
+    "        Shows this help.\n"
+    "\n";
+
+
+/*
+ * Applications and their titles. A title is the format filled in with the
+ * name of a document, weight is how likely the focus goes to them.
+ */
+typedef struct App {
+    const char *name;
+    const char *class;
+    const char *title_format;
+    int        weight;
+} App;
+
+static const App gen_apps[] = {
+    {"code-oss",    "Code - OSS",         "%s.c - worktrackage - Code - OSS", 30},
+    {"Navigator",   "firefox",            "%s - Mozilla Firefox",             25},
+    {"xterm",       "XTerm",              "user@host: ~/src/%s",              15},
+    {"thunderbird", "Thunderbird",        "Re: %s - Mozilla Thunderbird",      8},
+    {"slack",       "Slack",              "%s | Slack",                        8},
+    {"evince",      "Evince",             "%s.pdf",                            5},
+    {"libreoffice", "libreoffice-writer", "%s.odt - LibreOffice Writer",       4},
+    {"spotify",     "Spotify",            "%s - Spotify",                      2},
+    {"gimp",        "Gimp",               "[%s] (imported)-1.0 - GIMP",        2},
+    {"keepassxc",   "KeePassXC",          "Passwords.kdbx - KeePassXC",        1},
+};
+
+#define GEN_APP_COUNT ((int) (sizeof(gen_apps) / sizeof(gen_apps[0])))
+
+static const char *gen_words[] = {
+    "alpha", "budget", "cache", "deploy", "editor", "feature", "graph",
+    "holiday", "invoice", "journal", "kernel", "layout", "meeting", "notes",
+    "onboarding", "parser", "quarterly", "release", "schema", "travel",
+    "update", "vendor", "wiki", "xorg", "yearly", "zones",
+};
+
+#define GEN_WORD_COUNT ((int) (sizeof(gen_words) / sizeof(gen_words[0])))
+
+/* The document a window currently has open, with its string ids. */
+typedef struct AppState {
+    int           docs;
+    int           doc;
+    char          title[256];
+    sqlite3_int64 ids[3];
+} AppState;
+
+typedef struct Context {
+    const char    *db_name;
+    const char    *start_date;
+    int           apps;
+    int           months;
+    int           rules;
+    bool          normalize;
+    unsigned long seed;
+    int           sample_time;
+    jmp_buf       env;
+    Db            db;
+    uint64_t      rng;
+    AppState      state[GEN_APP_COUNT];
+    int           focus;
+    int           idle_left;
+    sqlite3_stmt  *snapshot_stmt;
+    sqlite3_stmt  *window_stmt;
+    StringStmts   string_stmts;
+    long long     snapshots;
+    long long     rows;
+} Context;
+
+
+static noreturn void die(Context *ctx, const char *fmt, ...)
+{
+    DO_LOG();
+    longjmp(ctx->env, 1);
+}
+
+
+/* xorshift64*, which is plenty random for this and the same everywhere. */
+static uint64_t gen_next(Context *ctx)
+{
+    ctx->rng ^= ctx->rng >> 12;
+    ctx->rng ^= ctx->rng << 25;
+    ctx->rng ^= ctx->rng >> 27;
+    return ctx->rng * 2685821657736338717ULL;
+}
+
+static int gen_below(Context *ctx, int n)
+{
+    return (int) (gen_next(ctx) % (uint64_t) n);
+}
+
+static double gen_uniform(Context *ctx)
+{
+    return (double) (gen_next(ctx) >> 11) / 9007199254740992.0;
+}
+
+static bool gen_chance(Context *ctx, double p)
+{
+    return gen_uniform(ctx) < p;
+}
+
+static int gen_pick_app(Context *ctx)
+{
+    int total = 0;
+    for (int i = 0; i < ctx->apps; ++i) {
+        total += gen_apps[i].weight;
+    }
+    int pick = gen_below(ctx, total);
+    for (int i = 0; i < ctx->apps; ++i) {
+        pick -= gen_apps[i].weight;
+        if (pick < 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static void gen_doc_name(int doc, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s-%d", gen_words[doc % GEN_WORD_COUNT],
+             doc / GEN_WORD_COUNT);
+}
+
+
+static sqlite3_int64 gen_intern_string(Context *ctx, const char *value)
+{
+    return schema_intern_string(&ctx->db, &ctx->string_stmts,
+                                schema_hash_string(value), value);
+}
+
+/*
+ * Recently opened documents come up a lot more often than old ones, by
+ * picking how far back to go on a logarithmic scale. Every so often, it's
+ * a document that wasn't there before.
+ */
+static void gen_change_title(Context *ctx, int app)
+{
+    AppState *state = &ctx->state[app];
+    if (state->docs == 0 || gen_chance(ctx, 0.25)) {
+        state->doc = state->docs++;
+    }
+    else {
+        double back = exp(gen_uniform(ctx) * log((double) state->docs + 1.0));
+        int    doc  = state->docs - (int) back;
+        state->doc  = doc < 0 ? 0 : doc;
+    }
+
+    char doc_name[64];
+    gen_doc_name(state->doc, doc_name, sizeof(doc_name));
+    snprintf(state->title, sizeof(state->title), gen_apps[app].title_format,
+             doc_name);
+
+    if (ctx->normalize) {
+        state->ids[0] = gen_intern_string(ctx, gen_apps[app].name);
+        state->ids[1] = gen_intern_string(ctx, gen_apps[app].class);
+        state->ids[2] = gen_intern_string(ctx, state->title);
+    }
+}
+
+
+static void gen_check_empty(Context *ctx)
+{
+    sqlite3_stmt  *stmt  = db_prepare(&ctx->db,
+        "select count(*) from sqlite_master");
+    sqlite3_int64 count = 0;
+    db_select_int64s(&ctx->db, stmt, &count, 1);
+    db_close_stmt(stmt);
+    if (count != 0) {
+        die(ctx, "Database '%s' already has tables in it", ctx->db_name);
+    }
+}
+
+/* Goes through the same migrations as wtsnap, so it's the schema it has. */
+static void gen_init(Context *ctx)
+{
+    int layout = ctx->normalize ? DB_LAYOUT_NORMALIZED : DB_LAYOUT_PLAIN;
+    gen_check_empty(ctx);
+    db_exec(&ctx->db, "begin");
+    schema_create(&ctx->db, layout);
+    schema_migrate(&ctx->db, layout, 0);
+    db_exec(&ctx->db, "commit");
+}
+
+static void gen_prepare_statements(Context *ctx)
+{
+    ctx->snapshot_stmt = db_prepare(&ctx->db,
+        "insert into snapshot (timestamp, epoch_ms, sample_time, idle_time)\n"
+        "values (strftime('%Y-%m-%dT%H:%M:%S:%fZ', ?1 / 1000.0, 'unixepoch'),\n"
+        "        ?1, ?2, ?3)");
+    if (ctx->normalize) {
+        ctx->window_stmt = db_prepare(&ctx->db,
+            "insert into window_data (snapshot_id, window_id,\n"
+            "                         parent_id, depth, focused,\n"
+            "                         name_id, class_id, title_id)\n"
+            "values(?, ?, ?, ?, ?, ?, ?, ?)");
+        schema_prepare_strings(&ctx->db, &ctx->string_stmts);
+    }
+    else {
+        ctx->window_stmt = db_prepare(&ctx->db,
+            "insert into window (snapshot_id, window_id,\n"
+            "                    parent_id, depth, focused,\n"
+            "                    name, class, title)\n"
+            "values(?, ?, ?, ?, ?, ?, ?, ?)");
+    }
+}
+
+
+static void gen_insert_window(Context *ctx, int snapshot_id,
+                              sqlite3_int64 window, sqlite3_int64 parent,
+                              int depth, int focused, int app)
+{
+    sqlite3_stmt *stmt = ctx->window_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int(&ctx->db, stmt, 1, snapshot_id);
+    db_bind_int64(&ctx->db, stmt, 2, window);
+    if (parent != 0) {
+        db_bind_int64(&ctx->db, stmt, 3, parent);
+    }
+    db_bind_int(&ctx->db, stmt, 4, depth);
+    db_bind_int(&ctx->db, stmt, 5, focused);
+
+    if (app >= 0) {
+        const AppState *state = &ctx->state[app];
+        if (ctx->normalize) {
+            for (int i = 0; i < 3; ++i) {
+                db_bind_int64(&ctx->db, stmt, 6 + i, state->ids[i]);
+            }
+        }
+        else {
+            db_bind_static_string(&ctx->db, stmt, 6, gen_apps[app].name);
+            db_bind_static_string(&ctx->db, stmt, 7, gen_apps[app].class);
+            db_bind_static_string(&ctx->db, stmt, 8, state->title);
+        }
+    }
+
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+    ++ctx->rows;
+}
+
+/*
+ * Like under a reparenting window manager: the root, then a frame without
+ * any properties for every application, with the client window inside it.
+ * The focus is on the client of one of them.
+ */
+static void gen_insert_snapshot(Context *ctx, long long epoch_ms,
+                                int idle_time)
+{
+    sqlite3_stmt *stmt = ctx->snapshot_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(&ctx->db, stmt, 1, epoch_ms);
+    db_bind_int(&ctx->db, stmt, 2, ctx->sample_time);
+    db_bind_int(&ctx->db, stmt, 3, idle_time);
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+    int snapshot_id = (int) sqlite3_last_insert_rowid(ctx->db.handle);
+    ++ctx->snapshots;
+
+    sqlite3_int64 root = 0x1e3;
+    gen_insert_window(ctx, snapshot_id, root, 0, 1, 3, -1);
+    for (int app = 0; app < ctx->apps; ++app) {
+        sqlite3_int64 frame   = 0x600000 + app * 0x1c;
+        sqlite3_int64 client  = 0x1000007 + app * 0x200000;
+        int           focused = app == ctx->focus ? 3 : 0;
+        gen_insert_window(ctx, snapshot_id, frame, root, 2, focused, -1);
+        gen_insert_window(ctx, snapshot_id, client, frame, 3, focused, app);
+    }
+}
+
+/*
+ * Idle times are a few seconds while someone's at it. Idle stretches, like
+ * meetings or coffee, keep adding up until they're over.
+ */
+static int gen_idle_time(Context *ctx, int *idle_run)
+{
+    if (ctx->idle_left <= 0 && gen_chance(ctx, 0.01)) {
+        ctx->idle_left = 3 + gen_below(ctx, 40);
+    }
+
+    if (ctx->idle_left > 0) {
+        --ctx->idle_left;
+        ++*idle_run;
+        long long idle = (long long) *idle_run * ctx->sample_time * 1000;
+        return idle < 0x7fffffff ? (int) idle : 0x7fffffff;
+    }
+
+    *idle_run = 0;
+    double u = gen_uniform(ctx);
+    return (int) (u * u * 20000.0);
+}
+
+static void gen_step_focus(Context *ctx)
+{
+    if (gen_chance(ctx, 0.15)) {
+        int app = gen_pick_app(ctx);
+        if (app != ctx->focus) {
+            ctx->focus = app;
+            if (gen_chance(ctx, 0.5)) {
+                gen_change_title(ctx, app);
+            }
+            return;
+        }
+    }
+    if (gen_chance(ctx, 0.2)) {
+        gen_change_title(ctx, ctx->focus);
+    }
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date. */
+static long long gen_days_from_civil(int year, int month, int day)
+{
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long yoe = year - era * 400;
+    long long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * Weekdays go from some time around 8 to some time around 17:30 with lunch
+ * at noon, a third of weekend days get a couple of hours in the afternoon.
+ */
+static void gen_day(Context *ctx, long long day)
+{
+    int  weekday = (int) ((day + 4) % 7);
+    bool weekend = weekday == 0 || weekday == 6;
+    int  start, end;
+    if (weekend) {
+        if (!gen_chance(ctx, 0.3)) {
+            return;
+        }
+        start = 14 * 3600 + gen_below(ctx, 3600);
+        end   = start + 3600 + gen_below(ctx, 2 * 3600);
+    }
+    else {
+        start = 8 * 3600 + gen_below(ctx, 3600);
+        end   = 17 * 3600 + gen_below(ctx, 5400);
+    }
+    int lunch_start = 12 * 3600 + gen_below(ctx, 1800);
+    int lunch_end   = lunch_start + 2700;
+
+    db_exec(&ctx->db, "begin");
+    int idle_run = 0;
+    for (int t = start; t < end; t += ctx->sample_time) {
+        int idle_time;
+        if (!weekend && t >= lunch_start && t < lunch_end) {
+            ++idle_run;
+            idle_time = idle_run * ctx->sample_time * 1000;
+        }
+        else {
+            idle_time = gen_idle_time(ctx, &idle_run);
+            if (idle_run == 0) {
+                gen_step_focus(ctx);
+            }
+        }
+        long long epoch_ms = (day * GEN_DAY_SECONDS + t) * 1000
+                           + gen_below(ctx, 1000);
+        gen_insert_snapshot(ctx, epoch_ms, idle_time);
+    }
+    db_exec(&ctx->db, "commit");
+}
+
+static long long gen_parse_date(Context *ctx, const char *date)
+{
+    int  year, month, day;
+    char rest;
+    if (sscanf(date, "%4d-%2d-%2d%c", &year, &month, &day, &rest) != 3
+            || month < 1 || month > 12 || day < 1 || day > 31) {
+        die(ctx, "Invalid date '%s', should look like 2021-01-04", date);
+    }
+    return gen_days_from_civil(year, month, day);
+}
+
+static void gen_history(Context *ctx)
+{
+    long long first = gen_parse_date(ctx, ctx->start_date);
+    long long days  = (long long) ctx->months * 30;
+
+    db_open(&ctx->db, ctx->db_name, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    db_set_pragma(&ctx->db, "journal_mode", "wal");
+    db_set_pragma(&ctx->db, "synchronous", "off");
+    gen_init(ctx);
+    gen_prepare_statements(ctx);
+
+    for (int app = 0; app < ctx->apps; ++app) {
+        gen_change_title(ctx, app);
+    }
+    for (long long day = first; day < first + days; ++day) {
+        gen_day(ctx, day);
+    }
+
+    int new_docs = 0;
+    for (int app = 0; app < ctx->apps; ++app) {
+        new_docs += ctx->state[app].docs;
+    }
+    warn("Wrote %lld snapshots with %lld windows and %d documents into '%s'",
+         ctx->snapshots, ctx->rows, new_docs, ctx->db_name);
+}
+
+
+/*
+ * Rules go round the applications and documents they put in their titles,
+ * so there's a good mix of ones that match early, late and never. Only
+ * conditions the builtin classifier of wtstats understands are used.
+ */
+static void gen_rules(Context *ctx)
+{
+    printf("-- %d rules generated by wtgen -a %d -c %d\n",
+           ctx->rules, ctx->apps, ctx->rules);
+    for (int i = 0; i < ctx->rules; ++i) {
+        int  app = i % ctx->apps;
+        char doc_name[64];
+        gen_doc_name(i, doc_name, sizeof(doc_name));
+        switch (i % 4) {
+            case 0:
+                printf("when name = '%s' and title like '%%%s%%'\n"
+                       "then 'Project %s'\n\n", gen_apps[app].name, doc_name,
+                       doc_name);
+                break;
+            case 1:
+                printf("when class = '%s' and title like '%%%s %%'\n"
+                       "then 'Reading %s'\n\n", gen_apps[app].class,
+                       doc_name, doc_name);
+                break;
+            case 2:
+                printf("when name in ('%s', 'nonexistent') "
+                       "and title like '%s%%'\n"
+                       "then '%s: ' || title\n\n", gen_apps[app].name,
+                       doc_name, gen_apps[app].class);
+                break;
+            default:
+                printf("when title like '%%%s%%' and not name = '%s'\n"
+                       "then 'Mentions %s'\n\n", doc_name,
+                       gen_apps[app].name, doc_name);
+                break;
+        }
+    }
+    printf("when show_uncategorized\n"
+           "and name is not null\n"
+           "and title is not null\n"
+           "then '*** ' || title\n\n"
+           "else null\n");
+}
+
+
+static void cleanup(Context *ctx)
+{
+    debug("Cleaning up");
+    ctx->snapshot_stmt = db_close_stmt(ctx->snapshot_stmt);
+    ctx->window_stmt   = db_close_stmt(ctx->window_stmt);
+    schema_close_strings(&ctx->string_stmts);
+    db_rollback(ctx->db.handle, ctx->db.handle
+                                && !sqlite3_get_autocommit(ctx->db.handle));
+    ctx->db.handle = db_close(ctx->db.handle);
+}
+
+static bool run_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        ctx->rng = ctx->seed * 0x9e3779b97f4a7c15ULL + 1;
+        if (ctx->rules > 0) {
+            gen_rules(ctx);
+        }
+        else {
+            gen_history(ctx);
+        }
+        return true;
+    }
+    else {
+        debug("Caught longjmp");
+        return false;
+    }
+}
+
+
+static int args_positive(const char *prog, int opt, const char *arg, int min,
+                         int max, int *out)
+{
+    *out = atoi(arg);
+    debug("-%c set to %d from '%s'", opt, *out, arg);
+    if (*out >= min && *out <= max) {
+        return 0;
+    }
+    else {
+        warn("%s: invalid argument to -%c -- '%s'", prog, opt, arg);
+        return ARGS_ERROR;
+    }
+}
+
+static int args_parse(Context *ctx, int argc, char **argv)
+{
+    int opt;
+    int ret = 0;
+
+    while ((opt = getopt(argc, argv, "a:c:d:f:hm:Nr:s:")) != -1) {
+        switch (opt) {
+            case 'a':
+                ret |= args_positive(argv[0], opt, optarg, 1, GEN_APP_COUNT,
+                                     &ctx->apps);
+                break;
+            case 'c':
+                ret |= args_positive(argv[0], opt, optarg, 1, 1000000,
+                                     &ctx->rules);
+                break;
+            case 'd':
+                ctx->start_date = optarg;
+                debug("start_date set to '%s'", ctx->start_date);
+                break;
+            case 'f':
+                ctx->db_name = optarg;
+                debug("db_name set to '%s'", ctx->db_name);
+                break;
+            case 'h':
+                ret |= ARGS_WANT_HELP;
+                break;
+            case 'm':
+                ret |= args_positive(argv[0], opt, optarg, 1, 1200,
+                                     &ctx->months);
+                break;
+            case 'N':
+                ctx->normalize = true;
+                debug("normalize set to true");
+                break;
+            case 'r':
+                ctx->seed = strtoul(optarg, NULL, 10);
+                debug("seed set to %lu", ctx->seed);
+                break;
+            case 's':
+                ret |= args_positive(argv[0], opt, optarg, 1, 86400,
+                                     &ctx->sample_time);
+                break;
+            default:
+                ret |= ARGS_ERROR;
+                break;
+        }
+    }
+
+    if (optind < argc) {
+        warn("%s: unexpected argument -- '%s'", argv[0], argv[optind]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ret & ARGS_WANT_HELP) {
+        fprintf(stdout, args_help, argv[0]);
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    Context ctx     = {0};
+    ctx.db.env      = &ctx.env;
+    ctx.db_name     = "wtgen.db";
+    ctx.start_date  = "2021-01-04";
+    ctx.apps        = GEN_APP_COUNT;
+    ctx.months      = 1;
+    ctx.seed        = 1;
+    ctx.sample_time = 60;
+
+    int arg_ret = args_parse(&ctx, argc, argv);
+    if (arg_ret & ARGS_ERROR) {
+        return 2;
+    }
+    else if (arg_ret & ARGS_WANT_HELP) {
+        return 0;
+    }
+
+    bool ok = run_with_jmp_buf(&ctx);
+    cleanup(&ctx);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
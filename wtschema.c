@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "wtschema.h"
+
+
+static void schema_read_layout(void *data, sqlite3_stmt *stmt)
+{
+    int        *layout = data;
+    const char *type   = (const char *) sqlite3_column_text(stmt, 0);
+    *layout = type && strcmp(type, "view") == 0 ? DB_LAYOUT_NORMALIZED
+                                                : DB_LAYOUT_PLAIN;
+}
+
+int schema_detect_layout(Db *db)
+{
+    sqlite3_stmt *stmt   = db_prepare(db,
+        "select type from sqlite_master where name = 'window'");
+    int          layout = DB_LAYOUT_NONE;
+    db_exec_stmt(db, stmt, schema_read_layout, &layout);
+    db_close_stmt(stmt);
+    debug("Database layout is %d", layout);
+    return layout;
+}
+
+int schema_get_version(Db *db)
+{
+    sqlite3_stmt  *stmt   = db_prepare(db, "pragma user_version");
+    sqlite3_int64 version = 0;
+    db_select_int64s(db, stmt, &version, 1);
+    db_close_stmt(stmt);
+    return (int) version;
+}
+
+
+static void schema_create_plain(Db *db)
+{
+    db_exec(db, "create table if not exists window (\n"
+                "    snapshot_id integer not null,\n"
+                "    window_id   text    not null,\n"
+                "    parent_id   text,\n"
+                "    depth       integer not null,\n"
+                "    focused     integer not null,\n"
+                "    name        text,\n"
+                "    class       text,\n"
+                "    title       text,\n"
+                "    primary key (snapshot_id, window_id),\n"
+                "    foreign key (snapshot_id)\n"
+                "        references snapshot (snapshot_id)\n"
+                "        on delete cascade,\n"
+                "    foreign key (snapshot_id, parent_id)\n"
+                "        references window (snapshot_id, window_id)\n"
+                "        on delete set null)");
+}
+
+static void schema_create_normalized(Db *db)
+{
+    db_exec(db, "create table if not exists string (\n"
+                "    string_id integer primary key not null,\n"
+                "    hash      integer             not null,\n"
+                "    value     text                not null)");
+    db_exec(db, "create index if not exists string_hash on string (hash)");
+    db_exec(db,
+            "create table if not exists window_data (\n"
+            "    snapshot_id integer not null,\n"
+            "    window_id   text    not null,\n"
+            "    parent_id   text,\n"
+            "    depth       integer not null,\n"
+            "    focused     integer not null,\n"
+            "    name_id     integer references string (string_id),\n"
+            "    class_id    integer references string (string_id),\n"
+            "    title_id    integer references string (string_id),\n"
+            "    primary key (snapshot_id, window_id),\n"
+            "    foreign key (snapshot_id)\n"
+            "        references snapshot (snapshot_id)\n"
+            "        on delete cascade,\n"
+            "    foreign key (snapshot_id, parent_id)\n"
+            "        references window_data (snapshot_id, window_id)\n"
+            "        on delete set null)");
+    db_exec(db, "create view if not exists window as\n"
+                "select w.snapshot_id, w.window_id, w.parent_id,\n"
+                "       w.depth, w.focused, n.value as name,\n"
+                "       c.value as class, t.value as title\n"
+                "from window_data w\n"
+                "left join string n on n.string_id = w.name_id\n"
+                "left join string c on c.string_id = w.class_id\n"
+                "left join string t on t.string_id = w.title_id");
+}
+
+static void schema_create_window_view(Db *db)
+{
+    /*
+     * A delta snapshot consists of the rows of its base keyframe that it
+     * doesn't have a row for itself, plus its own rows that aren't
+     * tombstones for windows that went away since the keyframe. This is a
+     * plain join rather than a compound query, so that SQLite can look up
+     * the rows of each snapshot by index instead of building all of them.
+     */
+    db_exec(db, "create view window as\n"
+                "select s.snapshot_id, w.window_id, w.parent_id,\n"
+                "       w.depth, w.focused, n.value as name,\n"
+                "       c.value as class, t.value as title, w.screen\n"
+                "from snapshot s\n"
+                "join window_data w\n"
+                "    on w.snapshot_id in (s.snapshot_id, s.base_id)\n"
+                "left join string n on n.string_id = w.name_id\n"
+                "left join string c on c.string_id = w.class_id\n"
+                "left join string t on t.string_id = w.title_id\n"
+                "where w.removed = 0\n"
+                "and (w.snapshot_id = s.snapshot_id or not exists (\n"
+                "    select 1 from window_data d\n"
+                "    where d.snapshot_id = s.snapshot_id\n"
+                "    and   d.window_id   = w.window_id))");
+}
+
+static void schema_migrate_to_1(Db *db, int layout)
+{
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        db_exec(db,
+                "alter table snapshot add column\n"
+                "    base_id integer references snapshot (snapshot_id)");
+        db_exec(db, "create index snapshot_base on snapshot (base_id)");
+        db_exec(db, "alter table window_data add column\n"
+                    "    removed integer not null default 0");
+    }
+}
+
+/*
+ * Window ids used to be stored as decimal text, which makes for bigger
+ * indices and slower joins. SQLite can't change the type of a column, so
+ * the window table gets rebuilt with integer ids instead.
+ */
+static void schema_migrate_to_2(Db *db, int layout)
+{
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        db_exec(db,
+                "create table window_data_new (\n"
+                "    snapshot_id integer not null,\n"
+                "    window_id   integer not null,\n"
+                "    parent_id   integer,\n"
+                "    depth       integer not null,\n"
+                "    focused     integer not null,\n"
+                "    name_id     integer references string (string_id),\n"
+                "    class_id    integer references string (string_id),\n"
+                "    title_id    integer references string (string_id),\n"
+                "    removed     integer not null default 0,\n"
+                "    primary key (snapshot_id, window_id),\n"
+                "    foreign key (snapshot_id)\n"
+                "        references snapshot (snapshot_id)\n"
+                "        on delete cascade,\n"
+                "    foreign key (snapshot_id, parent_id)\n"
+                "        references window_data (snapshot_id, window_id)\n"
+                "        on delete set null)");
+        db_exec(db, "insert into window_data_new\n"
+                    "select snapshot_id, cast(window_id as integer),\n"
+                    "       cast(parent_id as integer), depth, focused,\n"
+                    "       name_id, class_id, title_id, removed\n"
+                    "from window_data");
+        db_exec(db, "drop table window_data");
+        db_exec(db, "alter table window_data_new rename to window_data");
+    }
+    else {
+        db_exec(db, "create table window_new (\n"
+                    "    snapshot_id integer not null,\n"
+                    "    window_id   integer not null,\n"
+                    "    parent_id   integer,\n"
+                    "    depth       integer not null,\n"
+                    "    focused     integer not null,\n"
+                    "    name        text,\n"
+                    "    class       text,\n"
+                    "    title       text,\n"
+                    "    primary key (snapshot_id, window_id),\n"
+                    "    foreign key (snapshot_id)\n"
+                    "        references snapshot (snapshot_id)\n"
+                    "        on delete cascade,\n"
+                    "    foreign key (snapshot_id, parent_id)\n"
+                    "        references window (snapshot_id, window_id)\n"
+                    "        on delete set null)");
+        db_exec(db, "insert into window_new\n"
+                    "select snapshot_id, cast(window_id as integer),\n"
+                    "       cast(parent_id as integer), depth, focused,\n"
+                    "       name, class, title\n"
+                    "from window");
+        db_exec(db, "drop table window");
+        db_exec(db, "alter table window_new rename to window");
+    }
+}
+
+/*
+ * The text timestamps can only be filtered by string comparison. This adds
+ * milliseconds since the Unix epoch, filled in from the text for existing
+ * snapshots, which look like 2021-03-26T21:30:41:41.793Z.
+ */
+static void schema_migrate_to_3(Db *db)
+{
+    db_exec(db, "alter table snapshot add column epoch_ms integer");
+    db_exec(db,
+            "update snapshot set epoch_ms =\n"
+            "    cast(strftime('%s', substr(timestamp, 1, 19)) as integer)\n"
+            "    * 1000 + cast(substr(timestamp, 24, 3) as integer)");
+    db_exec(db, "create index snapshot_epoch on snapshot (epoch_ms)");
+}
+
+/*
+ * Reports only ever look at the few focused windows of each snapshot. A
+ * partial index over just those gets filled in as they're inserted and lets
+ * queries on focused <> 0 skip all the other windows.
+ */
+static void schema_migrate_to_4(Db *db, int layout)
+{
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        db_exec(db,
+                "create index window_focused on window_data (snapshot_id)\n"
+                "where focused <> 0");
+    }
+    else {
+        db_exec(db,
+                "create index window_focused on window (snapshot_id)\n"
+                "where focused <> 0");
+    }
+}
+
+/*
+ * Several displays and screens can go into one database, so snapshots say
+ * which display they're from and windows which screen they're on.
+ */
+static void schema_migrate_to_5(Db *db, int layout)
+{
+    db_exec(db, "alter table snapshot add column display text");
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        db_exec(db, "alter table window_data add column\n"
+                    "    screen integer not null default 0");
+    }
+    else {
+        db_exec(db, "alter table window add column\n"
+                    "    screen integer not null default 0");
+    }
+}
+
+
+void schema_create(Db *db, int layout)
+{
+    db_exec(db, "create table if not exists snapshot (\n"
+                "    snapshot_id integer primary key not null,\n"
+                "    timestamp   text                not null,\n"
+                "    sample_time integer             not null,\n"
+                "    idle_time   integer)");
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        schema_create_normalized(db);
+    }
+    else {
+        schema_create_plain(db);
+    }
+}
+
+void schema_migrate(Db *db, int layout, int version)
+{
+    /* The view is put back once window_data has all of its columns. */
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        db_exec(db, "drop view if exists window");
+    }
+    if (version < 1) {
+        schema_migrate_to_1(db, layout);
+    }
+    if (version < 2) {
+        schema_migrate_to_2(db, layout);
+    }
+    if (version < 3) {
+        schema_migrate_to_3(db);
+    }
+    if (version < 4) {
+        schema_migrate_to_4(db, layout);
+    }
+    if (version < 5) {
+        schema_migrate_to_5(db, layout);
+    }
+    if (layout == DB_LAYOUT_NORMALIZED) {
+        schema_create_window_view(db);
+    }
+
+    char sql[64];
+    snprintf(sql, sizeof(sql), "pragma user_version = %d", SCHEMA_VERSION);
+    db_exec(db, sql);
+}
+
+
+unsigned long long schema_hash_string(const char *value)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) value; *p; ++p) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void schema_prepare_strings(Db *db, StringStmts *stmts)
+{
+    stmts->select_stmt = db_prepare(db,
+        "select string_id from string where hash = ? and value = ?");
+    stmts->insert_stmt = db_prepare(db,
+        "insert into string (hash, value) values (?, ?)");
+}
+
+void schema_close_strings(StringStmts *stmts)
+{
+    stmts->select_stmt = db_close_stmt(stmts->select_stmt);
+    stmts->insert_stmt = db_close_stmt(stmts->insert_stmt);
+}
+
+sqlite3_int64 schema_intern_string(Db *db, StringStmts *stmts,
+                                   unsigned long long hash, const char *value)
+{
+    sqlite3_stmt *stmt = stmts->select_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(db, stmt, 1, (sqlite3_int64) hash);
+    db_bind_string(db, stmt, 2, value);
+
+    sqlite3_int64 id = 0;
+    if (db_select_int64s(db, stmt, &id, 1)) {
+        return id;
+    }
+
+    stmt = stmts->insert_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(db, stmt, 1, (sqlite3_int64) hash);
+    db_bind_string(db, stmt, 2, value);
+    db_exec_stmt(db, stmt, NULL, NULL);
+    return sqlite3_last_insert_rowid(db->handle);
+}
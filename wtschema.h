@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef WTSCHEMA_H
+#define WTSCHEMA_H
+
+/*
+ * The schema of snapshot databases, shared by wtsnap and wtgen so that the
+ * databases wtgen makes up are the same as the ones wtsnap writes. Errors go
+ * through db_die like everything else in wtdb.h.
+ */
+#include <sqlite3.h>
+#include "wtdb.h"
+
+
+/* Bump this and add a step to schema_migrate when changing the schema. */
+#define SCHEMA_VERSION 5
+
+enum {
+    DB_LAYOUT_NONE,
+    DB_LAYOUT_PLAIN,
+    DB_LAYOUT_NORMALIZED,
+};
+
+
+typedef struct {
+    sqlite3_stmt *select_stmt;
+    sqlite3_stmt *insert_stmt;
+} StringStmts;
+
+
+/* The plain layout has a window table, the normalized one a view. */
+int schema_detect_layout(Db *db);
+
+int schema_get_version(Db *db);
+
+/* Creates whatever tables of the layout are missing, at schema version 0. */
+void schema_create(Db *db, int layout);
+
+/* Takes the schema from version up to SCHEMA_VERSION. Doesn't begin or
+ * commit a transaction, the caller needs to hold one. */
+void schema_migrate(Db *db, int layout, int version);
+
+/* 64 bit FNV-1a, which is what the hash column of the string table holds. */
+unsigned long long schema_hash_string(const char *value);
+
+void schema_prepare_strings(Db *db, StringStmts *stmts);
+
+void schema_close_strings(StringStmts *stmts);
+
+/* Looks up the string with the given hash and value, inserting it if it's
+ * not there yet, and returns its id. */
+sqlite3_int64 schema_intern_string(Db *db, StringStmts *stmts,
+                                   unsigned long long hash, const char *value);
+
+#endif
@@ -20,26 +20,70 @@
  * SOFTWARE.
  */
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
 #include <limits.h>
-#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <sqlite3.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/scrnsaver.h>
+#ifdef WTSNAP_XCB
+#   include <xcb/xcb.h>
+#   include <X11/Xlib-xcb.h>
+#endif
+#include "wtdb.h"
+#include "wtschema.h"
 
 
 #define ARGS_ERROR     (1 << 0)
 #define ARGS_WANT_HELP (1 << 1)
 
+/* Long options don't have a short equivalent, so they get values past it. */
+#define ARGS_COMPACT          256
+#define ARGS_RETAIN           257
+#define ARGS_DOWNSAMPLE       258
+#define ARGS_DOWNSAMPLE_AFTER 259
+
+#define CAPTURE_MAX_DISPLAYS 16
+
+#define DAEMON_MAX_BACKOFF 16
+
+#define QUEUE_MIN_KB 16
+#define QUEUE_MAX_KB 1048576
+
+/*
+ * Compaction keeps each of its transactions at around COMPACT_TARGET_NS and
+ * waits COMPACT_PAUSE_NS after each one. SQLite's busy handler sleeps up to
+ * 100 ms between tries, so a daemon waiting for the lock always gets a go
+ * at it in between. Snapshots idle for COMPACT_IDLE_TIME, wtstats' default
+ * for -i, aren't downsampled together with the others unless -I says so.
+ */
+#define COMPACT_TARGET_NS    50000000LL
+#define COMPACT_PAUSE_NS     200000000LL
+#define COMPACT_BUSY_MS      60000
+#define COMPACT_START_UNITS  16
+#define COMPACT_MAX_UNITS    (1LL << 24)
+#define COMPACT_VACUUM_PAGES 256
+#define COMPACT_IDLE_TIME    60000
+#define COMPACT_DAY_MS       86400000LL
+
+/* In two parts, since C only guarantees string literals of 4095 bytes. */
 static const char *args_help =
     "\n"
     "wtsnap - takes a snapshot of the name, class, title and focus\n"
@@ -47,7 +91,7 @@ static const char *args_help =
     "the time since the last user interaction and writes it to an\n"
     "SQLite database for the sake of tracking what you worked on.\n"
     "\n"
-    "Usage: %s [OPTIONS]\n"
+    "Usage: %s [OPTIONS] [--compact]\n"
     "\n"
     "Available options:\n"
     "\n"
@@ -59,625 +103,4764 @@ static const char *args_help =
     "        don't carry any useful information.\n"
     "        Default is to include them.\n"
     "\n"
+    "    -C\n"
+    "        On window managers that support EWMH, only capture the\n"
+    "        clients they list in _NET_CLIENT_LIST, as children of\n"
+    "        the root window, with _NET_ACTIVE_WINDOW as the focused\n"
+    "        one. That's two property requests instead of walking\n"
+    "        the whole tree, and the focus doesn't end up on some\n"
+    "        focus proxy window. Falls back to walking the tree if\n"
+    "        the window manager doesn't set these properties.\n"
+    "        Can't be combined with -E.\n"
+    "        Default is to walk the whole tree.\n"
+    "\n"
+    "    -F\n"
+    "        Only capture the top-level windows, which are the\n"
+    "        children of the root window, and the windows on the way\n"
+    "        from the root down to the focused one. That's all that\n"
+    "        wtstats looks at, so its reports come out the same, but\n"
+    "        snapshots get a lot cheaper with many windows open.\n"
+    "        Default is to capture every window.\n"
+    "\n"
+    "    -L MAX_DEPTH\n"
+    "        Don't capture windows deeper than MAX_DEPTH into the tree,\n"
+    "        the root window being 1. If the focused window is further\n"
+    "        down, the windows above it still record the depth it's at\n"
+    "        in their focused column.\n"
+    "        Default is 0, no limit.\n"
+    "\n"
+    "    -M\n"
+    "        Skip windows that aren't mapped, along with everything\n"
+    "        below them. Those are mostly helper windows of toolkits\n"
+    "        that can't be seen anyway.\n"
+    "        Default is to capture them too.\n"
+    "\n"
+    "    -O\n"
+    "        Skip override-redirect windows, like menus and tooltips,\n"
+    "        along with everything below them.\n"
+    "        Default is to capture them too.\n"
+    "\n";
+
+static const char *args_help_more =
+    "    -D\n"
+    "        Run as a daemon, taking a snapshot every SAMPLE_TIME\n"
+    "        seconds until terminated. The database, display and\n"
+    "        prepared statements are kept open between snapshots.\n"
+    "        Default is to take a single snapshot and exit.\n"
+    "\n"
+    "    -E\n"
+    "        Keep the window tree in memory and update it from X\n"
+    "        events, only fetching the properties of windows that\n"
+    "        changed instead of walking the whole tree every time.\n"
+    "        Only works in daemon mode (-D).\n"
+    "        Default is to walk the whole tree for every snapshot.\n"
+    "\n"
+    "    -R\n"
+    "        Remember the properties of every window between\n"
+    "        snapshots and only fetch them again once a PropertyNotify\n"
+    "        event says they changed. The tree is still walked and\n"
+    "        every snapshot still gets all of its rows, but most of\n"
+    "        the requests go away. Hit rates are logged on exit.\n"
+    "        Only works in daemon mode (-D), and not together with\n"
+    "        -E, which already keeps everything up to date.\n"
+    "        Default is to fetch all properties for every snapshot.\n"
+    "\n"
+    "    -A MIN_SECONDS\n"
+    "        Adapt how often the daemon takes snapshots. Every\n"
+    "        MIN_SECONDS, it only looks at the active window, its\n"
+    "        title and the idle time, and takes a snapshot right\n"
+    "        away if the window or title changed or you came back\n"
+    "        from being idle. Otherwise, it waits for SAMPLE_TIME,\n"
+    "        which doubles up to 16 times over while you're idle.\n"
+    "        Each snapshot then accounts for the time until the one\n"
+    "        after it. Only works in daemon mode (-D) and with a\n"
+    "        single display, MIN_SECONDS can't be above SAMPLE_TIME.\n"
+    "        Default is 0, a snapshot every SAMPLE_TIME seconds.\n"
+    "\n"
     "    -d DISPLAY\n"
-    "        Name of the X display to open.\n"
+    "        Name of the X display to open. All of its screens are\n"
+    "        captured, with the screen number in the window rows.\n"
+    "        Give it up to 16 times to capture several displays at\n"
+    "        once, each on a thread of its own, into a snapshot per\n"
+    "        display with its name in it. Can't be combined with -K\n"
+    "        or -m then.\n"
     "        Default is '', the default display.\n"
     "\n"
     "    -f DATABASE_FILE\n"
     "        Path to the SQLite database file to write to.\n"
     "        Default is ~/.wtsnap.db\n"
     "\n"
+    "    -P PERIOD\n"
+    "        Write into a separate database file for every day,\n"
+    "        month or year, named after DATABASE_FILE with the local\n"
+    "        date put in front of the extension, like\n"
+    "        ~/.wtsnap-2021-03.db for month. The daemon switches to a\n"
+    "        new file when the period changes. wtstats finds these\n"
+    "        files on its own, so getting rid of old snapshots is\n"
+    "        just deleting their files. One of none, day, month or\n"
+    "        year.\n"
+    "        Default is none, writing everything into one file.\n"
+    "\n"
+    "    -N\n"
+    "        Create new databases with the normalized layout, which\n"
+    "        stores every distinct name, class and title string only\n"
+    "        once and has the windows refer to them. A view called\n"
+    "        window keeps the same columns as the plain layout, so\n"
+    "        wtstats and your own queries work the same. Existing\n"
+    "        databases keep their layout.\n"
+    "        Default is the plain layout.\n"
+    "\n";
+
+static const char *args_help_rest =
+    "    -g COUNT\n"
+    "    -G SECONDS\n"
+    "        Only commit after COUNT snapshots (-g) or after the\n"
+    "        first snapshot in a transaction is SECONDS old (-G),\n"
+    "        whichever comes first, to save on disk flushes. Pending\n"
+    "        snapshots are committed when the daemon is stopped, but\n"
+    "        are lost if it crashes. Only makes sense in daemon mode\n"
+    "        (-D) and best combined with -j wal.\n"
+    "        Default is to commit every snapshot.\n"
+    "\n"
+    "    -Q KILOBYTES\n"
+    "        Hand snapshots to a writer thread with a database\n"
+    "        connection of its own, through a queue of KILOBYTES\n"
+    "        rounded up to a power of two, so a slow disk or a reader\n"
+    "        holding a lock never holds up capturing. If the queue\n"
+    "        is full, capturing waits until the next snapshot is due,\n"
+    "        then drops the snapshot and adds its sample time to the\n"
+    "        next one that fits. -v only reports the capture then.\n"
+    "        With -g or -G, snapshots stay queued until they're\n"
+    "        committed, and a full queue gets committed early.\n"
+    "        Only works in daemon mode (-D), and not with -m.\n"
+    "        Default is 0, writing every snapshot right away.\n"
+    "\n"
+    "    -j JOURNAL_MODE\n"
+    "        Sets the SQLite journal mode of the database, one of\n"
+    "        delete, truncate, persist, memory, wal or off. With wal,\n"
+    "        readers like wtstats never block wtsnap from writing.\n"
+    "        The mode sticks with the database file.\n"
+    "        Default is to leave it alone.\n"
+    "\n"
+    "    -K KEYFRAME_INTERVAL\n"
+    "        Only store the windows that changed compared to the last\n"
+    "        full snapshot, writing a full keyframe snapshot every\n"
+    "        KEYFRAME_INTERVAL snapshots. The window view puts the\n"
+    "        full snapshots back together. Needs the normalized\n"
+    "        layout (-N).\n"
+    "        Default is 0, storing every snapshot in full.\n"
+    "\n"
+    "    -I IDLE_TIME_IN_MILLISECONDS\n"
+    "        While the last user interaction has been at least this\n"
+    "        long ago, don't capture any windows, only the snapshot\n"
+    "        with its times. wtstats doesn't count those anyway,\n"
+    "        unless its -i is above this. The daemon merges idle\n"
+    "        snapshots in a row into one whose sample time keeps\n"
+    "        growing, except with -A or several displays.\n"
+    "        Default is 0, capturing windows no matter the idle time.\n"
+    "\n"
     "    -s SAMPLE_TIME\n"
     "        The time your snapshot encompasses in seconds.\n"
     "        Set this to the interval that you're taking snapshots.\n"
     "        Default is 60.\n"
     "\n"
+    "    -y SYNCHRONOUS\n"
+    "        Sets the SQLite synchronous level, one of off, normal,\n"
+    "        full or extra. With -j wal, normal only flushes to disk\n"
+    "        at checkpoints, but can lose the latest snapshots on a\n"
+    "        power failure.\n"
+    "        Default is SQLite's default, which is full.\n"
+    "\n"
+    "    -v\n"
+    "        Print a line for every snapshot with how long it took,\n"
+    "        how much of that was spent in the database, how many\n"
+    "        round trips to the X server it made and how many rows\n"
+    "        it wrote. wtbench reads these.\n"
+    "        Default is to only print warnings.\n"
+    "\n"
+    "    -m\n"
+    "        Record how long each phase of every snapshot took in\n"
+    "        the snapshot_meta table, along with how many windows\n"
+    "        it looked at and how many of them it excluded. Rows are\n"
+    "        written after their snapshot is committed, so that the\n"
+    "        commit can be timed too, which takes one more commit\n"
+    "        when not running as a daemon.\n"
+    "        Default is to not record anything about snapshots.\n"
+    "\n"
     "    -h\n"
     "        Shows this help.\n"
     "\n";
 
+static const char *args_help_compact =
+    "    --compact\n"
+    "        Instead of taking a snapshot, clean up the -f database\n"
+    "        according to --retain and --downsample, then give the\n"
+    "        free space back to the file system. Works in short\n"
+    "        transactions with pauses in between, so a daemon writing\n"
+    "        to the same database never misses a snapshot. Stops\n"
+    "        early on SIGINT, SIGTERM or SIGHUP. Doesn't work with -D\n"
+    "        or -P, give a partition to -f to compact that one.\n"
+    "        Default is to take a snapshot.\n"
+    "\n"
+    "    --retain DAYS\n"
+    "        Delete snapshots older than DAYS, along with their\n"
+    "        windows. Keyframes of -K stay as long as they have\n"
+    "        deltas that are newer.\n"
+    "        Default is 0, keeping everything.\n"
+    "\n"
+    "    --downsample SECONDS\n"
+    "    --downsample-after DAYS\n"
+    "        Only keep the first snapshot in every SECONDS of each\n"
+    "        display for snapshots older than DAYS, adding the\n"
+    "        sample times of the others to it. Idle snapshots, as\n"
+    "        per -I or a minute if not given, are kept apart from the\n"
+    "        others, and keyframes of -K are always kept.\n"
+    "        wtstats rebuilds its classification_rollup afterwards.\n"
+    "        Default is not to downsample, and 7 days for DAYS.\n"
+    "\n";
+
+
+/*
+ * All atoms wtsnap ever needs, interned with a single XInternAtoms request
+ * when the display is opened. Add new ones here, not via XInternAtom calls.
+ */
+enum {
+    ATOM_WM_NAME,
+    ATOM_WM_CLASS,
+    ATOM_NET_WM_NAME,
+    ATOM_NET_WM_PID,
+    ATOM_NET_ACTIVE_WINDOW,
+    ATOM_NET_CLIENT_LIST,
+    ATOM_UTF8_STRING,
+    ATOM_COUNT,
+};
+
+static char *atom_names[ATOM_COUNT] = {
+    [ATOM_WM_NAME]           = "WM_NAME",
+    [ATOM_WM_CLASS]          = "WM_CLASS",
+    [ATOM_NET_WM_NAME]       = "_NET_WM_NAME",
+    [ATOM_NET_WM_PID]        = "_NET_WM_PID",
+    [ATOM_NET_ACTIVE_WINDOW] = "_NET_ACTIVE_WINDOW",
+    [ATOM_NET_CLIENT_LIST]   = "_NET_CLIENT_LIST",
+    [ATOM_UTF8_STRING]       = "UTF8_STRING",
+};
+
+
+typedef struct WindowProps {
+    char *name;
+    char *class;
+    char *title;
+} WindowProps;
+
+/*
+ * Property values only need to live until their window is inserted, so
+ * they're carved out of chunks that are rewound for every snapshot instead
+ * of being freed. Once there are enough chunks for a snapshot, capturing one
+ * doesn't allocate anything. With -E, the values live in the window tree for
+ * as long as their window does, so they're malloc'ed instead.
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t            capacity;
+    size_t            used;
+    char              data[];
+} ArenaChunk;
+
+typedef struct Arena {
+    ArenaChunk *first;
+    ArenaChunk *last;
+    ArenaChunk *current;
+} Arena;
+
+#define ARENA_CHUNK_SIZE 65536
+
+typedef struct XNode {
+    Window       window;
+    struct XNode *parent;
+    struct XNode *first_child;
+    struct XNode *last_child;
+    struct XNode *prev_sibling;
+    struct XNode *next_sibling;
+    struct XNode *hash_next;
+    WindowProps  props;
+    bool         class_dirty;
+    bool         title_dirty;
+    bool         mapped;
+    bool         override_redirect;
+} XNode;
+
+typedef struct XTree {
+    XNode  **buckets;
+    size_t nbuckets;
+    size_t count;
+    XNode  *root;
+} XTree;
+
+/*
+ * With -R, the daemon remembers the properties of every window it captured
+ * and listens for PropertyNotify events on it, so that walking the tree only
+ * needs to fetch the properties that changed since. This is a cache in front
+ * of the X server, not the database, so every snapshot still gets all of its
+ * rows. DestroyNotify drops windows, since their ids get reused. Each entry
+ * also keeps a hash of the row it last went into, to count the rows that
+ * came out the same as in the snapshot before.
+ */
+typedef struct PropEntry {
+    Window             window;
+    struct PropEntry   *hash_next;
+    WindowProps        props;
+    bool               class_dirty;
+    bool               title_dirty;
+    unsigned long long row_hash;
+} PropEntry;
+
+typedef struct PropCache {
+    PropEntry          **buckets;
+    size_t             nbuckets;
+    size_t             count;
+    int                hits;
+    int                misses;
+    int                unchanged;
+    unsigned long long total_hits;
+    unsigned long long total_misses;
+    unsigned long long total_unchanged;
+} PropCache;
+
+#ifdef WTSNAP_XCB
+typedef struct XcbNode {
+    xcb_window_t                       window;
+    size_t                             parent;
+    int                                depth;
+    int                                child_focused;
+    bool                               checking;
+    bool                               skip;
+    bool                               have_tree;
+    bool                               leaf;
+    bool                               fetch_class;
+    bool                               fetch_title;
+    PropEntry                          *cache_entry;
+    WindowProps                        props;
+    xcb_get_window_attributes_cookie_t attributes_cookie;
+    xcb_query_tree_cookie_t            tree_cookie;
+    xcb_get_property_cookie_t          class_cookie;
+    xcb_get_property_cookie_t          net_wm_cookie;
+    xcb_get_property_cookie_t          wm_cookie;
+} XcbNode;
+#endif
+
+typedef struct StringEntry {
+    unsigned long long hash;
+    sqlite3_int64      id;
+    char               *value;
+} StringEntry;
+
+/*
+ * In-process lookup of strings already in the string table, so that strings
+ * seen before don't need to go through the database at all. Cleared when it
+ * gets too big and when a transaction is rolled back, since any ids it got
+ * from inserts in that transaction are gone then.
+ */
+typedef struct StringCache {
+    StringEntry *entries;
+    size_t      capacity;
+    size_t      count;
+} StringCache;
+
+#define STRING_CACHE_MAX 65536
+
+/*
+ * The rows of the keyframe that delta snapshots are diffed against. Slots
+ * with a window of None are empty, since that's never a real window id.
+ */
+typedef struct DeltaRow {
+    Window        window;
+    Window        parent;
+    int           depth;
+    int           focused;
+    sqlite3_int64 ids[3];
+    int           seen;
+} DeltaRow;
+
+typedef struct DeltaBase {
+    DeltaRow *rows;
+    size_t   capacity;
+    size_t   count;
+    int      base_id;
+} DeltaBase;
+
+enum {
+    PARTITION_NONE,
+    PARTITION_DAY,
+    PARTITION_MONTH,
+    PARTITION_YEAR,
+};
+
+/*
+ * How long the phases of a snapshot took, for the snapshot_meta table. The
+ * database and display are only opened once in daemon mode, so their times
+ * go to the first snapshot after they were (re)opened and are 0 otherwise.
+ */
+typedef struct SnapMeta {
+    int       snapshot_id;
+    long long open_ns;
+    long long display_ns;
+    long long idle_ns;
+    long long windows_ns;
+    long long db_ns;
+    long long commit_ns;
+    int       windows;
+    int       excluded;
+    int       round_trips;
+    int       rows;
+} SnapMeta;
+
+/*
+ * With several displays, each of them is captured on a thread of its own by
+ * a Context of its own, which collects its windows in rows like these
+ * instead of inserting them. Their strings live in the arena, cache or tree
+ * of that context, which stay untouched until its next capture, so the
+ * writer can insert them once all captures are done.
+ */
+typedef struct CaptureRow {
+    Window      window;
+    Window      parent;
+    int         depth;
+    int         focused;
+    int         screen;
+    WindowProps props;
+} CaptureRow;
+
+/*
+ * What downsampling does with each snapshot of a chunk: the ones that are
+ * kept get sample_time added to theirs, the others are deleted.
+ */
+typedef struct CompactRow {
+    int  snapshot_id;
+    int  sample_time;
+    bool keep;
+} CompactRow;
+
+/*
+ * With -Q, the daemon doesn't write its snapshots, but copies them into this
+ * ring buffer for a writer thread with a database connection of its own, so
+ * a slow disk or a reader holding the lock never holds up capturing. There's
+ * one thread pushing and one popping, which only share the counts of bytes
+ * pushed and popped, so neither ever waits for a lock. The semaphores just
+ * wake them up when there's something new to write or room to push.
+ *
+ * Every record starts with its size and the number of snapshots in it, one
+ * per display. Each snapshot has its epoch_ms, sample and idle time, display
+ * tag and number of windows, then the window id, parent id, depth, focused
+ * and screen of each window, followed by its name, class and title, each as
+ * a length including the terminating zero, 0 for none, and the bytes. The
+ * writer binds the strings right where they are. Records are padded to
+ * QUEUE_ALIGN and never wrap around the end of the buffer, a record size of
+ * QUEUE_WRAP says the next one starts at the beginning.
+ *
+ * With -g or -G, records that were written but not committed yet stay in
+ * the queue, between tail and the writer's read position, so that they can
+ * be written again if the transaction gets rolled back. If that leaves no
+ * room for capturing, starved asks the writer to commit early.
+ */
+typedef struct Queue {
+    unsigned char *data;
+    size_t        capacity;
+    atomic_size_t head;
+    atomic_size_t tail;
+    size_t        read;
+    atomic_bool   stop;
+    atomic_bool   starved;
+    sem_t         ready;
+    sem_t         room;
+    int           sems;
+    pthread_t     thread;
+    bool          joinable;
+} Queue;
+
+#define QUEUE_ALIGN 8
+#define QUEUE_WRAP  UINT32_MAX
 
 typedef struct Context {
     const char   *db_name;
     bool         free_db_name;
+    const char   *db_file;
+    int          partition;
+    char         *partition_name;
+    bool         partition_open;
     const char   *dpy_name;
+    const char   *dpy_names[CAPTURE_MAX_DISPLAYS];
+    int          dpy_count;
     int          sample_time;
+    int          adaptive_time;
+    int          idle_threshold;
     bool         exclude_blanks;
+    bool         use_clients;
+    bool         focus_only;
+    int          max_depth;
+    bool         only_mapped;
+    bool         skip_override;
+    bool         daemon;
+    bool         track_events;
+    bool         cache_props;
+    bool         verbose;
+    bool         record_meta;
+    bool         normalize;
+    int          keyframe_interval;
+    const char   *journal_mode;
+    const char   *synchronous;
+    int          group_count;
+    int          group_seconds;
+    size_t       queue_size;
+    bool         compact;
+    int          retain_days;
+    int          downsample_seconds;
+    int          downsample_after_days;
     jmp_buf      env;
-    sqlite3      *db;
+    Db           db;
     Display      *dpy;
     Window       root;
+    int          screen;
+    const char   *display_tag;
+    Atom         atoms[ATOM_COUNT];
     int          idle_time;
     bool         tx;
-    sqlite3_stmt *stmt;
+    bool         savepoint;
+    int          tx_snapshots;
+    long long    tx_start_ns;
+    sqlite3_stmt *snapshot_stmt;
+    sqlite3_stmt *window_stmt;
+    StringStmts  string_stmts;
+    sqlite3_stmt *last_snapshot_stmt;
+    sqlite3_stmt *delta_count_stmt;
+    sqlite3_stmt *delta_load_stmt;
+    sqlite3_stmt *tombstone_stmt;
+    sqlite3_stmt *meta_stmt;
+    sqlite3_stmt *sample_fix_stmt;
+    sqlite3_stmt *idle_extend_stmt;
+    sqlite3_stmt *compact_next_stmt;
+    sqlite3_stmt *compact_retain_stmt;
+    sqlite3_stmt *compact_deltas_stmt;
+    sqlite3_stmt *compact_select_stmt;
+    sqlite3_stmt *compact_merge_stmt;
+    sqlite3_stmt *compact_mark_stmt;
+    sqlite3_stmt *compact_window_stmt;
+    sqlite3_stmt *compact_meta_stmt;
+    sqlite3_stmt *compact_delete_stmt;
+    int          layout;
+    StringCache  strings;
+    DeltaBase    delta;
+    int          snapshot_base_id;
+    int          idle_id;
+    bool         snapshot_extended;
+    Arena        arena;
+    int          allocations;
+    int          round_trips;
+    int          rows;
+    long long    db_ns;
+    int          windows;
+    int          excluded;
+    SnapMeta     meta;
+    bool         meta_pending;
     Window       focus;
+    Window       *focus_path;
+    size_t       focus_path_size;
+    size_t       focus_path_capacity;
     XClassHint   *ch;
     int          snapshot_id;
+    int          snapshot_sample_time;
+    long long    snapshot_epoch_ms;
+    long long    deadline_ns;
+    bool         snapshot_dropped;
+    int          previous_id;
+    int          previous_planned;
+    int          previous_sample_time;
+    Window       probe_window;
+    unsigned long long probe_title;
+    XTree        tree;
+    PropCache    cache;
+    bool           buffer_rows;
+    struct Context *writer;
+    Queue          *queue;
+    int            queue_dropped_time;
+    int            queue_previous_id;
+    int            queue_previous_planned;
+    struct Context *captures;
+    int            capture_count;
+    CaptureRow     *capture_rows;
+    size_t         capture_rows_size;
+    size_t         capture_rows_capacity;
+    pthread_t      capture_thread;
+    bool           capture_joinable;
+    bool           capture_ok;
+    CompactRow     *compact_rows;
+    size_t         compact_rows_size;
+    size_t         compact_rows_capacity;
+    long long      compact_end_ms;
+    int            compact_deleted;
+    int            compact_merged;
+    long long      compact_pages;
+#ifdef WTSNAP_XCB
+    xcb_connection_t *xcb;
+    XcbNode          *xcb_nodes;
+    size_t           xcb_nodes_size;
+    size_t           xcb_nodes_capacity;
+#endif
 } Context;
 
 
-#define DO_LOG() do { \
-        va_list ap; \
-        va_start(ap, fmt); \
-        vfprintf(stderr, fmt, ap); \
-        va_end(ap); \
-        fputs("\n", stderr); \
-    } while (0)
-
 static noreturn void die(Context *ctx, const char *fmt, ...)
 {
     DO_LOG();
     longjmp(ctx->env, 1);
 }
 
-static void warn(const char *fmt, ...)
+
+static long long monotonic_ns(void)
 {
-    DO_LOG();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-#ifdef NDEBUG
-#   define debug(...) do { /* nothing */ } while (0)
-#else
-static void debug(const char *fmt, ...)
+static long long realtime_ms(void)
 {
-    fputs("[DEBUG]\n", stderr);
-    DO_LOG();
-    fputs("\n", stderr);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
-#endif
 
 
 static void db_check_name(Context *ctx)
 {
     if (!ctx->db_name) {
-        debug("Constructing default db name", ctx->db_name);
-        const char *home = getenv("HOME");
-        if (!home) {
-            die(ctx, "HOME not set, use -f to specify a database file");
-        }
-
-        const char *suffix    = "/.wtsnap.db";
-        size_t     home_len   = strlen(home);
-        size_t     suffix_len = strlen(suffix);
-
-        size_t size = home_len + suffix_len + 1;
-        char   *buf = malloc(size);
-        if (!buf) {
-            die(ctx, "Can't malloc %zu bytes for database path", size);
-        }
-
-        memcpy(buf, home, home_len);
-        memcpy(buf + home_len, suffix, suffix_len + 1);
-        ctx->db_name      = buf;
+        ctx->db_name      = db_default_name(&ctx->db);
         ctx->free_db_name = true;
     }
+    ctx->db_file = ctx->db_name;
     debug("Using db '%s'", ctx->db_name);
 }
 
-static void db_open(Context *ctx)
+/*
+ * Partitions put the local date of epoch_ms in front of the extension of the
+ * file name, so ~/.wtsnap.db becomes ~/.wtsnap-2021-03.db. A leading dot
+ * doesn't count as an extension. wtstats has to agree on this to find them.
+ */
+static char *db_partition_name(Context *ctx, long long epoch_ms)
 {
-    debug("Opening db '%s'", ctx->db_name);
-    int flags  = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
-    int result = sqlite3_open_v2(ctx->db_name, &ctx->db, flags, NULL);
-    if (result != SQLITE_OK) {
-        die(ctx, "Can't open database '%s': %s", ctx->db_name,
-            sqlite3_errmsg(ctx->db));
-    }
-}
+    static const char *formats[] = {
+        [PARTITION_DAY]   = "-%Y-%m-%d",
+        [PARTITION_MONTH] = "-%Y-%m",
+        [PARTITION_YEAR]  = "-%Y",
+    };
 
-static sqlite3 *db_close(sqlite3 *db)
-{
-    if (db) {
-        debug("Closing database");
-        int result = sqlite3_close(db);
-        if (result != SQLITE_OK) {
-            warn("Can't close database: %s", sqlite3_errmsg(db));
-        }
+    time_t    then = (time_t) (epoch_ms / 1000);
+    struct tm tm;
+    char      date[32];
+    if (!localtime_r(&then, &tm)
+            || !strftime(date, sizeof(date), formats[ctx->partition], &tm)) {
+        die(ctx, "Can't format partition date");
     }
-    return NULL;
-}
 
-static void db_exec(Context *ctx, const char *sql)
-{
-    debug("Executing %s", sql);
-    int result = sqlite3_exec(ctx->db, sql, NULL, NULL, NULL);
-    if (result != SQLITE_OK) {
-        die(ctx, "Failed to execute statement '%s': %s",
-            sql, sqlite3_errmsg(ctx->db));
+    const char *base  = strrchr(ctx->db_name, '/');
+    const char *start = base ? base + 1 : ctx->db_name;
+    const char *ext   = strrchr(start, '.');
+    size_t     stem   = ext && ext != start ? (size_t) (ext - ctx->db_name)
+                                            : strlen(ctx->db_name);
+
+    size_t len  = strlen(ctx->db_name) + strlen(date) + 1;
+    char   *name = malloc(len);
+    if (!name) {
+        die(ctx, "Can't malloc %zu bytes for partition name", len);
     }
+    snprintf(name, len, "%.*s%s%s", (int) stem, ctx->db_name, date,
+             ctx->db_name + stem);
+    return name;
 }
 
-static void db_prepare(Context *ctx, const char *sql)
+static void db_open_rw(Context *ctx)
 {
-    debug("Preparing %s", sql);
-    int result = sqlite3_prepare_v2(ctx->db, sql, -1, &ctx->stmt, NULL);
-    if (result != SQLITE_OK) {
-        die(ctx, "Failed to prepare statement '%s': %s",
-            sql, sqlite3_errmsg(ctx->db));
-    }
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    db_open(&ctx->db, ctx->db_file, flags);
 }
 
-static void db_bind_int(Context *ctx, int index, int value)
+
+static bool db_is_empty(Context *ctx)
 {
-    debug("Binding int value %d to parameter %d in %s",
-          value, index, sqlite3_sql(ctx->stmt));
-    int result = sqlite3_bind_int(ctx->stmt, index, value);
-    if (result != SQLITE_OK) {
-        die(ctx, "Failed to bind int value %d to parameter %d: %s",
-            value, index, sqlite3_errmsg(ctx->db));
-    }
+    sqlite3_stmt  *stmt   = db_prepare(&ctx->db,
+        "select exists (select 1 from sqlite_master)");
+    sqlite3_int64 exists = 0;
+    db_select_int64s(&ctx->db, stmt, &exists, 1);
+    db_close_stmt(stmt);
+    return exists == 0;
 }
 
-static void db_bind_string(Context *ctx, int index, const char *value)
+static void db_configure(Context *ctx)
 {
-    debug("Binding string value '%s' to parameter %d in %s",
-          value, index, sqlite3_sql(ctx->stmt));
-    int result = sqlite3_bind_text(ctx->stmt, index, value,
-                                   -1, SQLITE_TRANSIENT);
-    if (result != SQLITE_OK) {
-        die(ctx, "Failed to bind string value '%s' to parameter %d: %s",
-            value, index, sqlite3_errmsg(ctx->db));
+    /* Give readers holding a lock a chance to finish instead of failing. */
+    sqlite3_busy_timeout(ctx->db.handle, 5000);
+    /* Only possible before anything is written, lets --compact shrink it. */
+    if (db_is_empty(ctx)) {
+        db_set_pragma(&ctx->db, "auto_vacuum", "incremental");
+    }
+    if (ctx->journal_mode) {
+        db_set_pragma(&ctx->db, "journal_mode", ctx->journal_mode);
+    }
+    if (ctx->synchronous) {
+        db_set_pragma(&ctx->db, "synchronous", ctx->synchronous);
     }
 }
 
-static void db_bind_unsigned_long_long_as_text(Context *ctx, int index,
-                                               unsigned long long value)
+static void db_bind_window(Context *ctx, sqlite3_stmt *stmt, int index,
+                           Window window)
 {
-    char text[64]; /* ensure this fits just in case */
-    assert(sizeof(text) > (size_t) floor(log10(ULLONG_MAX)) + 1);
-    snprintf(text, sizeof(text), "%llu", (unsigned long long) value);
-    db_bind_string(ctx, index, text);
+    /* X window ids are 29 bits, this can't overflow. */
+    db_bind_int64(&ctx->db, stmt, index, (sqlite3_int64) window);
 }
 
-static int db_exec_stmt(Context *ctx, void (*callback)(Context *ctx))
+/*
+ * Taking the write lock right away has SQLite's busy handler wait for
+ * --compact or another writer. A deferred transaction that reads first
+ * fails either way without waiting once someone else gets to write.
+ */
+static void db_begin(Context *ctx)
 {
-    debug("Executing prepared statement %s", sqlite3_sql(ctx->stmt));
+    db_exec(&ctx->db, "begin immediate");
+    ctx->tx = true;
+}
 
-    int rows = 0;
-    int result;
-    while ((result = sqlite3_step(ctx->stmt)) == SQLITE_ROW) {
-        ++rows;
-        debug("Got row %d", rows);
-        if (callback) {
-            callback(ctx);
-        }
-    }
 
-    if (result != SQLITE_DONE) {
-        die(ctx, "Failed to execute prepared statement: %s",
-            sqlite3_errmsg(ctx->db));
+static void db_commit(Context *ctx)
+{
+    if (!ctx->tx) {
+        die(ctx, "Nothing to commit");
     }
-
-    return rows;
+    db_exec(&ctx->db, "commit");
+    ctx->tx = false;
 }
 
-static void db_reset_stmt(Context *ctx)
+/*
+ * Snapshots are grouped into one transaction until -g or -G says it's time
+ * to commit. Within a group, each snapshot gets a savepoint, so a failing one
+ * can be undone without throwing away the others.
+ */
+static bool db_grouping(Context *ctx)
 {
-    debug("Resetting statement %s", sqlite3_sql(ctx->stmt));
-    sqlite3_reset(ctx->stmt);
-    sqlite3_clear_bindings(ctx->stmt);
+    return ctx->group_count > 1 || ctx->group_seconds > 0;
 }
 
-static sqlite3_stmt *db_close_stmt(sqlite3_stmt *stmt)
+static void db_begin_snapshot(Context *ctx)
 {
-    if (stmt) {
-        debug("Finalizing statment %s", sqlite3_sql(stmt));
-        sqlite3_finalize(stmt); /* Never fails. */
+    if (!ctx->tx) {
+        db_begin(ctx);
+        ctx->tx_snapshots = 0;
+        ctx->tx_start_ns  = monotonic_ns();
+    }
+    if (db_grouping(ctx)) {
+        db_exec(&ctx->db, "savepoint snapshot");
+        ctx->savepoint = true;
     }
-    return NULL;
 }
 
-static void db_init(Context *ctx)
+static void db_end_snapshot(Context *ctx)
 {
-    db_exec(ctx, "create table if not exists snapshot (\n"
-                 "    snapshot_id integer primary key not null,\n"
-                 "    timestamp   text                not null,\n"
-                 "    sample_time integer             not null,\n"
-                 "    idle_time   integer)");
-    db_exec(ctx, "create table if not exists window (\n"
-                 "    snapshot_id integer not null,\n"
-                 "    window_id   text    not null,\n"
-                 "    parent_id   text,\n"
-                 "    depth       integer not null,\n"
-                 "    focused     integer not null,\n"
-                 "    name        text,\n"
-                 "    class       text,\n"
-                 "    title       text,\n"
-                 "    primary key (snapshot_id, window_id),\n"
-                 "    foreign key (snapshot_id)\n"
-                 "        references snapshot (snapshot_id)\n"
-                 "        on delete cascade,\n"
-                 "    foreign key (snapshot_id, parent_id)\n"
-                 "        references window (snapshot_id, window_id)\n"
-                 "        on delete set null)");
-}
+    if (ctx->savepoint) {
+        db_exec(&ctx->db, "release snapshot");
+        ctx->savepoint = false;
+    }
+    ++ctx->tx_snapshots;
 
-static void db_begin(Context *ctx)
-{
-    db_exec(ctx, "begin");
-    ctx->tx = true;
+    long long age_ns  = monotonic_ns() - ctx->tx_start_ns;
+    bool      due     = (ctx->group_count > 0
+                         && ctx->tx_snapshots >= ctx->group_count)
+                     || (ctx->group_seconds > 0
+                         && age_ns >= ctx->group_seconds * 1000000000LL);
+    if (due || !db_grouping(ctx)) {
+        debug("Committing %d snapshots", ctx->tx_snapshots);
+        db_commit(ctx);
+    }
 }
 
-static bool db_rollback(sqlite3 *db, bool tx)
+/* Returns whether the transaction is still usable afterwards. */
+static bool db_abort_snapshot(Context *ctx)
 {
-    if (tx) {
-        debug("Executing rollback");
-        int result = sqlite3_exec(db, "rollback", NULL, NULL, NULL);
-        if (result != SQLITE_OK) {
-            warn("Failed to execute statement 'rollback': %s",
-                 sqlite3_errmsg(db));
+    if (ctx->savepoint) {
+        ctx->savepoint = false;
+        sqlite3 *db    = ctx->db.handle;
+        int     result = sqlite3_exec(db, "rollback to snapshot; "
+                                          "release snapshot", NULL, NULL, NULL);
+        if (result == SQLITE_OK && sqlite3_get_autocommit(db) == 0) {
+            return true;
         }
+        warn("Failed to roll back to savepoint: %s", sqlite3_errmsg(db));
     }
+    ctx->tx = db_rollback(ctx->db.handle, ctx->tx);
     return false;
 }
 
-static void db_commit(Context *ctx)
+/*
+ * Not part of the schema versions, since it's only there when asked for
+ * with -m and nothing but people looking into slow snapshots reads it.
+ */
+static void db_init_meta(Context *ctx)
 {
-    if (!ctx->tx) {
-        die(ctx, "Nothing to commit");
-    }
-    db_exec(ctx, "commit");
-    ctx->tx = false;
+    db_exec(&ctx->db, "create table if not exists snapshot_meta (\n"
+                      "    snapshot_id integer primary key not null\n"
+                      "        references snapshot (snapshot_id)\n"
+                      "        on delete cascade,\n"
+                      "    open_us     integer not null,\n"
+                      "    display_us  integer not null,\n"
+                      "    idle_us     integer not null,\n"
+                      "    windows_us  integer not null,\n"
+                      "    db_us       integer not null,\n"
+                      "    commit_us   integer not null,\n"
+                      "    windows     integer not null,\n"
+                      "    excluded    integer not null,\n"
+                      "    round_trips integer not null,\n"
+                      "    rows        integer not null)");
 }
 
-static void db_set_snapshot_id(Context *ctx)
+static bool db_has_snapshots(Context *ctx)
 {
-    ctx->snapshot_id = sqlite3_column_int(ctx->stmt, 0);
-    debug("Snapshot id is %d", ctx->snapshot_id);
+    sqlite3_stmt  *stmt   = db_prepare(&ctx->db,
+        "select exists (select 1 from snapshot)");
+    sqlite3_int64 exists = 0;
+    db_select_int64s(&ctx->db, stmt, &exists, 1);
+    db_close_stmt(stmt);
+    return exists != 0;
 }
 
-static void db_insert_snapshot(Context *ctx)
+static void db_migrate(Context *ctx)
 {
-    db_prepare(ctx, "insert into snapshot (timestamp, sample_time, idle_time)\n"
-                    "values (strftime('%Y-%m-%dT%H:%M:%S:%fZ', 'now'), ?, ?)");
-    db_bind_int(ctx, 1, ctx->sample_time);
-    db_bind_int(ctx, 2, ctx->idle_time);
-    db_exec_stmt(ctx, NULL);
-    ctx->stmt = db_close_stmt(ctx->stmt);
+    if (schema_get_version(&ctx->db) >= SCHEMA_VERSION) {
+        return;
+    }
+
+    db_exec(&ctx->db, "begin immediate");
+    ctx->tx = true;
 
-    db_prepare(ctx, "select last_insert_rowid()");
-    int rows = db_exec_stmt(ctx, db_set_snapshot_id);
-    if (rows != 1) {
-        die(ctx, "Wanted 1 id row from inserting snapshot, but got %d", rows);
+    /* Someone else may have migrated it while we were waiting for the lock. */
+    int version = schema_get_version(&ctx->db);
+    if (db_has_snapshots(ctx)) {
+        warn("Migrating database '%s' from schema version %d to %d, "
+             "this may take a while", ctx->db_file, version, SCHEMA_VERSION);
     }
-    ctx->stmt = db_close_stmt(ctx->stmt);
+    schema_migrate(&ctx->db, ctx->layout, version);
+    db_commit(ctx);
 }
 
-static void db_prepare_window_insert(Context *ctx)
+static void db_init(Context *ctx)
 {
-    db_prepare(ctx, "insert into window (snapshot_id, window_id,\n"
-                    "                    parent_id, depth, focused,\n"
-                    "                    name, class, title)\n"
-                    "values(?, ?, ?, ?, ?, ?, ?, ?)");
-}
+    ctx->layout = schema_detect_layout(&ctx->db);
+    if (ctx->layout == DB_LAYOUT_NONE) {
+        ctx->layout = ctx->normalize ? DB_LAYOUT_NORMALIZED : DB_LAYOUT_PLAIN;
+    }
+    else if (ctx->normalize && ctx->layout != DB_LAYOUT_NORMALIZED) {
+        warn("Database '%s' already has the plain layout, keeping it",
+             ctx->db_file);
+    }
 
+    schema_create(&ctx->db, ctx->layout);
 
-static int x_handle_error(Display *dpy, XErrorEvent *event)
-{
-    char buf[1024];
-    XGetErrorText(dpy, event->error_code, buf, sizeof(buf));
-    warn("X11 error: %s", buf);
-    return 0;
+    int version = schema_get_version(&ctx->db);
+    if (version > SCHEMA_VERSION) {
+        die(ctx, "Database '%s' has schema version %d, but this wtsnap "
+                 "only knows up to version %d", ctx->db_file, version,
+                 SCHEMA_VERSION);
+    }
+    db_migrate(ctx);
+
+    if (ctx->keyframe_interval > 0 && ctx->layout != DB_LAYOUT_NORMALIZED) {
+        warn("Delta snapshots need the normalized layout, "
+             "storing full snapshots");
+        ctx->keyframe_interval = 0;
+    }
+
+    if (ctx->record_meta) {
+        db_init_meta(ctx);
+    }
 }
 
-static void x_open_display(Context *ctx)
+static void db_prepare_statements(Context *ctx)
 {
-    if (ctx->dpy_name) {
-        debug("Opening display '%s'", ctx->dpy_name);
+    if (ctx->layout == DB_LAYOUT_NORMALIZED) {
+        ctx->snapshot_stmt = db_prepare(&ctx->db,
+            "insert into snapshot (timestamp, epoch_ms, sample_time,\n"
+            "                      idle_time, base_id, display)\n"
+            "values (strftime('%Y-%m-%dT%H:%M:%S:%fZ', ?1 / 1000.0,\n"
+            "                 'unixepoch'), ?1, ?2, ?3, ?4, ?5)");
     }
     else {
-        debug("Opening default display");
+        ctx->snapshot_stmt = db_prepare(&ctx->db,
+            "insert into snapshot (timestamp, epoch_ms,\n"
+            "                      sample_time, idle_time, display)\n"
+            "values (strftime('%Y-%m-%dT%H:%M:%S:%fZ', ?1 / 1000.0,\n"
+            "                 'unixepoch'), ?1, ?2, ?3, ?4)");
     }
-    ctx->dpy = XOpenDisplay(ctx->dpy_name);
 
-    if (ctx->dpy) {
-        ctx->root = XDefaultRootWindow(ctx->dpy);
+    if (ctx->keyframe_interval > 0) {
+        /* Idle snapshots from -I have no windows, they're no keyframes. */
+        ctx->last_snapshot_stmt = db_prepare(&ctx->db,
+            "select snapshot_id, coalesce(base_id, snapshot_id)\n"
+            "from snapshot s\n"
+            "where base_id is not null or exists (\n"
+            "    select 1 from window_data w\n"
+            "    where w.snapshot_id = s.snapshot_id)\n"
+            "order by snapshot_id desc limit 1");
+        ctx->delta_count_stmt = db_prepare(&ctx->db,
+            "select count(*) from snapshot where base_id = ?");
+        ctx->delta_load_stmt = db_prepare(&ctx->db,
+            "select window_id, parent_id, depth, focused,\n"
+            "       name_id, class_id, title_id\n"
+            "from window_data where snapshot_id = ?");
+        ctx->tombstone_stmt = db_prepare(&ctx->db,
+            "insert into window_data (snapshot_id, window_id,\n"
+            "                         depth, focused, removed)\n"
+            "values (?, ?, 0, 0, 1)");
+    }
+
+    if (ctx->idle_threshold > 0) {
+        ctx->idle_extend_stmt = db_prepare(&ctx->db,
+            "update snapshot set sample_time = sample_time + ?\n"
+            "where snapshot_id = ?");
+    }
+
+    if (ctx->adaptive_time > 0) {
+        ctx->sample_fix_stmt = db_prepare(&ctx->db,
+            "update snapshot set sample_time = ? where snapshot_id = ?");
+    }
+
+    if (ctx->record_meta) {
+        ctx->meta_stmt = db_prepare(&ctx->db,
+            "insert into snapshot_meta (snapshot_id, open_us, display_us,\n"
+            "                           idle_us, windows_us, db_us,\n"
+            "                           commit_us, windows, excluded,\n"
+            "                           round_trips, rows)\n"
+            "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    }
+
+    if (ctx->layout == DB_LAYOUT_NORMALIZED) {
+        ctx->window_stmt = db_prepare(&ctx->db,
+            "insert into window_data (snapshot_id, window_id,\n"
+            "                         parent_id, depth, focused,\n"
+            "                         name_id, class_id, title_id, screen)\n"
+            "values(?, ?, ?, ?, ?, ?, ?, ?, ?)");
+        schema_prepare_strings(&ctx->db, &ctx->string_stmts);
     }
     else {
-        if (ctx->dpy_name) {
-            die(ctx, "Can't open display '%s'", ctx->dpy_name);
-        }
-        else {
-            die(ctx, "Can't open default display");
-        }
+        ctx->window_stmt = db_prepare(&ctx->db,
+            "insert into window (snapshot_id, window_id,\n"
+            "                    parent_id, depth, focused,\n"
+            "                    name, class, title, screen)\n"
+            "values(?, ?, ?, ?, ?, ?, ?, ?, ?)");
     }
 }
 
-static Display *x_close_display(Display *dpy)
+static void db_close_statements(Context *ctx)
 {
-    if (dpy) {
-        debug("Closing display");
-        XCloseDisplay(dpy);
+    ctx->snapshot_stmt       = db_close_stmt(ctx->snapshot_stmt);
+    ctx->window_stmt         = db_close_stmt(ctx->window_stmt);
+    schema_close_strings(&ctx->string_stmts);
+    ctx->last_snapshot_stmt  = db_close_stmt(ctx->last_snapshot_stmt);
+    ctx->delta_count_stmt    = db_close_stmt(ctx->delta_count_stmt);
+    ctx->delta_load_stmt     = db_close_stmt(ctx->delta_load_stmt);
+    ctx->tombstone_stmt      = db_close_stmt(ctx->tombstone_stmt);
+    ctx->sample_fix_stmt     = db_close_stmt(ctx->sample_fix_stmt);
+    ctx->idle_extend_stmt    = db_close_stmt(ctx->idle_extend_stmt);
+    ctx->compact_next_stmt   = db_close_stmt(ctx->compact_next_stmt);
+    ctx->compact_retain_stmt = db_close_stmt(ctx->compact_retain_stmt);
+    ctx->compact_deltas_stmt = db_close_stmt(ctx->compact_deltas_stmt);
+    ctx->compact_select_stmt = db_close_stmt(ctx->compact_select_stmt);
+    ctx->compact_merge_stmt  = db_close_stmt(ctx->compact_merge_stmt);
+    ctx->compact_mark_stmt   = db_close_stmt(ctx->compact_mark_stmt);
+    ctx->compact_window_stmt = db_close_stmt(ctx->compact_window_stmt);
+    ctx->compact_meta_stmt   = db_close_stmt(ctx->compact_meta_stmt);
+    ctx->compact_delete_stmt = db_close_stmt(ctx->compact_delete_stmt);
+    ctx->meta_stmt           = db_close_stmt(ctx->meta_stmt);
+}
+
+static void db_clear_strings(StringCache *cache)
+{
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        free(cache->entries[i].value);
+        cache->entries[i].value = NULL;
     }
-    return NULL;
+    cache->count = 0;
 }
 
-static bool x_have_screensaver(Display *dpy)
+static void db_free_strings(StringCache *cache)
 {
-    int event_base, error_base;
-    return XScreenSaverQueryExtension(dpy, &event_base, &error_base);
+    db_clear_strings(cache);
+    free(cache->entries);
+    cache->entries  = NULL;
+    cache->capacity = 0;
 }
 
-static void x_clean_up_screensaver(Context *ctx, XScreenSaverInfo *info,
-                                   const char *error)
+static StringEntry *db_find_string_slot(StringEntry *entries, size_t capacity,
+                                        unsigned long long hash,
+                                        const char *value)
 {
-    if (error) {
-        warn("Can't get idle time: %s", error);
-        ctx->idle_time = 0;
+    size_t i = (size_t) hash & (capacity - 1);
+    while (entries[i].value) {
+        if (entries[i].hash == hash && strcmp(entries[i].value, value) == 0) {
+            break;
+        }
+        i = (i + 1) & (capacity - 1);
     }
-    else {
-        unsigned long max = INT_MAX;
-        ctx->idle_time    = info->idle <= max ? info->idle : max;
-        debug("Idle time: %d ms", ctx->idle_time);
+    return &entries[i];
+}
+
+static void db_grow_strings(Context *ctx, StringCache *cache)
+{
+    size_t      capacity = cache->capacity ? cache->capacity * 2 : 1024;
+    StringEntry *entries = calloc(capacity, sizeof(*entries));
+    if (!entries) {
+        die(ctx, "Can't calloc %zu string cache entries", capacity);
     }
-    if (info) {
-        XFree(info);
+    ++ctx->allocations;
+
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        StringEntry *old = &cache->entries[i];
+        if (old->value) {
+            *db_find_string_slot(entries, capacity, old->hash, old->value) =
+                *old;
+        }
     }
+
+    free(cache->entries);
+    cache->entries  = entries;
+    cache->capacity = capacity;
 }
 
-static void x_get_idle_time(Context *ctx)
+static sqlite3_int64 db_intern_string(Context *ctx, const char *value)
 {
-    debug("Getting idle time");
+    StringCache        *cache = &ctx->strings;
+    unsigned long long hash   = schema_hash_string(value);
 
-    if (!x_have_screensaver(ctx->dpy)) {
-        x_clean_up_screensaver(ctx, NULL, "XScreenSaver not supported");
-        return;
+    if (cache->count >= STRING_CACHE_MAX) {
+        debug("String cache full, clearing it");
+        db_clear_strings(cache);
     }
-
-    XScreenSaverInfo *info = XScreenSaverAllocInfo();
-    if (!info) {
-        x_clean_up_screensaver(ctx, NULL, "Can't allocate screensaver info");
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        db_grow_strings(ctx, cache);
     }
 
-    if (XScreenSaverQueryInfo(ctx->dpy, ctx->root, info) >= Success) {
-        x_clean_up_screensaver(ctx, info, NULL);
+    StringEntry *entry = db_find_string_slot(cache->entries, cache->capacity,
+                                             hash, value);
+    if (entry->value) {
+        return entry->id;
     }
-    else {
-        x_clean_up_screensaver(ctx, info, "Querying screen saver info failed");
+
+    sqlite3_int64 id = schema_intern_string(&ctx->db, &ctx->string_stmts, hash,
+                                            value);
+    char *copy = strdup(value);
+    ++ctx->allocations;
+    if (copy) {
+        entry->hash  = hash;
+        entry->id    = id;
+        entry->value = copy;
+        ++cache->count;
     }
+    return id;
 }
 
-static void x_get_focused_window(Context *ctx)
+static DeltaRow *db_find_delta_slot(DeltaRow *rows, size_t capacity,
+                                     Window window)
 {
-    debug("Getting input focus");
-    int revert;
-    if (XGetInputFocus(ctx->dpy, &ctx->focus, &revert) >= Success) {
-        debug("Input focus is window %llu", (unsigned long long) ctx->focus);
-    } else {
-        warn("Can't get input focus");
-        ctx->focus = None;
+    size_t i = ((size_t) window * 2654435761u) & (capacity - 1);
+    while (rows[i].window != None && rows[i].window != window) {
+        i = (i + 1) & (capacity - 1);
     }
+    return &rows[i];
 }
 
-static void x_alloc_class_hint(Context *ctx)
+static void db_grow_delta(Context *ctx, DeltaBase *delta)
 {
-    debug("Allocating X class hint");
-    XClassHint *ch = XAllocClassHint();
-    if (ch) {
-        ctx->ch = ch;
+    size_t   capacity = delta->capacity ? delta->capacity * 2 : 1024;
+    DeltaRow *rows    = calloc(capacity, sizeof(*rows));
+    if (!rows) {
+        die(ctx, "Can't calloc %zu delta rows", capacity);
     }
-    else {
-        die(ctx, "Can't allocate class hint structure");
+    ++ctx->allocations;
+
+    for (size_t i = 0; i < delta->capacity; ++i) {
+        DeltaRow *old = &delta->rows[i];
+        if (old->window != None) {
+            *db_find_delta_slot(rows, capacity, old->window) = *old;
+        }
     }
+
+    free(delta->rows);
+    delta->rows     = rows;
+    delta->capacity = capacity;
 }
 
-static XClassHint *x_free_class_hint(XClassHint *ch)
+static void db_clear_delta(DeltaBase *delta)
 {
-    if (ch) {
-        if (ch->res_name) {
-            XFree(ch->res_name);
-        }
-        if (ch->res_class) {
-            XFree(ch->res_class);
-        }
-        XFree(ch);
+    if (delta->rows) {
+        memset(delta->rows, 0, delta->capacity * sizeof(*delta->rows));
     }
-    return NULL;
+    delta->count   = 0;
+    delta->base_id = 0;
 }
 
-static char *x_copy_string_property_value(const char *prop_name, void *src)
+static void db_free_delta(DeltaBase *delta)
 {
-    size_t size = strlen((char *)src) + 1;
-    char   *dst = malloc(size);
-    if (dst) {
-        memcpy(dst, src, size);
+    free(delta->rows);
+    delta->rows     = NULL;
+    delta->capacity = 0;
+    delta->count    = 0;
+    delta->base_id  = 0;
+}
+
+static DeltaRow *db_find_delta(Context *ctx, Window window)
+{
+    DeltaBase *delta = &ctx->delta;
+    if ((delta->count + 1) * 2 > delta->capacity) {
+        db_grow_delta(ctx, delta);
     }
-    else {
+    return db_find_delta_slot(delta->rows, delta->capacity, window);
+}
+
+static void db_add_delta(Context *ctx, const DeltaRow *row)
+{
+    DeltaRow *slot = db_find_delta(ctx, row->window);
+    if (slot->window == None) {
+        ++ctx->delta.count;
+    }
+    *slot = *row;
+}
+
+static void db_load_delta(Context *ctx, int base_id)
+{
+    debug("Loading keyframe %d", base_id);
+    db_clear_delta(&ctx->delta);
+
+    sqlite3_stmt *stmt = ctx->delta_load_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int(&ctx->db, stmt, 1, base_id);
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        DeltaRow row = {0};
+        row.window   = (Window) sqlite3_column_int64(stmt, 0);
+        row.parent   = (Window) sqlite3_column_int64(stmt, 1);
+        row.depth    = sqlite3_column_int(stmt, 2);
+        row.focused  = sqlite3_column_int(stmt, 3);
+        for (int i = 0; i < 3; ++i) {
+            row.ids[i] = sqlite3_column_int64(stmt, 4 + i);
+        }
+        db_add_delta(ctx, &row);
+    }
+    if (result != SQLITE_DONE) {
+        die(ctx, "Failed to load keyframe %d: %s",
+            base_id, sqlite3_errmsg(ctx->db.handle));
+    }
+
+    ctx->delta.base_id = base_id;
+}
+
+/*
+ * The base of a delta snapshot is the keyframe of the most recent snapshot,
+ * until that keyframe has KEYFRAME_INTERVAL - 1 deltas. Then it's time for a
+ * new keyframe, which is what a base of 0 means.
+ */
+static int db_choose_base(Context *ctx)
+{
+    sqlite3_int64 last[2] = {0, 0};
+    sqlite3_stmt  *stmt = ctx->last_snapshot_stmt;
+    db_reset_stmt(stmt);
+    if (!db_select_int64s(&ctx->db, stmt, last, 2)) {
+        return 0;
+    }
+
+    sqlite3_int64 deltas = 0;
+    stmt = ctx->delta_count_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(&ctx->db, stmt, 1, last[1]);
+    db_select_int64s(&ctx->db, stmt, &deltas, 1);
+
+    if (deltas + 1 >= ctx->keyframe_interval) {
+        return 0;
+    }
+
+    int base_id = (int) last[1];
+    if (ctx->delta.base_id != base_id) {
+        db_load_delta(ctx, base_id);
+    }
+    return base_id;
+}
+
+/*
+ * With -I, snapshots taken while idle for that long don't get any windows.
+ * The daemon makes a row of them into a single snapshot that accounts for
+ * all of their time, unless the sample times have to stay as they are for
+ * -A or several displays would need one of these for each of them.
+ */
+static bool db_idle_only(const Context *ctx)
+{
+    return ctx->idle_threshold > 0 && ctx->idle_time >= ctx->idle_threshold;
+}
+
+static bool db_merges_idle(const Context *ctx)
+{
+    return ctx->daemon && ctx->adaptive_time == 0 && ctx->dpy_count <= 1;
+}
+
+static void db_extend_idle(Context *ctx)
+{
+    debug("Adding %d seconds to idle snapshot %d",
+          ctx->snapshot_sample_time, ctx->idle_id);
+    sqlite3_stmt *stmt = ctx->idle_extend_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int(&ctx->db, stmt, 1, ctx->snapshot_sample_time);
+    db_bind_int(&ctx->db, stmt, 2, ctx->idle_id);
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+    ctx->snapshot_id       = ctx->idle_id;
+    ctx->snapshot_base_id  = 0;
+    ctx->snapshot_extended = true;
+}
+
+static void db_insert_snapshot(Context *ctx)
+{
+    bool idle              = db_idle_only(ctx);
+    ctx->snapshot_extended = false;
+    if (idle && ctx->idle_id != 0) {
+        db_extend_idle(ctx);
+        return;
+    }
+
+    ctx->snapshot_base_id = ctx->keyframe_interval > 0 && !idle
+                          ? db_choose_base(ctx) : 0;
+
+    /* The time it was captured, which may be a while ago with -Q. */
+    sqlite3_stmt *stmt = ctx->snapshot_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(&ctx->db, stmt, 1, ctx->snapshot_epoch_ms);
+    db_bind_int(&ctx->db, stmt, 2, ctx->snapshot_sample_time);
+    db_bind_int(&ctx->db, stmt, 3, ctx->idle_time);
+    if (ctx->snapshot_base_id != 0) {
+        db_bind_int(&ctx->db, stmt, 4, ctx->snapshot_base_id);
+    }
+    if (ctx->display_tag) {
+        int index = ctx->layout == DB_LAYOUT_NORMALIZED ? 5 : 4;
+        db_bind_static_string(&ctx->db, stmt, index, ctx->display_tag);
+    }
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(ctx->db.handle);
+    if (id <= 0 || id > INT_MAX) {
+        die(ctx, "Got invalid snapshot id %lld", (long long) id);
+    }
+    ctx->snapshot_id = (int) id;
+    debug("Snapshot id is %d, base id is %d",
+          ctx->snapshot_id, ctx->snapshot_base_id);
+
+    ctx->idle_id = idle && db_merges_idle(ctx) ? ctx->snapshot_id : 0;
+    if (idle) {
+        return;
+    }
+    else if (ctx->keyframe_interval > 0 && ctx->snapshot_base_id == 0) {
+        db_clear_delta(&ctx->delta);
+        ctx->delta.base_id = ctx->snapshot_id;
+    }
+}
+
+/*
+ * Returns true if the window should be skipped because it's unchanged from
+ * the keyframe. Also remembers the rows of keyframes for later deltas.
+ */
+static bool db_check_delta(Context *ctx, const DeltaRow *row)
+{
+    if (ctx->keyframe_interval <= 0) {
+        return false;
+    }
+    else if (ctx->snapshot_base_id == 0) {
+        db_add_delta(ctx, row);
+        return false;
+    }
+
+    DeltaRow *base = db_find_delta(ctx, row->window);
+    if (base->window == None) {
+        return false;
+    }
+
+    base->seen = ctx->snapshot_id;
+    return base->parent  == row->parent
+        && base->depth   == row->depth
+        && base->focused == row->focused
+        && base->ids[0]  == row->ids[0]
+        && base->ids[1]  == row->ids[1]
+        && base->ids[2]  == row->ids[2];
+}
+
+static void db_finish_snapshot(Context *ctx)
+{
+    if (ctx->keyframe_interval <= 0 || ctx->snapshot_base_id == 0) {
+        return;
+    }
+
+    DeltaBase *delta = &ctx->delta;
+    for (size_t i = 0; i < delta->capacity; ++i) {
+        DeltaRow *row = &delta->rows[i];
+        if (row->window != None && row->seen != ctx->snapshot_id) {
+            debug("Window %llu went away since keyframe %d",
+                  (unsigned long long) row->window, delta->base_id);
+            sqlite3_stmt *stmt = ctx->tombstone_stmt;
+            db_reset_stmt(stmt);
+            db_bind_int(&ctx->db, stmt, 1, ctx->snapshot_id);
+            db_bind_window(ctx, stmt, 2, row->window);
+            db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+            ++ctx->rows;
+        }
+    }
+}
+
+/*
+ * With -A, snapshots are written with the sample time they're expected to
+ * account for, which is corrected once the next one is taken, since that
+ * may come sooner or later. The correction goes into the transaction of the
+ * next snapshot, or before switching partitions or stopping the daemon.
+ */
+static void db_fix_previous(Context *ctx)
+{
+    if (ctx->previous_id == 0 || ctx->previous_sample_time <= 0
+            || ctx->previous_sample_time == ctx->previous_planned) {
+        return;
+    }
+
+    debug("Snapshot %d accounts for %d seconds instead of %d",
+          ctx->previous_id, ctx->previous_sample_time, ctx->previous_planned);
+    sqlite3_stmt *stmt = ctx->sample_fix_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int(&ctx->db, stmt, 1, ctx->previous_sample_time);
+    db_bind_int(&ctx->db, stmt, 2, ctx->previous_id);
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+    ctx->previous_planned = ctx->previous_sample_time;
+}
+
+static void db_end_previous(Context *ctx)
+{
+    ctx->previous_id      = ctx->snapshot_id;
+    ctx->previous_planned = ctx->snapshot_sample_time;
+}
+
+static void db_bind_us(Context *ctx, sqlite3_stmt *stmt, int index,
+                       long long ns)
+{
+    db_bind_int64(&ctx->db, stmt, index, (sqlite3_int64) (ns / 1000));
+}
+
+/*
+ * Writes the timings of the last snapshot, which only exist once it's been
+ * committed. They go into the transaction of the next snapshot if there is
+ * one, otherwise they get committed on their own. The open and display
+ * times are used up by this, so the snapshots after don't count them again.
+ */
+static void db_flush_meta(Context *ctx)
+{
+    if (!ctx->meta_pending) {
+        return;
+    }
+    ctx->meta_pending = false;
+
+    SnapMeta     *meta = &ctx->meta;
+    sqlite3_stmt *stmt = ctx->meta_stmt;
+    debug("Recording timings of snapshot %d", meta->snapshot_id);
+    db_reset_stmt(stmt);
+    db_bind_int(&ctx->db, stmt, 1, meta->snapshot_id);
+    db_bind_us(ctx, stmt, 2, meta->open_ns);
+    db_bind_us(ctx, stmt, 3, meta->display_ns);
+    db_bind_us(ctx, stmt, 4, meta->idle_ns);
+    db_bind_us(ctx, stmt, 5, meta->windows_ns);
+    db_bind_us(ctx, stmt, 6, meta->db_ns);
+    db_bind_us(ctx, stmt, 7, meta->commit_ns);
+    db_bind_int(&ctx->db, stmt, 8, meta->windows);
+    db_bind_int(&ctx->db, stmt, 9, meta->excluded);
+    db_bind_int(&ctx->db, stmt, 10, meta->round_trips);
+    db_bind_int(&ctx->db, stmt, 11, meta->rows);
+    meta->open_ns    = 0;
+    meta->display_ns = 0;
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+}
+
+static void db_forget_caches(Context *ctx)
+{
+    db_clear_strings(&ctx->strings);
+    db_clear_delta(&ctx->delta);
+    ctx->idle_id = 0;
+}
+
+static void db_open_file(Context *ctx)
+{
+    long long start_ns = monotonic_ns();
+    db_open_rw(ctx);
+    db_configure(ctx);
+    db_init(ctx);
+    db_prepare_statements(ctx);
+    ctx->meta.open_ns += monotonic_ns() - start_ns;
+}
+
+/*
+ * Switches to the partition for the date of epoch_ms if it's not the one
+ * that's open already, committing whatever is pending in the old one first.
+ * String ids and delta bases only make sense within one file, so the caches
+ * start over and the first snapshot in the new partition becomes a keyframe.
+ * If opening the new one fails, the next snapshot tries again.
+ */
+static void db_rotate(Context *ctx, long long epoch_ms)
+{
+    char *name = db_partition_name(ctx, epoch_ms);
+    if (ctx->partition_open && strcmp(name, ctx->partition_name) == 0) {
+        free(name);
+        return;
+    }
+
+    db_flush_meta(ctx);
+    db_fix_previous(ctx);
+    ctx->previous_id = 0;
+    if (ctx->tx) {
+        debug("Committing %d snapshots before rotating", ctx->tx_snapshots);
+        db_commit(ctx);
+    }
+
+    debug("Rotating to partition '%s'", name);
+    ctx->partition_open = false;
+    db_close_statements(ctx);
+    ctx->db.handle = db_close(ctx->db.handle);
+    db_forget_caches(ctx);
+
+    free(ctx->partition_name);
+    ctx->partition_name = name;
+    ctx->db_file        = name;
+    db_open_file(ctx);
+    ctx->partition_open = true;
+}
+
+
+static int x_handle_error(Display *dpy, XErrorEvent *event)
+{
+    char buf[1024];
+    XGetErrorText(dpy, event->error_code, buf, sizeof(buf));
+    warn("X11 error: %s", buf);
+    return 0;
+}
+
+static void x_open_display(Context *ctx)
+{
+    if (ctx->dpy_name) {
+        debug("Opening display '%s'", ctx->dpy_name);
+    }
+    else {
+        debug("Opening default display");
+    }
+    ctx->dpy = XOpenDisplay(ctx->dpy_name);
+
+    if (ctx->dpy) {
+        ctx->root   = XDefaultRootWindow(ctx->dpy);
+        ctx->screen = XDefaultScreen(ctx->dpy);
+    }
+    else {
+        if (ctx->dpy_name) {
+            die(ctx, "Can't open display '%s'", ctx->dpy_name);
+        }
+        else {
+            die(ctx, "Can't open default display");
+        }
+    }
+}
+
+static void x_intern_atoms(Context *ctx)
+{
+    debug("Interning %d atoms", ATOM_COUNT);
+    if (!XInternAtoms(ctx->dpy, atom_names, ATOM_COUNT, false, ctx->atoms)) {
+        die(ctx, "Can't intern atoms");
+    }
+}
+
+static Display *x_close_display(Display *dpy)
+{
+    if (dpy) {
+        debug("Closing display");
+        XCloseDisplay(dpy);
+    }
+    return NULL;
+}
+
+static bool x_have_screensaver(Display *dpy)
+{
+    int event_base, error_base;
+    return XScreenSaverQueryExtension(dpy, &event_base, &error_base);
+}
+
+static void x_clean_up_screensaver(Context *ctx, XScreenSaverInfo *info,
+                                   const char *error)
+{
+    if (error) {
+        warn("Can't get idle time: %s", error);
+        ctx->idle_time = 0;
+    }
+    else {
+        unsigned long max = INT_MAX;
+        ctx->idle_time    = info->idle <= max ? info->idle : max;
+        debug("Idle time: %d ms", ctx->idle_time);
+    }
+    if (info) {
+        XFree(info);
+    }
+}
+
+static void x_get_idle_time(Context *ctx)
+{
+    debug("Getting idle time");
+
+    if (!x_have_screensaver(ctx->dpy)) {
+        x_clean_up_screensaver(ctx, NULL, "XScreenSaver not supported");
+        return;
+    }
+
+    XScreenSaverInfo *info = XScreenSaverAllocInfo();
+    if (!info) {
+        x_clean_up_screensaver(ctx, NULL, "Can't allocate screensaver info");
+    }
+
+    ++ctx->round_trips;
+    if (XScreenSaverQueryInfo(ctx->dpy, ctx->root, info) >= Success) {
+        x_clean_up_screensaver(ctx, info, NULL);
+    }
+    else {
+        x_clean_up_screensaver(ctx, info, "Querying screen saver info failed");
+    }
+}
+
+static void x_get_focused_window(Context *ctx)
+{
+    debug("Getting input focus");
+    int revert;
+    ++ctx->round_trips;
+    if (XGetInputFocus(ctx->dpy, &ctx->focus, &revert) >= Success) {
+        debug("Input focus is window %llu", (unsigned long long) ctx->focus);
+    } else {
+        warn("Can't get input focus");
+        ctx->focus = None;
+    }
+}
+
+static void x_alloc_class_hint(Context *ctx)
+{
+    debug("Allocating X class hint");
+    XClassHint *ch = XAllocClassHint();
+    if (ch) {
+        ctx->ch = ch;
+    }
+    else {
+        die(ctx, "Can't allocate class hint structure");
+    }
+}
+
+static XClassHint *x_free_class_hint(XClassHint *ch)
+{
+    if (ch) {
+        if (ch->res_name) {
+            XFree(ch->res_name);
+        }
+        if (ch->res_class) {
+            XFree(ch->res_class);
+        }
+        XFree(ch);
+    }
+    return NULL;
+}
+
+static void x_arena_reset(Arena *arena)
+{
+    for (ArenaChunk *chunk = arena->first; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+static void x_arena_free(Arena *arena)
+{
+    ArenaChunk *chunk = arena->first;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first   = NULL;
+    arena->last    = NULL;
+    arena->current = NULL;
+}
+
+static char *x_arena_alloc(Context *ctx, const char *prop_name, size_t size)
+{
+    Arena      *arena = &ctx->arena;
+    ArenaChunk *chunk = arena->current;
+    while (chunk && chunk->capacity - chunk->used < size) {
+        chunk = chunk->next;
+    }
+
+    if (!chunk) {
+        size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(*chunk) + capacity);
+        if (!chunk) {
+            warn("Can't malloc %zu bytes for '%s' property value",
+                 capacity, prop_name);
+            return NULL;
+        }
+        ++ctx->allocations;
+        chunk->next     = NULL;
+        chunk->capacity = capacity;
+        chunk->used     = 0;
+        if (arena->last) {
+            arena->last->next = chunk;
+        }
+        else {
+            arena->first = chunk;
+        }
+        arena->last = chunk;
+    }
+
+    char *out = chunk->data + chunk->used;
+    chunk->used   += size;
+    arena->current = chunk;
+    return out;
+}
+
+static char *x_alloc_property_value(Context *ctx, const char *prop_name,
+                                    size_t size)
+{
+    if (!ctx->track_events) {
+        return x_arena_alloc(ctx, prop_name, size);
+    }
+
+    char *out = malloc(size);
+    if (out) {
+        ++ctx->allocations;
+    }
+    else {
         warn("Can't malloc %zu bytes for '%s' property value",
              size, prop_name);
     }
-    return dst;
+    return out;
+}
+
+static char *x_copy_string_property_value(Context *ctx, const char *prop_name,
+                                          const void *src)
+{
+    size_t size = strlen((const char *) src) + 1;
+    char   *dst = x_alloc_property_value(ctx, prop_name, size);
+    if (dst) {
+        memcpy(dst, src, size);
+    }
+    return dst;
+}
+
+/*
+ * This is inspired by the way dwm gets the title for a window.
+ * See https://dwm.suckless.org/
+ */
+static char *x_get_string_property(Context *ctx, Window window, int atom)
+{
+    const char *prop_name = atom_names[atom];
+    Atom       prop       = ctx->atoms[atom];
+    debug("Getting string property '%s'", prop_name);
+
+    XTextProperty xtp;
+    xtp.value      = NULL;
+    char **strings = NULL;
+    char *out      = NULL;
+
+    ++ctx->round_trips;
+    if (XGetTextProperty(ctx->dpy, window, &xtp, prop) < Success) {
+        debug("Can't get string property '%s'", prop_name);
+        goto end_of_x_get_string_property;
+    }
+
+    if (xtp.nitems == 0) {
+        debug("No items in string property '%s'", prop_name);
+        goto end_of_x_get_string_property;
+    }
+
+    /* UTF-8 is what goes into the database, so it skips the conversion. */
+    if (xtp.encoding == XA_STRING
+            || xtp.encoding == ctx->atoms[ATOM_UTF8_STRING]) {
+        out = x_copy_string_property_value(ctx, prop_name, xtp.value);
+    }
+    else {
+        int nstrings = 0;
+        int result   = XmbTextPropertyToTextList(ctx->dpy, &xtp,
+                                                 &strings, &nstrings);
+        if (result >= Success && nstrings > 0 && strings && strings[0]) {
+            out = x_copy_string_property_value(ctx, prop_name, strings[0]);
+        }
+    }
+
+end_of_x_get_string_property:
+    if (strings) {
+        XFreeStringList(strings);
+    }
+    if (xtp.value) {
+        XFree(xtp.value);
+    }
+
+    if (out) {
+        debug("Got '%s' value: '%s'", prop_name, out);
+    }
+    else {
+        debug("No value for '%s' property", prop_name);
+    }
+
+    return out;
+}
+
+static char *x_get_title(Context *ctx, Window window)
+{
+    char *title = x_get_string_property(ctx, window, ATOM_NET_WM_NAME);
+    if (!title) {
+        title = x_get_string_property(ctx, window, ATOM_WM_NAME);
+    }
+    return title;
+}
+
+static void x_get_class(Context *ctx, Window window, WindowProps *props)
+{
+    XClassHint *ch = ctx->ch;
+    ++ctx->round_trips;
+    if (XGetClassHint(ctx->dpy, window, ch) >= Success) {
+        if (ch->res_name) {
+            props->name = x_copy_string_property_value(ctx, "WM_CLASS",
+                                                       ch->res_name);
+            XFree(ch->res_name);
+            ch->res_name = NULL;
+        }
+        if (ch->res_class) {
+            props->class = x_copy_string_property_value(ctx, "WM_CLASS",
+                                                        ch->res_class);
+            XFree(ch->res_class);
+            ch->res_class = NULL;
+        }
+    }
+    else {
+        debug("No class hint for window %llu", (unsigned long long) window);
+    }
+}
+
+static void x_free_window_props(WindowProps *props)
+{
+    free(props->name);
+    free(props->class);
+    free(props->title);
+    props->name  = NULL;
+    props->class = NULL;
+    props->title = NULL;
+}
+
+static bool x_have_window_prop(const char *value)
+{
+    return value && value[0] != '\0';
+}
+
+static void db_buffer_window(Context *ctx, Window window, Window parent,
+                             int depth, int focused, const WindowProps *props)
+{
+    if (ctx->capture_rows_size == ctx->capture_rows_capacity) {
+        size_t     capacity = ctx->capture_rows_capacity
+                            ? ctx->capture_rows_capacity * 2 : 256;
+        CaptureRow *rows    = realloc(ctx->capture_rows,
+                                      capacity * sizeof(*rows));
+        if (!rows) {
+            die(ctx, "Can't realloc %zu capture rows", capacity);
+        }
+        ++ctx->allocations;
+        ctx->capture_rows          = rows;
+        ctx->capture_rows_capacity = capacity;
+    }
+    ctx->capture_rows[ctx->capture_rows_size++] = (CaptureRow) {
+        window, parent, depth, focused, ctx->screen, *props,
+    };
+}
+
+static void db_insert_window(Context *ctx, Window window, Window parent,
+                             int depth, int focused, const WindowProps *props)
+{
+    if (ctx->buffer_rows) {
+        db_buffer_window(ctx, window, parent, depth, focused, props);
+        return;
+    }
+
+    /*
+     * If there's neither a name nor a class nor a title, you can't actually
+     * classify anything about this window. Exclude it if so instructed.
+     */
+    bool have_property = x_have_window_prop(props->name)
+                      || x_have_window_prop(props->class)
+                      || x_have_window_prop(props->title);
+    ++ctx->windows;
+    if (ctx->exclude_blanks && !have_property) {
+        debug("Not inserting empty entry for window %llu",
+              (unsigned long long) window);
+        ++ctx->excluded;
+        return;
+    }
+
+    long long    start_ns = monotonic_ns();
+    sqlite3_stmt *stmt    = ctx->window_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int(&ctx->db, stmt, 1, ctx->snapshot_id);
+    db_bind_window(ctx, stmt, 2, window);
+    if (parent != None) {
+        db_bind_window(ctx, stmt, 3, parent);
+    }
+    db_bind_int(&ctx->db, stmt, 4, depth);
+    db_bind_int(&ctx->db, stmt, 5, focused);
+    db_bind_int(&ctx->db, stmt, 9, ctx->screen);
+
+    DeltaRow   row      = {window, parent, depth, focused, {0, 0, 0}, 0};
+    const char *values[] = {props->name, props->class, props->title};
+    for (int i = 0; i < 3; ++i) {
+        if (!values[i]) {
+            continue;
+        }
+        else if (ctx->layout == DB_LAYOUT_NORMALIZED) {
+            row.ids[i] = db_intern_string(ctx, values[i]);
+            db_bind_int64(&ctx->db, stmt, 6 + i, row.ids[i]);
+        }
+        else {
+            db_bind_static_string(&ctx->db, stmt, 6 + i, values[i]);
+        }
+    }
+
+    if (db_check_delta(ctx, &row)) {
+        debug("Window %llu unchanged since keyframe %d",
+              (unsigned long long) window, ctx->snapshot_base_id);
+    }
+    else {
+        db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+        ++ctx->rows;
+    }
+    ctx->db_ns += monotonic_ns() - start_ns;
+}
+
+/*
+ * The traversal policies -F, -L, -M and -O decide which windows are worth
+ * capturing before anything else is fetched about them, and cut off their
+ * whole subtree if not. The focused window may be cut off along with them,
+ * so its path from the root is looked up beforehand, which is also all
+ * that -F follows below the top level.
+ */
+static bool x_pruning(const Context *ctx)
+{
+    return ctx->focus_only || ctx->max_depth > 0
+        || ctx->only_mapped || ctx->skip_override;
+}
+
+static bool x_checks_attributes(const Context *ctx)
+{
+    return ctx->only_mapped || ctx->skip_override;
+}
+
+static bool x_wants_attributes(const Context *ctx, bool mapped,
+                               bool override_redirect)
+{
+    return (mapped || !ctx->only_mapped)
+        && (!override_redirect || !ctx->skip_override);
+}
+
+static bool x_wants_depth(const Context *ctx, int depth)
+{
+    return ctx->max_depth == 0 || depth <= ctx->max_depth;
+}
+
+static bool x_on_focus_path(const Context *ctx, Window window, int depth)
+{
+    return depth >= 1 && (size_t) depth <= ctx->focus_path_size
+        && ctx->focus_path[depth - 1] == window;
+}
+
+/*
+ * Focus bubbles up from the focused window, but when that isn't captured,
+ * the windows above it on the focus path still get its depth.
+ */
+static int x_focused(const Context *ctx, Window window, int depth,
+                     int child_focused)
+{
+    return child_focused != 0                  ? child_focused
+         : ctx->focus == window                ? depth
+         : x_on_focus_path(ctx, window, depth) ? (int) ctx->focus_path_size
+         : 0;
+}
+
+static void x_push_focus_path(Context *ctx, Window window)
+{
+    if (ctx->focus_path_size == ctx->focus_path_capacity) {
+        size_t capacity = ctx->focus_path_capacity
+                        ? ctx->focus_path_capacity * 2 : 16;
+        Window *path    = realloc(ctx->focus_path, capacity * sizeof(*path));
+        if (!path) {
+            die(ctx, "Can't realloc %zu focus path entries", capacity);
+        }
+        ++ctx->allocations;
+        ctx->focus_path          = path;
+        ctx->focus_path_capacity = capacity;
+    }
+    ctx->focus_path[ctx->focus_path_size++] = window;
+}
+
+/* The path is collected from the bottom up, but looked up from the top. */
+static void x_finish_focus_path(Context *ctx)
+{
+    size_t size = ctx->focus_path_size;
+    if (size == 0 || ctx->focus_path[size - 1] != ctx->root) {
+        debug("Focused window isn't below the root window");
+        ctx->focus_path_size = 0;
+        return;
+    }
+    for (size_t i = 0; i < size / 2; ++i) {
+        Window window                 = ctx->focus_path[i];
+        ctx->focus_path[i]            = ctx->focus_path[size - 1 - i];
+        ctx->focus_path[size - 1 - i] = window;
+    }
+    debug("Focused window is at depth %zu", size);
+}
+
+static void x_get_focus_path(Context *ctx)
+{
+    ctx->focus_path_size = 0;
+    if (!x_pruning(ctx) || ctx->focus == None || ctx->focus == PointerRoot) {
+        return;
+    }
+
+    Window window = ctx->focus;
+    while (window != None) {
+        x_push_focus_path(ctx, window);
+        if (window == ctx->root) {
+            break;
+        }
+
+        Window       root, parent = None, *children = NULL;
+        unsigned int nchildren;
+        ++ctx->round_trips;
+        if (XQueryTree(ctx->dpy, window, &root, &parent,
+                       &children, &nchildren) >= Success) {
+            if (children) {
+                XFree(children);
+            }
+        }
+        else {
+            debug("Can't get parent of window %llu",
+                  (unsigned long long) window);
+        }
+        window = parent;
+    }
+    x_finish_focus_path(ctx);
+}
+
+/*
+ * With -C on an EWMH window manager, the root window already lists every
+ * managed client in _NET_CLIENT_LIST and the active one in
+ * _NET_ACTIVE_WINDOW. Reading those two properties replaces the tree walk,
+ * and the clients are captured as children of the root. The active window
+ * is what the window manager considers focused, rather than whatever focus
+ * proxy child actually has the input focus. If either property is missing,
+ * x_snap_clients returns false, so that the tree is walked after all.
+ */
+static void x_set_active_window(Context *ctx, Window active)
+{
+    debug("Active window is %llu", (unsigned long long) active);
+    ctx->focus           = active;
+    ctx->focus_path_size = 0;
+}
+
+static size_t x_hash_window(Window window, size_t nbuckets)
+{
+    unsigned long long h = (unsigned long long) window;
+    h ^= h >> 16;
+    h *= 0x45d9f3bULL;
+    h ^= h >> 16;
+    return (size_t) h & (nbuckets - 1);
+}
+
+static PropEntry *x_cache_find(const PropCache *cache, Window window)
+{
+    if (cache->nbuckets == 0) {
+        return NULL;
+    }
+    PropEntry *entry = cache->buckets[x_hash_window(window, cache->nbuckets)];
+    while (entry && entry->window != window) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void x_cache_grow(Context *ctx, PropCache *cache)
+{
+    size_t    nbuckets = cache->nbuckets ? cache->nbuckets * 2 : 256;
+    PropEntry **old    = cache->buckets;
+    size_t    old_size = cache->nbuckets;
+
+    cache->buckets = calloc(nbuckets, sizeof(*cache->buckets));
+    if (!cache->buckets) {
+        cache->buckets = old;
+        die(ctx, "Can't calloc %zu property cache buckets", nbuckets);
+    }
+    ++ctx->allocations;
+    cache->nbuckets = nbuckets;
+
+    for (size_t i = 0; i < old_size; ++i) {
+        PropEntry *entry = old[i];
+        while (entry) {
+            PropEntry *next = entry->hash_next;
+            size_t    b     = x_hash_window(entry->window, nbuckets);
+            entry->hash_next  = cache->buckets[b];
+            cache->buckets[b] = entry;
+            entry = next;
+        }
+    }
+    free(old);
+}
+
+static void x_cache_free_entry(PropEntry *entry)
+{
+    free(entry->props.name);
+    free(entry->props.class);
+    free(entry->props.title);
+    free(entry);
+}
+
+static void x_cache_remove(PropCache *cache, Window window)
+{
+    if (cache->nbuckets == 0) {
+        return;
+    }
+    PropEntry **pp = &cache->buckets[x_hash_window(window, cache->nbuckets)];
+    while (*pp && (*pp)->window != window) {
+        pp = &(*pp)->hash_next;
+    }
+    if (*pp) {
+        debug("Forgetting properties of window %llu",
+              (unsigned long long) window);
+        PropEntry *entry = *pp;
+        *pp = entry->hash_next;
+        x_cache_free_entry(entry);
+        --cache->count;
+    }
+}
+
+static void x_cache_free(PropCache *cache)
+{
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        PropEntry *entry = cache->buckets[i];
+        while (entry) {
+            PropEntry *next = entry->hash_next;
+            x_cache_free_entry(entry);
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets  = NULL;
+    cache->nbuckets = 0;
+    cache->count    = 0;
+}
+
+/*
+ * Input is selected before the properties are fetched, on the same
+ * connection that fetches them, so that a change in between can't slip by
+ * without an event.
+ */
+static void x_cache_select_input(Context *ctx, Window window)
+{
+#ifndef WTSNAP_XCB
+    XSelectInput(ctx->dpy, window, PropertyChangeMask | StructureNotifyMask);
+#else
+    uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE
+                  | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_change_window_attributes(ctx->xcb, (xcb_window_t) window,
+                                 XCB_CW_EVENT_MASK, &mask);
+#endif
+}
+
+/* Gives the entry to fetch the dirty properties of a window into, if -R. */
+static PropEntry *x_cache_get(Context *ctx, Window window)
+{
+    if (!ctx->cache_props) {
+        return NULL;
+    }
+
+    PropCache *cache = &ctx->cache;
+    PropEntry *entry = x_cache_find(cache, window);
+    if (entry) {
+        if (entry->class_dirty || entry->title_dirty) {
+            ++cache->misses;
+        }
+        else {
+            ++cache->hits;
+        }
+        return entry;
+    }
+
+    if (cache->count >= cache->nbuckets) {
+        x_cache_grow(ctx, cache);
+    }
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        die(ctx, "Can't calloc property cache entry");
+    }
+    ++ctx->allocations;
+
+    size_t b = x_hash_window(window, cache->nbuckets);
+    entry->window      = window;
+    entry->hash_next   = cache->buckets[b];
+    entry->class_dirty = true;
+    entry->title_dirty = true;
+    cache->buckets[b]  = entry;
+    ++cache->count;
+    ++cache->misses;
+
+    x_cache_select_input(ctx, window);
+    return entry;
+}
+
+static char *x_cache_copy(Context *ctx, const char *value)
+{
+    if (!value) {
+        return NULL;
+    }
+    char *copy = strdup(value);
+    if (copy) {
+        ++ctx->allocations;
+    }
+    else {
+        warn("Can't copy property value '%s' into the cache", value);
+    }
+    return copy;
+}
+
+/*
+ * Takes the properties that were dirty over from the ones just fetched into
+ * the arena and hands back all of them.
+ */
+static void x_cache_update(Context *ctx, PropEntry *entry, WindowProps *props)
+{
+    if (!entry) {
+        return;
+    }
+    if (entry->class_dirty) {
+        free(entry->props.name);
+        free(entry->props.class);
+        entry->props.name  = x_cache_copy(ctx, props->name);
+        entry->props.class = x_cache_copy(ctx, props->class);
+        entry->class_dirty = false;
+    }
+    if (entry->title_dirty) {
+        free(entry->props.title);
+        entry->props.title = x_cache_copy(ctx, props->title);
+        entry->title_dirty = false;
+    }
+    *props = entry->props;
+}
+
+static void x_cache_handle_property(Context *ctx, Window window, Atom atom)
+{
+    PropEntry *entry = x_cache_find(&ctx->cache, window);
+    if (!entry) {
+        return;
+    }
+    if (atom == ctx->atoms[ATOM_WM_CLASS]) {
+        entry->class_dirty = true;
+    }
+    else if (atom == ctx->atoms[ATOM_WM_NAME]
+          || atom == ctx->atoms[ATOM_NET_WM_NAME]) {
+        entry->title_dirty = true;
+    }
+}
+
+static void x_cache_process_events(Context *ctx)
+{
+    PropCache *cache = &ctx->cache;
+    cache->hits      = 0;
+    cache->misses    = 0;
+    cache->unchanged = 0;
+    if (!ctx->cache_props) {
+        return;
+    }
+
+    int count = 0;
+    while (XPending(ctx->dpy)) {
+        XEvent ev;
+        XNextEvent(ctx->dpy, &ev);
+        if (ev.type == PropertyNotify) {
+            x_cache_handle_property(ctx, ev.xproperty.window,
+                                    ev.xproperty.atom);
+        }
+        else if (ev.type == DestroyNotify) {
+            x_cache_remove(cache, ev.xdestroywindow.window);
+        }
+        ++count;
+    }
+    debug("Processed %d events, caching %zu windows", count, cache->count);
+}
+
+static unsigned long long x_cache_hash_row(Window parent, int depth,
+                                           int focused,
+                                           const WindowProps *props)
+{
+    /* 64 bit FNV-1a, with a byte that can't be in a string after each. */
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned long long nums[] = {
+        (unsigned long long) parent, (unsigned long long) depth,
+        (unsigned long long) focused,
+    };
+    for (size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); ++i) {
+        for (int shift = 0; shift < 64; shift += 8) {
+            hash ^= (nums[i] >> shift) & 0xff;
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    const char *values[] = {props->name, props->class, props->title};
+    for (int i = 0; i < 3; ++i) {
+        for (const unsigned char *p = (const unsigned char *) values[i];
+                p && *p; ++p) {
+            hash ^= *p;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= values[i] ? 0xff : 0xfe;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void x_insert_window(Context *ctx, Window window, Window parent,
+                            int depth, int focused, const WindowProps *props)
+{
+    PropEntry *entry = ctx->cache_props ? x_cache_find(&ctx->cache, window)
+                                        : NULL;
+    if (entry) {
+        unsigned long long row_hash =
+            x_cache_hash_row(parent, depth, focused, props);
+        if (row_hash == entry->row_hash) {
+            ++ctx->cache.unchanged;
+        }
+        entry->row_hash = row_hash;
+    }
+    db_insert_window(ctx, window, parent, depth, focused, props);
+}
+
+static void x_cache_count(Context *ctx)
+{
+    PropCache *cache = &ctx->cache;
+    if (ctx->cache_props) {
+        debug("Property cache had %d hits and %d misses, %d unchanged rows",
+              cache->hits, cache->misses, cache->unchanged);
+        cache->total_hits      += (unsigned long long) cache->hits;
+        cache->total_misses    += (unsigned long long) cache->misses;
+        cache->total_unchanged += (unsigned long long) cache->unchanged;
+    }
+}
+
+static void x_cache_report(const Context *ctx)
+{
+    const PropCache    *cache = &ctx->cache;
+    unsigned long long total  = cache->total_hits + cache->total_misses;
+    if (ctx->cache_props && total > 0) {
+        warn("Property cache: %llu hits, %llu misses, %.1f%% hit rate, "
+             "%llu unchanged rows", cache->total_hits, cache->total_misses,
+             100.0 * (double) cache->total_hits / (double) total,
+             cache->total_unchanged);
+    }
+}
+
+static unsigned long *x_get_root_windows(Context *ctx, int atom,
+                                         unsigned long *count)
+{
+    Atom          type;
+    int           format;
+    unsigned long after;
+    unsigned char *data = NULL;
+    ++ctx->round_trips;
+    if (XGetWindowProperty(ctx->dpy, ctx->root, ctx->atoms[atom], 0,
+                           UINT32_MAX / 4, false, XA_WINDOW, &type, &format,
+                           count, &after, &data) != Success
+            || type != XA_WINDOW || format != 32) {
+        debug("No '%s' property on the root window", atom_names[atom]);
+        if (data) {
+            XFree(data);
+        }
+        return NULL;
+    }
+    /* Xlib hands out 32 bit properties as longs. */
+    return (unsigned long *) data;
+}
+
+/*
+ * What -A looks at between snapshots: the active window, from the window
+ * manager's _NET_ACTIVE_WINDOW if it sets one and the input focus if not,
+ * its title and the idle time. That's a few round trips instead of a whole
+ * snapshot, and enough to tell that it's time for one.
+ */
+static void x_probe(Context *ctx)
+{
+    x_arena_reset(&ctx->arena);
+    x_get_idle_time(ctx);
+
+    unsigned long count;
+    unsigned long *active = x_get_root_windows(ctx, ATOM_NET_ACTIVE_WINDOW,
+                                               &count);
+    if (active && count > 0) {
+        ctx->probe_window = (Window) active[0];
+    }
+    else {
+        x_get_focused_window(ctx);
+        ctx->probe_window = ctx->focus;
+    }
+    if (active) {
+        XFree(active);
+    }
+
+    char *title = ctx->probe_window != None && ctx->probe_window != PointerRoot
+                ? x_get_title(ctx, ctx->probe_window) : NULL;
+    ctx->probe_title = title ? schema_hash_string(title) : 0;
+    debug("Probed window %llu with title '%s'",
+          (unsigned long long) ctx->probe_window, title ? title : "");
+    /* With -E, property values are malloc'ed rather than in the arena. */
+    if (ctx->track_events) {
+        free(title);
+    }
+}
+
+#ifndef WTSNAP_XCB
+
+static void x_get_window_props(Context *ctx, Window window, WindowProps *props)
+{
+    PropEntry *entry = x_cache_get(ctx, window);
+    if (!entry || entry->class_dirty) {
+        x_get_class(ctx, window, props);
+    }
+    if (!entry || entry->title_dirty) {
+        props->title = x_get_title(ctx, window);
+        if (!props->title) {
+            debug("No title for window %llu", (unsigned long long) window);
+        }
+    }
+    x_cache_update(ctx, entry, props);
+}
+
+/* Xlib can't batch these, but it's one round trip to save several. */
+static bool x_wants_window(Context *ctx, Window window)
+{
+    if (!x_checks_attributes(ctx)) {
+        return true;
+    }
+
+    XWindowAttributes attrs;
+    ++ctx->round_trips;
+    if (!XGetWindowAttributes(ctx->dpy, window, &attrs)) {
+        debug("Can't get attributes of window %llu",
+              (unsigned long long) window);
+        return false;
+    }
+
+    bool wanted = x_wants_attributes(ctx, attrs.map_state != IsUnmapped,
+                                     attrs.override_redirect);
+    if (!wanted) {
+        debug("Skipping window %llu", (unsigned long long) window);
+    }
+    return wanted;
+}
+
+static int x_snap_window(Context *ctx, Window window,
+                         Window parent, int depth);
+
+static int x_snap_children(Context *ctx, Window parent, int depth,
+                           Window *children, unsigned int nchildren)
+{
+    int focused = 0;
+    for (unsigned int i = 0; i < nchildren; ++i) {
+        if (!x_wants_window(ctx, children[i])) {
+            continue;
+        }
+        int child_focused = x_snap_window(ctx, children[i], parent, depth);
+        if (child_focused != 0) {
+            focused = child_focused;
+        }
+    }
+    return focused;
+}
+
+/* Below the top level, -F knows the only child it wants without asking. */
+static int x_snap_focus_child(Context *ctx, Window window, int depth)
+{
+    if (x_on_focus_path(ctx, window, depth - 1)
+            && (size_t) depth <= ctx->focus_path_size) {
+        Window child = ctx->focus_path[depth - 1];
+        if (x_wants_window(ctx, child)) {
+            return x_snap_window(ctx, child, window, depth);
+        }
+    }
+    return 0;
+}
+
+static int x_get_children(Context *ctx, Window window, int depth)
+{
+    if (!x_wants_depth(ctx, depth)) {
+        return 0;
+    }
+    else if (ctx->focus_only && depth > 2) {
+        return x_snap_focus_child(ctx, window, depth);
+    }
+
+    Window       root, parent, *children;
+    unsigned int nchildren;
+    ++ctx->round_trips;
+    if (XQueryTree(ctx->dpy, window, &root, &parent,
+                   &children, &nchildren) >= Success) {
+        if (children) {
+            int focused =
+                x_snap_children(ctx, window, depth, children, nchildren);
+            XFree(children);
+            return focused;
+        }
+    }
+    else {
+        debug("Can't get children of window %llu", (unsigned long long) window);
+    }
+    return 0;
+}
+
+static int x_snap_window(Context *ctx, Window window, Window parent, int depth)
+{
+    debug("Capturing snapshot of window %llu", (unsigned long long) window);
+    int child_focused = x_get_children(ctx, window, depth + 1);
+    int focused       = x_focused(ctx, window, depth, child_focused);
+
+    WindowProps props = {0};
+    x_get_window_props(ctx, window, &props);
+    x_insert_window(ctx, window, parent, depth, focused, &props);
+
+    return focused;
+}
+
+static bool x_snap_clients(Context *ctx)
+{
+    unsigned long nactive, nclients;
+    unsigned long *active  = x_get_root_windows(ctx, ATOM_NET_ACTIVE_WINDOW,
+                                                &nactive);
+    unsigned long *clients = active ? x_get_root_windows(
+                                 ctx, ATOM_NET_CLIENT_LIST, &nclients) : NULL;
+    if (!clients) {
+        if (active) {
+            XFree(active);
+        }
+        return false;
+    }
+
+    x_set_active_window(ctx, nactive > 0 ? (Window) active[0] : None);
+    XFree(active);
+
+    int focused = 0;
+    if (x_wants_depth(ctx, 2)) {
+        for (unsigned long i = 0; i < nclients; ++i) {
+            Window window = (Window) clients[i];
+            if (!x_wants_window(ctx, window)) {
+                continue;
+            }
+            int client_focused = x_focused(ctx, window, 2, 0);
+            if (client_focused != 0) {
+                focused = client_focused;
+            }
+
+            WindowProps props = {0};
+            x_get_window_props(ctx, window, &props);
+            x_insert_window(ctx, window, ctx->root, 2, client_focused, &props);
+        }
+    }
+    XFree(clients);
+
+    WindowProps props = {0};
+    x_get_window_props(ctx, ctx->root, &props);
+    x_insert_window(ctx, ctx->root, None, 1, focused, &props);
+    return true;
+}
+
+#else
+
+/*
+ * The XCB capture backend walks the tree one level at a time. It sends the
+ * QueryTree and GetProperty requests for every window on a level before
+ * waiting on any of the replies, so on a high latency connection a snapshot
+ * costs one round trip per tree level rather than several per window. Text
+ * conversion is left to Xlib, so the rows come out the same either way.
+ *
+ * The requests go over the connection that Xlib already has open, rather
+ * than a second one to the same server. Xlib keeps owning it, so events are
+ * still read through Xlib and XCloseDisplay closes it.
+ */
+static void x_xcb_connect(Context *ctx)
+{
+    debug("Using the XCB connection of the display");
+    ctx->xcb = XGetXCBConnection(ctx->dpy);
+}
+
+static XcbNode *x_xcb_push_node(Context *ctx, xcb_window_t window,
+                                size_t parent, int depth)
+{
+    if (ctx->xcb_nodes_size == ctx->xcb_nodes_capacity) {
+        size_t  capacity = ctx->xcb_nodes_capacity
+                         ? ctx->xcb_nodes_capacity * 2 : 256;
+        XcbNode *nodes   = realloc(ctx->xcb_nodes, capacity * sizeof(*nodes));
+        if (!nodes) {
+            die(ctx, "Can't realloc %zu XCB nodes", capacity);
+        }
+        ++ctx->allocations;
+        ctx->xcb_nodes          = nodes;
+        ctx->xcb_nodes_capacity = capacity;
+    }
+
+    XcbNode *node = &ctx->xcb_nodes[ctx->xcb_nodes_size++];
+    memset(node, 0, sizeof(*node));
+    node->window = window;
+    node->parent = parent;
+    node->depth  = depth;
+    return node;
+}
+
+/*
+ * With -M or -O, the attributes of a child are requested as soon as it's
+ * known, so that they're back by the time its level is fetched and it can
+ * be dropped before any of its other requests are sent.
+ */
+static void x_xcb_push_child(Context *ctx, xcb_window_t window,
+                             size_t parent, int depth)
+{
+    XcbNode *node = x_xcb_push_node(ctx, window, parent, depth);
+    if (x_checks_attributes(ctx)) {
+        node->attributes_cookie = xcb_get_window_attributes(ctx->xcb, window);
+        node->checking          = true;
+    }
+}
+
+static void x_xcb_check_node(Context *ctx, XcbNode *node)
+{
+    if (!node->checking) {
+        return;
+    }
+
+    xcb_generic_error_t               *err   = NULL;
+    xcb_get_window_attributes_reply_t *reply =
+        xcb_get_window_attributes_reply(ctx->xcb, node->attributes_cookie,
+                                        &err);
+    if (err) {
+        debug("Can't get attributes of window %llu: error code %d",
+              (unsigned long long) node->window, (int) err->error_code);
+        free(err);
+    }
+
+    node->checking = false;
+    node->skip     = !reply
+                  || !x_wants_attributes(
+                         ctx, reply->map_state != XCB_MAP_STATE_UNMAPPED,
+                         reply->override_redirect);
+    if (node->skip) {
+        debug("Skipping window %llu", (unsigned long long) node->window);
+    }
+    free(reply);
+}
+
+/* Below the top level, -F knows the only child it wants without asking. */
+static void x_xcb_follow_focus(Context *ctx, size_t index)
+{
+    const XcbNode *node = &ctx->xcb_nodes[index];
+    int           depth = node->depth + 1;
+    if (x_wants_depth(ctx, depth)
+            && x_on_focus_path(ctx, (Window) node->window, node->depth)
+            && (size_t) depth <= ctx->focus_path_size) {
+        x_xcb_push_child(ctx, (xcb_window_t) ctx->focus_path[depth - 1],
+                         index, depth);
+    }
+}
+
+/* Their property values are in the arena, so this just forgets them. */
+static void x_xcb_free_nodes(Context *ctx)
+{
+    ctx->xcb_nodes_size = 0;
+}
+
+static xcb_get_property_cookie_t x_xcb_request_property(Context *ctx,
+                                                        xcb_window_t window,
+                                                        int atom)
+{
+    return xcb_get_property(ctx->xcb, false, window, ctx->atoms[atom],
+                            XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX / 4);
+}
+
+static xcb_get_property_reply_t *x_xcb_property_reply(
+    Context *ctx, xcb_get_property_cookie_t cookie, int atom)
+{
+    xcb_generic_error_t      *err   = NULL;
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(ctx->xcb, cookie,
+                                                             &err);
+    if (err) {
+        warn("X11 error getting property '%s': error code %d",
+             atom_names[atom], (int) err->error_code);
+        free(err);
+    }
+    if (reply && reply->type == XCB_NONE) {
+        free(reply);
+        reply = NULL;
+    }
+    return reply;
+}
+
+/* Same as what XGetClassHint does with the WM_CLASS property. */
+static void x_xcb_read_class(Context *ctx, XcbNode *node)
+{
+    xcb_get_property_reply_t *reply =
+        x_xcb_property_reply(ctx, node->class_cookie, ATOM_WM_CLASS);
+    if (!reply) {
+        return;
+    }
+
+    /* Both strings stay in the one buffer, the name being cut off by its NUL. */
+    int len = xcb_get_property_value_length(reply);
+    if (reply->type == XCB_ATOM_STRING && reply->format == 8 && len > 0) {
+        char *value = x_arena_alloc(ctx, "WM_CLASS", (size_t) len + 2);
+        if (value) {
+            memcpy(value, xcb_get_property_value(reply), (size_t) len);
+            value[len]     = '\0';
+            value[len + 1] = '\0';
+
+            int name_len = (int) strlen(value);
+            node->props.name = value;
+            if (name_len == len) {
+                --name_len;
+            }
+            node->props.class = value + name_len + 1;
+        }
+    }
+    free(reply);
+}
+
+/* Same as what x_get_string_property does with XGetTextProperty. */
+static char *x_xcb_read_string(Context *ctx, xcb_get_property_cookie_t cookie,
+                               int atom)
+{
+    xcb_get_property_reply_t *reply = x_xcb_property_reply(ctx, cookie, atom);
+    if (!reply) {
+        return NULL;
+    }
+
+    const char *prop_name = atom_names[atom];
+    char       *out       = NULL;
+    int        len        = xcb_get_property_value_length(reply);
+    int        nitems     = (int) reply->value_len;
+    if (nitems > 0) {
+        char *value = x_arena_alloc(ctx, prop_name, (size_t) len + 1);
+        if (value) {
+            memcpy(value, xcb_get_property_value(reply), (size_t) len);
+            value[len] = '\0';
+
+            if (reply->type == XCB_ATOM_STRING
+                    || reply->type == ctx->atoms[ATOM_UTF8_STRING]) {
+                out = value;
+            }
+            else {
+                XTextProperty xtp;
+                xtp.value      = (unsigned char *) value;
+                xtp.encoding   = reply->type;
+                xtp.format     = reply->format;
+                xtp.nitems     = (unsigned long) nitems;
+                char **strings = NULL;
+                int  nstrings  = 0;
+                int  result    = XmbTextPropertyToTextList(ctx->dpy, &xtp,
+                                                           &strings, &nstrings);
+                if (result >= Success && nstrings > 0 && strings && strings[0]) {
+                    out = x_copy_string_property_value(ctx, prop_name,
+                                                       strings[0]);
+                }
+                if (strings) {
+                    XFreeStringList(strings);
+                }
+            }
+        }
+    }
+
+    free(reply);
+    return out;
+}
+
+static void x_xcb_read_children(Context *ctx, size_t index)
+{
+    xcb_generic_error_t     *err   = NULL;
+    xcb_query_tree_reply_t  *reply = xcb_query_tree_reply(
+        ctx->xcb, ctx->xcb_nodes[index].tree_cookie, &err);
+    if (err) {
+        warn("X11 error getting children of window %llu: error code %d",
+             (unsigned long long) ctx->xcb_nodes[index].window,
+             (int) err->error_code);
+        free(err);
+    }
+    if (!reply) {
+        return;
+    }
+
+    int          nchildren = xcb_query_tree_children_length(reply);
+    xcb_window_t *children = xcb_query_tree_children(reply);
+    int          depth     = ctx->xcb_nodes[index].depth + 1;
+    for (int i = 0; i < nchildren; ++i) {
+        x_xcb_push_child(ctx, children[i], index, depth);
+    }
+    free(reply);
+}
+
+static void x_xcb_fetch_level(Context *ctx, size_t start, size_t end)
+{
+    debug("Fetching %zu windows at depth %d",
+          end - start, ctx->xcb_nodes[start].depth);
+
+    /* All replies of a batch arrive together, so waiting on one counts. */
+    bool waiting = false;
+    for (size_t i = start; i < end; ++i) {
+        waiting = waiting || ctx->xcb_nodes[i].checking;
+        x_xcb_check_node(ctx, &ctx->xcb_nodes[i]);
+    }
+    if (waiting) {
+        ++ctx->round_trips;
+    }
+
+    waiting = false;
+    for (size_t i = start; i < end; ++i) {
+        XcbNode *node = &ctx->xcb_nodes[i];
+        if (node->skip) {
+            continue;
+        }
+        node->have_tree = !node->leaf && x_wants_depth(ctx, node->depth + 1)
+                       && (!ctx->focus_only || node->depth == 1);
+        if (node->have_tree) {
+            node->tree_cookie = xcb_query_tree(ctx->xcb, node->window);
+        }
+
+        PropEntry *entry  = x_cache_get(ctx, (Window) node->window);
+        node->cache_entry = entry;
+        node->fetch_class = !entry || entry->class_dirty;
+        node->fetch_title = !entry || entry->title_dirty;
+        if (node->fetch_class) {
+            node->class_cookie  = x_xcb_request_property(ctx, node->window,
+                                                         ATOM_WM_CLASS);
+        }
+        if (node->fetch_title) {
+            node->net_wm_cookie = x_xcb_request_property(ctx, node->window,
+                                                         ATOM_NET_WM_NAME);
+            node->wm_cookie     = x_xcb_request_property(ctx, node->window,
+                                                         ATOM_WM_NAME);
+        }
+        waiting = waiting || node->have_tree
+               || node->fetch_class || node->fetch_title;
+    }
+    xcb_flush(ctx->xcb);
+    if (waiting) {
+        ++ctx->round_trips;
+    }
+
+    /* Pushing children may move the array, so always go through the index. */
+    for (size_t i = start; i < end; ++i) {
+        if (ctx->xcb_nodes[i].skip) {
+            continue;
+        }
+        else if (ctx->xcb_nodes[i].have_tree) {
+            x_xcb_read_children(ctx, i);
+        }
+        else if (ctx->focus_only) {
+            x_xcb_follow_focus(ctx, i);
+        }
+
+        XcbNode *node = &ctx->xcb_nodes[i];
+        if (node->fetch_class) {
+            x_xcb_read_class(ctx, node);
+        }
+
+        /* WM_NAME was requested along on the off chance it's needed. */
+        if (node->fetch_title) {
+            node->props.title = x_xcb_read_string(ctx, node->net_wm_cookie,
+                                                  ATOM_NET_WM_NAME);
+            if (node->props.title) {
+                xcb_discard_reply(ctx->xcb, node->wm_cookie.sequence);
+            }
+            else {
+                node->props.title = x_xcb_read_string(ctx, node->wm_cookie,
+                                                      ATOM_WM_NAME);
+            }
+        }
+        x_cache_update(ctx, node->cache_entry, &node->props);
+    }
+}
+
+static void x_xcb_insert_nodes(Context *ctx)
+{
+    /*
+     * Nodes are in breadth-first order, so going backwards visits every child
+     * before its parent, which lets focus bubble up the same way it does in
+     * the recursive Xlib walk, where the last focused child wins.
+     */
+    for (size_t i = ctx->xcb_nodes_size; i-- > 0;) {
+        XcbNode *node = &ctx->xcb_nodes[i];
+        if (node->skip) {
+            continue;
+        }
+
+        Window window  = (Window) node->window;
+        int    focused = x_focused(ctx, window, node->depth,
+                                   node->child_focused);
+        Window parent  = None;
+
+        if (node->parent != SIZE_MAX) {
+            XcbNode *parent_node = &ctx->xcb_nodes[node->parent];
+            parent = (Window) parent_node->window;
+            if (focused != 0 && parent_node->child_focused == 0) {
+                parent_node->child_focused = focused;
+            }
+        }
+
+        x_insert_window(ctx, window, parent, node->depth, focused,
+                        &node->props);
+    }
+
+    x_xcb_free_nodes(ctx);
+}
+
+static void x_xcb_recurse_windows(Context *ctx)
+{
+    x_xcb_push_node(ctx, (xcb_window_t) ctx->root, SIZE_MAX, 1);
+
+    size_t start = 0;
+    while (start < ctx->xcb_nodes_size) {
+        size_t end = ctx->xcb_nodes_size;
+        x_xcb_fetch_level(ctx, start, end);
+        start = end;
+    }
+
+    x_xcb_insert_nodes(ctx);
+}
+
+static xcb_get_property_reply_t *x_xcb_root_windows(
+    Context *ctx, xcb_get_property_cookie_t cookie, int atom)
+{
+    xcb_get_property_reply_t *reply = x_xcb_property_reply(ctx, cookie, atom);
+    if (reply && (reply->type != XCB_ATOM_WINDOW || reply->format != 32)) {
+        free(reply);
+        reply = NULL;
+    }
+    if (!reply) {
+        debug("No '%s' property on the root window", atom_names[atom]);
+    }
+    return reply;
+}
+
+/*
+ * Both root properties come back in one round trip, and the clients are
+ * fetched as a single level below the root without asking for children.
+ */
+static bool x_snap_clients(Context *ctx)
+{
+    xcb_window_t              root           = (xcb_window_t) ctx->root;
+    xcb_get_property_cookie_t active_cookie  =
+        x_xcb_request_property(ctx, root, ATOM_NET_ACTIVE_WINDOW);
+    xcb_get_property_cookie_t clients_cookie =
+        x_xcb_request_property(ctx, root, ATOM_NET_CLIENT_LIST);
+    xcb_flush(ctx->xcb);
+    ++ctx->round_trips;
+
+    xcb_get_property_reply_t *active  =
+        x_xcb_root_windows(ctx, active_cookie, ATOM_NET_ACTIVE_WINDOW);
+    xcb_get_property_reply_t *clients =
+        x_xcb_root_windows(ctx, clients_cookie, ATOM_NET_CLIENT_LIST);
+    if (!active || !clients) {
+        free(active);
+        free(clients);
+        return false;
+    }
+
+    const xcb_window_t *active_value = xcb_get_property_value(active);
+    x_set_active_window(ctx, active->value_len > 0
+                           ? (Window) active_value[0] : None);
+    free(active);
+
+    x_xcb_push_node(ctx, root, SIZE_MAX, 1)->leaf = true;
+    if (x_wants_depth(ctx, 2)) {
+        const xcb_window_t *windows = xcb_get_property_value(clients);
+        for (uint32_t i = 0; i < clients->value_len; ++i) {
+            x_xcb_push_child(ctx, windows[i], 0, 2);
+            ctx->xcb_nodes[ctx->xcb_nodes_size - 1].leaf = true;
+        }
+    }
+    free(clients);
+
+    x_xcb_fetch_level(ctx, 0, ctx->xcb_nodes_size);
+    x_xcb_insert_nodes(ctx);
+    return true;
+}
+
+#endif
+
+static void x_recurse_windows(Context *ctx)
+{
+    x_get_focus_path(ctx);
+#ifndef WTSNAP_XCB
+    x_snap_window(ctx, ctx->root, None, 1);
+#else
+    x_xcb_recurse_windows(ctx);
+#endif
+}
+
+/*
+ * Every screen has a root window of its own, each captured like it was the
+ * only one. Idle time and the tree that -E keeps stay with the default.
+ */
+static void x_snap_screens(Context *ctx)
+{
+    Window default_root = ctx->root;
+    int    count        = XScreenCount(ctx->dpy);
+    for (int screen = 0; screen < count; ++screen) {
+        debug("Capturing screen %d of %d", screen + 1, count);
+        ctx->screen = screen;
+        ctx->root   = XRootWindow(ctx->dpy, screen);
+        if (!ctx->use_clients || !x_snap_clients(ctx)) {
+            x_get_focused_window(ctx);
+            x_recurse_windows(ctx);
+        }
+    }
+    ctx->screen = XDefaultScreen(ctx->dpy);
+    ctx->root   = default_root;
+}
+
+
+/*
+ * In daemon mode with -E, the window tree is kept in memory and updated from
+ * the SubstructureNotify and PropertyNotify events of every window in it, so
+ * a snapshot only needs to go to the X server for windows that changed.
+ */
+static size_t x_tree_bucket(const XTree *tree, Window window)
+{
+    return x_hash_window(window, tree->nbuckets);
+}
+
+static XNode *x_tree_find(const XTree *tree, Window window)
+{
+    if (tree->nbuckets == 0) {
+        return NULL;
+    }
+    XNode *node = tree->buckets[x_tree_bucket(tree, window)];
+    while (node && node->window != window) {
+        node = node->hash_next;
+    }
+    return node;
+}
+
+static void x_tree_grow(Context *ctx, XTree *tree)
+{
+    size_t nbuckets = tree->nbuckets ? tree->nbuckets * 2 : 256;
+    XNode  **old    = tree->buckets;
+    size_t old_size = tree->nbuckets;
+
+    tree->buckets = calloc(nbuckets, sizeof(*tree->buckets));
+    if (!tree->buckets) {
+        tree->buckets = old;
+        die(ctx, "Can't calloc %zu window tree buckets", nbuckets);
+    }
+    ++ctx->allocations;
+    tree->nbuckets = nbuckets;
+
+    for (size_t i = 0; i < old_size; ++i) {
+        XNode *node = old[i];
+        while (node) {
+            XNode  *next = node->hash_next;
+            size_t b     = x_tree_bucket(tree, node->window);
+            node->hash_next  = tree->buckets[b];
+            tree->buckets[b] = node;
+            node = next;
+        }
+    }
+    free(old);
+}
+
+static void x_tree_link_child(XNode *parent, XNode *node)
+{
+    node->parent       = parent;
+    node->next_sibling = NULL;
+    node->prev_sibling = parent->last_child;
+    if (parent->last_child) {
+        parent->last_child->next_sibling = node;
+    }
+    else {
+        parent->first_child = node;
+    }
+    parent->last_child = node;
+}
+
+static void x_tree_unlink_child(XNode *node)
+{
+    XNode *parent = node->parent;
+    if (!parent) {
+        return;
+    }
+    if (node->prev_sibling) {
+        node->prev_sibling->next_sibling = node->next_sibling;
+    }
+    else {
+        parent->first_child = node->next_sibling;
+    }
+    if (node->next_sibling) {
+        node->next_sibling->prev_sibling = node->prev_sibling;
+    }
+    else {
+        parent->last_child = node->prev_sibling;
+    }
+    node->parent       = NULL;
+    node->prev_sibling = NULL;
+    node->next_sibling = NULL;
+}
+
+static XNode *x_tree_insert(Context *ctx, XTree *tree, Window window,
+                            XNode *parent)
+{
+    if (tree->count >= tree->nbuckets) {
+        x_tree_grow(ctx, tree);
+    }
+
+    XNode *node = calloc(1, sizeof(*node));
+    if (!node) {
+        die(ctx, "Can't calloc window tree node");
+    }
+    ++ctx->allocations;
+    node->window      = window;
+    node->class_dirty = true;
+    node->title_dirty = true;
+    node->mapped      = true;
+
+    size_t b         = x_tree_bucket(tree, window);
+    node->hash_next  = tree->buckets[b];
+    tree->buckets[b] = node;
+    ++tree->count;
+
+    if (parent) {
+        x_tree_link_child(parent, node);
+    }
+    return node;
+}
+
+static void x_tree_remove(XTree *tree, XNode *node)
+{
+    while (node->first_child) {
+        x_tree_remove(tree, node->first_child);
+    }
+    x_tree_unlink_child(node);
+
+    XNode **pp = &tree->buckets[x_tree_bucket(tree, node->window)];
+    while (*pp != node) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = node->hash_next;
+    --tree->count;
+
+    if (tree->root == node) {
+        tree->root = NULL;
+    }
+    x_free_window_props(&node->props);
+    free(node);
+}
+
+static void x_tree_free(XTree *tree)
+{
+    if (tree->root) {
+        x_tree_remove(tree, tree->root);
+    }
+    free(tree->buckets);
+    tree->buckets  = NULL;
+    tree->nbuckets = 0;
+    tree->count    = 0;
+}
+
+/*
+ * Input is selected before querying the children, so that any child created
+ * in between either shows up in the query or in a CreateNotify event. Getting
+ * it from both is fine, since windows that are already known are skipped.
+ * The same goes for the attributes that -M and -O look at, which are kept up
+ * to date from MapNotify, UnmapNotify and ConfigureNotify events after.
+ */
+static void x_tree_add_subtree(Context *ctx, XTree *tree, Window window,
+                               XNode *parent)
+{
+    if (x_tree_find(tree, window)) {
+        return;
+    }
+    debug("Tracking window %llu", (unsigned long long) window);
+    XNode *node = x_tree_insert(ctx, tree, window, parent);
+    XSelectInput(ctx->dpy, window, SubstructureNotifyMask | PropertyChangeMask);
+
+    XWindowAttributes attrs;
+    if (x_checks_attributes(ctx)) {
+        ++ctx->round_trips;
+        if (XGetWindowAttributes(ctx->dpy, window, &attrs)) {
+            node->mapped            = attrs.map_state != IsUnmapped;
+            node->override_redirect = attrs.override_redirect;
+        }
+    }
+
+    Window       root, parent_window, *children;
+    unsigned int nchildren;
+    ++ctx->round_trips;
+    if (XQueryTree(ctx->dpy, window, &root, &parent_window,
+                   &children, &nchildren) >= Success) {
+        if (children) {
+            for (unsigned int i = 0; i < nchildren; ++i) {
+                x_tree_add_subtree(ctx, tree, children[i], node);
+            }
+            XFree(children);
+        }
+    }
+    else {
+        debug("Can't get children of window %llu", (unsigned long long) window);
+    }
+}
+
+static void x_tree_init(Context *ctx)
+{
+    debug("Building window tree");
+    XTree *tree = &ctx->tree;
+    x_tree_add_subtree(ctx, tree, ctx->root, NULL);
+    tree->root = x_tree_find(tree, ctx->root);
+}
+
+static void x_tree_handle_reparent(Context *ctx, XTree *tree,
+                                   const XReparentEvent *ev)
+{
+    XNode *node   = x_tree_find(tree, ev->window);
+    XNode *parent = x_tree_find(tree, ev->parent);
+    if (node && parent) {
+        if (node->parent != parent) {
+            x_tree_unlink_child(node);
+            x_tree_link_child(parent, node);
+        }
+    }
+    else if (node) {
+        x_tree_remove(tree, node);
+    }
+    else if (parent) {
+        x_tree_add_subtree(ctx, tree, ev->window, parent);
+    }
+}
+
+static void x_tree_handle_property(Context *ctx, XTree *tree,
+                                   const XPropertyEvent *ev)
+{
+    XNode *node = x_tree_find(tree, ev->window);
+    if (!node) {
+        return;
+    }
+    if (ev->atom == ctx->atoms[ATOM_WM_CLASS]) {
+        node->class_dirty = true;
+    }
+    else if (ev->atom == ctx->atoms[ATOM_WM_NAME]
+          || ev->atom == ctx->atoms[ATOM_NET_WM_NAME]) {
+        node->title_dirty = true;
+    }
+}
+
+static void x_tree_handle_event(Context *ctx, XTree *tree, XEvent *ev)
+{
+    XNode *node;
+    switch (ev->type) {
+        case CreateNotify:
+            node = x_tree_find(tree, ev->xcreatewindow.parent);
+            if (node) {
+                x_tree_add_subtree(ctx, tree, ev->xcreatewindow.window, node);
+            }
+            break;
+        case DestroyNotify:
+            node = x_tree_find(tree, ev->xdestroywindow.window);
+            if (node && node != tree->root) {
+                debug("Untracking window %llu",
+                      (unsigned long long) node->window);
+                x_tree_remove(tree, node);
+            }
+            break;
+        case ReparentNotify:
+            x_tree_handle_reparent(ctx, tree, &ev->xreparent);
+            break;
+        case MapNotify:
+            node = x_tree_find(tree, ev->xmap.window);
+            if (node) {
+                node->mapped            = true;
+                node->override_redirect = ev->xmap.override_redirect;
+            }
+            break;
+        case UnmapNotify:
+            node = x_tree_find(tree, ev->xunmap.window);
+            if (node) {
+                node->mapped = false;
+            }
+            break;
+        case ConfigureNotify:
+            node = x_tree_find(tree, ev->xconfigure.window);
+            if (node) {
+                node->override_redirect = ev->xconfigure.override_redirect;
+            }
+            break;
+        case PropertyNotify:
+            x_tree_handle_property(ctx, tree, &ev->xproperty);
+            break;
+        default:
+            break;
+    }
+}
+
+static void x_tree_process_events(Context *ctx)
+{
+    XTree *tree = &ctx->tree;
+    int   count = 0;
+    while (XPending(ctx->dpy)) {
+        XEvent ev;
+        XNextEvent(ctx->dpy, &ev);
+        x_tree_handle_event(ctx, tree, &ev);
+        ++count;
+    }
+    debug("Processed %d events, tracking %zu windows", count, tree->count);
+}
+
+static void x_tree_refresh_node(Context *ctx, XNode *node)
+{
+    if (node->class_dirty) {
+        free(node->props.name);
+        free(node->props.class);
+        node->props.name  = NULL;
+        node->props.class = NULL;
+        x_get_class(ctx, node->window, &node->props);
+        node->class_dirty = false;
+    }
+
+    if (node->title_dirty) {
+        free(node->props.title);
+        node->props.title = x_get_title(ctx, node->window);
+        node->title_dirty = false;
+    }
+}
+
+/* Below the top level, -F only follows the focus path. */
+static bool x_tree_wants_node(const Context *ctx, const XNode *node, int depth)
+{
+    return x_wants_depth(ctx, depth)
+        && (!ctx->focus_only || depth <= 2
+            || x_on_focus_path(ctx, node->window, depth))
+        && x_wants_attributes(ctx, node->mapped, node->override_redirect);
+}
+
+static int x_tree_snap_node(Context *ctx, XNode *node, int depth)
+{
+    int child_focused = 0;
+    for (XNode *child = node->first_child; child; child = child->next_sibling) {
+        if (!x_tree_wants_node(ctx, child, depth + 1)) {
+            continue;
+        }
+        int focused = x_tree_snap_node(ctx, child, depth + 1);
+        if (focused != 0) {
+            child_focused = focused;
+        }
+    }
+
+    int focused = x_focused(ctx, node->window, depth, child_focused);
+
+    x_tree_refresh_node(ctx, node);
+    Window parent = node->parent ? node->parent->window : None;
+    db_insert_window(ctx, node->window, parent, depth, focused, &node->props);
+    return focused;
+}
+
+/* The tree already knows every parent, so this doesn't ask the X server. */
+static void x_tree_get_focus_path(Context *ctx)
+{
+    ctx->focus_path_size = 0;
+    if (!x_pruning(ctx)) {
+        return;
+    }
+    for (XNode *node = x_tree_find(&ctx->tree, ctx->focus); node;
+            node = node->parent) {
+        x_push_focus_path(ctx, node->window);
+    }
+    x_finish_focus_path(ctx);
+}
+
+static void x_tree_snap(Context *ctx)
+{
+    x_tree_process_events(ctx);
+    x_tree_get_focus_path(ctx);
+    if (ctx->tree.root) {
+        x_tree_snap_node(ctx, ctx->tree.root, 1);
+    }
+}
+
+
+static Queue *queue_init(Context *ctx)
+{
+    Queue *queue = calloc(1, sizeof(*queue));
+    if (!queue) {
+        die(ctx, "Can't calloc queue");
+    }
+    ctx->queue = queue;
+
+    /* A power of two, so the counts can wrap around and still line up. */
+    queue->capacity = QUEUE_MIN_KB * 1024;
+    while (queue->capacity < ctx->queue_size) {
+        queue->capacity *= 2;
+    }
+    queue->data = malloc(queue->capacity);
+    if (!queue->data) {
+        die(ctx, "Can't malloc %zu bytes for queue", queue->capacity);
+    }
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->stop, false);
+    atomic_init(&queue->starved, false);
+
+    if (sem_init(&queue->ready, 0, 0) != 0) {
+        die(ctx, "Can't create queue semaphore: %s", strerror(errno));
+    }
+    ++queue->sems;
+    if (sem_init(&queue->room, 0, 0) != 0) {
+        die(ctx, "Can't create queue semaphore: %s", strerror(errno));
+    }
+    ++queue->sems;
+    debug("Queue has %zu bytes", queue->capacity);
+    return queue;
+}
+
+static Queue *queue_free(Queue *queue)
+{
+    if (queue) {
+        if (queue->sems > 1) {
+            sem_destroy(&queue->room);
+        }
+        if (queue->sems > 0) {
+            sem_destroy(&queue->ready);
+        }
+        free(queue->data);
+        free(queue);
+    }
+    return NULL;
+}
+
+/* Waits on a semaphore until wait_ns from now or until a signal comes in. */
+static bool queue_timed_wait(sem_t *sem, long long wait_ns)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long deadline_ns = (long long) ts.tv_sec * 1000000000LL
+                          + ts.tv_nsec + wait_ns;
+    ts.tv_sec  = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    return sem_timedwait(sem, &ts) == 0;
+}
+
+static void queue_put(unsigned char **p, const void *value, size_t size)
+{
+    if (size > 0) {
+        memcpy(*p, value, size);
+        *p += size;
+    }
+}
+
+static void queue_get(unsigned char **p, void *value, size_t size)
+{
+    memcpy(value, *p, size);
+    *p += size;
+}
+
+static size_t queue_string_size(const char *value)
+{
+    return sizeof(uint32_t) + (value ? strlen(value) + 1 : 0);
+}
+
+static void queue_put_string(unsigned char **p, const char *value)
+{
+    uint32_t size = value ? (uint32_t) strlen(value) + 1 : 0;
+    queue_put(p, &size, sizeof(size));
+    queue_put(p, value, size);
+}
+
+static char *queue_get_string(unsigned char **p)
+{
+    uint32_t size;
+    queue_get(p, &size, sizeof(size));
+    char     *value = size ? (char *) *p : NULL;
+    *p += size;
+    return value;
+}
+
+static size_t queue_record_size(const Context *ctx, bool snapshots)
+{
+    size_t size = 3 * sizeof(uint32_t);
+    for (int i = 0; i < ctx->capture_count && snapshots; ++i) {
+        const Context *capture = &ctx->captures[i];
+        if (!capture->capture_ok) {
+            continue;
+        }
+        size += sizeof(long long) + 2 * sizeof(int)
+              + sizeof(const char *) + sizeof(uint32_t);
+        for (size_t j = 0; j < capture->capture_rows_size; ++j) {
+            const WindowProps *props = &capture->capture_rows[j].props;
+            size += 2 * sizeof(uint32_t) + 3 * sizeof(int)
+                  + queue_string_size(props->name)
+                  + queue_string_size(props->class)
+                  + queue_string_size(props->title);
+        }
+    }
+    return (size + QUEUE_ALIGN - 1) & ~(size_t) (QUEUE_ALIGN - 1);
+}
+
+/*
+ * Returns where a record of the given size goes, or NULL if there's no room
+ * for it right now. If it doesn't fit before the end of the buffer, the rest
+ * is skipped and marked as such, which only shows once the record is pushed.
+ */
+static unsigned char *queue_reserve(Queue *queue, size_t size, size_t *skip)
+{
+    size_t head  = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail  = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    size_t pos   = head & (queue->capacity - 1);
+    size_t left  = queue->capacity - pos;
+    *skip        = left < size ? left : 0;
+    if (head - tail + *skip + size > queue->capacity) {
+        return NULL;
+    }
+    else if (*skip) {
+        uint32_t wrap = QUEUE_WRAP;
+        memcpy(queue->data + pos, &wrap, sizeof(wrap));
+        return queue->data;
+    }
+    else {
+        return queue->data + pos;
+    }
+}
+
+/*
+ * Backpressure: waits for the writer to make room until the next snapshot is
+ * due or a signal says the daemon is stopping. Wakeups from earlier pops are
+ * used up first, so this doesn't spin through them.
+ */
+static unsigned char *queue_wait_for_room(Context *ctx, size_t size,
+                                          size_t *skip)
+{
+    Queue *queue = ctx->queue;
+    for (;;) {
+        while (sem_trywait(&queue->room) == 0) {
+            continue;
+        }
+
+        unsigned char *p = queue_reserve(queue, size, skip);
+        long long     wait_ns = ctx->deadline_ns - monotonic_ns();
+        if (!p) {
+            atomic_store(&queue->starved, true);
+            sem_post(&queue->ready);
+        }
+        if (p || wait_ns <= 0 || !queue_timed_wait(&queue->room, wait_ns)) {
+            return p;
+        }
+    }
+}
+
+/*
+ * Pushes the snapshots of all displays that were captured, or with snapshots
+ * being false, only the correction of the previous one's sample time.
+ */
+static bool queue_push(Context *ctx, bool snapshots)
+{
+    Queue  *queue = ctx->queue;
+    size_t size   = queue_record_size(ctx, snapshots);
+    if (size > queue->capacity) {
+        warn("Snapshot of %zu bytes doesn't fit into a queue of %zu bytes",
+             size, queue->capacity);
+        return false;
+    }
+
+    size_t        skip;
+    unsigned char *record = queue_reserve(queue, size, &skip);
+    if (!record) {
+        debug("Queue is full, waiting for the writer");
+        record = queue_wait_for_room(ctx, size, &skip);
+        if (!record) {
+            return false;
+        }
+    }
+
+    long long     sample_time = (long long) ctx->snapshot_sample_time
+                              + ctx->queue_dropped_time;
+    int           sample      = sample_time <= INT_MAX ? (int) sample_time
+                                                       : INT_MAX;
+    uint32_t      count       = 0;
+    unsigned char *p          = record + 3 * sizeof(uint32_t);
+    for (int i = 0; i < ctx->capture_count && snapshots; ++i) {
+        const Context *capture = &ctx->captures[i];
+        if (!capture->capture_ok) {
+            continue;
+        }
+        uint32_t rows = (uint32_t) capture->capture_rows_size;
+        queue_put(&p, &capture->snapshot_epoch_ms, sizeof(long long));
+        queue_put(&p, &sample, sizeof(int));
+        queue_put(&p, &capture->idle_time, sizeof(int));
+        queue_put(&p, &capture->display_tag, sizeof(const char *));
+        queue_put(&p, &rows, sizeof(rows));
+        for (size_t j = 0; j < capture->capture_rows_size; ++j) {
+            /* X window ids are 29 bits, they fit into 32. */
+            const CaptureRow *row    = &capture->capture_rows[j];
+            uint32_t         ids[2]  = {(uint32_t) row->window,
+                                        (uint32_t) row->parent};
+            int              ints[3] = {row->depth, row->focused,
+                                        row->screen};
+            queue_put(&p, ids, sizeof(ids));
+            queue_put(&p, ints, sizeof(ints));
+            queue_put_string(&p, row->props.name);
+            queue_put_string(&p, row->props.class);
+            queue_put_string(&p, row->props.title);
+        }
+        ctx->rows += (int) rows;
+        ++count;
+    }
+
+    uint32_t header[3] = {(uint32_t) size, count,
+                          (uint32_t) ctx->previous_sample_time};
+    memcpy(record, header, sizeof(header));
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + skip + size,
+                          memory_order_release);
+    sem_post(&queue->ready);
+    return true;
+}
+
+static unsigned char *queue_peek(Queue *queue)
+{
+    for (;;) {
+        size_t read = queue->read;
+        size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (read == head) {
+            return NULL;
+        }
+
+        size_t        pos    = read & (queue->capacity - 1);
+        unsigned char *record = queue->data + pos;
+        uint32_t      size;
+        memcpy(&size, record, sizeof(size));
+        if (size != QUEUE_WRAP) {
+            return record;
+        }
+        queue->read = read + queue->capacity - pos;
+    }
+}
+
+static void queue_pop(Queue *queue, const unsigned char *record)
+{
+    uint32_t size;
+    memcpy(&size, record, sizeof(size));
+    queue->read += size;
+}
+
+/*
+ * Once committed, the records up to the read position are done with. The
+ * previous snapshot is remembered as of then, so that records written again
+ * after a rollback fix up the right one.
+ */
+static void queue_release(Context *ctx)
+{
+    Queue *queue = ctx->queue;
+    atomic_store(&queue->starved, false);
+    atomic_store_explicit(&queue->tail, queue->read, memory_order_release);
+    sem_post(&queue->room);
+    ctx->queue_previous_id      = ctx->previous_id;
+    ctx->queue_previous_planned = ctx->previous_planned;
+}
+
+static void queue_rewind(Context *ctx)
+{
+    Queue  *queue = ctx->queue;
+    size_t tail   = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (queue->read != tail) {
+        warn("Writing %d uncommitted snapshots again", ctx->tx_snapshots);
+    }
+    queue->read           = tail;
+    ctx->previous_id      = ctx->queue_previous_id;
+    ctx->previous_planned = ctx->queue_previous_planned;
+}
+
+static void queue_write_record(Context *ctx, unsigned char *record)
+{
+    uint32_t      header[3];
+    unsigned char *p = record;
+    queue_get(&p, header, sizeof(header));
+
+    db_begin_snapshot(ctx);
+    db_fix_previous(ctx);
+    for (uint32_t i = 0; i < header[1]; ++i) {
+        uint32_t rows;
+        queue_get(&p, &ctx->snapshot_epoch_ms, sizeof(long long));
+        queue_get(&p, &ctx->snapshot_sample_time, sizeof(int));
+        queue_get(&p, &ctx->idle_time, sizeof(int));
+        queue_get(&p, &ctx->display_tag, sizeof(const char *));
+        queue_get(&p, &rows, sizeof(rows));
+        db_insert_snapshot(ctx);
+
+        for (uint32_t j = 0; j < rows; ++j) {
+            uint32_t    ids[2];
+            int         ints[3];
+            WindowProps props;
+            queue_get(&p, ids, sizeof(ids));
+            queue_get(&p, ints, sizeof(ints));
+            props.name  = queue_get_string(&p);
+            props.class = queue_get_string(&p);
+            props.title = queue_get_string(&p);
+            ctx->screen = ints[2];
+            db_insert_window(ctx, ids[0], ids[1], ints[0], ints[1], &props);
+        }
+        db_finish_snapshot(ctx);
+    }
+    db_end_snapshot(ctx);
+    if (header[1] > 0) {
+        db_end_previous(ctx);
+    }
+}
+
+static bool queue_write_with_jmp_buf(Context *ctx, unsigned char *record)
+{
+    /*
+     * Rotating may need the correction for the last snapshot already, and
+     * goes by when the record was captured, not when it gets written.
+     */
+    uint32_t header[3];
+    memcpy(header, record, sizeof(header));
+    ctx->previous_sample_time = (int) header[2];
+    if (setjmp(ctx->env) == 0) {
+        if (ctx->partition) {
+            long long epoch_ms = realtime_ms();
+            if (header[1] > 0) {
+                memcpy(&epoch_ms, record + sizeof(header), sizeof(epoch_ms));
+            }
+            db_rotate(ctx, epoch_ms);
+            if (!ctx->tx) {
+                queue_release(ctx);
+            }
+        }
+        queue_write_record(ctx, record);
+        queue_pop(ctx->queue, record);
+        if (!ctx->tx) {
+            queue_release(ctx);
+        }
+        return true;
+    }
+    else {
+        debug("Caught longjmp writing queued snapshot");
+        if (!ctx->tx) {
+            queue_release(ctx);
+        }
+        else if (!db_abort_snapshot(ctx)) {
+            queue_rewind(ctx);
+        }
+        db_forget_caches(ctx);
+        return false;
+    }
+}
+
+static bool queue_commit_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        debug("Committing %d pending snapshots", ctx->tx_snapshots);
+        db_commit(ctx);
+        queue_release(ctx);
+        return true;
+    }
+    else {
+        debug("Caught longjmp committing queued snapshots");
+        ctx->tx = db_rollback(ctx->db.handle, ctx->tx);
+        queue_rewind(ctx);
+        db_forget_caches(ctx);
+        return false;
+    }
+}
+
+/*
+ * Drains the queue into the database. A record that can't be written stays
+ * in the queue and is tried again a second later, while capturing goes on
+ * until the queue fills up. The same goes for all records since the last
+ * commit if the transaction is lost. Once stopped, whatever is left gets
+ * written, unless the database still won't take it.
+ */
+static void *queue_writer_thread(void *data)
+{
+    Context *ctx   = data;
+    Queue   *queue = ctx->queue;
+    for (;;) {
+        bool          stopping = atomic_load(&queue->stop);
+        unsigned char *record  = queue_peek(queue);
+        if (!record) {
+            if (stopping) {
+                break;
+            }
+            else if (!ctx->tx || !atomic_load(&queue->starved)) {
+                sem_wait(&queue->ready);
+            }
+            else if (!queue_commit_with_jmp_buf(ctx)) {
+                warn("Failed to commit snapshots, trying again in a second");
+                queue_timed_wait(&queue->ready, 1000000000LL);
+            }
+        }
+        else if (queue_write_with_jmp_buf(ctx, record)) {
+            continue;
+        }
+        else if (stopping) {
+            warn("Dropping queued snapshots the database won't take");
+            break;
+        }
+        else {
+            warn("Failed to write snapshot, trying again in a second");
+            queue_timed_wait(&queue->ready, 1000000000LL);
+        }
+    }
+
+    if (ctx->tx && !queue_commit_with_jmp_buf(ctx)) {
+        warn("Lost %d uncommitted snapshots", ctx->tx_snapshots);
+    }
+    return NULL;
+}
+
+/* Signals are for the daemon loop, so the writer blocks all of them. */
+static void queue_start(Context *ctx)
+{
+    Queue    *queue = ctx->queue;
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int error = pthread_create(&queue->thread, NULL, queue_writer_thread,
+                               ctx->writer);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (error != 0) {
+        die(ctx, "Can't start writer thread: %s", strerror(error));
+    }
+    queue->joinable = true;
+}
+
+static void queue_stop(Context *ctx)
+{
+    Queue *queue = ctx->queue;
+    if (queue && queue->joinable) {
+        debug("Waiting for the writer to finish");
+        atomic_store(&queue->stop, true);
+        sem_post(&queue->ready);
+        pthread_join(queue->thread, NULL);
+        queue->joinable = false;
+    }
+}
+
+
+static void setup_display(Context *ctx)
+{
+    long long display_start_ns = monotonic_ns();
+    x_open_display(ctx);
+    x_intern_atoms(ctx);
+#ifdef WTSNAP_XCB
+    x_xcb_connect(ctx);
+#endif
+    ctx->meta.display_ns = monotonic_ns() - display_start_ns;
+    x_alloc_class_hint(ctx);
+    if (ctx->track_events) {
+        x_tree_init(ctx);
+    }
+}
+
+static void setup_capture(Context *ctx, Context *capture)
+{
+    if (setjmp(capture->env) == 0) {
+        setup_display(capture);
+    }
+    else {
+        die(ctx, "Can't set up capturing display '%s'", capture->dpy_name);
+    }
+}
+
+/*
+ * Captures start out as copies of the options, before the database is
+ * opened, so they don't get anything of it. They only ever talk to X. With
+ * -Q, a single display gets a capture too, the writer has the database.
+ */
+static void setup_captures(Context *ctx)
+{
+    int count     = ctx->dpy_count > 0 ? ctx->dpy_count : 1;
+    ctx->captures = calloc((size_t) count, sizeof(*ctx->captures));
+    if (!ctx->captures) {
+        die(ctx, "Can't calloc %d captures", count);
+    }
+    for (int i = 0; i < count; ++i) {
+        Context    *capture    = &ctx->captures[i];
+        const char *name       = ctx->dpy_count > 0 ? ctx->dpy_names[i]
+                                                    : ctx->dpy_name;
+        *capture               = *ctx;
+        capture->db.env        = &capture->env;
+        capture->dpy_name      = name;
+        capture->display_tag   = name[0] ? name : NULL;
+        capture->buffer_rows   = true;
+        capture->captures      = NULL;
+        capture->capture_count = 0;
+        ctx->capture_count     = i + 1;
+        setup_capture(ctx, capture);
+    }
+}
+
+/*
+ * The writer is another copy of the options and the only one that talks to
+ * the database. It opens it right away, so that a database that can't be
+ * opened keeps the daemon from starting, just like without -Q.
+ */
+static void setup_writer(Context *ctx)
+{
+    queue_init(ctx);
+    Context *writer = malloc(sizeof(*writer));
+    if (!writer) {
+        die(ctx, "Can't malloc writer");
+    }
+    *writer               = *ctx;
+    writer->db.env        = &writer->env;
+    writer->free_db_name  = false;
+    writer->captures      = NULL;
+    writer->capture_count = 0;
+    ctx->writer           = writer;
+
+    if (setjmp(writer->env) == 0) {
+        if (writer->partition) {
+            db_rotate(writer, realtime_ms());
+        }
+        else {
+            db_open_file(writer);
+        }
+    }
+    else {
+        die(ctx, "Can't set up the database writer");
+    }
+    queue_start(ctx);
+}
+
+static void setup(Context *ctx)
+{
+    db_check_name(ctx);
+    if (ctx->dpy_count > 1 || ctx->queue_size > 0) {
+        setup_captures(ctx);
+    }
+    if (ctx->queue_size > 0) {
+        setup_writer(ctx);
+    }
+    else if (ctx->partition) {
+        db_rotate(ctx, realtime_ms());
+    }
+    else {
+        db_open_file(ctx);
+    }
+    if (ctx->capture_count == 0) {
+        ctx->display_tag = ctx->dpy_name[0] ? ctx->dpy_name : NULL;
+        setup_display(ctx);
+    }
+}
+
+static void snap_report(const Context *ctx, long long elapsed_ns)
+{
+    printf("Snapshot %d: %.3f ms, %.3f ms in the database, "
+           "%d round trips, %d rows\n", ctx->snapshot_id,
+           (double) elapsed_ns / 1e6, (double) ctx->db_ns / 1e6,
+           ctx->round_trips, ctx->rows);
+    fflush(stdout);
+}
+
+/* The database time is counted within the window phase, it's in there. */
+static void snap_record_meta(Context *ctx, long long idle_ns,
+                             long long windows_ns, long long commit_ns)
+{
+    SnapMeta *meta    = &ctx->meta;
+    meta->snapshot_id = ctx->snapshot_id;
+    meta->idle_ns     = idle_ns;
+    meta->windows_ns  = windows_ns;
+    meta->db_ns       = ctx->db_ns;
+    meta->commit_ns   = commit_ns;
+    meta->windows     = ctx->windows;
+    meta->excluded    = ctx->excluded;
+    meta->round_trips = ctx->round_trips;
+    meta->rows        = ctx->rows;
+    ctx->meta_pending = true;
+}
+
+static void snap_windows(Context *ctx)
+{
+    if (ctx->track_events) {
+        x_get_focused_window(ctx);
+        x_tree_snap(ctx);
+    }
+    else {
+        x_cache_process_events(ctx);
+        x_snap_screens(ctx);
+        x_cache_count(ctx);
+    }
+}
+
+static void *snap_capture_thread(void *data)
+{
+    Context *ctx = data;
+    if (setjmp(ctx->env) == 0) {
+        ctx->allocations       = 0;
+        ctx->round_trips       = 0;
+        ctx->capture_rows_size = 0;
+        ctx->snapshot_epoch_ms = realtime_ms();
+        x_arena_reset(&ctx->arena);
+        x_get_idle_time(ctx);
+        if (!db_idle_only(ctx)) {
+            snap_windows(ctx);
+        }
+        ctx->capture_ok = true;
+    }
+    else {
+        debug("Caught longjmp capturing display '%s'", ctx->dpy_name);
+        ctx->capture_ok = false;
+    }
+    return NULL;
+}
+
+static void snap_write_capture(Context *ctx, const Context *capture)
+{
+    long long db_start_ns  = monotonic_ns();
+    ctx->snapshot_epoch_ms = capture->snapshot_epoch_ms;
+    ctx->idle_time         = capture->idle_time;
+    ctx->display_tag       = capture->display_tag;
+    db_insert_snapshot(ctx);
+    ctx->db_ns += monotonic_ns() - db_start_ns;
+
+    for (size_t i = 0; i < capture->capture_rows_size; ++i) {
+        const CaptureRow *row = &capture->capture_rows[i];
+        ctx->screen           = row->screen;
+        db_insert_window(ctx, row->window, row->parent, row->depth,
+                         row->focused, &row->props);
+    }
 }
 
 /*
- * This is inspired by the way dwm gets the title for a window.
- * See https://dwm.suckless.org/
+ * All displays are captured at the same time, each on a thread of its own.
+ * Then this thread writes them in one transaction, so there's only the one
+ * connection to the database and no contention for its lock. Every display
+ * gets a snapshot of its own, since each has its own focus and idle time.
+ * A single display with -Q is just captured on this thread.
  */
-static char *x_get_string_property(Context *ctx, Window window,
-                                   const char *prop_name)
+static void snap_start_capture(Context *ctx, Context *capture)
 {
-    debug("Getting string property '%s'", prop_name);
-    Atom prop = XInternAtom(ctx->dpy, prop_name, false);
+    capture->capture_ok = false;
+    if (ctx->capture_count == 1) {
+        snap_capture_thread(capture);
+        return;
+    }
 
-    XTextProperty xtp;
-    xtp.value      = NULL;
-    char **strings = NULL;
-    char *out      = NULL;
+    int error = pthread_create(&capture->capture_thread, NULL,
+                               snap_capture_thread, capture);
+    capture->capture_joinable = error == 0;
+    if (error != 0) {
+        warn("Can't start thread for display '%s': %s",
+             capture->dpy_name, strerror(error));
+        snap_capture_thread(capture);
+    }
+}
 
-    if (XGetTextProperty(ctx->dpy, window, &xtp, prop) < Success) {
-        debug("Can't get string property '%s'", prop_name);
-        goto end_of_x_get_string_property;
+static void snap_captures(Context *ctx)
+{
+    for (int i = 0; i < ctx->capture_count; ++i) {
+        snap_start_capture(ctx, &ctx->captures[i]);
     }
 
-    if (xtp.nitems == 0) {
-        debug("No items in string property '%s'", prop_name);
-        goto end_of_x_get_string_property;
+    int captured = 0;
+    for (int i = 0; i < ctx->capture_count; ++i) {
+        Context *capture = &ctx->captures[i];
+        if (capture->capture_joinable) {
+            pthread_join(capture->capture_thread, NULL);
+            capture->capture_joinable = false;
+        }
+        ctx->allocations += capture->allocations;
+        ctx->round_trips += capture->round_trips;
+        if (capture->capture_ok) {
+            ++captured;
+        }
+        else {
+            warn("Failed to capture display '%s'", capture->dpy_name);
+        }
+    }
+    if (captured == 0) {
+        die(ctx, "Failed to capture any display");
+    }
+}
+
+/*
+ * If the queue stays full until the next snapshot is due, this one is
+ * dropped and the next one that makes it accounts for its time, just like
+ * skipped ticks. With -A, the one before it does, like with failed ones.
+ * The writer assigns the real snapshot ids, so -v only counts them.
+ */
+static void snap_queue(Context *ctx)
+{
+    if (queue_push(ctx, true)) {
+        ctx->queue_dropped_time = 0;
+        ++ctx->snapshot_id;
+        return;
+    }
+
+    ctx->snapshot_dropped = true;
+    if (ctx->adaptive_time > 0) {
+        warn("Queue is full, dropped snapshot");
+        return;
+    }
+
+    long long dropped       = (long long) ctx->queue_dropped_time
+                            + ctx->snapshot_sample_time;
+    ctx->queue_dropped_time = dropped <= INT_MAX ? (int) dropped : INT_MAX;
+    warn("Queue is full, dropped snapshot, %d seconds go to the next one",
+         ctx->queue_dropped_time);
+}
+
+static void snap_displays(Context *ctx)
+{
+    snap_captures(ctx);
+    if (ctx->queue) {
+        snap_queue(ctx);
+        return;
+    }
+
+    long long db_start_ns = monotonic_ns();
+    db_begin_snapshot(ctx);
+    ctx->db_ns += monotonic_ns() - db_start_ns;
+
+    for (int i = 0; i < ctx->capture_count; ++i) {
+        const Context *capture = &ctx->captures[i];
+        if (capture->capture_ok) {
+            snap_write_capture(ctx, capture);
+        }
+    }
+
+    db_start_ns = monotonic_ns();
+    db_end_snapshot(ctx);
+    ctx->db_ns += monotonic_ns() - db_start_ns;
+}
+
+static void snap_display(Context *ctx, long long start_ns)
+{
+    ctx->snapshot_epoch_ms = realtime_ms();
+    x_arena_reset(&ctx->arena);
+    x_get_idle_time(ctx);
+    long long idle_ns = monotonic_ns() - start_ns;
+
+    long long db_start_ns = monotonic_ns();
+    db_begin_snapshot(ctx);
+    db_flush_meta(ctx);
+    db_fix_previous(ctx);
+    db_insert_snapshot(ctx);
+    ctx->db_ns += monotonic_ns() - db_start_ns;
+
+    long long windows_start_ns = monotonic_ns();
+    if (db_idle_only(ctx)) {
+        debug("Idle for %d ms, not capturing any windows", ctx->idle_time);
+    }
+    else {
+        snap_windows(ctx);
     }
 
-    if (xtp.encoding == XA_STRING) {
-        out = x_copy_string_property_value(prop_name, xtp.value);
+    db_start_ns = monotonic_ns();
+    db_finish_snapshot(ctx);
+    long long windows_ns = monotonic_ns() - windows_start_ns;
+    long long commit_start_ns = monotonic_ns();
+    db_end_snapshot(ctx);
+    db_end_previous(ctx);
+    long long end_ns = monotonic_ns();
+    ctx->db_ns += end_ns - db_start_ns;
+
+    if (ctx->record_meta && !ctx->snapshot_extended) {
+        snap_record_meta(ctx, idle_ns, windows_ns, end_ns - commit_start_ns);
+    }
+}
+
+static void snap(Context *ctx)
+{
+    long long start_ns = monotonic_ns();
+    ctx->allocations   = 0;
+    ctx->round_trips   = 0;
+    ctx->rows          = 0;
+    ctx->db_ns         = 0;
+    ctx->windows       = 0;
+    ctx->excluded      = 0;
+    if (ctx->capture_count > 0) {
+        snap_displays(ctx);
     }
     else {
-        int nstrings = 0;
-        int result   = XmbTextPropertyToTextList(ctx->dpy, &xtp,
-                                                 &strings, &nstrings);
-        if (result >= Success && nstrings > 0 && strings && strings[0]) {
-            out = x_copy_string_property_value(prop_name, strings[0]);
+        snap_display(ctx, start_ns);
+    }
+
+    debug("Capturing snapshot %d took %d allocations",
+          ctx->snapshot_id, ctx->allocations);
+    if (ctx->verbose) {
+        snap_report(ctx, monotonic_ns() - start_ns);
+    }
+}
+
+static void run(Context *ctx)
+{
+    setup(ctx);
+    if (!ctx->daemon) {
+        ctx->snapshot_sample_time = ctx->sample_time;
+        snap(ctx);
+        db_flush_meta(ctx);
+    }
+}
+
+static bool run_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        debug("Running with longjmp buffer");
+        run(ctx);
+        return true;
+    }
+    else {
+        debug("Caught longjmp");
+        return false;
+    }
+}
+
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_handle_signal(int sig)
+{
+    (void) sig;
+    daemon_stop = 1;
+}
+
+static void daemon_install_signal_handlers(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+}
+
+static void daemon_sleep_until(long long deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec  = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    int result;
+    do {
+        result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    } while (result == EINTR && !daemon_stop);
+}
+
+static bool daemon_snap_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        if (ctx->partition && !ctx->queue) {
+            db_rotate(ctx, realtime_ms());
+        }
+        snap(ctx);
+        return true;
+    }
+    else {
+        debug("Caught longjmp in daemon snapshot");
+        if (!db_abort_snapshot(ctx) && ctx->tx_snapshots > 0) {
+            warn("Lost %d uncommitted snapshots", ctx->tx_snapshots);
         }
+        db_forget_caches(ctx);
+        ctx->meta_pending = false;
+        return false;
     }
+}
 
-end_of_x_get_string_property:
-    if (strings) {
-        XFreeStringList(strings);
+/*
+ * Snapshots are scheduled on a fixed grid of start + n * sample_time on the
+ * monotonic clock, so the schedule doesn't drift by however long capturing
+ * takes. If a snapshot overruns and ticks get skipped, the next one accounts
+ * for all of the elapsed ticks in its sample time, so the sums in wtstats
+ * still match the wall time that actually passed.
+ */
+static void daemon_run_fixed(Context *ctx)
+{
+    long long interval_ns = (long long) ctx->sample_time * 1000000000LL;
+    long long start_ns    = monotonic_ns();
+    long long last_tick   = -1;
+
+    while (!daemon_stop) {
+        long long tick = (monotonic_ns() - start_ns) / interval_ns;
+        long long ticks_elapsed = last_tick < 0 ? 1 : tick - last_tick;
+        last_tick = tick;
+
+        long long sample_time = ticks_elapsed * ctx->sample_time;
+        ctx->snapshot_sample_time = sample_time <= INT_MAX
+                                  ? (int) sample_time : INT_MAX;
+        if (ticks_elapsed > 1) {
+            warn("Skipped %lld ticks, sample time is %d seconds",
+                 ticks_elapsed - 1, ctx->snapshot_sample_time);
+        }
+
+        ctx->deadline_ns = start_ns + (tick + 1) * interval_ns;
+        if (!daemon_snap_with_jmp_buf(ctx)) {
+            warn("Failed to take snapshot, trying again next tick");
+        }
+
+        daemon_sleep_until(ctx->deadline_ns);
     }
-    if (xtp.value) {
-        XFree(xtp.value);
+}
+
+static bool daemon_probe_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        x_probe(ctx);
+        return true;
+    }
+    else {
+        debug("Caught longjmp probing display");
+        return false;
+    }
+}
+
+/* While idle, each snapshot accounts for twice as long as the one before. */
+static int daemon_backoff(const Context *ctx, int idle_time)
+{
+    long long sample_time = ctx->sample_time;
+    long long max         = sample_time * DAEMON_MAX_BACKOFF;
+    while (sample_time < max && idle_time / 1000 >= sample_time) {
+        sample_time *= 2;
+    }
+    return sample_time <= INT_MAX ? (int) sample_time : INT_MAX;
+}
+
+static int daemon_ticks_to_seconds(const Context *ctx, long long ticks)
+{
+    long long seconds = ticks * ctx->adaptive_time;
+    return seconds <= INT_MAX ? (int) seconds : INT_MAX;
+}
+
+/*
+ * With -A, the daemon wakes up on a grid of MIN_SECONDS instead and probes
+ * the display, only taking a snapshot if the active window or its title
+ * changed, the user came back from being idle or the last snapshot has
+ * accounted for all of its time. Each snapshot accounts for the time until
+ * the next one, counted in ticks of the grid so they add up to the wall
+ * time that passed, and failed ones leave it to the one before.
+ */
+static void daemon_run_adaptive(Context *ctx)
+{
+    Context            *probe      = ctx->capture_count > 0
+                                   ? &ctx->captures[0] : ctx;
+    long long          interval_ns = (long long) ctx->adaptive_time
+                                   * 1000000000LL;
+    long long          start_ns    = monotonic_ns();
+    long long          last_tick   = -1;
+    int                planned     = 0;
+    Window             last_window = None;
+    unsigned long long last_title  = 0;
+
+    while (!daemon_stop) {
+        long long tick    = (monotonic_ns() - start_ns) / interval_ns;
+        int       elapsed = last_tick < 0 ? 0
+                          : daemon_ticks_to_seconds(ctx, tick - last_tick);
+        ctx->deadline_ns  = start_ns + (tick + 1) * interval_ns;
+
+        if (!daemon_probe_with_jmp_buf(probe)) {
+            warn("Failed to probe display, trying again next tick");
+        }
+        else if (last_tick < 0 || elapsed >= planned
+                     || probe->probe_window != last_window
+                     || probe->probe_title != last_title
+                     || (planned > ctx->sample_time
+                         && probe->idle_time / 1000 < ctx->sample_time)) {
+            int next                  = daemon_backoff(ctx, probe->idle_time);
+            ctx->snapshot_sample_time = next;
+            ctx->previous_sample_time = elapsed;
+            ctx->snapshot_dropped     = false;
+            if (daemon_snap_with_jmp_buf(ctx) && !ctx->snapshot_dropped) {
+                last_tick   = tick;
+                planned     = next;
+                last_window = probe->probe_window;
+                last_title  = probe->probe_title;
+            }
+            else if (!ctx->snapshot_dropped) {
+                warn("Failed to take snapshot, trying again next tick");
+            }
+        }
+
+        daemon_sleep_until(ctx->deadline_ns);
+    }
+
+    /* The last snapshot accounts for the time up to now. */
+    if (last_tick >= 0) {
+        long long passed_ns       = monotonic_ns() - start_ns
+                                  - last_tick * interval_ns;
+        long long seconds         = (passed_ns + 500000000LL) / 1000000000LL;
+        ctx->previous_sample_time = seconds < 1 ? 1
+                                  : seconds <= INT_MAX ? (int) seconds
+                                  : INT_MAX;
+    }
+}
+
+static void daemon_run(Context *ctx)
+{
+    daemon_install_signal_handlers();
+    if (ctx->adaptive_time > 0) {
+        daemon_run_adaptive(ctx);
+    }
+    else {
+        daemon_run_fixed(ctx);
+    }
+
+    debug("Daemon stopping");
+    if (ctx->queue && ctx->adaptive_time > 0) {
+        ctx->deadline_ns = monotonic_ns() + 1000000000LL;
+        if (!queue_push(ctx, false)) {
+            warn("Queue is full, can't correct the last sample time");
+        }
+    }
+    queue_stop(ctx);
+    x_cache_report(ctx);
+    for (int i = 0; i < ctx->capture_count; ++i) {
+        x_cache_report(&ctx->captures[i]);
+    }
+    bool pending = ctx->tx || ctx->meta_pending
+                || (ctx->adaptive_time > 0 && !ctx->queue);
+    if (pending && setjmp(ctx->env) == 0) {
+        db_fix_previous(ctx);
+        db_flush_meta(ctx);
+        if (ctx->tx) {
+            debug("Committing %d pending snapshots", ctx->tx_snapshots);
+            db_commit(ctx);
+        }
+    }
+}
+
+static bool compact_has_table(Context *ctx, const char *name)
+{
+    sqlite3_stmt  *stmt   = db_prepare(&ctx->db,
+        "select exists (select 1 from sqlite_master where name = ?)");
+    sqlite3_int64 exists = 0;
+    db_bind_static_string(&ctx->db, stmt, 1, name);
+    db_select_int64s(&ctx->db, stmt, &exists, 1);
+    db_close_stmt(stmt);
+    return exists != 0;
+}
+
+/*
+ * Snapshots to delete are collected in a temporary table first, then their
+ * rows go from every table that has some. Letting foreign keys cascade
+ * doesn't work, since the parent_id key of a window would set the window's
+ * snapshot_id to null along with its parent_id.
+ */
+static void compact_prepare_statements(Context *ctx)
+{
+    db_exec(&ctx->db, "create temp table if not exists compact_chunk (\n"
+                      "    snapshot_id integer primary key not null)");
+
+    ctx->compact_next_stmt = db_prepare(&ctx->db,
+        "select epoch_ms from snapshot where epoch_ms >= ?\n"
+        "order by epoch_ms limit 1");
+    ctx->compact_merge_stmt = db_prepare(&ctx->db,
+        "update snapshot set sample_time = sample_time + ?\n"
+        "where snapshot_id = ?");
+    ctx->compact_mark_stmt = db_prepare(&ctx->db,
+        "insert into compact_chunk (snapshot_id) values (?)");
+    ctx->compact_delete_stmt = db_prepare(&ctx->db,
+        "delete from snapshot where snapshot_id in compact_chunk");
+    if (compact_has_table(ctx, "snapshot_meta")) {
+        ctx->compact_meta_stmt = db_prepare(&ctx->db,
+            "delete from snapshot_meta where snapshot_id in compact_chunk");
+    }
+
+    /*
+     * A keyframe only goes once all of its deltas are past the retention,
+     * and takes them along even if they're further on than the chunk. The
+     * newest one that has any may still get more from a running daemon.
+     */
+    if (ctx->layout == DB_LAYOUT_NORMALIZED) {
+        ctx->compact_window_stmt = db_prepare(&ctx->db,
+            "delete from window_data where snapshot_id in compact_chunk");
+        ctx->compact_retain_stmt = db_prepare(&ctx->db,
+            "insert into compact_chunk (snapshot_id)\n"
+            "select snapshot_id from snapshot\n"
+            "where epoch_ms >= ?1 and epoch_ms < ?2\n"
+            "and snapshot_id <> (select coalesce(max(base_id), 0)\n"
+            "                    from snapshot)\n"
+            "and not exists (\n"
+            "    select 1 from snapshot d\n"
+            "    where d.base_id = snapshot.snapshot_id\n"
+            "    and   d.epoch_ms >= ?3)");
+        ctx->compact_deltas_stmt = db_prepare(&ctx->db,
+            "insert or ignore into compact_chunk (snapshot_id)\n"
+            "select snapshot_id from snapshot\n"
+            "where base_id in compact_chunk");
+        ctx->compact_select_stmt = db_prepare(&ctx->db,
+            "select snapshot_id, sample_time, display,\n"
+            "       epoch_ms / ?3 as bucket,\n"
+            "       coalesce(idle_time, 0) >= ?4 as idle,\n"
+            "       exists (select 1 from snapshot d\n"
+            "               where d.base_id = s.snapshot_id) as keyframe\n"
+            "from snapshot s\n"
+            "where epoch_ms >= ?1 and epoch_ms < ?2\n"
+            "order by display, bucket, idle, keyframe desc,\n"
+            "         epoch_ms, snapshot_id");
+    }
+    else {
+        ctx->compact_window_stmt = db_prepare(&ctx->db,
+            "delete from window where snapshot_id in compact_chunk");
+        ctx->compact_retain_stmt = db_prepare(&ctx->db,
+            "insert into compact_chunk (snapshot_id)\n"
+            "select snapshot_id from snapshot\n"
+            "where epoch_ms >= ?1 and epoch_ms < ?2");
+        ctx->compact_select_stmt = db_prepare(&ctx->db,
+            "select snapshot_id, sample_time, display,\n"
+            "       epoch_ms / ?3 as bucket,\n"
+            "       coalesce(idle_time, 0) >= ?4 as idle,\n"
+            "       0 as keyframe\n"
+            "from snapshot\n"
+            "where epoch_ms >= ?1 and epoch_ms < ?2\n"
+            "order by display, bucket, idle, epoch_ms, snapshot_id");
+    }
+}
+
+/*
+ * Waits a lot longer for the lock than snapshots do, since a daemon
+ * grouping them with -g or -G holds on to it for a while.
+ */
+static void compact_open(Context *ctx)
+{
+    db_check_name(ctx);
+    db_open(&ctx->db, ctx->db_file, SQLITE_OPEN_READWRITE);
+    db_configure(ctx);
+    sqlite3_busy_timeout(ctx->db.handle, COMPACT_BUSY_MS);
+    db_init(ctx);
+    compact_prepare_statements(ctx);
+}
+
+static void compact_begin(Context *ctx)
+{
+    db_exec(&ctx->db, "begin immediate");
+    ctx->tx = true;
+}
+
+/* Deletes the snapshots in compact_chunk and returns how many there were. */
+static int compact_delete_marked(Context *ctx)
+{
+    db_reset_stmt(ctx->compact_window_stmt);
+    db_exec_stmt(&ctx->db, ctx->compact_window_stmt, NULL, NULL);
+    if (ctx->compact_meta_stmt) {
+        db_reset_stmt(ctx->compact_meta_stmt);
+        db_exec_stmt(&ctx->db, ctx->compact_meta_stmt, NULL, NULL);
+    }
+    db_reset_stmt(ctx->compact_delete_stmt);
+    db_exec_stmt(&ctx->db, ctx->compact_delete_stmt, NULL, NULL);
+    int deleted = sqlite3_changes(ctx->db.handle);
+    db_exec(&ctx->db, "delete from compact_chunk");
+    return deleted;
+}
+
+/* Halves or doubles how much the next chunk takes on to hit the target. */
+static long long compact_resize(long long units, long long elapsed_ns)
+{
+    if (elapsed_ns > COMPACT_TARGET_NS && units > 1) {
+        return units / 2;
+    }
+    else if (elapsed_ns < COMPACT_TARGET_NS / 2 && units < COMPACT_MAX_UNITS) {
+        return units * 2;
+    }
+    return units;
+}
+
+static void compact_pause(void)
+{
+    daemon_sleep_until(monotonic_ns() + COMPACT_PAUSE_NS);
+}
+
+static bool compact_next_epoch(Context *ctx, long long from_ms,
+                               long long *epoch_ms)
+{
+    sqlite3_int64 epoch = 0;
+    sqlite3_stmt  *stmt = ctx->compact_next_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(&ctx->db, stmt, 1, from_ms);
+    bool found = db_select_int64s(&ctx->db, stmt, &epoch, 1);
+    *epoch_ms  = epoch;
+    return found;
+}
+
+static int compact_retain_chunk(Context *ctx, long long from_ms,
+                                long long to_ms)
+{
+    sqlite3_stmt *stmt = ctx->compact_retain_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(&ctx->db, stmt, 1, from_ms);
+    db_bind_int64(&ctx->db, stmt, 2, to_ms);
+    if (ctx->layout == DB_LAYOUT_NORMALIZED) {
+        db_bind_int64(&ctx->db, stmt, 3, ctx->compact_end_ms);
+    }
+    db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+    if (ctx->compact_deltas_stmt) {
+        db_reset_stmt(ctx->compact_deltas_stmt);
+        db_exec_stmt(&ctx->db, ctx->compact_deltas_stmt, NULL, NULL);
+    }
+    int deleted = compact_delete_marked(ctx);
+    ctx->compact_deleted += deleted;
+    return deleted;
+}
+
+static void compact_add_row(Context *ctx, int snapshot_id, int sample_time,
+                            bool keep)
+{
+    if (ctx->compact_rows_size == ctx->compact_rows_capacity) {
+        size_t     capacity = ctx->compact_rows_capacity
+                            ? ctx->compact_rows_capacity * 2 : 256;
+        CompactRow *rows    = realloc(ctx->compact_rows,
+                                      capacity * sizeof(*rows));
+        if (!rows) {
+            die(ctx, "Can't realloc %zu compaction rows", capacity);
+        }
+        ctx->compact_rows          = rows;
+        ctx->compact_rows_capacity = capacity;
+    }
+    ctx->compact_rows[ctx->compact_rows_size++] = (CompactRow) {
+        snapshot_id, sample_time, keep,
+    };
+}
+
+static bool compact_same_display(const char *a, const char *b)
+{
+    return a && b ? strcmp(a, b) == 0 : a == b;
+}
+
+/*
+ * Rows come sorted by bucket with the one to keep first, a keyframe if
+ * there is one, and are only acted on once they've all been read. Any
+ * other keyframes in the bucket stay as they are.
+ */
+static void compact_read_buckets(Context *ctx, long long from_ms,
+                                 long long to_ms)
+{
+    int idle_time = ctx->idle_threshold > 0 ? ctx->idle_threshold
+                                            : COMPACT_IDLE_TIME;
+    sqlite3_stmt *stmt = ctx->compact_select_stmt;
+    db_reset_stmt(stmt);
+    db_bind_int64(&ctx->db, stmt, 1, from_ms);
+    db_bind_int64(&ctx->db, stmt, 2, to_ms);
+    db_bind_int64(&ctx->db, stmt, 3, ctx->downsample_seconds * 1000LL);
+    db_bind_int(&ctx->db, stmt, 4, idle_time);
+
+    char          *display = NULL;
+    sqlite3_int64 bucket   = -1;
+    int           idle     = -1;
+    size_t        keeper   = 0;
+    int           result;
+    ctx->compact_rows_size = 0;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char    *row_display =
+            (const char *) sqlite3_column_text(stmt, 2);
+        sqlite3_int64 row_bucket   = sqlite3_column_int64(stmt, 3);
+        int           row_idle     = sqlite3_column_int(stmt, 4);
+        int           snapshot_id  = sqlite3_column_int(stmt, 0);
+        int           sample_time  = sqlite3_column_int(stmt, 1);
+        if (row_bucket != bucket || row_idle != idle
+                || !compact_same_display(row_display, display)) {
+            free(display);
+            display = row_display ? strdup(row_display) : NULL;
+            if (row_display && !display) {
+                die(ctx, "Can't strdup display '%s'", row_display);
+            }
+            bucket  = row_bucket;
+            idle    = row_idle;
+            keeper  = ctx->compact_rows_size;
+            compact_add_row(ctx, snapshot_id, 0, true);
+        }
+        else if (sqlite3_column_int(stmt, 5)) {
+            compact_add_row(ctx, snapshot_id, 0, true);
+        }
+        else {
+            ctx->compact_rows[keeper].sample_time += sample_time;
+            compact_add_row(ctx, snapshot_id, 0, false);
+        }
     }
+    free(display);
 
-    if (out) {
-        debug("Got '%s' value: '%s'", prop_name, out);
-    }
-    else {
-        debug("No value for '%s' property", prop_name);
+    if (result != SQLITE_DONE) {
+        db_die(&ctx->db, "Failed to execute prepared statement: %s",
+               sqlite3_errmsg(ctx->db.handle));
     }
-
-    return out;
 }
 
-static char *x_get_title(Context *ctx, Window window)
+static int compact_downsample_chunk(Context *ctx, long long from_ms,
+                                    long long to_ms)
 {
-    char *title = x_get_string_property(ctx, window, "_NET_WM_NAME");
-    if (!title) {
-        title = x_get_string_property(ctx, window, "WM_NAME");
+    compact_read_buckets(ctx, from_ms, to_ms);
+    for (size_t i = 0; i < ctx->compact_rows_size; ++i) {
+        const CompactRow *row = &ctx->compact_rows[i];
+        if (!row->keep) {
+            sqlite3_stmt *stmt = ctx->compact_mark_stmt;
+            db_reset_stmt(stmt);
+            db_bind_int(&ctx->db, stmt, 1, row->snapshot_id);
+            db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+        }
+        else if (row->sample_time > 0) {
+            sqlite3_stmt *stmt = ctx->compact_merge_stmt;
+            db_reset_stmt(stmt);
+            db_bind_int(&ctx->db, stmt, 1, row->sample_time);
+            db_bind_int(&ctx->db, stmt, 2, row->snapshot_id);
+            db_exec_stmt(&ctx->db, stmt, NULL, NULL);
+        }
     }
-    return title;
+    int merged = compact_delete_marked(ctx);
+    ctx->compact_merged += merged;
+    return merged;
 }
 
-static int x_snap_window(Context *ctx, Window window,
-                         Window parent, int depth);
-
-static int x_snap_children(Context *ctx, Window parent, int depth,
-                           Window *children, unsigned int nchildren)
+/*
+ * Goes through the snapshots before end_ms in chunks of whole units of
+ * time, skipping over stretches without any. Returns how many snapshots
+ * the chunks changed.
+ */
+static int compact_range(Context *ctx, long long unit_ms, long long end_ms,
+                         int (*chunk)(Context *ctx, long long from_ms,
+                                      long long to_ms))
 {
-    int focused = 0;
-    for (unsigned int i = 0; i < nchildren; ++i) {
-        int child_focused = x_snap_window(ctx, children[i], parent, depth);
-        if (child_focused != 0) {
-            focused = child_focused;
-        }
+    int       changed = 0;
+    long long units   = COMPACT_START_UNITS;
+    long long from_ms = 0;
+    ctx->compact_end_ms = end_ms;
+
+    while (!daemon_stop && compact_next_epoch(ctx, from_ms, &from_ms)
+                        && from_ms < end_ms) {
+        from_ms -= from_ms % unit_ms;
+        long long to_ms = from_ms + units * unit_ms < end_ms
+                        ? from_ms + units * unit_ms : end_ms;
+
+        long long start_ns = monotonic_ns();
+        compact_begin(ctx);
+        changed += chunk(ctx, from_ms, to_ms);
+        db_commit(ctx);
+        long long elapsed_ns = monotonic_ns() - start_ns;
+        debug("Compacted %lld units in %lld ms", units, elapsed_ns / 1000000);
+
+        units   = compact_resize(units, elapsed_ns);
+        from_ms = to_ms;
+        compact_pause();
     }
-    return focused;
+    return changed;
 }
 
-static int x_get_children(Context *ctx, Window window, int depth)
+/*
+ * wtstats sums up whole days in classification_rollup, which would still
+ * count the time of snapshots that are gone now. Without any state left,
+ * it builds them up from scratch the next time around.
+ */
+static void compact_reset_rollup(Context *ctx)
 {
-    Window       root, parent, *children;
-    unsigned int nchildren;
-    if (XQueryTree(ctx->dpy, window, &root, &parent,
-                   &children, &nchildren) >= Success) {
-        if (children) {
-            int focused =
-                x_snap_children(ctx, window, depth, children, nchildren);
-            XFree(children);
-            return focused;
-        }
-    }
-    else {
-        debug("Can't get children of window %llu", (unsigned long long) window);
+    sqlite3_stmt  *stmt   = db_prepare(&ctx->db,
+        "select exists (select 1 from sqlite_master\n"
+        "               where name = 'classification_rollup_state')");
+    sqlite3_int64 exists = 0;
+    db_select_int64s(&ctx->db, stmt, &exists, 1);
+    db_close_stmt(stmt);
+
+    if (exists) {
+        compact_begin(ctx);
+        db_exec(&ctx->db, "delete from classification_rollup");
+        db_exec(&ctx->db, "delete from classification_rollup_state");
+        db_commit(ctx);
     }
-    return 0;
 }
 
-static int x_snap_window(Context *ctx, Window window, Window parent, int depth)
+static sqlite3_int64 compact_get_pragma(Context *ctx, const char *sql)
 {
-    debug("Capturing snapshot of window %llu", (unsigned long long) window);
-    bool have_property = false;
-    int  child_focused = x_get_children(ctx, window, depth + 1);
-    int  focused       = child_focused != 0   ? child_focused
-                       : ctx->focus == window ? depth
-                       : 0;
-
-    db_reset_stmt(ctx);
-    db_bind_int(ctx, 1, ctx->snapshot_id);
-    db_bind_unsigned_long_long_as_text(ctx, 2, window);
-    if (parent != None) {
-        db_bind_unsigned_long_long_as_text(ctx, 3, parent);
-    }
-    db_bind_int(ctx, 4, depth);
-    db_bind_int(ctx, 5, focused);
+    sqlite3_stmt  *stmt  = db_prepare(&ctx->db, sql);
+    sqlite3_int64 value = 0;
+    db_select_int64s(&ctx->db, stmt, &value, 1);
+    db_close_stmt(stmt);
+    return value;
+}
 
-    XClassHint *ch = ctx->ch;
-    if (XGetClassHint(ctx->dpy, window, ch) >= Success) {
-        if (ch->res_name) {
-            have_property = have_property || strlen(ch->res_name) > 0;
-            db_bind_string(ctx, 6, ch->res_name);
-            XFree(ch->res_name);
-            ch->res_name = NULL;
-        }
-        if (ch->res_class) {
-            have_property = have_property || strlen(ch->res_class) > 0;
-            db_bind_string(ctx, 7, ch->res_class);
-            XFree(ch->res_class);
-            ch->res_class = NULL;
+/*
+ * Deleted pages are only reused for new snapshots, it takes auto_vacuum to
+ * give them back. New databases are incremental, where each run of the
+ * pragma moves a bunch of pages from the end of the file into free ones.
+ */
+static void compact_vacuum(Context *ctx)
+{
+    sqlite3_int64 mode = compact_get_pragma(ctx, "pragma auto_vacuum");
+    if (mode == 0) {
+        if (compact_get_pragma(ctx, "pragma freelist_count") > 0) {
+            warn("Database '%s' has no auto_vacuum, so it won't shrink. "
+                 "Run 'pragma auto_vacuum = incremental' and 'vacuum' on "
+                 "it once while nothing else is using it",
+                 ctx->db_file);
         }
+        return;
     }
-    else {
-        debug("No class hint for window %llu", (unsigned long long) window);
+    else if (mode != 2) {
+        return;
     }
 
-    char *title = x_get_title(ctx, window);
-    if (title) {
-        have_property = have_property || strlen(title) > 0;
-        db_bind_string(ctx, 8, title);
-        free(title);
-    }
-    else {
-        debug("No title for window %llu", (unsigned long long) window);
-    }
+    long long     pages = COMPACT_VACUUM_PAGES;
+    sqlite3_int64 free_pages;
+    while (!daemon_stop && (free_pages = compact_get_pragma(
+                                ctx, "pragma freelist_count")) > 0) {
+        long long step = pages < free_pages ? pages : free_pages;
+        char      sql[64];
+        snprintf(sql, sizeof(sql), "pragma incremental_vacuum(%lld)", step);
 
-    /*
-     * If there's neither a name nor a class nor a title, you can't actually
-     * classify anything about this window. Exclude it if so instructed.
-     */
-    if (!ctx->exclude_blanks || have_property) {
-        db_exec_stmt(ctx, NULL);
-    }
-    else {
-        debug("Not inserting empty entry for window %llu",
-              (unsigned long long) window);
-    }
+        long long start_ns = monotonic_ns();
+        compact_begin(ctx);
+        db_exec(&ctx->db, sql);
+        db_commit(ctx);
+        ctx->compact_pages += step;
 
-    return focused;
+        pages = compact_resize(pages, monotonic_ns() - start_ns);
+        compact_pause();
+    }
 }
 
-static void x_recurse_windows(Context *ctx)
+static void compact(Context *ctx)
 {
-    db_prepare_window_insert(ctx);
-    x_snap_window(ctx, ctx->root, None, 1);
-    ctx->stmt = db_close_stmt(ctx->stmt);
-}
+    compact_open(ctx);
+    daemon_install_signal_handlers();
 
+    int       changed = 0;
+    long long now_ms  = realtime_ms();
+    if (ctx->retain_days > 0) {
+        long long end_ms = now_ms - ctx->retain_days * COMPACT_DAY_MS;
+        changed += compact_range(ctx, 60000, end_ms, compact_retain_chunk);
+    }
+    if (ctx->downsample_seconds > 0) {
+        long long bucket_ms = ctx->downsample_seconds * 1000LL;
+        long long end_ms    = now_ms - ctx->downsample_after_days
+                                     * COMPACT_DAY_MS;
+        end_ms             -= end_ms % bucket_ms;
+        changed += compact_range(ctx, bucket_ms, end_ms,
+                                 compact_downsample_chunk);
+    }
+    if (changed > 0) {
+        compact_reset_rollup(ctx);
+    }
+    compact_vacuum(ctx);
 
-static void run(Context *ctx)
-{
-    db_check_name(ctx);
-    db_open(ctx);
-    db_init(ctx);
-    x_open_display(ctx);
-    x_get_idle_time(ctx);
-    db_begin(ctx);
-    db_insert_snapshot(ctx);
-    x_get_focused_window(ctx);
-    x_alloc_class_hint(ctx);
-    x_recurse_windows(ctx);
-    db_commit(ctx);
+    if (ctx->verbose) {
+        printf("Deleted %d snapshots, merged %d into others, "
+               "vacuumed %lld pages\n", ctx->compact_deleted,
+               ctx->compact_merged, ctx->compact_pages);
+    }
 }
 
-static bool run_with_jmp_buf(Context *ctx)
+static bool compact_with_jmp_buf(Context *ctx)
 {
     if (setjmp(ctx->env) == 0) {
-        debug("Running with longjmp buffer");
-        run(ctx);
+        debug("Compacting with longjmp buffer");
+        compact(ctx);
         return true;
     }
     else {
@@ -686,23 +4869,98 @@ static bool run_with_jmp_buf(Context *ctx)
     }
 }
 
-static void cleanup(Context *ctx)
+static void cleanup_display(Context *ctx)
 {
-    debug("Cleaning up");
-    ctx->stmt = db_close_stmt(ctx->stmt);
-    ctx->tx   = db_rollback(ctx->db, ctx->tx);
+    x_tree_free(&ctx->tree);
+    x_cache_free(&ctx->cache);
+    free(ctx->focus_path);
+    x_arena_free(&ctx->arena);
     ctx->ch   = x_free_class_hint(ctx->ch);
+#ifdef WTSNAP_XCB
+    x_xcb_free_nodes(ctx);
+    free(ctx->xcb_nodes);
+    ctx->xcb  = NULL;
+#endif
     ctx->dpy  = x_close_display(ctx->dpy);
-    ctx->db   = db_close(ctx->db);
+}
+
+static void cleanup_db(Context *ctx)
+{
+    db_close_statements(ctx);
+    ctx->tx   = db_rollback(ctx->db.handle, ctx->tx);
+    db_free_strings(&ctx->strings);
+    db_free_delta(&ctx->delta);
+    ctx->db.handle = db_close(ctx->db.handle);
+    free(ctx->partition_name);
+    ctx->partition_name = NULL;
+}
+
+static void cleanup(Context *ctx)
+{
+    debug("Cleaning up");
+    queue_stop(ctx);
+    if (ctx->writer) {
+        cleanup_db(ctx->writer);
+        free(ctx->writer);
+        ctx->writer = NULL;
+    }
+    ctx->queue = queue_free(ctx->queue);
+    cleanup_db(ctx);
+    for (int i = 0; i < ctx->capture_count; ++i) {
+        cleanup_display(&ctx->captures[i]);
+        free(ctx->captures[i].capture_rows);
+    }
+    free(ctx->captures);
+    free(ctx->compact_rows);
+    ctx->captures      = NULL;
+    ctx->capture_count = 0;
+    cleanup_display(ctx);
     if (ctx->free_db_name) {
         free((char *)ctx->db_name);
     }
 }
 
 
+static const char *args_journal_modes[] = {
+    "delete", "truncate", "persist", "memory", "wal", "off", NULL,
+};
+
+static const char *args_synchronous_levels[] = {
+    "off", "normal", "full", "extra", NULL,
+};
+
+static const char *args_partitions[] = {
+    [PARTITION_NONE]  = "none",
+    [PARTITION_DAY]   = "day",
+    [PARTITION_MONTH] = "month",
+    [PARTITION_YEAR]  = "year",
+    NULL,
+};
+
+static bool args_is_one_of(const char *arg, const char **values)
+{
+    for (const char **value = values; *value; ++value) {
+        if (strcasecmp(arg, *value) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int args_handle(Context *ctx, const char *prog, int opt)
 {
     switch (opt) {
+        case 'A':
+            ctx->adaptive_time = atoi(optarg);
+            debug("adaptive_time set to %d from '%s'",
+                  ctx->adaptive_time, optarg);
+            if (ctx->adaptive_time > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -A -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
         case 'b':
             ctx->exclude_blanks = false;
             debug("exclude_blanks set to false");
@@ -711,16 +4969,140 @@ static int args_handle(Context *ctx, const char *prog, int opt)
             ctx->exclude_blanks = true;
             debug("exclude_blanks set to true");
             return 0;
+        case 'C':
+            ctx->use_clients = true;
+            debug("use_clients set to true");
+            return 0;
+        case 'D':
+            ctx->daemon = true;
+            debug("daemon set to true");
+            return 0;
+        case 'E':
+            ctx->track_events = true;
+            debug("track_events set to true");
+            return 0;
+        case 'R':
+            ctx->cache_props = true;
+            debug("cache_props set to true");
+            return 0;
+        case 'F':
+            ctx->focus_only = true;
+            debug("focus_only set to true");
+            return 0;
+        case 'L':
+            ctx->max_depth = atoi(optarg);
+            debug("max_depth set to %d from '%s'", ctx->max_depth, optarg);
+            if (ctx->max_depth >= 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -L -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case 'M':
+            ctx->only_mapped = true;
+            debug("only_mapped set to true");
+            return 0;
+        case 'O':
+            ctx->skip_override = true;
+            debug("skip_override set to true");
+            return 0;
         case 'd':
-            ctx->dpy_name = optarg;
+            if (ctx->dpy_count == CAPTURE_MAX_DISPLAYS) {
+                warn("%s: can't capture more than %d displays",
+                     prog, CAPTURE_MAX_DISPLAYS);
+                return ARGS_ERROR;
+            }
+            ctx->dpy_name                    = optarg;
+            ctx->dpy_names[ctx->dpy_count++] = optarg;
             debug("dpy_name set to '%s'", ctx->dpy_name);
             return 0;
         case 'f':
             ctx->db_name = optarg;
             debug("db_name set to '%s'", ctx->db_name);
             return 0;
+        case 'g':
+            ctx->group_count = atoi(optarg);
+            debug("group_count set to %d from '%s'", ctx->group_count, optarg);
+            if (ctx->group_count > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -g -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case 'G':
+            ctx->group_seconds = atoi(optarg);
+            debug("group_seconds set to %d from '%s'",
+                  ctx->group_seconds, optarg);
+            if (ctx->group_seconds > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -G -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
         case 'h':
             return ARGS_WANT_HELP;
+        case 'j':
+            ctx->journal_mode = optarg;
+            debug("journal_mode set to '%s'", ctx->journal_mode);
+            if (args_is_one_of(optarg, args_journal_modes)) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -j -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case 'I':
+            ctx->idle_threshold = atoi(optarg);
+            debug("idle_threshold set to %d from '%s'",
+                  ctx->idle_threshold, optarg);
+            if (ctx->idle_threshold > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -I -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case 'K':
+            ctx->keyframe_interval = atoi(optarg);
+            debug("keyframe_interval set to %d from '%s'",
+                  ctx->keyframe_interval, optarg);
+            if (ctx->keyframe_interval >= 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -K -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case 'Q': {
+            int kb = atoi(optarg);
+            debug("queue_size set to %d KB from '%s'", kb, optarg);
+            if (kb > 0 && kb <= QUEUE_MAX_KB) {
+                ctx->queue_size = (size_t) kb * 1024;
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -Q -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        }
+        case 'P':
+            for (int i = 0; args_partitions[i]; ++i) {
+                if (strcasecmp(optarg, args_partitions[i]) == 0) {
+                    ctx->partition = i;
+                    debug("partition set to %d from '%s'",
+                          ctx->partition, optarg);
+                    return 0;
+                }
+            }
+            warn("%s: invalid argument to -P -- '%s'", prog, optarg);
+            return ARGS_ERROR;
+        case 'N':
+            ctx->normalize = true;
+            debug("normalize set to true");
+            return 0;
         case 's':
             ctx->sample_time = atoi(optarg);
             debug("sample_time set to %d from '%s'", ctx->sample_time, optarg);
@@ -731,6 +5113,64 @@ static int args_handle(Context *ctx, const char *prog, int opt)
                 warn("%s: invalid argument to -s -- '%s'", prog, optarg);
                 return ARGS_ERROR;
             }
+        case 'm':
+            ctx->record_meta = true;
+            debug("record_meta set to true");
+            return 0;
+        case 'v':
+            ctx->verbose = true;
+            debug("verbose set to true");
+            return 0;
+        case 'y':
+            ctx->synchronous = optarg;
+            debug("synchronous set to '%s'", ctx->synchronous);
+            if (args_is_one_of(optarg, args_synchronous_levels)) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -y -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case ARGS_COMPACT:
+            ctx->compact = true;
+            debug("compact set to true");
+            return 0;
+        case ARGS_RETAIN:
+            ctx->retain_days = atoi(optarg);
+            debug("retain_days set to %d from '%s'",
+                  ctx->retain_days, optarg);
+            if (ctx->retain_days > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to --retain -- '%s'",
+                     prog, optarg);
+                return ARGS_ERROR;
+            }
+        case ARGS_DOWNSAMPLE:
+            ctx->downsample_seconds = atoi(optarg);
+            debug("downsample_seconds set to %d from '%s'",
+                  ctx->downsample_seconds, optarg);
+            if (ctx->downsample_seconds > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to --downsample -- '%s'",
+                     prog, optarg);
+                return ARGS_ERROR;
+            }
+        case ARGS_DOWNSAMPLE_AFTER:
+            ctx->downsample_after_days = atoi(optarg);
+            debug("downsample_after_days set to %d from '%s'",
+                  ctx->downsample_after_days, optarg);
+            if (ctx->downsample_after_days > 0) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to --downsample-after -- '%s'",
+                     prog, optarg);
+                return ARGS_ERROR;
+            }
         default:
             return ARGS_ERROR;
     }
@@ -738,13 +5178,101 @@ static int args_handle(Context *ctx, const char *prog, int opt)
 
 static int args_parse(Context *ctx, int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        {"compact",          no_argument,       NULL, ARGS_COMPACT},
+        {"retain",           required_argument, NULL, ARGS_RETAIN},
+        {"downsample",       required_argument, NULL, ARGS_DOWNSAMPLE},
+        {"downsample-after", required_argument, NULL, ARGS_DOWNSAMPLE_AFTER},
+        {NULL, 0, NULL, 0},
+    };
+
     int opt;
     int ret = 0;
 
-    while ((opt = getopt(argc, argv, "bBd:f:hs:")) != -1) {
+    while ((opt = getopt_long(argc, argv,
+                              "A:bBCDEFd:f:g:G:hI:j:K:L:mMNOP:Q:Rs:vy:",
+                              long_options, NULL)) != -1) {
         ret |= args_handle(ctx, argv[0], opt);
     }
 
+    if (ctx->track_events && !ctx->daemon) {
+        warn("%s: -E only works in daemon mode (-D)", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->cache_props && !ctx->daemon) {
+        warn("%s: -R only works in daemon mode (-D)", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->cache_props && ctx->track_events) {
+        warn("%s: -R and -E can't be used together", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->track_events && ctx->use_clients) {
+        warn("%s: -C and -E can't be used together", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->dpy_count > 1 && ctx->keyframe_interval > 0) {
+        warn("%s: -K only works with a single display", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->dpy_count > 1 && ctx->record_meta) {
+        warn("%s: -m only works with a single display", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->adaptive_time > 0 && !ctx->daemon) {
+        warn("%s: -A only works in daemon mode (-D)", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->adaptive_time > ctx->sample_time) {
+        warn("%s: -A can't be above the sample time (-s)", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->dpy_count > 1 && ctx->adaptive_time > 0) {
+        warn("%s: -A only works with a single display", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->queue_size > 0 && !ctx->daemon) {
+        warn("%s: -Q only works in daemon mode (-D)", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->queue_size > 0 && ctx->record_meta) {
+        warn("%s: -Q and -m can't be used together", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if ((ctx->group_count > 1 || ctx->group_seconds > 0) && !ctx->daemon) {
+        warn("%s: -g and -G only work in daemon mode (-D)", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if ((ctx->retain_days > 0 || ctx->downsample_seconds > 0)
+            && !ctx->compact) {
+        warn("%s: --retain and --downsample only work with --compact",
+             argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->compact && ctx->daemon) {
+        warn("%s: --compact and -D can't be used together", argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ctx->compact && ctx->partition) {
+        warn("%s: --compact doesn't work with -P, give the partition to -f",
+             argv[0]);
+        ret |= ARGS_ERROR;
+    }
+
     if (optind != argc) {
         fprintf(stderr, "%s: trailing arguments --", argv[0]);
         for (int i = optind; i < argc; ++i) {
@@ -756,6 +5284,9 @@ static int args_parse(Context *ctx, int argc, char **argv)
 
     if (ret & ARGS_WANT_HELP) {
         fprintf(stdout, args_help, argv[0]);
+        fputs(args_help_more, stdout);
+        fputs(args_help_rest, stdout);
+        fputs(args_help_compact, stdout);
     }
 
     return ret;
@@ -763,12 +5294,12 @@ static int args_parse(Context *ctx, int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-    XSetErrorHandler(x_handle_error);
-
-    Context ctx     = {0};
-    ctx.db_name     = NULL;
-    ctx.dpy_name    = "";
-    ctx.sample_time = 60;
+    Context ctx               = {0};
+    ctx.db.env                = &ctx.env;
+    ctx.db_name               = NULL;
+    ctx.dpy_name              = "";
+    ctx.sample_time           = 60;
+    ctx.downsample_after_days = 7;
 
     int arg_ret = args_parse(&ctx, argc, argv);
     if (arg_ret & ARGS_ERROR) {
@@ -778,7 +5309,18 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    bool ok = run_with_jmp_buf(&ctx);
+    /* Each display is only used by one thread, but Xlib is shared. */
+    if (ctx.dpy_count > 1 && !XInitThreads()) {
+        warn("Can't initialize Xlib for threads");
+        return EXIT_FAILURE;
+    }
+    XSetErrorHandler(x_handle_error);
+
+    bool ok = ctx.compact ? compact_with_jmp_buf(&ctx)
+                          : run_with_jmp_buf(&ctx);
+    if (ok && ctx.daemon) {
+        daemon_run(&ctx);
+    }
     cleanup(&ctx);
     return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,3147 @@
+/*
+ * Copyright (c) 2021, 2022 Carsten Hartenfels
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sqlite3.h>
+#include "wtarc.h"
+#include "wtclassify.h"
+#include "wtdb.h"
+
+
+#define ARGS_ERROR     (1 << 0)
+#define ARGS_WANT_HELP (1 << 1)
+
+/* Long options don't have a short equivalent, so they get values past it. */
+#define ARGS_SERVE 256
+
+/* How long to wait for a lock, shorter for the optional cache. */
+#define DB_BUSY_MS    5000
+#define CACHE_BUSY_MS 50
+
+static const char *args_help =
+    "\n"
+    "wtstats - queries snapshots previously made with wtsnap, classifying\n"
+    "them into tasks according to your specifications and telling you how\n"
+    "long you worked on each of them. Really just convenience around\n"
+    "querying the SQLite database manually.\n"
+    "\n"
+    "Usage: %s [OPTIONS] [--serve]\n"
+    "\n"
+    "Available options:\n"
+    "\n"
+    "    -c SQL_FILE\n"
+    "        Path to the file containing the classification conditions\n"
+    "        as the contents of an SQL CASE statement. They're compiled\n"
+    "        with the builtin classifier, which is a lot faster for\n"
+    "        large classification files. If it can't handle them,\n"
+    "        they're used as an ordinary CASE statement.\n"
+    "        Default is ~/.wtclass.sql\n"
+    "\n"
+    "    -f DATABASE_FILE\n"
+    "        Path to the SQLite database file. Can be given several\n"
+    "        times and may contain wildcards like '*.db', in which\n"
+    "        case the time from all of the databases is added up.\n"
+    "        Partitions written by wtsnap -P are found on their own,\n"
+    "        only the ones overlapping the -s/-S/-t/-T range are read.\n"
+    "        Archives written by wtarchive (ending in .wta) are read\n"
+    "        in place of the databases they were made from once those\n"
+    "        are gone, but can't be queried with -w.\n"
+    "        Default is ~/.wtsnap.db\n"
+    "\n"
+    "    -h\n"
+    "        Show this help.\n"
+    "\n"
+    "    -j JOBS\n"
+    "        Number of databases to query at the same time when there\n"
+    "        are several, each on its own thread and connection.\n"
+    "        Default is the number of processors.\n"
+    "\n"
+    "    -i IDLE_TIME_IN_MILLISECONDS\n"
+    "        Idle time in milliseconds at which to ignore a snapshot.\n"
+    "        Default is 60000, excluding every snapshot where the last\n"
+    "        user interaction has been a minute or longer ago.\n"
+    "\n"
+    "    -o FORMAT\n"
+    "        Write rows in a format for other programs instead, one of\n"
+    "        csv (with a header), ndjson (a JSON object per line) or\n"
+    "        binary (described in the README). Rows are written as\n"
+    "        they come in, so this works for huge exports with -x.\n"
+    "        Default is to use the -q options.\n"
+    "\n"
+    "    -q SQLITE_OPTIONS\n"
+    "        Output options in the style of the sqlite3 command line,\n"
+    "        separated by spaces. Understands -list, -csv, -tabs,\n"
+    "        -line, -column, -table, -box, -markdown and -json, as\n"
+    "        well as -header, -noheader, -separator SEPARATOR,\n"
+    "        -newline NEWLINE and -nullvalue TEXT.\n"
+    "        Default is '-header -table'.\n"
+    "\n"
+    "    -s DATETIME     (for snapshot >= DATETIME)\n"
+    "    -S DATETIME     (for snapshot >  DATETIME)\n"
+    "    -t DATETIME     (for snapshot <= DATETIME)\n"
+    "    -T DATETIME     (for snapshot <  DATETIME)\n"
+    "        Adds a date condition to the classification query. The\n"
+    "        argument is something that your date command can parse,\n"
+    "        for example 'today 12 pm', 'March 1' or '2021-01-01'.\n"
+    "        Dates like '2021-01-01 12:30' and 'now' are understood\n"
+    "        directly, anything else is passed to date.\n"
+    "        Default is to have all of these unset.\n"
+    "\n"
+    "    -u\n"
+    "    -U\n"
+    "        Sets the show_uncategorized variable to 1 (-u) or 0 (-U).\n"
+    "        This will appear as a column in your classification query.\n"
+    "        Use it to show uncategorized windows when set to 1.\n"
+    "        Default is show_uncategorized being 0.\n"
+    "\n"
+    "    -w WHERE_CONDITIONS\n"
+    "        Specify additional conditions for the WHERE clause in the\n"
+    "        classification query. Should probably start with AND.\n"
+    "        Default is ''.\n"
+    "\n"
+    "    -x\n"
+    "        Export every classified snapshot in order of time instead\n"
+    "        of summing them up, with its snapshot_id, timestamp,\n"
+    "        epoch_ms, idle_time, class and seconds. With several\n"
+    "        databases, they're exported one after the other.\n"
+    "        Default is to sum up the time per class.\n"
+    "\n"
+    "    --serve\n"
+    "        Keep the database open and answer queries read from\n"
+    "        standard input, one per line. Each line contains options\n"
+    "        like the ones above, quoted like in a shell, which apply\n"
+    "        on top of the ones given on the command line. -f can only\n"
+    "        be given on the command line. Every answer is followed by\n"
+    "        an empty line, errors go to standard error.\n"
+    "        Default is to answer a single query and exit.\n"
+    "\n";
+
+
+enum {
+    TIME_GTE,
+    TIME_GT,
+    TIME_LTE,
+    TIME_LT,
+    TIME_COUNT,
+};
+
+enum {
+    OUTPUT_LIST,
+    OUTPUT_CSV,
+    OUTPUT_LINE,
+    OUTPUT_COLUMN,
+    OUTPUT_TABLE,
+    OUTPUT_BOX,
+    OUTPUT_MARKDOWN,
+    OUTPUT_JSON,
+    OUTPUT_NDJSON,
+    OUTPUT_BINARY,
+};
+
+/* Same limit as the sqlite3 command line has for these. */
+#define OUTPUT_STRING_SIZE 20
+
+typedef struct Output {
+    int  mode;
+    bool header;
+    char separator[OUTPUT_STRING_SIZE];
+    char newline[OUTPUT_STRING_SIZE];
+    char null_value[OUTPUT_STRING_SIZE];
+} Output;
+
+/*
+ * Everything that the options of a single query specify. The strings point
+ * into the arguments they were parsed from. Times are kept as they were
+ * given and only resolved when the query is run, so that something like
+ * "today" in serve mode means the day of the query, not of the startup.
+ */
+typedef struct Query {
+    const char *classes_name;
+    int        idle_time;
+    int        show_uncategorized;
+    const char *where;
+    const char *times[TIME_COUNT];
+    bool       snapshots;
+    Output     out;
+} Query;
+
+typedef struct Buffer {
+    char   *data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+typedef struct Cell {
+    int        type;
+    const char *text;
+} Cell;
+
+/*
+ * Rows are written out as they are stepped, only the modes that align their
+ * columns need to keep all of them around in cells. The others just go
+ * through the current row, whose text points into the statement.
+ */
+typedef struct Result {
+    int    columns;
+    char   **names;
+    int    name_width;
+    Cell   *current;
+    Cell   *cells;
+    size_t rows;
+    size_t capacity;
+} Result;
+
+/*
+ * Prepared statements are kept around by their SQL, which is all the same
+ * between queries with the same options. Slots are reused round-robin.
+ */
+#define STMT_CACHE_SIZE 32
+
+typedef struct CachedStmt {
+    char         *sql;
+    sqlite3_stmt *stmt;
+} CachedStmt;
+
+/* The per-class sums of one of several databases, see query_run_sharded. */
+typedef struct ShardRow {
+    char          *class;
+    sqlite3_int64 seconds;
+} ShardRow;
+
+typedef struct Shard {
+    const char *db_name;
+    bool       archive;
+    bool       ok;
+    ShardRow   *rows;
+    size_t     count;
+    size_t     capacity;
+} Shard;
+
+/* Partitions only have snapshots from their own period, others from any. */
+typedef struct DbFile {
+    char          *name;
+    sqlite3_int64 from_ms;
+    sqlite3_int64 until_ms;
+    bool          archive;
+} DbFile;
+
+/*
+ * What archive_execute found out about the windows of an archive: per focus
+ * path, the time of the snapshots that had it and its class, which it
+ * borrows from its triples, and per triple whether any of those paths have
+ * it and its class.
+ */
+typedef struct ArcPath {
+    sqlite3_int64 seconds;
+    sqlite3_int64 count;
+    const char    *class;
+} ArcPath;
+
+typedef struct ArcTriple {
+    bool used;
+    char *class;
+} ArcTriple;
+
+typedef struct Context {
+    DbFile        *db_files;
+    int           db_count;
+    int           jobs;
+    const char    *db_name;
+    bool          serve;
+    Query         defaults;
+    jmp_buf       env;
+    Db            db;
+    CachedStmt    stmts[STMT_CACHE_SIZE];
+    int           stmts_next;
+    Buffer        sql;
+    Buffer        classes;
+    char          classes_hash[17];
+    char          checked_hash[17];
+    bool          classifier;
+    const Query   *query;
+    bool          have_times[TIME_COUNT];
+    sqlite3_int64 times[TIME_COUNT];
+    sqlite3_int64 rules_id;
+    sqlite3_int64 rollup_snapshot_id;
+    Result        result;
+    Shard         *shards;
+    int           shard_count;
+    Shard         *shard;
+    Archive       archive;
+    ArcRows       *arc_rows;
+    ArcPath       *arc_paths;
+    ArcTriple     *arc_triples;
+    uint64_t      arc_triple_count;
+} Context;
+
+
+static noreturn void die(Context *ctx, const char *fmt, ...)
+{
+    DO_LOG();
+    longjmp(ctx->env, 1);
+}
+
+
+static void buf_clear(Buffer *buf)
+{
+    buf->size = 0;
+    if (buf->data) {
+        buf->data[0] = '\0';
+    }
+}
+
+static void buf_free(Buffer *buf)
+{
+    free(buf->data);
+    buf->data     = NULL;
+    buf->size     = 0;
+    buf->capacity = 0;
+}
+
+static void buf_reserve(Context *ctx, Buffer *buf, size_t len)
+{
+    if (buf->size + len >= buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (buf->size + len >= capacity) {
+            capacity *= 2;
+        }
+        char *data = realloc(buf->data, capacity);
+        if (!data) {
+            die(ctx, "Can't realloc %zu bytes for buffer", capacity);
+        }
+        buf->data     = data;
+        buf->capacity = capacity;
+    }
+}
+
+static void buf_append(Context *ctx, Buffer *buf, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        die(ctx, "Can't format '%s'", fmt);
+    }
+
+    buf_reserve(ctx, buf, (size_t) len);
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->size, buf->capacity - buf->size, fmt, ap);
+    va_end(ap);
+    buf->size += (size_t) len;
+}
+
+
+/*
+ * Parses the formats that come up the most, as local time like date does:
+ * "now", "@SECONDS" and ISO dates with an optional time of day.
+ */
+static bool time_parse_digits(const char **s, int count, int *out)
+{
+    int value = 0;
+    for (int i = 0; i < count; ++i) {
+        char c = (*s)[i];
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    *s   += count;
+    *out  = value;
+    return true;
+}
+
+static bool time_parse_native(const char *arg, sqlite3_int64 *out)
+{
+    if (strcmp(arg, "now") == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        *out = (sqlite3_int64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        return true;
+    }
+
+    if (arg[0] == '@') {
+        char      *end;
+        long long seconds = strtoll(arg + 1, &end, 10);
+        if (end == arg + 1 || *end) {
+            return false;
+        }
+        *out = (sqlite3_int64) seconds * 1000;
+        return true;
+    }
+
+    struct tm tm = {0};
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    const char *s = arg;
+    if (!time_parse_digits(&s, 4, &year) || *s++ != '-'
+            || !time_parse_digits(&s, 2, &month) || *s++ != '-'
+            || !time_parse_digits(&s, 2, &day)) {
+        return false;
+    }
+
+    if (*s == ' ' || *s == 'T') {
+        ++s;
+        if (!time_parse_digits(&s, 2, &hour) || *s++ != ':'
+                || !time_parse_digits(&s, 2, &minute)) {
+            return false;
+        }
+        if (*s == ':') {
+            ++s;
+            if (!time_parse_digits(&s, 2, &second)) {
+                return false;
+            }
+        }
+    }
+
+    if (*s) {
+        return false;
+    }
+
+    tm.tm_year  = year - 1900;
+    tm.tm_mon   = month - 1;
+    tm.tm_mday  = day;
+    tm.tm_hour  = hour;
+    tm.tm_min   = minute;
+    tm.tm_sec   = second;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+
+    /* mktime moves invalid dates and times that fall into a DST gap
+     * somewhere else, date complains about them, so let it do that. */
+    if (t == (time_t) -1 || tm.tm_mday != day || tm.tm_mon != month - 1
+            || tm.tm_hour != hour || tm.tm_min != minute) {
+        return false;
+    }
+
+    *out = (sqlite3_int64) t * 1000;
+    return true;
+}
+
+static bool time_parse_date(const char *arg, sqlite3_int64 *out)
+{
+    debug("Running date -d '%s'", arg);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        warn("Can't create pipe for date: %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        warn("Can't fork for date: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    else if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execlp("date", "date", "-d", arg, "+%s%3N", (char *) NULL);
+        warn("Can't run date: %s", strerror(errno));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    char    buf[64];
+    size_t  len = 0;
+    ssize_t got;
+    while (len < sizeof(buf) - 1
+            && ((got = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0
+                || (got < 0 && errno == EINTR))) {
+        len += got > 0 ? (size_t) got : 0;
+    }
+    buf[len] = '\0';
+    close(fds[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            warn("Can't wait for date: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return false;
+    }
+
+    char      *end;
+    long long epoch_ms = strtoll(buf, &end, 10);
+    if (end == buf || (*end && *end != '\n')) {
+        warn("Can't make sense of date output '%s'", buf);
+        return false;
+    }
+
+    *out = (sqlite3_int64) epoch_ms;
+    return true;
+}
+
+static bool query_resolve_times(Context *ctx, const Query *q)
+{
+    for (int i = 0; i < TIME_COUNT; ++i) {
+        const char *arg = q->times[i];
+        ctx->have_times[i] = arg != NULL;
+        if (arg && !time_parse_native(arg, &ctx->times[i])
+                && !time_parse_date(arg, &ctx->times[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool query_has_times(Context *ctx)
+{
+    for (int i = 0; i < TIME_COUNT; ++i) {
+        if (ctx->have_times[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void stmts_reset(Context *ctx)
+{
+    for (int i = 0; i < STMT_CACHE_SIZE; ++i) {
+        if (ctx->stmts[i].stmt) {
+            db_reset_stmt(ctx->stmts[i].stmt);
+        }
+    }
+}
+
+static void stmts_free(Context *ctx)
+{
+    for (int i = 0; i < STMT_CACHE_SIZE; ++i) {
+        ctx->stmts[i].stmt = db_close_stmt(ctx->stmts[i].stmt);
+        free(ctx->stmts[i].sql);
+        ctx->stmts[i].sql = NULL;
+    }
+}
+
+/*
+ * Binds the named parameters that the statement uses from the query. Plain
+ * question marks are left for the caller to bind.
+ */
+static void stmt_bind(Context *ctx, sqlite3_stmt *stmt)
+{
+    static const char *time_names[TIME_COUNT] = {
+        ":gte", ":gt", ":lte", ":lt",
+    };
+
+    int count = sqlite3_bind_parameter_count(stmt);
+    for (int i = 1; i <= count; ++i) {
+        const char *name = sqlite3_bind_parameter_name(stmt, i);
+        if (!name) {
+            continue;
+        }
+        else if (strcmp(name, ":hash") == 0) {
+            db_bind_string(&ctx->db, stmt, i, ctx->classes_hash);
+        }
+        else if (strcmp(name, ":rules") == 0) {
+            db_bind_string(&ctx->db, stmt, i, ctx->classes.data);
+        }
+        else if (strcmp(name, ":show") == 0) {
+            db_bind_int(&ctx->db, stmt, i, ctx->query->show_uncategorized);
+        }
+        else if (strcmp(name, ":idle") == 0) {
+            db_bind_int(&ctx->db, stmt, i, ctx->query->idle_time);
+        }
+        else if (strcmp(name, ":rules_id") == 0) {
+            db_bind_int64(&ctx->db, stmt, i, ctx->rules_id);
+        }
+        else if (strcmp(name, ":rollup_snapshot_id") == 0) {
+            db_bind_int64(&ctx->db, stmt, i, ctx->rollup_snapshot_id);
+        }
+        else {
+            int t = 0;
+            while (t < TIME_COUNT && strcmp(name, time_names[t]) != 0) {
+                ++t;
+            }
+            if (t == TIME_COUNT) {
+                die(ctx, "Unknown parameter %s in %s", name, sqlite3_sql(stmt));
+            }
+            db_bind_int64(&ctx->db, stmt, i, ctx->times[t]);
+        }
+    }
+}
+
+/*
+ * With WTSTATS_EXPLAIN set, the query plan of every statement is written to
+ * standard error when it's first prepared, indented like the sqlite3 shell
+ * does it. Nested more than PLAN_MAX_DEPTH deep just stays at that depth.
+ */
+#define PLAN_MAX_DEPTH 32
+
+static void stmt_explain(Context *ctx, const char *sql)
+{
+    const char *explain = getenv("WTSTATS_EXPLAIN");
+    if (!explain || !explain[0]) {
+        return;
+    }
+
+    char *plan_sql = sqlite3_mprintf("explain query plan %s", sql);
+    if (!plan_sql) {
+        die(ctx, "Can't allocate query plan statement");
+    }
+    sqlite3_stmt *stmt;
+    int result = sqlite3_prepare_v2(ctx->db.handle, plan_sql, -1, &stmt, NULL);
+    sqlite3_free(plan_sql);
+    if (result != SQLITE_OK) {
+        warn("Can't explain query plan: %s", sqlite3_errmsg(ctx->db.handle));
+        return;
+    }
+
+    int ids[PLAN_MAX_DEPTH];
+    int depth = 0;
+    fprintf(stderr, "QUERY PLAN for\n%s\n", sql);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int        id     = sqlite3_column_int(stmt, 0);
+        int        parent = sqlite3_column_int(stmt, 1);
+        const char *text  = (const char *) sqlite3_column_text(stmt, 3);
+        while (depth > 0 && ids[depth - 1] != parent) {
+            --depth;
+        }
+        fprintf(stderr, "%*s`--%s\n", depth * 3, "", text ? text : "");
+        if (depth < PLAN_MAX_DEPTH) {
+            ids[depth++] = id;
+        }
+    }
+    fputc('\n', stderr);
+    sqlite3_finalize(stmt);
+}
+
+/*
+ * Returns the cached statement for the given SQL, ready to execute with all
+ * of its parameters bound. Returns NULL if it doesn't prepare, leaving the
+ * error message on the database handle.
+ */
+static sqlite3_stmt *stmt_try_get(Context *ctx, const char *sql)
+{
+    for (int i = 0; i < STMT_CACHE_SIZE; ++i) {
+        CachedStmt *cached = &ctx->stmts[i];
+        if (cached->sql && strcmp(cached->sql, sql) == 0) {
+            db_reset_stmt(cached->stmt);
+            stmt_bind(ctx, cached->stmt);
+            return cached->stmt;
+        }
+    }
+
+    debug("Preparing %s", sql);
+    sqlite3_stmt *stmt;
+    int result = sqlite3_prepare_v3(ctx->db.handle, sql, -1,
+                                    SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+    if (result != SQLITE_OK) {
+        return NULL;
+    }
+    stmt_explain(ctx, sql);
+
+    char *copy = strdup(sql);
+    if (!copy) {
+        sqlite3_finalize(stmt);
+        die(ctx, "Can't copy SQL for statement cache");
+    }
+
+    CachedStmt *cached = &ctx->stmts[ctx->stmts_next];
+    ctx->stmts_next    = (ctx->stmts_next + 1) % STMT_CACHE_SIZE;
+    db_close_stmt(cached->stmt);
+    free(cached->sql);
+    cached->sql  = copy;
+    cached->stmt = stmt;
+
+    stmt_bind(ctx, stmt);
+    return stmt;
+}
+
+static sqlite3_stmt *stmt_get(Context *ctx, const char *sql)
+{
+    sqlite3_stmt *stmt = stmt_try_get(ctx, sql);
+    if (!stmt) {
+        die(ctx, "Failed to prepare statement '%s': %s",
+            sql, sqlite3_errmsg(ctx->db.handle));
+    }
+    return stmt;
+}
+
+
+static void query_read_classes(Context *ctx, const Query *q)
+{
+    char       *default_name = NULL;
+    const char *name         = q->classes_name;
+    if (!name) {
+        const char *home = getenv("HOME");
+        if (!home) {
+            die(ctx, "HOME not set, use -c to specify a classification file");
+        }
+        size_t size  = strlen(home) + sizeof("/.wtclass.sql");
+        default_name = malloc(size);
+        if (!default_name) {
+            die(ctx, "Can't malloc %zu bytes for classification path", size);
+        }
+        snprintf(default_name, size, "%s/.wtclass.sql", home);
+        name = default_name;
+    }
+
+    debug("Reading classification file '%s'", name);
+    buf_clear(&ctx->classes);
+    FILE *fh = fopen(name, "r");
+    if (fh) {
+        size_t got;
+        do {
+            buf_reserve(ctx, &ctx->classes, 4096);
+            got = fread(ctx->classes.data + ctx->classes.size, 1,
+                        ctx->classes.capacity - ctx->classes.size - 1, fh);
+            ctx->classes.size += got;
+        } while (got > 0);
+        fclose(fh);
+        /* Trailing newlines are dropped like the shell would. */
+        while (ctx->classes.size > 0
+                && ctx->classes.data[ctx->classes.size - 1] == '\n') {
+            --ctx->classes.size;
+        }
+        ctx->classes.data[ctx->classes.size] = '\0';
+    }
+    else {
+        warn("Can't open classification file '%s': %s", name, strerror(errno));
+    }
+
+    if (ctx->classes.size == 0) {
+        warn("Got nothing from classification file '%s', bailing out", name);
+        free(default_name);
+        longjmp(ctx->env, 1);
+    }
+    free(default_name);
+}
+
+/* Only needs to tell different classification files apart, so FNV-1a. */
+static void query_hash_classes(Context *ctx)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < ctx->classes.size; ++i) {
+        hash ^= (unsigned char) ctx->classes.data[i];
+        hash *= 1099511628211ULL;
+    }
+    snprintf(ctx->classes_hash, sizeof(ctx->classes_hash), "%016llx", hash);
+}
+
+/*
+ * The classifier only understands a subset of SQL, so if it can't compile
+ * the classification file, stick with the plain CASE. The answer only
+ * changes with the classification file, so it's remembered by its hash.
+ */
+static void query_check_classifier(Context *ctx)
+{
+    if (strcmp(ctx->checked_hash, ctx->classes_hash) != 0) {
+        sqlite3_stmt *stmt = stmt_get(ctx, "select wtclassify_check(:rules)");
+        ctx->classifier    = sqlite3_step(stmt) == SQLITE_ROW;
+        debug("Classifier %s compile the classification file",
+              ctx->classifier ? "can" : "can't");
+        db_reset_stmt(stmt);
+        memcpy(ctx->checked_hash, ctx->classes_hash, sizeof(ctx->checked_hash));
+    }
+}
+
+static const char *query_classify(Context *ctx)
+{
+    buf_clear(&ctx->sql);
+    if (ctx->classifier) {
+        buf_append(ctx, &ctx->sql, "wtclassify(:rules, show_uncategorized, "
+                                   "w.name, w.class, w.title)");
+    }
+    else {
+        buf_append(ctx, &ctx->sql, "case %s end", ctx->classes.data);
+    }
+    return ctx->sql.data;
+}
+
+/*
+ * Without the hint, SQLite likes to scan all snapshots in id order to save
+ * itself the sorting for the group by, which is terrible on a big db. The
+ * per-snapshot export always goes in epoch order, so that it can group by
+ * the index and stream its rows instead of sorting all of them first.
+ */
+static const char *query_snapshot_source(Context *ctx)
+{
+    if (query_has_times(ctx) || ctx->query->snapshots) {
+        if (!stmt_try_get(ctx, "select epoch_ms from snapshot limit 0")) {
+            die(ctx, "Database '%s' has no epoch_ms column, "
+                     "run wtsnap once to update it", ctx->db_name);
+        }
+        return "snapshot s indexed by snapshot_epoch";
+    }
+    return "snapshot s";
+}
+
+
+/*
+ * Classification results are remembered in the database for the next run,
+ * keyed by the hash of the classification file and show_uncategorized. Each
+ * run only looks at snapshots newer than the last one that was cached and
+ * classifies the triples of name, class and title that weren't seen before.
+ * That only works if the classification depends on nothing else, so it's
+ * evaluated over just those columns, which fails for files that look at
+ * anything else. Then, or if the database can't be written to, the windows
+ * just get classified directly. The cache is left joined so that SQLite
+ * doesn't get the idea to loop over it on the outside.
+ */
+#define CACHE_RULES_KEY \
+    "rules_hash = :hash and show_uncategorized = :show"
+
+#define CACHE_RULES_ID \
+    "(select rules_id from classification_rules where " CACHE_RULES_KEY ")"
+
+#define CACHE_STALE_RULES \
+    "rules_id in (select rules_id from classification_rules " \
+    "where rules_hash <> :hash)"
+
+#define CACHE_KEY \
+    "c.name is w.name and c.class is w.class and c.title is w.title"
+
+static const char *cache_create_sql =
+    "create table if not exists classification_rules (\n"
+    "    rules_id           integer primary key,\n"
+    "    rules_hash         text not null,\n"
+    "    show_uncategorized integer not null,\n"
+    "    snapshot_id        integer not null default 0,\n"
+    "    unique (rules_hash, show_uncategorized));\n"
+    "create table if not exists classification_cache (\n"
+    "    rules_id integer not null,\n"
+    "    name     text,\n"
+    "    class    text,\n"
+    "    title    text,\n"
+    "    category text);\n"
+    "create index if not exists classification_cache_key\n"
+    "    on classification_cache (rules_id, title, name, class);\n"
+    "create table if not exists classification_rollup (\n"
+    "    rules_id  integer not null,\n"
+    "    idle_time integer not null,\n"
+    "    day_start integer not null,\n"
+    "    day_end   integer not null,\n"
+    "    category  text not null,\n"
+    "    seconds   integer not null,\n"
+    "    primary key (rules_id, idle_time, day_start, category));\n"
+    "create table if not exists classification_rollup_state (\n"
+    "    rules_id    integer not null,\n"
+    "    idle_time   integer not null,\n"
+    "    snapshot_id integer not null default 0,\n"
+    "    primary key (rules_id, idle_time));\n";
+
+static const char *cache_prune_sqls[] = {
+    "delete from classification_rollup where " CACHE_STALE_RULES,
+    "delete from classification_rollup_state where " CACHE_STALE_RULES,
+    "delete from classification_cache where " CACHE_STALE_RULES,
+    "delete from classification_rules where rules_hash <> :hash",
+    "insert or ignore into classification_rules\n"
+    "    (rules_hash, show_uncategorized) values (:hash, :show)",
+    NULL,
+};
+
+static const char *cache_fill_sql =
+    "insert into classification_cache\n"
+    "with\n"
+    "    variables as (\n"
+    "        select :show as show_uncategorized),\n"
+    "    rules as (\n"
+    "        select rules_id, snapshot_id from classification_rules\n"
+    "        where " CACHE_RULES_KEY "),\n"
+    "    unseen as (\n"
+    "        select distinct w.name, w.class, w.title\n"
+    "        from  snapshot s\n"
+    "        join  window w on w.snapshot_id = s.snapshot_id\n"
+    "        where s.snapshot_id > (select snapshot_id from rules)\n"
+    "        and   focused <> 0\n"
+    "        and   parent_id is not null\n"
+    "        and   not exists (\n"
+    "            select 1 from classification_cache c\n"
+    "            where c.rules_id = (select rules_id from rules)\n"
+    "            and  " CACHE_KEY "))\n"
+    "select (select rules_id from rules), w.name, w.class, w.title, %s\n"
+    "from unseen w\n"
+    "cross join variables";
+
+static const char *cache_mark_sql =
+    "update classification_rules\n"
+    "    set snapshot_id = (select coalesce(max(snapshot_id), 0)\n"
+    "                       from snapshot)\n"
+    "    where " CACHE_RULES_KEY;
+
+/*
+ * Whole days of classified time are also summed up in classification_rollup
+ * per classification and idle time, which is kept up to date the same way.
+ * The report then takes every day that the date range covers entirely from
+ * the rollup and only looks at the snapshots outside of those days, which
+ * are the partial days at the edges of the range. Additional where
+ * conditions could filter on anything, so they always need all snapshots.
+ * The newest snapshot stays out of the rollup, since wtsnap may still
+ * correct its sample time when the next one comes along, with -A or while
+ * merging idle snapshots.
+ */
+#define ROLLUP_KEY "rules_id = " CACHE_RULES_ID " and idle_time = :idle"
+
+#define ROLLUP_UNTIL "(select coalesce(max(snapshot_id), 1) - 1 from snapshot)"
+
+static const char *rollup_sqls[] = {
+    "insert or ignore into classification_rollup_state (rules_id, idle_time)\n"
+    "    values (" CACHE_RULES_ID ", :idle)",
+    "insert into classification_rollup\n"
+    "with\n"
+    "    classified as (\n"
+    "        select\n"
+    "            s.snapshot_id, s.epoch_ms, depth,\n"
+    "            c.category as class,\n"
+    "            sample_time as seconds\n"
+    "        from  snapshot s\n"
+    "        join  window w on w.snapshot_id = s.snapshot_id\n"
+    "        left join classification_cache c\n"
+    "            on   c.rules_id = " CACHE_RULES_ID "\n"
+    "            and  " CACHE_KEY "\n"
+    "        where s.snapshot_id > (select snapshot_id\n"
+    "                               from classification_rollup_state\n"
+    "                               where " ROLLUP_KEY ")\n"
+    "        and   s.snapshot_id <= " ROLLUP_UNTIL "\n"
+    "        and   idle_time < :idle\n"
+    "        and   focused <> 0\n"
+    "        and   parent_id is not null),\n"
+    "    filtered as (\n"
+    "        select epoch_ms, class, seconds\n"
+    "        from classified\n"
+    "        where class is not null\n"
+    "        group by snapshot_id\n"
+    "        having depth = max(depth)),\n"
+    "    days as (\n"
+    "        select\n"
+    "            class, seconds,\n"
+    "            cast(strftime('%s', epoch_ms / 1000, 'unixepoch',\n"
+    "                          'localtime', 'start of day', 'utc')\n"
+    "                 as integer) * 1000 as day_start\n"
+    "        from filtered)\n"
+    "select\n"
+    "    " CACHE_RULES_ID ", :idle, day_start,\n"
+    "    cast(strftime('%s', day_start / 1000, 'unixepoch', 'localtime',\n"
+    "                  '+1 day', 'utc') as integer) * 1000,\n"
+    "    class, sum(seconds)\n"
+    "from days\n"
+    "where true\n"
+    "group by day_start, class\n"
+    "on conflict do update set seconds = seconds + excluded.seconds",
+    "update classification_rollup_state\n"
+    "    set snapshot_id = " ROLLUP_UNTIL "\n"
+    "    where " ROLLUP_KEY,
+    NULL,
+};
+
+static const char *cache_select_sql =
+    "select rules_id, " ROLLUP_UNTIL " from classification_rules\n"
+    "where " CACHE_RULES_KEY;
+
+/*
+ * Whether the cache is up to date without writing anything, so that a
+ * writer holding on to the lock doesn't hold up queries that don't need it.
+ * Rollups have to be up to date too, unless the query can't use them.
+ */
+#define CACHE_CURRENT_SQL \
+    "select rules_id, " ROLLUP_UNTIL " from classification_rules r\n" \
+    "where " CACHE_RULES_KEY "\n" \
+    "and snapshot_id = (select coalesce(max(snapshot_id), 0)\n" \
+    "                   from snapshot)"
+
+static const char *cache_current_sql = CACHE_CURRENT_SQL;
+
+static const char *cache_current_rollup_sql =
+    CACHE_CURRENT_SQL "\n"
+    "and exists (\n"
+    "    select 1 from classification_rollup_state c\n"
+    "    where c.rules_id    = r.rules_id\n"
+    "    and   c.idle_time   = :idle\n"
+    "    and   c.snapshot_id = " ROLLUP_UNTIL ")";
+
+static bool query_has_where(const Query *q)
+{
+    return q->where && q->where[0];
+}
+
+/* Runs a cache statement, failures just mean going without the cache. */
+static bool cache_step(Context *ctx, const char *sql,
+                       sqlite3_int64 *out, int count)
+{
+    sqlite3_stmt *stmt = stmt_try_get(ctx, sql);
+    if (!stmt) {
+        debug("Can't prepare cache statement: %s",
+              sqlite3_errmsg(ctx->db.handle));
+        return false;
+    }
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (int i = 0; i < count; ++i) {
+            out[i] = sqlite3_column_int64(stmt, i);
+        }
+    }
+    db_reset_stmt(stmt);
+
+    if (result != SQLITE_DONE) {
+        debug("Can't execute cache statement: %s",
+              sqlite3_errmsg(ctx->db.handle));
+        return false;
+    }
+    return true;
+}
+
+static void cache_use(Context *ctx, const sqlite3_int64 *ids)
+{
+    ctx->rules_id           = ids[0];
+    ctx->rollup_snapshot_id = ids[1];
+    debug("Using rules_id %lld with rollups up to snapshot %lld",
+          (long long) ctx->rules_id, (long long) ctx->rollup_snapshot_id);
+}
+
+/* Fails quietly if the cache tables aren't there yet. */
+static bool cache_is_current(Context *ctx)
+{
+    const char    *sql   = query_has_where(ctx->query)
+                         ? cache_current_sql : cache_current_rollup_sql;
+    sqlite3_stmt  *stmt  = stmt_try_get(ctx, sql);
+    sqlite3_int64 ids[2] = {0, 0};
+    if (!stmt) {
+        return false;
+    }
+
+    bool found = false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        ids[0] = sqlite3_column_int64(stmt, 0);
+        ids[1] = sqlite3_column_int64(stmt, 1);
+        found  = true;
+    }
+    db_reset_stmt(stmt);
+
+    if (found) {
+        debug("Cache is up to date, not writing to it");
+        cache_use(ctx, ids);
+    }
+    return found;
+}
+
+static bool cache_write(Context *ctx)
+{
+    if (sqlite3_exec(ctx->db.handle, "begin immediate", NULL, NULL, NULL)
+            != SQLITE_OK) {
+        debug("Can't begin cache transaction: %s",
+              sqlite3_errmsg(ctx->db.handle));
+        return false;
+    }
+
+    if (sqlite3_exec(ctx->db.handle, cache_create_sql, NULL, NULL, NULL)
+            != SQLITE_OK) {
+        debug("Can't create cache tables: %s", sqlite3_errmsg(ctx->db.handle));
+        return db_rollback(ctx->db.handle, true);
+    }
+
+    for (const char **sql = cache_prune_sqls; *sql; ++sql) {
+        if (!cache_step(ctx, *sql, NULL, 0)) {
+            return db_rollback(ctx->db.handle, true);
+        }
+    }
+
+    /* The classify expression is in the sql buffer, so copy it out first. */
+    Buffer fill = {0};
+    buf_append(ctx, &fill, "%s", query_classify(ctx));
+    buf_clear(&ctx->sql);
+    buf_append(ctx, &ctx->sql, cache_fill_sql, fill.data);
+    buf_free(&fill);
+    if (!cache_step(ctx, ctx->sql.data, NULL, 0)
+            || !cache_step(ctx, cache_mark_sql, NULL, 0)) {
+        return db_rollback(ctx->db.handle, true);
+    }
+
+    if (!query_has_where(ctx->query)) {
+        for (const char **sql = rollup_sqls; *sql; ++sql) {
+            if (!cache_step(ctx, *sql, NULL, 0)) {
+                return db_rollback(ctx->db.handle, true);
+            }
+        }
+    }
+
+    sqlite3_int64 ids[2] = {0, 0};
+    if (!cache_step(ctx, cache_select_sql, ids, 2)) {
+        return db_rollback(ctx->db.handle, true);
+    }
+
+    if (sqlite3_exec(ctx->db.handle, "commit", NULL, NULL, NULL)
+            != SQLITE_OK) {
+        debug("Can't commit cache: %s", sqlite3_errmsg(ctx->db.handle));
+        return db_rollback(ctx->db.handle, true);
+    }
+
+    cache_use(ctx, ids);
+    return true;
+}
+
+/*
+ * Someone else writing, like a daemon grouping its commits or wtsnap
+ * --compact, can hold the lock for a while. Rather than waiting for them,
+ * the query goes without the cache then.
+ */
+static bool cache_update(Context *ctx)
+{
+    if (cache_is_current(ctx)) {
+        return true;
+    }
+
+    sqlite3_busy_timeout(ctx->db.handle, CACHE_BUSY_MS);
+    bool ok = cache_write(ctx);
+    sqlite3_busy_timeout(ctx->db.handle, DB_BUSY_MS);
+    return ok;
+}
+
+
+static const char *report_sums_sql =
+    "    sum(seconds) / 3600 as hours,\n"
+    "    sum(seconds) % 3600 / 60 as minutes\n";
+
+/* Snapshots outside of the covered days or newer than the rollup. */
+static const char *report_uncovered_sql =
+    "\n"
+    "        and   (s.epoch_ms < (select day_start from covered)\n"
+    "            or s.epoch_ms >= (select day_end from covered)\n"
+    "            or s.snapshot_id > :rollup_snapshot_id)";
+
+static void query_append_times(Context *ctx, const char *column_lt,
+                               const char *column_gt)
+{
+    static const char *ops[TIME_COUNT] = {">=", ">", "<=", "<"};
+    static const char *names[TIME_COUNT] = {":gte", ":gt", ":lte", ":lt"};
+
+    for (int i = 0; i < TIME_COUNT; ++i) {
+        if (ctx->have_times[i]) {
+            const char *column = i < TIME_LTE ? column_gt : column_lt;
+            buf_append(ctx, &ctx->sql, "\n        and   %s %s %s",
+                       column, ops[i], names[i]);
+        }
+    }
+}
+
+/*
+ * Builds the report query into the sql buffer. With partial, it gives the
+ * plain sum of seconds per class for adding up over several databases.
+ */
+static void query_build_report(Context *ctx, bool cached, bool partial)
+{
+    const Query *q        = ctx->query;
+    const char  *source   = query_snapshot_source(ctx);
+    bool        rollup    = cached && !query_has_where(q) && !q->snapshots;
+    const char  *classify = cached ? "c.category" : query_classify(ctx);
+
+    /* The classify expression may live in the sql buffer itself. */
+    Buffer expr = {0};
+    buf_append(ctx, &expr, "%s", classify);
+
+    buf_clear(&ctx->sql);
+    buf_append(ctx, &ctx->sql,
+               "with\n"
+               "    variables as (\n"
+               "        select :show as show_uncategorized),");
+
+    /* A day is covered entirely if its first millisecond passes the lower
+     * bounds and its last one passes the upper bounds. */
+    if (rollup) {
+        buf_append(ctx, &ctx->sql,
+                   "\n"
+                   "    rollup as (\n"
+                   "        select category as class, seconds,\n"
+                   "               day_start, day_end\n"
+                   "        from  classification_rollup\n"
+                   "        where rules_id = :rules_id\n"
+                   "        and   idle_time = :idle");
+        query_append_times(ctx, "day_end - 1", "day_start");
+        buf_append(ctx, &ctx->sql,
+                   "),\n"
+                   "    covered as (\n"
+                   "        select\n"
+                   "            coalesce(min(day_start), 0) as day_start,\n"
+                   "            coalesce(max(day_end), 0) as day_end\n"
+                   "        from rollup),");
+    }
+
+    /* The focused <> 0 condition is what lets SQLite use the window_focused
+     * partial index, so it only needs to look at the few focused windows. */
+    buf_append(ctx, &ctx->sql,
+               "\n"
+               "    classified as (\n"
+               "        select\n"
+               "            s.snapshot_id, depth,%s\n"
+               "            %s as class,\n"
+               "            sample_time as seconds\n"
+               "        from  %s\n"
+               "        join  window w on w.snapshot_id = s.snapshot_id",
+               q->snapshots ? " s.timestamp, s.epoch_ms, idle_time," : "",
+               expr.data, source);
+    buf_free(&expr);
+
+    /* Conditions from -w may use name, class and title unqualified, so the
+     * cache columns of the same names are kept out of their way. */
+    if (cached) {
+        buf_append(ctx, &ctx->sql,
+                   "\n"
+                   "        left join (\n"
+                   "            select rules_id, name as c_name,\n"
+                   "                   class as c_class, title as c_title,\n"
+                   "                   category\n"
+                   "            from classification_cache) c\n"
+                   "            on   c.rules_id = :rules_id\n"
+                   "            and  c.c_name is w.name\n"
+                   "            and  c.c_class is w.class\n"
+                   "            and  c.c_title is w.title");
+    }
+
+    buf_append(ctx, &ctx->sql,
+               "\n"
+               "        cross join variables\n"
+               "        where idle_time < :idle\n"
+               "        and   focused <> 0\n"
+               "        and   parent_id is not null");
+    query_append_times(ctx, "s.epoch_ms", "s.epoch_ms");
+
+    if (query_has_where(q)) {
+        buf_append(ctx, &ctx->sql, "\n        %s", q->where);
+    }
+
+    if (rollup) {
+        buf_append(ctx, &ctx->sql, "%s", report_uncovered_sql);
+    }
+
+    if (q->snapshots) {
+        buf_append(ctx, &ctx->sql,
+                   ")\n"
+                   "select\n"
+                   "    snapshot_id, timestamp, epoch_ms, idle_time,\n"
+                   "    class, seconds\n"
+                   "from classified\n"
+                   "where class is not null\n"
+                   "group by epoch_ms, snapshot_id\n"
+                   "having depth = max(depth)");
+        return;
+    }
+
+    buf_append(ctx, &ctx->sql,
+               "),\n"
+               "    filtered as (\n"
+               "        select class, seconds\n"
+               "        from classified\n"
+               "        where class is not null\n"
+               "        group by snapshot_id\n"
+               "        having depth = max(depth)%s)\n"
+               "select\n"
+               "    class,\n"
+               "%s"
+               "from filtered\n"
+               "group by class",
+               rollup ? "\n"
+                        "        union all\n"
+                        "        select class, seconds from rollup"
+                      : "",
+               partial ? "    sum(seconds) as seconds\n" : report_sums_sql);
+}
+
+
+static void result_clear(Result *res)
+{
+    if (res->cells) {
+        for (size_t i = 0; i < res->rows * (size_t) res->columns; ++i) {
+            free((char *) res->cells[i].text);
+        }
+    }
+    for (int i = 0; i < res->columns; ++i) {
+        free(res->names[i]);
+    }
+    free(res->names);
+    free(res->current);
+    free(res->cells);
+    *res = (Result) {0};
+}
+
+static char *result_copy(Context *ctx, const char *text)
+{
+    char *copy = strdup(text ? text : "");
+    if (!copy) {
+        die(ctx, "Can't copy result value");
+    }
+    return copy;
+}
+
+static void result_add_row(Context *ctx, sqlite3_stmt *stmt)
+{
+    Result *res = &ctx->result;
+
+    if (res->rows == res->capacity) {
+        size_t capacity = res->capacity ? res->capacity * 2 : 16;
+        Cell   *cells   = realloc(res->cells, capacity * sizeof(*cells)
+                                              * (size_t) res->columns);
+        if (!cells) {
+            die(ctx, "Can't realloc %zu result rows", capacity);
+        }
+        res->cells    = cells;
+        res->capacity = capacity;
+    }
+
+    /* Counted right away, so that result_clear frees partial rows. */
+    Cell *row = res->cells + res->rows * (size_t) res->columns;
+    for (int i = 0; i < res->columns; ++i) {
+        row[i].type = sqlite3_column_type(stmt, i);
+        row[i].text = NULL;
+    }
+    ++res->rows;
+
+    for (int i = 0; i < res->columns; ++i) {
+        if (row[i].type != SQLITE_NULL) {
+            const char *text = (const char *) sqlite3_column_text(stmt, i);
+            row[i].text      = result_copy(ctx, text);
+        }
+    }
+}
+
+static void result_init(Context *ctx, sqlite3_stmt *stmt)
+{
+    Result *res = &ctx->result;
+    result_clear(res);
+
+    int columns  = sqlite3_column_count(stmt);
+    res->names   = calloc((size_t) columns, sizeof(*res->names));
+    res->current = calloc((size_t) columns, sizeof(*res->current));
+    if (!res->names || !res->current) {
+        die(ctx, "Can't calloc %d result columns", columns);
+    }
+    res->columns = columns;
+    for (int i = 0; i < columns; ++i) {
+        res->names[i] = result_copy(ctx, sqlite3_column_name(stmt, i));
+    }
+}
+
+
+/* Counts code points, which is close enough to the display width. */
+static int output_width(const char *s)
+{
+    int width = 0;
+    for (; *s; ++s) {
+        if (((unsigned char) *s & 0xc0) != 0x80) {
+            ++width;
+        }
+    }
+    return width;
+}
+
+static void output_pad(int count)
+{
+    for (int i = 0; i < count; ++i) {
+        fputc(' ', stdout);
+    }
+}
+
+static void output_repeat(const char *s, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        fputs(s, stdout);
+    }
+}
+
+static const char *output_value(const Output *out, const Cell *cell)
+{
+    return cell->text ? cell->text : out->null_value;
+}
+
+/* Quotes the same values as the sqlite3 command line does. */
+static void output_csv_value(const Output *out, const char *s)
+{
+    bool quote = !s[0] || strstr(s, out->separator);
+    for (const unsigned char *c = (const unsigned char *) s; *c; ++c) {
+        if (*c <= ' ' || *c == '"' || *c == '\'' || *c >= 0x7f) {
+            quote = true;
+        }
+    }
+
+    if (quote) {
+        fputc('"', stdout);
+        for (const char *c = s; *c; ++c) {
+            if (*c == '"') {
+                fputc('"', stdout);
+            }
+            fputc(*c, stdout);
+        }
+        fputc('"', stdout);
+    }
+    else {
+        fputs(s, stdout);
+    }
+}
+
+static void output_list_row(const Output *out, int columns,
+                            char **names, const Cell *row)
+{
+    for (int i = 0; i < columns; ++i) {
+        if (i > 0) {
+            fputs(out->separator, stdout);
+        }
+        if (names) {
+            if (out->mode == OUTPUT_CSV) {
+                output_csv_value(out, names[i]);
+            }
+            else {
+                fputs(names[i], stdout);
+            }
+        }
+        else if (out->mode == OUTPUT_CSV && row[i].text) {
+            output_csv_value(out, row[i].text);
+        }
+        else {
+            fputs(output_value(out, &row[i]), stdout);
+        }
+    }
+    fputs(out->newline, stdout);
+}
+
+static void output_line_row(const Output *out, const Result *res,
+                            const Cell *row)
+{
+    if (res->rows > 0) {
+        fputs("\n", stdout);
+    }
+    for (int i = 0; i < res->columns; ++i) {
+        output_pad(res->name_width - output_width(res->names[i]));
+        printf("%s = %s\n", res->names[i], output_value(out, &row[i]));
+    }
+}
+
+static void output_json_string(const char *s)
+{
+    fputc('"', stdout);
+    for (const unsigned char *c = (const unsigned char *) s; *c; ++c) {
+        switch (*c) {
+            case '"':  fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            case '\b': fputs("\\b", stdout);  break;
+            case '\f': fputs("\\f", stdout);  break;
+            case '\n': fputs("\\n", stdout);  break;
+            case '\r': fputs("\\r", stdout);  break;
+            case '\t': fputs("\\t", stdout);  break;
+            default:
+                if (*c < ' ') {
+                    printf("\\u%04x", *c);
+                }
+                else {
+                    fputc(*c, stdout);
+                }
+        }
+    }
+    fputc('"', stdout);
+}
+
+static void output_json_object(const Result *res, const Cell *row)
+{
+    fputc('{', stdout);
+    for (int i = 0; i < res->columns; ++i) {
+        if (i > 0) {
+            fputc(',', stdout);
+        }
+        output_json_string(res->names[i]);
+        fputc(':', stdout);
+        if (row[i].type == SQLITE_NULL) {
+            fputs("null", stdout);
+        }
+        else if (row[i].type == SQLITE_TEXT || row[i].type == SQLITE_BLOB) {
+            output_json_string(row[i].text);
+        }
+        else {
+            fputs(row[i].text, stdout);
+        }
+    }
+    fputc('}', stdout);
+}
+
+/*
+ * The binary format starts with "WTS1", the number of columns and their
+ * names, all integers being little endian. Each row is a 1 byte followed
+ * by its values, each of which is SQLite's type code as a byte and then an
+ * 8 byte integer, an 8 byte IEEE double or a 4 byte length and that many
+ * bytes for text and blobs. Nulls are just the type code. A 0 byte ends it.
+ */
+static void output_binary_uint(unsigned long long value, int size)
+{
+    for (int i = 0; i < size; ++i) {
+        fputc((int) (value >> (i * 8) & 0xff), stdout);
+    }
+}
+
+static void output_binary_bytes(const void *data, int size)
+{
+    output_binary_uint((unsigned long long) size, 4);
+    fwrite(data, 1, (size_t) size, stdout);
+}
+
+static void output_binary_header(const Result *res)
+{
+    fputs("WTS1", stdout);
+    output_binary_uint((unsigned long long) res->columns, 4);
+    for (int i = 0; i < res->columns; ++i) {
+        output_binary_bytes(res->names[i], (int) strlen(res->names[i]));
+    }
+}
+
+static void output_binary_row(const Result *res, sqlite3_stmt *stmt)
+{
+    fputc(1, stdout);
+    for (int i = 0; i < res->columns; ++i) {
+        int type = sqlite3_column_type(stmt, i);
+        fputc(type, stdout);
+        if (type == SQLITE_INTEGER) {
+            sqlite3_int64 value = sqlite3_column_int64(stmt, i);
+            output_binary_uint((unsigned long long) value, 8);
+        }
+        else if (type == SQLITE_FLOAT) {
+            double             value = sqlite3_column_double(stmt, i);
+            unsigned long long bits;
+            memcpy(&bits, &value, sizeof(bits));
+            output_binary_uint(bits, 8);
+        }
+        else if (type == SQLITE_TEXT) {
+            const unsigned char *text = sqlite3_column_text(stmt, i);
+            output_binary_bytes(text, sqlite3_column_bytes(stmt, i));
+        }
+        else if (type == SQLITE_BLOB) {
+            const void *blob = sqlite3_column_blob(stmt, i);
+            output_binary_bytes(blob, sqlite3_column_bytes(stmt, i));
+        }
+    }
+}
+
+/* Corners and lines of the table-like modes, markdown has no top or bottom. */
+typedef struct Frame {
+    const char *top[4];
+    const char *middle[4];
+    const char *bottom[4];
+    const char *vertical;
+} Frame;
+
+static const Frame output_frames[] = {
+    [OUTPUT_TABLE] = {
+        {"+", "-", "+", "+"}, {"+", "-", "+", "+"}, {"+", "-", "+", "+"}, "|",
+    },
+    [OUTPUT_BOX] = {
+        {"┌", "─", "┬", "┐"},
+        {"├", "─", "┼", "┤"},
+        {"└", "─", "┴", "┘"},
+        "│",
+    },
+    [OUTPUT_MARKDOWN] = {
+        {NULL, NULL, NULL, NULL}, {"|", "-", "|", "|"},
+        {NULL, NULL, NULL, NULL}, "|",
+    },
+};
+
+static void output_frame_line(const char *const *parts, const int *widths,
+                              int columns)
+{
+    if (parts[0]) {
+        for (int i = 0; i < columns; ++i) {
+            fputs(i == 0 ? parts[0] : parts[2], stdout);
+            output_repeat(parts[1], widths[i] + 2);
+        }
+        fputs(parts[3], stdout);
+        fputs("\n", stdout);
+    }
+}
+
+static void output_frame_row(const Frame *frame, const int *widths,
+                             int columns, char **names, const Output *out,
+                             const Cell *row)
+{
+    for (int i = 0; i < columns; ++i) {
+        const char *value = names ? names[i] : output_value(out, &row[i]);
+        int        pad    = widths[i] - output_width(value);
+        int        left   = names ? pad / 2 : 0;
+        fputs(frame->vertical, stdout);
+        output_pad(1 + left);
+        fputs(value, stdout);
+        output_pad(pad - left + 1);
+    }
+    fputs(frame->vertical, stdout);
+    fputs("\n", stdout);
+}
+
+static void output_column_row(const int *widths, int columns, char **names,
+                              const Output *out, const Cell *row)
+{
+    for (int i = 0; i < columns; ++i) {
+        const char *value = names ? names[i] : output_value(out, &row[i]);
+        if (i > 0) {
+            fputs("  ", stdout);
+        }
+        fputs(value, stdout);
+        output_pad(widths[i] - output_width(value));
+    }
+    fputs("\n", stdout);
+}
+
+static void output_aligned(Context *ctx, const Output *out, const Result *res)
+{
+    int *widths = calloc((size_t) res->columns, sizeof(*widths));
+    if (!widths) {
+        die(ctx, "Can't calloc %d column widths", res->columns);
+    }
+
+    for (int i = 0; i < res->columns; ++i) {
+        widths[i] = output_width(res->names[i]);
+        for (size_t r = 0; r < res->rows; ++r) {
+            const Cell *cell = &res->cells[r * (size_t) res->columns + i];
+            int        w     = output_width(output_value(out, cell));
+            widths[i] = w > widths[i] ? w : widths[i];
+        }
+    }
+
+    if (out->mode == OUTPUT_COLUMN) {
+        if (out->header) {
+            output_column_row(widths, res->columns, res->names, out, NULL);
+            for (int i = 0; i < res->columns; ++i) {
+                fputs(i == 0 ? "" : "  ", stdout);
+                output_repeat("-", widths[i]);
+            }
+            fputs("\n", stdout);
+        }
+        for (size_t r = 0; r < res->rows; ++r) {
+            output_column_row(widths, res->columns, NULL, out,
+                              res->cells + r * (size_t) res->columns);
+        }
+    }
+    else {
+        const Frame *frame = &output_frames[out->mode];
+        output_frame_line(frame->top, widths, res->columns);
+        output_frame_row(frame, widths, res->columns, res->names, out, NULL);
+        output_frame_line(frame->middle, widths, res->columns);
+        for (size_t r = 0; r < res->rows; ++r) {
+            output_frame_row(frame, widths, res->columns, NULL, out,
+                             res->cells + r * (size_t) res->columns);
+        }
+        output_frame_line(frame->bottom, widths, res->columns);
+    }
+
+    free(widths);
+}
+
+static bool output_is_aligned(const Output *out)
+{
+    return out->mode == OUTPUT_COLUMN || out->mode == OUTPUT_TABLE
+        || out->mode == OUTPUT_BOX || out->mode == OUTPUT_MARKDOWN;
+}
+
+static void output_row(void *data, sqlite3_stmt *stmt)
+{
+    Context      *ctx = data;
+    const Output *out = &ctx->query->out;
+    Result       *res = &ctx->result;
+
+    if (output_is_aligned(out)) {
+        result_add_row(ctx, stmt);
+        return;
+    }
+    else if (out->mode == OUTPUT_BINARY) {
+        output_binary_row(res, stmt);
+        ++res->rows;
+        return;
+    }
+
+    Cell *row = res->current;
+    for (int i = 0; i < res->columns; ++i) {
+        row[i].type = sqlite3_column_type(stmt, i);
+        row[i].text = (const char *) sqlite3_column_text(stmt, i);
+    }
+
+    switch (out->mode) {
+        case OUTPUT_LIST:
+        case OUTPUT_CSV:
+            if (res->rows == 0 && out->header) {
+                output_list_row(out, res->columns, res->names, NULL);
+            }
+            output_list_row(out, res->columns, NULL, row);
+            break;
+        case OUTPUT_LINE:
+            output_line_row(out, res, row);
+            break;
+        case OUTPUT_JSON:
+            fputs(res->rows == 0 ? "[" : ",\n", stdout);
+            output_json_object(res, row);
+            break;
+        case OUTPUT_NDJSON:
+            output_json_object(res, row);
+            fputs("\n", stdout);
+            break;
+    }
+    ++res->rows;
+}
+
+/*
+ * Like the sqlite3 command line, an empty result prints nothing at all,
+ * except for the binary format, which always has its header and end.
+ */
+static void output_begin(Context *ctx, sqlite3_stmt *stmt)
+{
+    const Output *out = &ctx->query->out;
+    Result       *res = &ctx->result;
+    result_init(ctx, stmt);
+
+    res->name_width = 5;
+    for (int i = 0; i < res->columns; ++i) {
+        int w = output_width(res->names[i]);
+        res->name_width = w > res->name_width ? w : res->name_width;
+    }
+
+    if (out->mode == OUTPUT_BINARY) {
+        output_binary_header(res);
+    }
+}
+
+static void output_end(Context *ctx)
+{
+    const Output *out = &ctx->query->out;
+    const Result *res = &ctx->result;
+    if (out->mode == OUTPUT_BINARY) {
+        fputc(0, stdout);
+    }
+    else if (out->mode == OUTPUT_JSON && res->rows > 0) {
+        fputs("]\n", stdout);
+    }
+    else if (output_is_aligned(out) && res->rows > 0) {
+        output_aligned(ctx, out, res);
+    }
+}
+
+static void output_query(Context *ctx, sqlite3_stmt *stmt)
+{
+    output_begin(ctx, stmt);
+    db_exec_stmt(&ctx->db, stmt, output_row, ctx);
+    db_reset_stmt(stmt);
+    output_end(ctx);
+}
+
+
+static void db_register_classifier(Context *ctx)
+{
+    int result = wtclassify_register(ctx->db.handle);
+    if (result != SQLITE_OK) {
+        die(ctx, "Can't register classifier: %s", sqlite3_errstr(result));
+    }
+}
+
+/*
+ * Opens the database read-write if possible so that the classification
+ * cache can be kept up to date, but a read-only one works without it.
+ */
+static void db_open_for_stats(Context *ctx)
+{
+    int flags = access(ctx->db_name, W_OK) == 0
+              ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY;
+    db_open(&ctx->db, ctx->db_name, flags);
+    sqlite3_busy_timeout(ctx->db.handle, DB_BUSY_MS);
+    db_register_classifier(ctx);
+}
+
+/* Takes ownership of the name, which is freed on failure. */
+static bool db_add_file(Context *ctx, char *name, sqlite3_int64 from_ms,
+                        sqlite3_int64 until_ms)
+{
+    if (name && ctx->db_count % 16 == 0) {
+        size_t capacity = (size_t) ctx->db_count + 16;
+        DbFile *files   = realloc(ctx->db_files, capacity * sizeof(*files));
+        if (!files) {
+            free(name);
+            return false;
+        }
+        ctx->db_files = files;
+    }
+
+    if (name) {
+        debug("Adding database '%s'", name);
+        ctx->db_files[ctx->db_count++] = (DbFile) {
+            name, from_ms, until_ms, arc_is_archive_name(name),
+        };
+        return true;
+    }
+    return false;
+}
+
+static bool db_add_name(Context *ctx, char *name)
+{
+    return db_add_file(ctx, name, LLONG_MIN, LLONG_MAX);
+}
+
+/*
+ * wtsnap -P names its partitions after the database file with the local
+ * date put in front of the extension, like ~/.wtsnap-2021-03.db. Figures out
+ * the period that SUFFIX stands for, which is -YYYY, -YYYY-MM or -YYYY-MM-DD
+ * followed by exactly EXT, or EXT and the archive suffix from wtarchive.
+ */
+static bool db_parse_partition(const char *suffix, const char *ext,
+                               sqlite3_int64 *from_ms, sqlite3_int64 *until_ms)
+{
+    static const int digits[] = {4, 2, 2};
+    int        parts[]        = {0, 1, 1};
+    int        count          = 0;
+    const char *s             = suffix;
+    while (count < 3 && *s == '-') {
+        ++s;
+        if (!time_parse_digits(&s, digits[count], &parts[count])) {
+            return false;
+        }
+        ++count;
+    }
+
+    size_t len = strlen(ext);
+    if (strncmp(s, ext, len) != 0
+            || (s[len] && strcmp(s + len, ARC_SUFFIX) != 0)) {
+        return false;
+    }
+
+    if (count == 0 || parts[1] < 1 || parts[1] > 12
+            || parts[2] < 1 || parts[2] > 31) {
+        return false;
+    }
+
+    struct tm from = {
+        .tm_year  = parts[0] - 1900,
+        .tm_mon   = parts[1] - 1,
+        .tm_mday  = parts[2],
+        .tm_isdst = -1,
+    };
+    struct tm until = from;
+    if (count == 1) {
+        ++until.tm_year;
+    }
+    else if (count == 2) {
+        ++until.tm_mon;
+    }
+    else {
+        ++until.tm_mday;
+    }
+
+    time_t from_t  = mktime(&from);
+    time_t until_t = mktime(&until);
+    if (from_t == (time_t) -1 || until_t == (time_t) -1) {
+        return false;
+    }
+    *from_ms  = (sqlite3_int64) from_t * 1000;
+    *until_ms = (sqlite3_int64) until_t * 1000;
+    return true;
+}
+
+static int db_compare_files(const void *a, const void *b)
+{
+    const DbFile *fa = a;
+    const DbFile *fb = b;
+    if (fa->from_ms != fb->from_ms) {
+        return fa->from_ms < fb->from_ms ? -1 : 1;
+    }
+    return strcmp(fa->name, fb->name);
+}
+
+/* Whether FILE is an archive and its database is still around. */
+static bool db_has_database(const char *file)
+{
+    if (!arc_is_archive_name(file)) {
+        return false;
+    }
+    size_t len  = strlen(file) - strlen(ARC_SUFFIX);
+    char   *db  = strndup(file, len);
+    bool   have = db && access(db, F_OK) == 0;
+    free(db);
+    return have;
+}
+
+/*
+ * Adds the partitions of a database in order of time, along with the file
+ * itself if it exists, since it may have snapshots from before partitioning
+ * was turned on. Without any partitions, it's added either way, so that not
+ * being able to open it is reported like before. Archives stand in for the
+ * files that they were made from once those are gone, but the database wins
+ * while there are both, since it may have gotten more snapshots since. Takes
+ * ownership of the name.
+ */
+static bool db_add_partitioned(Context *ctx, char *name)
+{
+    if (!name) {
+        return false;
+    }
+
+    const char *base  = strrchr(name, '/');
+    const char *start = base ? base + 1 : name;
+    const char *ext   = strrchr(start, '.');
+    size_t     stem   = ext && ext != start ? (size_t) (ext - name)
+                                            : strlen(name);
+    ext = name + stem;
+
+    /* Every character may need escaping, plus the date, a star and a NUL. */
+    static const char *date_pattern = "-[0-9][0-9][0-9][0-9]*";
+    size_t size    = 2 * strlen(name) + strlen(date_pattern) + 2;
+    char   *pattern = malloc(size);
+    if (!pattern) {
+        free(name);
+        return false;
+    }
+
+    char *p = pattern;
+    for (const char *c = name; *c; ++c) {
+        if (c == ext) {
+            p = stpcpy(p, date_pattern);
+        }
+        if (strchr("*?[\\", *c)) {
+            *p++ = '\\';
+        }
+        *p++ = *c;
+    }
+    p = stpcpy(p, *ext ? "*" : date_pattern);
+
+    glob_t matches;
+    int    found = glob(pattern, 0, NULL, &matches) == 0
+                 ? (int) matches.gl_pathc : 0;
+    free(pattern);
+
+    int  first = ctx->db_count;
+    bool ok    = true;
+    for (int i = 0; i < found && ok; ++i) {
+        const char    *path = matches.gl_pathv[i];
+        sqlite3_int64 from_ms, until_ms;
+        if (db_parse_partition(path + stem, ext, &from_ms, &until_ms)
+                && !db_has_database(path)) {
+            ok = db_add_file(ctx, strdup(path), from_ms, until_ms);
+        }
+    }
+    globfree(&matches);
+
+    if (ctx->db_count > first) {
+        qsort(ctx->db_files + first, (size_t) (ctx->db_count - first),
+              sizeof(*ctx->db_files), db_compare_files);
+    }
+
+    if (ok && access(name, F_OK) != 0) {
+        size_t len      = strlen(name);
+        char   *archive = malloc(len + sizeof(ARC_SUFFIX));
+        if (!archive) {
+            free(name);
+            return false;
+        }
+        memcpy(stpcpy(archive, name), ARC_SUFFIX, sizeof(ARC_SUFFIX));
+        if (access(archive, F_OK) == 0) {
+            free(name);
+            return db_add_name(ctx, archive);
+        }
+        free(archive);
+    }
+
+    if (!ok || (ctx->db_count > first && access(name, F_OK) != 0)) {
+        debug("Not adding database '%s' itself", name);
+        free(name);
+        return ok;
+    }
+    return db_add_name(ctx, name);
+}
+
+/*
+ * The same file given twice, like with a glob and by name, or by its base
+ * name and as a partition, would have its time counted twice. Files are
+ * the same if they resolve to the same path, the first one stays, with the
+ * narrowest period of time that any of them got from its name.
+ */
+static void db_dedupe_files(Context *ctx)
+{
+    char **paths = calloc((size_t) ctx->db_count + 1, sizeof(*paths));
+    if (!paths) {
+        die(ctx, "Can't calloc %d paths", ctx->db_count);
+    }
+
+    int count = 0;
+    for (int i = 0; i < ctx->db_count; ++i) {
+        DbFile *file = &ctx->db_files[i];
+        char   *path = realpath(file->name, NULL);
+        int    same  = -1;
+        for (int j = 0; path && j < count && same < 0; ++j) {
+            if (paths[j] && strcmp(paths[j], path) == 0) {
+                same = j;
+            }
+        }
+
+        if (same < 0) {
+            paths[count]           = path;
+            ctx->db_files[count++] = *file;
+        }
+        else {
+            DbFile *first = &ctx->db_files[same];
+            debug("Dropping database '%s', it's the same as '%s'",
+                  file->name, first->name);
+            first->from_ms  = first->from_ms > file->from_ms
+                            ? first->from_ms : file->from_ms;
+            first->until_ms = first->until_ms < file->until_ms
+                            ? first->until_ms : file->until_ms;
+            free(file->name);
+            free(path);
+        }
+    }
+    ctx->db_count = count;
+
+    for (int i = 0; i < count; ++i) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+static bool query_use_cache(Context *ctx)
+{
+    const char *no_cache = getenv("WTSTATS_NO_CACHE");
+    return !(no_cache && no_cache[0]) && cache_update(ctx);
+}
+
+static void query_execute(Context *ctx, const Query *q)
+{
+    ctx->query = q;
+    query_read_classes(ctx, q);
+    query_hash_classes(ctx);
+    query_check_classifier(ctx);
+
+    query_build_report(ctx, query_use_cache(ctx), false);
+    output_query(ctx, stmt_get(ctx, ctx->sql.data));
+}
+
+
+/*
+ * With several databases, worker threads each take the next one, open it
+ * on their own connection and sum up the seconds per class. The main thread
+ * then adds those up in an in-memory database and reports on that, so the
+ * output is the same as if it were all one database.
+ */
+typedef struct Pool {
+    Context         *ctx;
+    int             next;
+    int             done;
+    bool            progress;
+    pthread_mutex_t lock;
+} Pool;
+
+static void shards_free(Context *ctx)
+{
+    if (ctx->shards) {
+        for (int i = 0; i < ctx->shard_count; ++i) {
+            Shard *shard = &ctx->shards[i];
+            for (size_t j = 0; j < shard->count; ++j) {
+                free(shard->rows[j].class);
+            }
+            free(shard->rows);
+        }
+        free(ctx->shards);
+        ctx->shards      = NULL;
+        ctx->shard_count = 0;
+    }
+}
+
+static void shard_add(Context *ctx, const char *class, sqlite3_int64 seconds)
+{
+    Shard *shard = ctx->shard;
+
+    if (shard->count == shard->capacity) {
+        size_t   capacity = shard->capacity ? shard->capacity * 2 : 64;
+        ShardRow *rows    = realloc(shard->rows, capacity * sizeof(*rows));
+        if (!rows) {
+            die(ctx, "Can't realloc %zu rows for '%s'",
+                capacity, shard->db_name);
+        }
+        shard->rows     = rows;
+        shard->capacity = capacity;
+    }
+
+    ShardRow *row = &shard->rows[shard->count];
+    row->class   = result_copy(ctx, class);
+    row->seconds = seconds;
+    ++shard->count;
+}
+
+static void shard_add_row(void *data, sqlite3_stmt *stmt)
+{
+    Context *ctx = data;
+    shard_add(ctx, (const char *) sqlite3_column_text(stmt, 0),
+              sqlite3_column_int64(stmt, 1));
+}
+
+
+/*
+ * Archives from wtarchive have no SQL to run, so their snapshots are
+ * filtered and summed up right here, a block at a time. Each snapshot only
+ * adds its sample time to its focus path, and just the windows on the paths
+ * that got any are classified afterwards, in a single statement on an
+ * in-memory database so that the rules only get compiled once. That only
+ * has name, class and title to go by, like the classification cache. Each
+ * path then gets the class of its deepest window that has one, like the
+ * report does. Exports go through the blocks a second time to write out
+ * their snapshots once their classes are known.
+ */
+static const char *archive_create_sql =
+    "create table window (\n"
+    "    triple_id integer primary key,\n"
+    "    name      text,\n"
+    "    class     text,\n"
+    "    title     text)";
+
+static const char *archive_insert_sql =
+    "insert into window values (?, ?, ?, ?)";
+
+static const char *archive_classify_sql =
+    "with\n"
+    "    variables as (\n"
+    "        select :show as show_uncategorized)\n"
+    "select triple_id, %s\n"
+    "from window w\n"
+    "cross join variables";
+
+static const char *archive_export_sql =
+    "select\n"
+    "    ? as snapshot_id,\n"
+    "    strftime('%Y-%m-%dT%H:%M:%S:%fZ', ? / 1000.0, 'unixepoch')\n"
+    "        as timestamp,\n"
+    "    ? as epoch_ms, ? as idle_time, ? as class, ? as seconds";
+
+static void archive_free(Context *ctx)
+{
+    if (ctx->arc_triples) {
+        for (uint64_t i = 0; i < ctx->arc_triple_count; ++i) {
+            free(ctx->arc_triples[i].class);
+        }
+    }
+    free(ctx->arc_triples);
+    free(ctx->arc_paths);
+    free(ctx->arc_rows);
+    ctx->arc_triples      = NULL;
+    ctx->arc_paths        = NULL;
+    ctx->arc_rows         = NULL;
+    ctx->arc_triple_count = 0;
+    arc_close(&ctx->archive);
+}
+
+static void *archive_calloc(Context *ctx, uint64_t count, size_t size)
+{
+    void *p = calloc((size_t) count, size);
+    if (!p) {
+        die(ctx, "Can't calloc %llu entries for archive '%s'",
+            (unsigned long long) count, ctx->db_name);
+    }
+    return p;
+}
+
+static void archive_bind(Context *ctx, sqlite3_stmt *stmt, int index,
+                         uint32_t id)
+{
+    const char *s;
+    size_t     len;
+    int        result = arc_string(&ctx->archive, id, &s, &len)
+                      ? sqlite3_bind_text(stmt, index, s, (int) len,
+                                          SQLITE_STATIC)
+                      : sqlite3_bind_null(stmt, index);
+    if (result != SQLITE_OK) {
+        db_die(&ctx->db, "Failed to bind parameter %d: %s",
+               index, sqlite3_errmsg(ctx->db.handle));
+    }
+}
+
+/* Lower and upper bounds are both made inclusive to check them quickly. */
+static void archive_bounds(Context *ctx, sqlite3_int64 *from_ms,
+                           sqlite3_int64 *until_ms)
+{
+    *from_ms  = LLONG_MIN;
+    *until_ms = LLONG_MAX;
+    if (ctx->have_times[TIME_GTE] && ctx->times[TIME_GTE] > *from_ms) {
+        *from_ms = ctx->times[TIME_GTE];
+    }
+    if (ctx->have_times[TIME_GT] && ctx->times[TIME_GT] >= *from_ms) {
+        *from_ms = ctx->times[TIME_GT] + 1;
+    }
+    if (ctx->have_times[TIME_LTE] && ctx->times[TIME_LTE] < *until_ms) {
+        *until_ms = ctx->times[TIME_LTE];
+    }
+    if (ctx->have_times[TIME_LT] && ctx->times[TIME_LT] <= *until_ms) {
+        *until_ms = ctx->times[TIME_LT] - 1;
+    }
+}
+
+/*
+ * The conditions are checked without any branches, so that the compiler can
+ * vectorize them. Only adding up the time jumps around between the paths.
+ */
+static void archive_keep(Context *ctx, const ArcRows *rows,
+                         sqlite3_int64 from_ms, sqlite3_int64 until_ms,
+                         unsigned char *kept)
+{
+    sqlite3_int64 idle = ctx->query->idle_time;
+    for (size_t i = 0; i < rows->count; ++i) {
+        kept[i] = (rows->idle_time[i] >= 0) & (rows->idle_time[i] < idle)
+                & (rows->epoch_ms[i] >= from_ms)
+                & (rows->epoch_ms[i] <= until_ms);
+    }
+}
+
+static void archive_sum_block(Context *ctx, const ArcRows *rows,
+                              const unsigned char *kept)
+{
+    ArcPath *paths = ctx->arc_paths;
+    for (size_t i = 0; i < rows->count; ++i) {
+        paths[rows->path[i]].seconds += kept[i] * rows->sample_time[i];
+        paths[rows->path[i]].count   += kept[i];
+    }
+}
+
+static void archive_classify(Context *ctx)
+{
+    const Archive *arc = &ctx->archive;
+    for (uint64_t p = 0; p < arc->path_count; ++p) {
+        if (ctx->arc_paths[p].count > 0) {
+            size_t        count;
+            const ArcStep *steps = arc_path(arc, (uint32_t) p, &count);
+            for (size_t i = 0; i < count; ++i) {
+                ctx->arc_triples[steps[i].triple].used = true;
+            }
+        }
+    }
+
+    db_exec(&ctx->db, archive_create_sql);
+    db_exec(&ctx->db, "begin");
+    sqlite3_stmt *insert = stmt_get(ctx, archive_insert_sql);
+    for (uint64_t t = 0; t < arc->triple_count; ++t) {
+        if (ctx->arc_triples[t].used) {
+            const uint32_t *strings = arc_triple(arc, (uint32_t) t);
+            db_bind_int64(&ctx->db, insert, 1, (sqlite3_int64) t);
+            for (int i = 0; i < 3; ++i) {
+                archive_bind(ctx, insert, i + 2, strings[i]);
+            }
+            db_exec_stmt(&ctx->db, insert, NULL, NULL);
+            db_reset_stmt(insert);
+        }
+    }
+    db_exec(&ctx->db, "commit");
+
+    /* The classify expression is in the sql buffer, so copy it out first. */
+    Buffer expr = {0};
+    buf_append(ctx, &expr, "%s", query_classify(ctx));
+    buf_clear(&ctx->sql);
+    buf_append(ctx, &ctx->sql, archive_classify_sql, expr.data);
+    buf_free(&expr);
+
+    sqlite3_stmt *stmt = stmt_try_get(ctx, ctx->sql.data);
+    if (!stmt) {
+        die(ctx, "Classification file doesn't work on archive '%s', "
+                 "it can only use name, class, title and "
+                 "show_uncategorized: %s",
+            ctx->db_name, sqlite3_errmsg(ctx->db.handle));
+    }
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlite3_int64 t     = sqlite3_column_int64(stmt, 0);
+        const char    *text = (const char *) sqlite3_column_text(stmt, 1);
+        if (text) {
+            ctx->arc_triples[t].class = result_copy(ctx, text);
+        }
+    }
+    if (result != SQLITE_DONE) {
+        die(ctx, "Can't classify windows from archive '%s': %s",
+            ctx->db_name, sqlite3_errmsg(ctx->db.handle));
+    }
+    db_reset_stmt(stmt);
+
+    for (uint64_t p = 0; p < arc->path_count; ++p) {
+        ArcPath *path = &ctx->arc_paths[p];
+        if (path->count > 0) {
+            size_t        count;
+            const ArcStep *steps = arc_path(arc, (uint32_t) p, &count);
+            while (count > 0 && !path->class) {
+                path->class = ctx->arc_triples[steps[--count].triple].class;
+            }
+        }
+    }
+}
+
+static void archive_export_row(Context *ctx, sqlite3_stmt *stmt,
+                               const ArcRows *rows, size_t i,
+                               const char *class)
+{
+    db_bind_int64(&ctx->db, stmt, 1, rows->snapshot_id[i]);
+    db_bind_int64(&ctx->db, stmt, 2, rows->epoch_ms[i]);
+    db_bind_int64(&ctx->db, stmt, 3, rows->epoch_ms[i]);
+    db_bind_int64(&ctx->db, stmt, 4, rows->idle_time[i]);
+    db_bind_string(&ctx->db, stmt, 5, class);
+    db_bind_int64(&ctx->db, stmt, 6, rows->sample_time[i]);
+    if (ctx->result.columns == 0) {
+        output_begin(ctx, stmt);
+    }
+    db_exec_stmt(&ctx->db, stmt, output_row, ctx);
+    db_reset_stmt(stmt);
+}
+
+static void archive_export(Context *ctx, sqlite3_int64 from_ms,
+                           sqlite3_int64 until_ms, unsigned char *kept)
+{
+    const Archive *arc  = &ctx->archive;
+    ArcRows       *rows = ctx->arc_rows;
+    sqlite3_stmt  *stmt = stmt_get(ctx, archive_export_sql);
+    for (uint64_t b = 0; b < arc->block_count; ++b) {
+        if (arc_block_overlaps(arc, b, from_ms, until_ms)) {
+            arc_read_block(arc, b, rows);
+            archive_keep(ctx, rows, from_ms, until_ms, kept);
+            for (size_t i = 0; i < rows->count; ++i) {
+                const char *class = ctx->arc_paths[rows->path[i]].class;
+                if (kept[i] && class) {
+                    archive_export_row(ctx, stmt, rows, i, class);
+                }
+            }
+        }
+    }
+}
+
+static void archive_execute(Context *ctx)
+{
+    if (query_has_where(ctx->query)) {
+        die(ctx, "Archive '%s' can't be queried with -w", ctx->db_name);
+    }
+
+    db_open(&ctx->db, ":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    db_register_classifier(ctx);
+
+    Archive *arc = &ctx->archive;
+    arc->env = &ctx->env;
+    arc_open(arc, ctx->db_name);
+    ctx->arc_rows         = archive_calloc(ctx, 1, sizeof(*ctx->arc_rows));
+    ctx->arc_paths        = archive_calloc(ctx, arc->path_count,
+                                           sizeof(*ctx->arc_paths));
+    ctx->arc_triples      = archive_calloc(ctx, arc->triple_count,
+                                           sizeof(*ctx->arc_triples));
+    ctx->arc_triple_count = arc->triple_count;
+
+    sqlite3_int64 from_ms, until_ms;
+    archive_bounds(ctx, &from_ms, &until_ms);
+
+    unsigned char kept[ARC_BLOCK_SIZE];
+    for (uint64_t b = 0; b < arc->block_count; ++b) {
+        if (arc_block_overlaps(arc, b, from_ms, until_ms)) {
+            arc_read_block(arc, b, ctx->arc_rows);
+            archive_keep(ctx, ctx->arc_rows, from_ms, until_ms, kept);
+            archive_sum_block(ctx, ctx->arc_rows, kept);
+        }
+    }
+    archive_classify(ctx);
+
+    if (ctx->query->snapshots) {
+        archive_export(ctx, from_ms, until_ms, kept);
+        return;
+    }
+
+    for (uint64_t p = 0; p < arc->path_count; ++p) {
+        const ArcPath *path = &ctx->arc_paths[p];
+        if (path->count > 0 && path->class) {
+            shard_add(ctx, path->class, path->seconds);
+        }
+    }
+}
+
+/* Exports write out their rows right away, everything else is summed up. */
+static void shard_execute(Context *ctx, Shard *shard)
+{
+    ctx->db_name = shard->db_name;
+    ctx->shard   = shard;
+    if (shard->archive) {
+        archive_execute(ctx);
+        return;
+    }
+    db_open_for_stats(ctx);
+
+    bool snapshots = ctx->query->snapshots;
+    query_build_report(ctx, query_use_cache(ctx), !snapshots);
+    sqlite3_stmt *stmt = stmt_get(ctx, ctx->sql.data);
+    if (snapshots) {
+        if (ctx->result.columns == 0) {
+            output_begin(ctx, stmt);
+        }
+        db_exec_stmt(&ctx->db, stmt, output_row, ctx);
+    }
+    else {
+        db_exec_stmt(&ctx->db, stmt, shard_add_row, ctx);
+    }
+}
+
+static void shard_run_with_jmp_buf(Context *ctx, Shard *shard)
+{
+    if (setjmp(ctx->env) == 0) {
+        debug("Querying database '%s'", shard->db_name);
+        shard_execute(ctx, shard);
+        shard->ok = true;
+    }
+    else {
+        debug("Caught longjmp");
+        if (ctx->db.handle) {
+            db_rollback(ctx->db.handle,
+                        !sqlite3_get_autocommit(ctx->db.handle));
+        }
+    }
+    /* Connections only live for one database, so neither do statements. */
+    stmts_free(ctx);
+    archive_free(ctx);
+    ctx->db.handle = db_close(ctx->db.handle);
+}
+
+/* The workers only read from the main context, it doesn't change now. */
+static void shard_init_context(Context *ctx, const Context *main)
+{
+    *ctx            = (Context) {0};
+    ctx->db.env     = &ctx->env;
+    ctx->query      = main->query;
+    ctx->classes    = main->classes;
+    ctx->classifier = main->classifier;
+    memcpy(ctx->classes_hash, main->classes_hash, sizeof(ctx->classes_hash));
+    memcpy(ctx->have_times, main->have_times, sizeof(ctx->have_times));
+    memcpy(ctx->times, main->times, sizeof(ctx->times));
+}
+
+static void *pool_work(void *data)
+{
+    Pool    *pool = data;
+    Context *main = pool->ctx;
+
+    Context ctx;
+    shard_init_context(&ctx, main);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int next = pool->next < main->shard_count ? pool->next++ : -1;
+        pthread_mutex_unlock(&pool->lock);
+        if (next < 0) {
+            break;
+        }
+
+        shard_run_with_jmp_buf(&ctx, &main->shards[next]);
+
+        pthread_mutex_lock(&pool->lock);
+        ++pool->done;
+        if (pool->progress) {
+            fprintf(stderr, "\rQueried %d of %d databases",
+                    pool->done, main->shard_count);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    buf_free(&ctx.sql);
+    return NULL;
+}
+
+/* The main thread works along, so there's always at least one worker. */
+static void pool_run(Context *ctx)
+{
+    int jobs = ctx->jobs < ctx->shard_count ? ctx->jobs : ctx->shard_count;
+    Pool pool = {
+        .ctx      = ctx,
+        .progress = isatty(STDERR_FILENO),
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    pthread_t *threads = calloc((size_t) jobs, sizeof(*threads));
+    int       started  = 0;
+    if (threads) {
+        while (started < jobs - 1) {
+            int result = pthread_create(&threads[started], NULL,
+                                        pool_work, &pool);
+            if (result != 0) {
+                warn("Can't start worker thread: %s", strerror(result));
+                break;
+            }
+            ++started;
+        }
+    }
+
+    debug("Querying %d databases with %d threads",
+          ctx->shard_count, started + 1);
+    pool_work(&pool);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (pool.progress) {
+        fputs("\n", stderr);
+    }
+    pthread_mutex_destroy(&pool.lock);
+}
+
+/*
+ * Exports can't be added up, so the main thread goes through the databases
+ * one after the other instead, writing out their rows as they come. That
+ * keeps partitions in order of time. If no database has anything in the
+ * time range, there's no statement to take the columns from, so not even
+ * the binary format writes anything.
+ */
+static void query_export_sharded(Context *ctx)
+{
+    Context export;
+    shard_init_context(&export, ctx);
+
+    const Shard *failed = NULL;
+    for (int i = 0; i < ctx->shard_count && !failed; ++i) {
+        shard_run_with_jmp_buf(&export, &ctx->shards[i]);
+        failed = ctx->shards[i].ok ? NULL : &ctx->shards[i];
+    }
+    if (!failed && export.result.columns > 0) {
+        output_end(&export);
+    }
+    result_clear(&export.result);
+    buf_free(&export.sql);
+
+    if (failed) {
+        die(ctx, "Failed to query database '%s'", failed->db_name);
+    }
+}
+
+/*
+ * Only the files that can have snapshots in the time range of the query are
+ * worth opening. Partitions are named after local dates, which move around
+ * when the time zone changes, so they get a day of slack on either side.
+ */
+static bool query_wants_file(Context *ctx, const DbFile *file)
+{
+    if (file->from_ms == LLONG_MIN) {
+        return true;
+    }
+
+    sqlite3_int64 slack = 24 * 60 * 60 * 1000LL;
+    for (int i = TIME_GTE; i <= TIME_GT; ++i) {
+        if (ctx->have_times[i] && ctx->times[i] >= file->until_ms + slack) {
+            return false;
+        }
+    }
+    for (int i = TIME_LTE; i <= TIME_LT; ++i) {
+        if (ctx->have_times[i] && ctx->times[i] < file->from_ms - slack) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void query_execute_sharded(Context *ctx, const Query *q)
+{
+    ctx->query = q;
+    query_read_classes(ctx, q);
+    query_hash_classes(ctx);
+    query_check_classifier(ctx);
+
+    shards_free(ctx);
+    ctx->shards = calloc((size_t) ctx->db_count, sizeof(*ctx->shards));
+    if (!ctx->shards) {
+        die(ctx, "Can't calloc %d shards", ctx->db_count);
+    }
+    for (int i = 0; i < ctx->db_count; ++i) {
+        if (query_wants_file(ctx, &ctx->db_files[i])) {
+            Shard *shard   = &ctx->shards[ctx->shard_count++];
+            shard->db_name = ctx->db_files[i].name;
+            shard->archive = ctx->db_files[i].archive;
+        }
+    }
+    debug("Querying %d of %d databases", ctx->shard_count, ctx->db_count);
+
+    if (q->snapshots) {
+        query_export_sharded(ctx);
+        shards_free(ctx);
+        return;
+    }
+
+    pool_run(ctx);
+
+    int failed = 0;
+    for (int i = 0; i < ctx->shard_count; ++i) {
+        failed += !ctx->shards[i].ok;
+    }
+    if (failed) {
+        die(ctx, "Failed to query %d of %d databases",
+            failed, ctx->shard_count);
+    }
+
+    db_exec(&ctx->db, "create temp table if not exists partial (\n"
+                      "    class   text not null,\n"
+                      "    seconds integer not null)");
+    db_exec(&ctx->db, "begin");
+    db_exec(&ctx->db, "delete from partial");
+    sqlite3_stmt *insert = stmt_get(ctx, "insert into partial values (?, ?)");
+    for (int i = 0; i < ctx->shard_count; ++i) {
+        const Shard *shard = &ctx->shards[i];
+        for (size_t j = 0; j < shard->count; ++j) {
+            db_bind_string(&ctx->db, insert, 1, shard->rows[j].class);
+            db_bind_int64(&ctx->db, insert, 2, shard->rows[j].seconds);
+            db_exec_stmt(&ctx->db, insert, NULL, NULL);
+            db_reset_stmt(insert);
+        }
+    }
+    db_exec(&ctx->db, "commit");
+    shards_free(ctx);
+
+    buf_clear(&ctx->sql);
+    buf_append(ctx, &ctx->sql, "select\n    class,\n%sfrom partial\n"
+                               "group by class", report_sums_sql);
+    output_query(ctx, stmt_get(ctx, ctx->sql.data));
+}
+
+/* Archives are always summed up by the workers, even on their own. */
+static bool db_is_sharded(const Context *ctx)
+{
+    return ctx->db_count > 1 || (ctx->db_count == 1 && ctx->db_files[0].archive);
+}
+
+/* Returns an exit code: 2 for dates that don't parse, 1 for other errors. */
+static int query_run(Context *ctx, const Query *q)
+{
+    if (!query_resolve_times(ctx, q)) {
+        return 2;
+    }
+
+    if (setjmp(ctx->env) == 0) {
+        if (db_is_sharded(ctx)) {
+            query_execute_sharded(ctx, q);
+        }
+        else {
+            query_execute(ctx, q);
+        }
+        return 0;
+    }
+    else {
+        debug("Caught longjmp");
+        stmts_reset(ctx);
+        db_rollback(ctx->db.handle, !sqlite3_get_autocommit(ctx->db.handle));
+        return 1;
+    }
+}
+
+
+/*
+ * A single database stays open for as long as wtstats runs. With several,
+ * the workers open them for every query and the main thread just needs an
+ * in-memory database to add up their results.
+ */
+static void db_open_main(Context *ctx)
+{
+    if (ctx->db_count == 0
+            && !db_add_partitioned(ctx, db_default_name(&ctx->db))) {
+        die(ctx, "Can't add default database");
+    }
+    db_dedupe_files(ctx);
+
+    if (!db_is_sharded(ctx)) {
+        ctx->db_name = ctx->db_files[0].name;
+        db_open_for_stats(ctx);
+    }
+    else {
+        ctx->db_name = ":memory:";
+        db_open(&ctx->db, ctx->db_name,
+                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        db_register_classifier(ctx);
+    }
+}
+
+static bool open_with_jmp_buf(Context *ctx)
+{
+    if (setjmp(ctx->env) == 0) {
+        debug("Running with longjmp buffer");
+        db_open_main(ctx);
+        return true;
+    }
+    else {
+        debug("Caught longjmp");
+        return false;
+    }
+}
+
+static void cleanup(Context *ctx)
+{
+    debug("Cleaning up");
+    result_clear(&ctx->result);
+    stmts_free(ctx);
+    buf_free(&ctx->sql);
+    buf_free(&ctx->classes);
+    shards_free(ctx);
+    ctx->db.handle = db_close(ctx->db.handle);
+    for (int i = 0; i < ctx->db_count; ++i) {
+        free(ctx->db_files[i].name);
+    }
+    free(ctx->db_files);
+}
+
+
+static bool args_set_string(char *dst, const char *src)
+{
+    size_t len = strlen(src);
+    if (len >= OUTPUT_STRING_SIZE) {
+        return false;
+    }
+    memcpy(dst, src, len + 1);
+    return true;
+}
+
+static void args_set_mode(Output *out, int mode, const char *separator,
+                          const char *newline)
+{
+    out->mode = mode;
+    if (separator) {
+        args_set_string(out->separator, separator);
+        args_set_string(out->newline, newline);
+    }
+}
+
+static void args_reset_output(Output *out)
+{
+    *out = (Output) {0};
+    args_set_mode(out, OUTPUT_LIST, "|", "\n");
+}
+
+/* Splits on whitespace without any quoting, like wtstats always has. */
+static int args_parse_output(Output *out, const char *prog, const char *arg)
+{
+    char *copy = strdup(arg);
+    if (!copy) {
+        warn("%s: can't copy argument to -q", prog);
+        return ARGS_ERROR;
+    }
+
+    args_reset_output(out);
+    int  ret  = 0;
+    char *save;
+    for (char *word = strtok_r(copy, " \t\n", &save); word && !ret;
+         word = strtok_r(NULL, " \t\n", &save)) {
+        const char *opt = word[0] == '-' && word[1] == '-' ? word + 1 : word;
+        char       *dst = NULL;
+
+        if (strcmp(opt, "-list") == 0) {
+            args_set_mode(out, OUTPUT_LIST, "|", "\n");
+        }
+        else if (strcmp(opt, "-csv") == 0) {
+            args_set_mode(out, OUTPUT_CSV, ",", "\n");
+        }
+        else if (strcmp(opt, "-tabs") == 0) {
+            args_set_mode(out, OUTPUT_LIST, "\t", "\n");
+        }
+        else if (strcmp(opt, "-line") == 0) {
+            args_set_mode(out, OUTPUT_LINE, NULL, NULL);
+        }
+        else if (strcmp(opt, "-column") == 0) {
+            args_set_mode(out, OUTPUT_COLUMN, NULL, NULL);
+        }
+        else if (strcmp(opt, "-table") == 0) {
+            args_set_mode(out, OUTPUT_TABLE, NULL, NULL);
+        }
+        else if (strcmp(opt, "-box") == 0) {
+            args_set_mode(out, OUTPUT_BOX, NULL, NULL);
+        }
+        else if (strcmp(opt, "-markdown") == 0) {
+            args_set_mode(out, OUTPUT_MARKDOWN, NULL, NULL);
+        }
+        else if (strcmp(opt, "-json") == 0) {
+            args_set_mode(out, OUTPUT_JSON, NULL, NULL);
+        }
+        else if (strcmp(opt, "-header") == 0) {
+            out->header = true;
+        }
+        else if (strcmp(opt, "-noheader") == 0) {
+            out->header = false;
+        }
+        else if (strcmp(opt, "-separator") == 0) {
+            dst = out->separator;
+        }
+        else if (strcmp(opt, "-newline") == 0) {
+            dst = out->newline;
+        }
+        else if (strcmp(opt, "-nullvalue") == 0) {
+            dst = out->null_value;
+        }
+        else {
+            warn("%s: unsupported sqlite3 option in -q -- '%s'", prog, word);
+            ret = ARGS_ERROR;
+        }
+
+        if (dst) {
+            const char *value = strtok_r(NULL, " \t\n", &save);
+            if (!value) {
+                warn("%s: missing argument to %s in -q", prog, word);
+                ret = ARGS_ERROR;
+            }
+            else if (!args_set_string(dst, value)) {
+                warn("%s: argument to %s in -q is too long -- '%s'",
+                     prog, word, value);
+                ret = ARGS_ERROR;
+            }
+        }
+    }
+
+    free(copy);
+    return ret;
+}
+
+/* Names with wildcards are expanded, so that quoting them works too. */
+static int db_add_names(Context *ctx, const char *prog, const char *arg)
+{
+    if (!strpbrk(arg, "*?[")) {
+        if (db_add_partitioned(ctx, strdup(arg))) {
+            return 0;
+        }
+        warn("%s: can't add database '%s'", prog, arg);
+        return ARGS_ERROR;
+    }
+
+    glob_t matches;
+    int    result = glob(arg, 0, NULL, &matches);
+    if (result != 0) {
+        warn("%s: no databases match '%s'", prog, arg);
+        globfree(&matches);
+        return ARGS_ERROR;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < matches.gl_pathc && !ret; ++i) {
+        if (!db_add_name(ctx, strdup(matches.gl_pathv[i]))) {
+            warn("%s: can't add database '%s'", prog, matches.gl_pathv[i]);
+            ret = ARGS_ERROR;
+        }
+    }
+    globfree(&matches);
+    return ret;
+}
+
+static int args_parse_format(Output *out, const char *prog, const char *arg)
+{
+    args_reset_output(out);
+    if (strcmp(arg, "csv") == 0) {
+        args_set_mode(out, OUTPUT_CSV, ",", "\n");
+        out->header = true;
+    }
+    else if (strcmp(arg, "ndjson") == 0) {
+        args_set_mode(out, OUTPUT_NDJSON, NULL, NULL);
+    }
+    else if (strcmp(arg, "binary") == 0) {
+        args_set_mode(out, OUTPUT_BINARY, NULL, NULL);
+    }
+    else {
+        warn("%s: invalid argument to -o -- '%s'", prog, arg);
+        return ARGS_ERROR;
+    }
+    return 0;
+}
+
+static int args_handle(Context *ctx, Query *q, const char *prog, int opt,
+                       bool serving)
+{
+    switch (opt) {
+        case 'c':
+            q->classes_name = optarg;
+            debug("classes_name set to '%s'", q->classes_name);
+            return 0;
+        case 'f':
+            if (serving) {
+                warn("%s: -f can't be changed while serving", prog);
+                return ARGS_ERROR;
+            }
+            return db_add_names(ctx, prog, optarg);
+        case 'h':
+            return ARGS_WANT_HELP;
+        case 'j':
+            ctx->jobs = atoi(optarg);
+            debug("jobs set to %d from '%s'", ctx->jobs, optarg);
+            if (ctx->jobs > 0 && !serving) {
+                return 0;
+            }
+            else {
+                warn("%s: invalid argument to -j -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        case 'i': {
+            char *end;
+            long idle_time = strtol(optarg, &end, 10);
+            debug("idle_time set to %ld from '%s'", idle_time, optarg);
+            if (end != optarg && !*end && idle_time != 0
+                    && idle_time >= -2147483647L && idle_time <= 2147483647L) {
+                q->idle_time = (int) idle_time;
+                return 0;
+            }
+            else {
+                warn("%s: invalid idle time -- '%s'", prog, optarg);
+                return ARGS_ERROR;
+            }
+        }
+        case 'o':
+            return args_parse_format(&q->out, prog, optarg);
+        case 'q':
+            return args_parse_output(&q->out, prog, optarg);
+        case 's':
+            q->times[TIME_GTE] = optarg;
+            return 0;
+        case 'S':
+            q->times[TIME_GT] = optarg;
+            return 0;
+        case 't':
+            q->times[TIME_LTE] = optarg;
+            return 0;
+        case 'T':
+            q->times[TIME_LT] = optarg;
+            return 0;
+        case 'u':
+            q->show_uncategorized = 1;
+            debug("show_uncategorized set to 1");
+            return 0;
+        case 'U':
+            q->show_uncategorized = 0;
+            debug("show_uncategorized set to 0");
+            return 0;
+        case 'w':
+            q->where = optarg;
+            debug("where set to '%s'", q->where);
+            return 0;
+        case 'x':
+            q->snapshots = true;
+            debug("snapshots set to true");
+            return 0;
+        case ARGS_SERVE:
+            if (serving) {
+                warn("%s: --serve only works on the command line", prog);
+                return ARGS_ERROR;
+            }
+            ctx->serve = true;
+            debug("serve set to true");
+            return 0;
+        default:
+            return ARGS_ERROR;
+    }
+}
+
+static int args_parse(Context *ctx, Query *q, int argc, char **argv,
+                      bool serving)
+{
+    static const struct option long_options[] = {
+        {"serve", no_argument, NULL, ARGS_SERVE},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    int ret = 0;
+
+    /* Zero makes glibc start over completely for every served query. */
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "c:f:hi:j:o:q:s:S:t:T:uUw:x",
+                              long_options, NULL)) != -1) {
+        ret |= args_handle(ctx, q, argv[0], opt, serving);
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "%s: trailing arguments --", argv[0]);
+        for (int i = optind; i < argc; ++i) {
+            fprintf(stderr, " %s", argv[i]);
+        }
+        fputs("\n", stderr);
+        ret |= ARGS_ERROR;
+    }
+
+    if (ret & ARGS_WANT_HELP) {
+        fprintf(stdout, args_help, argv[0]);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Splits a line into words in place, with single quotes, double quotes and
+ * backslashes working like in a shell. Returns the number of words or -1 if
+ * a quote isn't closed. The caller needs to free the argv array.
+ */
+static int serve_split(Context *ctx, char *line, char ***out_argv,
+                       const char *prog)
+{
+    size_t capacity = 8;
+    char   **argv   = malloc(capacity * sizeof(*argv));
+    if (!argv) {
+        die(ctx, "Can't malloc %zu arguments", capacity);
+    }
+    argv[0] = (char *) prog;
+
+    int  argc = 1;
+    char *src = line;
+    char *dst = line;
+    for (;;) {
+        while (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r') {
+            ++src;
+        }
+        if (!*src) {
+            break;
+        }
+
+        if ((size_t) argc + 1 >= capacity) {
+            capacity *= 2;
+            char **grown = realloc(argv, capacity * sizeof(*argv));
+            if (!grown) {
+                free(argv);
+                die(ctx, "Can't realloc %zu arguments", capacity);
+            }
+            argv = grown;
+        }
+        argv[argc++] = dst;
+
+        char quote = '\0';
+        while (*src && (quote || (*src != ' ' && *src != '\t'
+                                  && *src != '\n' && *src != '\r'))) {
+            if (quote == '\'') {
+                if (*src == '\'') {
+                    quote = '\0';
+                    ++src;
+                }
+                else {
+                    *dst++ = *src++;
+                }
+            }
+            else if (*src == '\\' && src[1]
+                     && (!quote || src[1] == '"' || src[1] == '\\')) {
+                ++src;
+                *dst++ = *src++;
+            }
+            else if (*src == quote) {
+                quote = '\0';
+                ++src;
+            }
+            else if (!quote && (*src == '\'' || *src == '"')) {
+                quote = *src++;
+            }
+            else {
+                *dst++ = *src++;
+            }
+        }
+
+        if (quote) {
+            free(argv);
+            return -1;
+        }
+        /* The word is at most as long as its source, so this is safe. */
+        char *next = *src ? src + 1 : src;
+        *dst = '\0';
+        src  = next;
+        dst  = next;
+    }
+
+    argv[argc] = NULL;
+    *out_argv  = argv;
+    return argc;
+}
+
+static bool serve_split_with_jmp_buf(Context *ctx, char *line, char ***argv,
+                                     int *argc, const char *prog)
+{
+    if (setjmp(ctx->env) == 0) {
+        *argc = serve_split(ctx, line, argv, prog);
+        return true;
+    }
+    else {
+        debug("Caught longjmp");
+        return false;
+    }
+}
+
+static void serve_line(Context *ctx, char *line, const char *prog)
+{
+    char **argv = NULL;
+    int  argc   = 0;
+    bool ok     = serve_split_with_jmp_buf(ctx, line, &argv, &argc, prog);
+
+    if (ok && argc < 0) {
+        warn("%s: unterminated quote in query", prog);
+    }
+    else if (ok) {
+        Query q       = ctx->defaults;
+        int   arg_ret = args_parse(ctx, &q, argc, argv, true);
+        if (!(arg_ret & (ARGS_ERROR | ARGS_WANT_HELP))) {
+            query_run(ctx, &q);
+        }
+        free(argv);
+    }
+
+    fputs("\n", stdout);
+    fflush(stdout);
+}
+
+static void serve(Context *ctx, const char *prog)
+{
+    debug("Serving queries from stdin");
+    char   *line = NULL;
+    size_t size  = 0;
+    while (getline(&line, &size, stdin) != -1) {
+        serve_line(ctx, line, prog);
+    }
+    free(line);
+}
+
+
+int main(int argc, char **argv)
+{
+    Context ctx  = {0};
+    ctx.db.env   = &ctx.env;
+    ctx.db_name  = NULL;
+    ctx.jobs     = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (ctx.jobs < 1) {
+        ctx.jobs = 1;
+    }
+
+    Query *q     = &ctx.defaults;
+    q->idle_time = 60000;
+    args_reset_output(&q->out);
+    q->out.mode   = OUTPUT_TABLE;
+    q->out.header = true;
+
+    int arg_ret = args_parse(&ctx, q, argc, argv, false);
+    if (arg_ret & ARGS_ERROR) {
+        return 2;
+    }
+    else if (arg_ret & ARGS_WANT_HELP) {
+        return 0;
+    }
+
+    int status = EXIT_FAILURE;
+    if (open_with_jmp_buf(&ctx)) {
+        if (ctx.serve) {
+            serve(&ctx, argv[0]);
+            status = EXIT_SUCCESS;
+        }
+        else {
+            status = query_run(&ctx, q);
+        }
+    }
+    cleanup(&ctx);
+    return status;
+}
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Times wtstats over synthetic history written by wtgen, for both layouts,
+# classification files of 10, 100 and 1000 rules and a few fixed ranges,
+# with and without the classification cache. Prints one tab separated line
+# per run and writes the query plans of every combination next to the
+# databases, so changes to indices, rollups and the classifier can be
+# compared run for run. The databases are kept and reused, delete the
+# directory to have them written anew.
+#
+# Environment variables:
+#   BENCH_DIR     where to put databases, rules and plans (bench-stats)
+#   BENCH_MONTHS  months of history to generate (6)
+#   BENCH_RULES   rule counts to try ("10 100 1000")
+#   BENCH_RUNS    how many times to time each query, reporting the best (3)
+set -e
+
+dir=${BENCH_DIR:-bench-stats}
+months=${BENCH_MONTHS:-6}
+rules=${BENCH_RULES:-10 100 1000}
+runs=${BENCH_RUNS:-3}
+
+# The history starts on 2021-01-04, these fall within six months of it.
+ranges='all|
+day|-s 2021-03-10 -T 2021-03-11
+week|-s 2021-03-08 -T 2021-03-15
+month|-s 2021-03-01 -T 2021-04-01'
+
+# Times are local, so pin them down to get the same numbers anywhere.
+TZ=UTC
+export TZ
+
+mkdir -p "$dir"
+for layout in plain normalized; do
+    db="$dir/$layout.db"
+    if [ ! -e "$db" ]; then
+        if [ "$layout" = normalized ]; then
+            ./wtgen -N -m "$months" -f "$db"
+        else
+            ./wtgen -m "$months" -f "$db"
+        fi
+    fi
+done
+for count in $rules; do
+    ./wtgen -c "$count" > "$dir/rules-$count.sql"
+done
+
+now_ms() {
+    date +%s%N | cut -c1-13
+}
+
+# Runs wtstats $runs times, printing the fastest in milliseconds. The first
+# argument is what to set WTSTATS_NO_CACHE to, empty to use the cache.
+time_wtstats() {
+    no_cache=$1
+    shift
+    best=
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        start=$(now_ms)
+        WTSTATS_NO_CACHE=$no_cache ./wtstats "$@" > /dev/null
+        elapsed=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+printf 'layout\trules\trange\tcache\tms\n'
+for layout in plain normalized; do
+    db="$dir/$layout.db"
+    for count in $rules; do
+        class="$dir/rules-$count.sql"
+        plan="$dir/plan-$layout-$count.txt"
+        WTSTATS_EXPLAIN=1 WTSTATS_NO_CACHE=1 \
+            ./wtstats -f "$db" -c "$class" > /dev/null 2> "$plan"
+
+        echo "$ranges" | while IFS='|' read -r name args; do
+            # Word splitting of the range arguments is intended here.
+            # shellcheck disable=SC2086
+            cold=$(time_wtstats 1 -f "$db" -c "$class" $args)
+            printf '%s\t%s\t%s\t%s\t%s\n' "$layout" "$count" "$name" \
+                   none "$cold"
+            # shellcheck disable=SC2086
+            ./wtstats -f "$db" -c "$class" $args > /dev/null
+            # shellcheck disable=SC2086
+            warm=$(time_wtstats '' -f "$db" -c "$class" $args)
+            printf '%s\t%s\t%s\t%s\t%s\n' "$layout" "$count" "$name" \
+                   warm "$warm"
+        done
+    done
+done